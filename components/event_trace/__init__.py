@@ -0,0 +1,50 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome import automation
+from esphome.automation import register_action
+from esphome.const import CONF_ID, CONF_BUFFER_SIZE
+
+CODEOWNERS = ["@LumenSoftNL"]
+
+CONF_REPORT_INTERVAL = "report_interval"
+
+event_trace_ns = cg.esphome_ns.namespace("event_trace")
+EventTrace = event_trace_ns.class_("EventTrace", cg.Component)
+
+DumpAction = event_trace_ns.class_(
+    "DumpAction", automation.Action, cg.Parented.template(EventTrace)
+)
+
+CONFIG_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(): cv.declare_id(EventTrace),
+        # 16 bytes per event in internal RAM.
+        cv.Optional(CONF_BUFFER_SIZE, default=1024): cv.int_range(min=64, max=8192),
+        # The 32 bit cycle counter the loop accounting uses wraps after ~17 s at 240 MHz.
+        cv.Optional(
+            CONF_REPORT_INTERVAL, default="10s"
+        ): cv.All(
+            cv.positive_time_period_milliseconds,
+            cv.Range(max=cv.TimePeriod(seconds=15)),
+        ),
+    }
+).extend(cv.COMPONENT_SCHEMA)
+
+
+async def to_code(config):
+    var = cg.new_Pvariable(config[CONF_ID])
+    await cg.register_component(var, config)
+    cg.add(var.set_buffer_size(config[CONF_BUFFER_SIZE]))
+    cg.add(var.set_report_interval(config[CONF_REPORT_INTERVAL]))
+    cg.add_define("USE_EVENT_TRACE")
+
+
+@register_action(
+    "event_trace.dump",
+    DumpAction,
+    automation.maybe_simple_id({cv.GenerateID(): cv.use_id(EventTrace)}),
+)
+async def event_trace_dump_code(config, action_id, template_arg, arg):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    return var
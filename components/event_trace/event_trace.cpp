@@ -0,0 +1,119 @@
+#include "event_trace.h"
+
+#include "esphome/core/application.h"
+#include "esphome/core/helpers.h"
+#include "esphome/core/log.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+namespace esphome::event_trace {
+
+static const char *const TAG = "event_trace";
+
+/// Events per dump line, 8 * 16 bytes keep the line well below the logger's buffer.
+static const size_t DUMP_EVENTS_PER_LINE = 8;
+
+EventTrace *global_event_trace = nullptr;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+EventTrace::EventTrace() { global_event_trace = this; }
+
+void EventTrace::setup() {
+  // Internal RAM: the ring is written from the radio task and ISRs, PSRAM would stall them.
+  RAMAllocator<trace_event_t> allocator(RAMAllocator<trace_event_t>::ALLOC_INTERNAL);
+  this->events_ = allocator.allocate(this->size_);
+  if (this->events_ == nullptr) {
+    ESP_LOGE(TAG, "Could not allocate %u trace events", (unsigned) this->size_);
+    this->mark_failed();
+    return;
+  }
+  this->last_report_ = millis();
+  this->report_start_cycles_ = arch_get_cpu_cycle_count();
+}
+
+void EventTrace::dump_config() {
+  ESP_LOGCONFIG(TAG, "Event Trace:");
+  ESP_LOGCONFIG(TAG, "  Buffer: %u events (%u bytes)", (unsigned) this->size_,
+                (unsigned) (this->size_ * sizeof(trace_event_t)));
+  ESP_LOGCONFIG(TAG, "  Loop report interval: %" PRIu32 " ms", this->report_interval_);
+  ESP_LOGCONFIG(TAG, "  CPU frequency: %" PRIu32 " Hz", arch_get_cpu_freq_hz());
+}
+
+void EventTrace::loop() {
+  uint32_t now = millis();
+  if (this->report_interval_ > 0 && now - this->last_report_ >= this->report_interval_) {
+    this->last_report_ = now;
+    this->report_loops_();
+  }
+}
+
+void EventTrace::account_loop(const Component *component, uint32_t start) {
+  uint32_t cycles = arch_get_cpu_cycle_count() - start;
+  uint8_t index = 0;
+  while (index < TRACE_MAX_COMPONENTS && this->loops_[index].component != nullptr &&
+         this->loops_[index].component != component) {
+    index++;
+  }
+  if (index < TRACE_MAX_COMPONENTS) {
+    loop_account_t &account = this->loops_[index];
+    account.component = component;
+    account.cycles += cycles;
+    account.calls++;
+    account.max_cycles = std::max(account.max_cycles, cycles);
+  }
+  this->record(TRACE_LOOP, index, cycles);
+}
+
+void EventTrace::report_loops_() {
+  // Cycles since the last report; the 32 bit counter wraps after ~17 s at 240 MHz, fine for the default interval.
+  uint32_t now_cycles = arch_get_cpu_cycle_count();
+  uint32_t total = now_cycles - this->report_start_cycles_;
+  this->report_start_cycles_ = now_cycles;
+  uint32_t per_us = arch_get_cpu_freq_hz() / 1000000;
+  if (total == 0 || per_us == 0) {
+    return;
+  }
+  uint64_t accounted = 0;
+  for (uint8_t i = 0; i < TRACE_MAX_COMPONENTS && this->loops_[i].component != nullptr; i++) {
+    loop_account_t &account = this->loops_[i];
+    ESP_LOGD(TAG, "Loop %u %s: %.1f%% CPU, %" PRIu32 " calls, avg %" PRIu32 " us, max %" PRIu32 " us", i,
+             account.component->get_component_source(), 100.0f * account.cycles / total, account.calls,
+             account.calls > 0 ? (uint32_t) (account.cycles / account.calls / per_us) : 0,
+             account.max_cycles / per_us);
+    accounted += account.cycles;
+    account.cycles = 0;
+    account.calls = 0;
+    account.max_cycles = 0;
+  }
+  ESP_LOGD(TAG, "Loop other: %.1f%% CPU", 100.0f * (total - std::min<uint64_t>(accounted, total)) / total);
+}
+
+void EventTrace::dump() {
+  if (this->events_ == nullptr) {
+    return;
+  }
+  // Stop recording so the dump itself does not overwrite what it is printing.
+  this->paused_ = true;
+  uint32_t count = this->count_.load(std::memory_order_relaxed);
+  uint32_t first = count > this->size_ ? count - this->size_ : 0;
+  ESP_LOGI(TAG, "TRACE begin freq=%" PRIu32 " events=%" PRIu32 " lost=%" PRIu32, arch_get_cpu_freq_hz(),
+           count - first, first);
+  for (uint8_t i = 0; i < TRACE_MAX_COMPONENTS && this->loops_[i].component != nullptr; i++) {
+    ESP_LOGI(TAG, "TRACE loop %u=%s", i, this->loops_[i].component->get_component_source());
+  }
+  uint32_t seq = first;
+  while (seq < count) {
+    // A line never runs past the end of the ring, the next one continues at its start.
+    size_t offset = seq % this->size_;
+    size_t events = std::min<size_t>({DUMP_EVENTS_PER_LINE, count - seq, this->size_ - offset});
+    const uint8_t *line = reinterpret_cast<const uint8_t *>(&this->events_[offset]);
+    ESP_LOGI(TAG, "TRACE %s", format_hex(line, events * sizeof(trace_event_t)).c_str());
+    seq += events;
+    App.feed_wdt();
+  }
+  ESP_LOGI(TAG, "TRACE end");
+  this->count_.store(0, std::memory_order_relaxed);
+  this->paused_ = false;
+}
+
+}  // namespace esphome::event_trace
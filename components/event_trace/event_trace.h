@@ -0,0 +1,147 @@
+#pragma once
+
+#include "esphome/core/automation.h"
+#include "esphome/core/component.h"
+#include "esphome/core/hal.h"
+
+#include <esp_timer.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome::event_trace {
+
+/// Event IDs, grouped per component in the high byte. tools/decode_trace.py has the same table.
+enum TraceEvent : uint16_t {
+  TRACE_LOOP = 0x0001,  // [component][cycles]
+  TRACE_MARK = 0x0002,  // [arg0][arg1], free for ad hoc instrumentation
+
+  TRACE_INTERCOM_MODE = 0x0101,      // [new mode][old mode]
+  TRACE_INTERCOM_RX = 0x0102,        // [bytes][timed]
+  TRACE_INTERCOM_TX = 0x0103,        // [bytes][timed]
+  TRACE_INTERCOM_UNDERRUN = 0x0104,  // [underruns][buffered bytes]
+  TRACE_INTERCOM_RESYNC = 0x0105,    // [samples late][0]
+  TRACE_INTERCOM_DROP = 0x0106,      // [bytes][buffered bytes]
+  TRACE_INTERCOM_CONCEAL = 0x0107,   // [lost frames][concealed samples]
+  TRACE_INTERCOM_RECOVER = 0x0108,   // [block first seq][recovered total]
+
+  TRACE_MESH_MODE = 0x0201,      // [new mode][old mode]
+  TRACE_MESH_RX = 0x0202,        // [bytes][from]
+  TRACE_MESH_COUNTER = 0x0203,   // [received counter][expected counter]
+  TRACE_MESH_TX = 0x0204,        // [bytes][counter]
+  TRACE_MESH_FORWARD = 0x0205,   // [bytes][children]
+
+  TRACE_NOWTALK_RX = 0x0301,     // [code][bytes]
+  TRACE_NOWTALK_TX = 0x0302,     // [code][bytes]
+  TRACE_NOWTALK_BATCH = 0x0303,  // [requests][cycles]
+  TRACE_NOWTALK_CALL = 0x0304,   // [direct][us since start_call]
+};
+
+/// One event, 16 bytes so a ring of them is a plain array the decoder can read back as is.
+struct trace_event_t {
+  uint32_t time_us;  // esp_timer time, one clock for both cores
+  uint16_t id;
+  uint16_t seq;  // low bits of the event counter, gaps show where the ring was overwritten
+  uint32_t arg0;
+  uint32_t arg1;
+};
+
+/// Loop time of one instrumented component over the current report interval.
+struct loop_account_t {
+  const Component *component{nullptr};
+  uint64_t cycles{0};
+  uint32_t calls{0};
+  uint32_t max_cycles{0};
+};
+
+static const uint8_t TRACE_MAX_COMPONENTS = 8;
+
+/// Binary event tracer for the audio and radio hot paths.
+///
+/// Recording an event is a timer read and four stores into a RAM ring, cheap enough for every frame where a log line
+/// would cost hundreds of microseconds of formatting and UART time. The ring is written out as hex log lines
+/// on the event_trace.dump action and turned back into a timeline by tools/decode_trace.py.
+///
+/// Components mark their loop() with EVENT_TRACE_LOOP(this); the tracer sums the cycles each spends and logs every
+/// report interval how much of the CPU went where. The macros below need this component; components that trace
+/// include intercom_core/event_trace_hooks.h, which defines them empty when event_trace is not configured.
+class EventTrace : public Component {
+ public:
+  EventTrace();
+  void setup() override;
+  void loop() override;
+  void dump_config() override;
+  float get_setup_priority() const override { return setup_priority::BUS; }
+
+  /// Ring size in events.
+  void set_buffer_size(size_t events) { this->size_ = events; }
+  void set_report_interval(uint32_t interval) { this->report_interval_ = interval; }
+
+  /// Safe from any task and from ISRs. Events are stamped with esp_timer rather than the cycle counter, which each
+  /// core keeps on its own, so the radio task and the loop task share one timeline.
+  void record(uint16_t id, uint32_t arg0, uint32_t arg1) {
+    if (this->events_ == nullptr || this->paused_) {
+      return;
+    }
+    uint32_t seq = this->count_.fetch_add(1, std::memory_order_relaxed);
+    trace_event_t &event = this->events_[seq % this->size_];
+    event.time_us = (uint32_t) esp_timer_get_time();
+    event.id = id;
+    event.seq = seq;
+    event.arg0 = arg0;
+    event.arg1 = arg1;
+  }
+  /// Add one loop() pass of `component` that started at cycle count `start`.
+  void account_loop(const Component *component, uint32_t start);
+
+  /// Log the ring, oldest event first, and start over.
+  void dump();
+
+ protected:
+  void report_loops_();
+
+  trace_event_t *events_{nullptr};
+  size_t size_{1024};
+  std::atomic<uint32_t> count_{0};
+  volatile bool paused_{false};
+
+  std::array<loop_account_t, TRACE_MAX_COMPONENTS> loops_{};
+  uint32_t report_interval_{10000};
+  uint32_t last_report_{0};
+  uint32_t report_start_cycles_{0};
+};
+
+extern EventTrace *global_event_trace;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/// Accounts the enclosing scope as one loop() pass of `component`.
+class LoopScope {
+ public:
+  explicit LoopScope(const Component *component) : component_(component), start_(arch_get_cpu_cycle_count()) {}
+  ~LoopScope() {
+    if (global_event_trace != nullptr) {
+      global_event_trace->account_loop(this->component_, this->start_);
+    }
+  }
+
+ protected:
+  const Component *component_;
+  uint32_t start_;
+};
+
+template<typename... Ts> class DumpAction : public Action<Ts...>, public Parented<EventTrace> {
+ public:
+  void play(Ts... x) override { this->parent_->dump(); }
+};
+
+}  // namespace esphome::event_trace
+
+#define EVENT_TRACE(id, arg0, arg1) \
+  do { \
+    if (::esphome::event_trace::global_event_trace != nullptr) { \
+      ::esphome::event_trace::global_event_trace->record(::esphome::event_trace::id, (uint32_t) (arg0), \
+                                                         (uint32_t) (arg1)); \
+    } \
+  } while (0)
+#define EVENT_TRACE_LOOP(component) ::esphome::event_trace::LoopScope event_trace_loop_scope_(component)
@@ -0,0 +1,76 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.const import CONF_ID, CONF_KEY
+
+CODEOWNERS = ["@LumenSoftNL"]
+
+CONF_GROUP_CRYPTO_ID = "group_crypto_id"
+CONF_GROUPS = "groups"
+CONF_KEY_ID = "key_id"
+CONF_TX_GROUP = "tx_group"
+
+group_crypto_ns = cg.esphome_ns.namespace("group_crypto")
+GroupCrypto = group_crypto_ns.class_("GroupCrypto", cg.Component)
+
+
+def _key(value):
+    value = cv.string_strict(value).replace(":", "").replace(" ", "")
+    try:
+        key = bytes.fromhex(value)
+    except ValueError as err:
+        raise cv.Invalid("Key must be hex") from err
+    if len(key) != 16:
+        raise cv.Invalid("Key must be 16 bytes (32 hex digits)")
+    return list(key)
+
+
+def _validate_tx_group(config):
+    ids = [group[CONF_KEY_ID] for group in config[CONF_GROUPS]]
+    if len(set(ids)) != len(ids):
+        raise cv.Invalid("Key ids must be unique")
+    if config[CONF_TX_GROUP] not in ids:
+        raise cv.Invalid(f"{CONF_TX_GROUP} must be one of the configured key ids")
+    return config
+
+
+CONFIG_SCHEMA = cv.All(
+    cv.Schema(
+        {
+            cv.GenerateID(): cv.declare_id(GroupCrypto),
+            cv.Required(CONF_GROUPS): cv.All(
+                cv.ensure_list(
+                    cv.Schema(
+                        {
+                            cv.Required(CONF_KEY_ID): cv.int_range(min=0, max=255),
+                            cv.Required(CONF_KEY): _key,
+                        }
+                    )
+                ),
+                cv.Length(min=1, max=4),
+            ),
+            cv.Required(CONF_TX_GROUP): cv.int_range(min=0, max=255),
+        }
+    ).extend(cv.COMPONENT_SCHEMA),
+    _validate_tx_group,
+)
+
+GROUP_CRYPTO_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_GROUP_CRYPTO_ID): cv.use_id(GroupCrypto),
+    }
+)
+
+
+async def register_group_crypto(var, config):
+    if crypto_id := config.get(CONF_GROUP_CRYPTO_ID):
+        crypto = await cg.get_variable(crypto_id)
+        cg.add(var.set_group_crypto(crypto))
+
+
+async def to_code(config):
+    var = cg.new_Pvariable(config[CONF_ID])
+    await cg.register_component(var, config)
+    for group in config[CONF_GROUPS]:
+        cg.add(var.set_group_key(group[CONF_KEY_ID], group[CONF_KEY]))
+    cg.add(var.set_tx_group(config[CONF_TX_GROUP]))
+    cg.add_define("USE_GROUP_CRYPTO")
@@ -0,0 +1,235 @@
+#include "group_crypto.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <esp_attr.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+
+#include <cinttypes>
+#include <cstring>
+
+namespace esphome::group_crypto {
+
+static const char *const TAG = "group_crypto";
+
+/// Counters reserved in flash at a time; a reboot skips the rest of the block so no nonce repeats.
+static const uint32_t COUNTER_BLOCK = 0x10000;
+/// loop() reserves the next block once fewer counters than this are left, far more than are sealed between loops.
+static const uint32_t COUNTER_LOW_WATER = COUNTER_BLOCK / 2;
+static const uint32_t RTC_COUNTER_MAGIC = 0x47437231;  // "GCr1"
+
+struct crypto_rtc_state_t {
+  uint32_t magic;
+  uint32_t counter;
+  uint32_t reserved_until;
+};
+
+static RTC_DATA_ATTR crypto_rtc_state_t rtc_state;
+
+void GroupCrypto::setup() {
+  get_mac_address_raw(this->own_mac_);
+  this->counter_pref_ = global_preferences->make_preference<uint32_t>(fnv1_hash("group_crypto_counter"));
+  bool resumed = rtc_state.magic == RTC_COUNTER_MAGIC && esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED;
+  if (resumed) {
+    this->reserved_until_ = rtc_state.reserved_until;
+  } else {
+    uint32_t stored = 0;
+    this->counter_pref_.load(&stored);
+    rtc_state.magic = RTC_COUNTER_MAGIC;
+    rtc_state.counter = stored;
+    this->reserved_until_ = stored;
+  }
+  // A wake from deep sleep usually still has counters left, a boot has none.
+  this->loop();
+  this->set_interval("stats", 60000, [this]() {
+    if (this->stats_.sealed + this->stats_.opened > 0) {
+      ESP_LOGD(TAG, "%" PRIu32 " sealed, %" PRIu32 " opened, %" PRIu32 " us per frame", this->stats_.sealed,
+               this->stats_.opened, this->stats_.us_per_frame());
+    }
+  });
+}
+
+GroupCrypto::group_t *GroupCrypto::find_group_(uint8_t key_id) {
+  for (group_t &group : this->groups_) {
+    if (group.used && group.key_id == key_id) {
+      return &group;
+    }
+  }
+  return nullptr;
+}
+
+bool GroupCrypto::set_group_key(uint8_t key_id, const std::array<uint8_t, GROUP_CRYPTO_KEY_SIZE> &key) {
+  group_t *group = this->find_group_(key_id);
+  if (group == nullptr) {
+    for (group_t &candidate : this->groups_) {
+      if (!candidate.used) {
+        group = &candidate;
+        mbedtls_ccm_init(&group->ctx);
+        break;
+      }
+    }
+  }
+  if (group == nullptr) {
+    ESP_LOGE(TAG, "No room for key %u", key_id);
+    return false;
+  }
+  if (mbedtls_ccm_setkey(&group->ctx, MBEDTLS_CIPHER_ID_AES, key.data(), GROUP_CRYPTO_KEY_SIZE * 8) != 0) {
+    return false;
+  }
+  group->used = true;
+  group->key_id = key_id;
+  group->key = key;
+  return true;
+}
+
+bool GroupCrypto::load_tx_key(mbedtls_ccm_context *ctx) const {
+  for (const group_t &group : this->groups_) {
+    if (group.used && group.key_id == this->tx_key_id_) {
+      return mbedtls_ccm_setkey(ctx, MBEDTLS_CIPHER_ID_AES, group.key.data(), GROUP_CRYPTO_KEY_SIZE * 8) == 0;
+    }
+  }
+  return false;
+}
+
+void GroupCrypto::loop() {
+  if (this->reserved_until_ - rtc_state.counter < COUNTER_LOW_WATER) {
+    this->reserve_counters_();
+  }
+}
+
+void GroupCrypto::reserve_counters_() {
+  this->reserved_until_ = rtc_state.counter + COUNTER_BLOCK;
+  this->counter_pref_.save(&this->reserved_until_);
+  global_preferences->sync();
+  rtc_state.reserved_until = this->reserved_until_;
+}
+
+uint32_t GroupCrypto::next_counter_() {
+  uint32_t counter = ++rtc_state.counter;
+  if (counter >= this->reserved_until_) {
+    // Only when half a block was sealed since the last loop(); a repeated nonce would be worse than the wait.
+    this->reserve_counters_();
+  }
+  return counter;
+}
+
+void GroupCrypto::make_nonce_(uint8_t *nonce, const uint8_t *mac, uint8_t key_id, uint32_t counter) {
+  memcpy(nonce, mac, 6);
+  nonce[6] = key_id;
+  nonce[7] = counter & 0xff;
+  nonce[8] = (counter >> 8) & 0xff;
+  nonce[9] = (counter >> 16) & 0xff;
+  nonce[10] = counter >> 24;
+  nonce[11] = 0;
+  nonce[12] = 0;
+}
+
+size_t GroupCrypto::seal(const uint8_t *plain, size_t len, uint8_t *out, const uint8_t *aad, size_t aad_len) {
+  group_t *group = this->find_group_(this->tx_key_id_);
+  if (group == nullptr) {
+    return 0;
+  }
+  uint32_t start = (uint32_t) esp_timer_get_time();
+  uint32_t counter = this->next_counter_();
+  out[0] = this->tx_key_id_;
+  out[1] = counter & 0xff;
+  out[2] = (counter >> 8) & 0xff;
+  out[3] = (counter >> 16) & 0xff;
+  out[4] = counter >> 24;
+  uint8_t nonce[GROUP_CRYPTO_NONCE_SIZE];
+  make_nonce_(nonce, this->own_mac_, this->tx_key_id_, counter);
+  if (mbedtls_ccm_encrypt_and_tag(&group->ctx, len, nonce, GROUP_CRYPTO_NONCE_SIZE, aad, aad_len, plain,
+                                  out + GROUP_CRYPTO_HEADER_SIZE, out + GROUP_CRYPTO_HEADER_SIZE + len,
+                                  GROUP_CRYPTO_TAG_SIZE) != 0) {
+    return 0;
+  }
+  this->stats_.sealed++;
+  this->stats_.total_us += (uint32_t) esp_timer_get_time() - start;
+  return len + GROUP_CRYPTO_OVERHEAD;
+}
+
+int GroupCrypto::open(const uint8_t *sender, const uint8_t *sealed, size_t len, uint8_t *out, const uint8_t *aad,
+                      size_t aad_len) {
+  if (len < GROUP_CRYPTO_OVERHEAD) {
+    return -1;
+  }
+  group_t *group = this->find_group_(sealed[0]);
+  if (group == nullptr) {
+    this->stats_.rejected++;
+    return -1;
+  }
+  uint32_t start = (uint32_t) esp_timer_get_time();
+  uint32_t counter = sealed[1] | (sealed[2] << 8) | (sealed[3] << 16) | ((uint32_t) sealed[4] << 24);
+  size_t plain_len = len - GROUP_CRYPTO_OVERHEAD;
+  uint8_t nonce[GROUP_CRYPTO_NONCE_SIZE];
+  make_nonce_(nonce, sender, sealed[0], counter);
+  if (mbedtls_ccm_auth_decrypt(&group->ctx, plain_len, nonce, GROUP_CRYPTO_NONCE_SIZE, aad, aad_len,
+                               sealed + GROUP_CRYPTO_HEADER_SIZE, out, sealed + GROUP_CRYPTO_HEADER_SIZE + plain_len,
+                               GROUP_CRYPTO_TAG_SIZE) != 0) {
+    this->stats_.rejected++;
+    return -1;
+  }
+  // Only authentic frames may move the replay window.
+  if (!this->check_replay_(sender, counter)) {
+    this->stats_.replays++;
+    return -1;
+  }
+  this->stats_.opened++;
+  this->stats_.total_us += (uint32_t) esp_timer_get_time() - start;
+  return plain_len;
+}
+
+bool GroupCrypto::check_replay_(const uint8_t *sender, uint32_t counter) {
+  uint32_t now = millis();
+  replay_t *entry = nullptr;
+  replay_t *oldest = &this->senders_[0];
+  for (replay_t &candidate : this->senders_) {
+    if (candidate.used && memcmp(candidate.mac, sender, 6) == 0) {
+      entry = &candidate;
+      break;
+    }
+    if (!candidate.used || (oldest->used && now - candidate.last_used > now - oldest->last_used)) {
+      oldest = &candidate;
+    }
+  }
+  if (entry == nullptr) {
+    entry = oldest;
+    memcpy(entry->mac, sender, 6);
+    entry->used = true;
+    entry->highest = counter;
+    entry->window = 1;
+    entry->last_used = now;
+    return true;
+  }
+  entry->last_used = now;
+  if (counter > entry->highest) {
+    uint32_t shift = counter - entry->highest;
+    entry->window = shift >= 32 ? 1 : (entry->window << shift) | 1;
+    entry->highest = counter;
+    return true;
+  }
+  uint32_t age = entry->highest - counter;
+  if (age >= 32 || ((entry->window >> age) & 1)) {
+    return false;
+  }
+  entry->window |= 1UL << age;
+  return true;
+}
+
+void GroupCrypto::dump_config() {
+  ESP_LOGCONFIG(TAG, "Group crypto:");
+  ESP_LOGCONFIG(TAG, "  Cipher: AES-128-CCM, %u byte tag", GROUP_CRYPTO_TAG_SIZE);
+  ESP_LOGCONFIG(TAG, "  TX group: %u", this->tx_key_id_);
+  for (const group_t &group : this->groups_) {
+    if (group.used) {
+      ESP_LOGCONFIG(TAG, "  Group %u: key installed", group.key_id);
+    }
+  }
+  ESP_LOGCONFIG(TAG, "  Frames sealed: %" PRIu32 ", opened: %" PRIu32 ", rejected: %" PRIu32 ", replays: %" PRIu32,
+                this->stats_.sealed, this->stats_.opened, this->stats_.rejected, this->stats_.replays);
+  ESP_LOGCONFIG(TAG, "  Cost per frame: %" PRIu32 " us", this->stats_.us_per_frame());
+}
+
+}  // namespace esphome::group_crypto
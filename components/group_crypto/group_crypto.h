@@ -0,0 +1,107 @@
+#pragma once
+
+#include "esphome/core/component.h"
+#include "esphome/core/helpers.h"
+#include "esphome/core/preferences.h"
+
+#include <mbedtls/ccm.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome::group_crypto {
+
+static const uint8_t GROUP_CRYPTO_KEY_SIZE = 16;
+static const uint8_t GROUP_CRYPTO_TAG_SIZE = 8;
+/// Sender MAC, key id, counter and two zero bytes.
+static const uint8_t GROUP_CRYPTO_NONCE_SIZE = 13;
+/// [key id][counter:4] in front of the ciphertext.
+static const uint8_t GROUP_CRYPTO_HEADER_SIZE = 5;
+/// Bytes a sealed payload adds to the plaintext.
+static const uint8_t GROUP_CRYPTO_OVERHEAD = GROUP_CRYPTO_HEADER_SIZE + GROUP_CRYPTO_TAG_SIZE;
+static const uint8_t GROUP_CRYPTO_MAX_GROUPS = 4;
+static const uint8_t GROUP_CRYPTO_MAX_SENDERS = 16;
+
+struct crypto_stats_t {
+  uint32_t sealed{0};
+  uint32_t opened{0};
+  uint32_t rejected{0};  // bad tag or unknown key
+  uint32_t replays{0};
+  uint64_t total_us{0};
+
+  uint32_t us_per_frame() const {
+    uint32_t frames = this->sealed + this->opened;
+    return frames == 0 ? 0 : (uint32_t) (this->total_us / frames);
+  }
+};
+
+/// AES-CCM with per-group keys for frames that ESP-NOW's own encryption cannot cover: broadcasts and more peers
+/// than the driver's encrypted peer table holds. AES runs on the hardware accelerator through mbedtls.
+///
+///  sealed  [key id][counter:4][ciphertext][tag:8]
+///
+/// The 13 byte nonce is sender MAC, key id and counter, so all members of a group can share one key. The counter
+/// survives deep sleep in RTC memory and reboots through a high water mark in flash; receivers drop frames whose
+/// counter they have seen before. Counters are reserved in flash ahead of use from loop(), so sealing never waits
+/// for a flash write.
+///
+/// Keys come from the configuration only. Nothing hands them out over the air, so changing a key means flashing
+/// every member of the group.
+class GroupCrypto : public Component {
+ public:
+  void setup() override;
+  void loop() override;
+  void dump_config() override;
+  float get_setup_priority() const override { return setup_priority::BUS; }
+
+  /// Install or replace the key of group `key_id`.
+  bool set_group_key(uint8_t key_id, const std::array<uint8_t, GROUP_CRYPTO_KEY_SIZE> &key);
+  /// Group used for outgoing frames.
+  void set_tx_group(uint8_t key_id) { this->tx_key_id_ = key_id; }
+
+  /// Seal `len` bytes into `out`, which needs room for len + GROUP_CRYPTO_OVERHEAD. `aad` is authenticated but
+  /// not encrypted, typically the frame header in front of the sealed part. Returns the sealed length or 0.
+  size_t seal(const uint8_t *plain, size_t len, uint8_t *out, const uint8_t *aad, size_t aad_len);
+  /// Verify and decrypt a sealed payload from `sender`. Returns the plaintext length or -1.
+  int open(const uint8_t *sender, const uint8_t *sealed, size_t len, uint8_t *out, const uint8_t *aad,
+           size_t aad_len);
+  /// Load the key of the TX group into a caller owned context, so the cipher can be timed without spending
+  /// counters or touching replay windows. Returns false when the TX group has no key.
+  bool load_tx_key(mbedtls_ccm_context *ctx) const;
+
+  const crypto_stats_t &get_stats() const { return this->stats_; }
+
+ protected:
+  struct group_t {
+    bool used;
+    uint8_t key_id;
+    std::array<uint8_t, GROUP_CRYPTO_KEY_SIZE> key;
+    mbedtls_ccm_context ctx;
+  };
+  struct replay_t {
+    uint8_t mac[6];
+    bool used;
+    uint32_t highest;
+    uint32_t window;  // bit n: counter highest - n was seen
+    uint32_t last_used;
+  };
+
+  group_t *find_group_(uint8_t key_id);
+  bool check_replay_(const uint8_t *sender, uint32_t counter);
+  uint32_t next_counter_();
+  void reserve_counters_();
+  static void make_nonce_(uint8_t *nonce, const uint8_t *mac, uint8_t key_id, uint32_t counter);
+
+  std::array<group_t, GROUP_CRYPTO_MAX_GROUPS> groups_{};
+  std::array<replay_t, GROUP_CRYPTO_MAX_SENDERS> senders_{};
+  uint8_t tx_key_id_{0};
+  uint8_t own_mac_[6]{};
+
+  ESPPreferenceObject counter_pref_;
+  uint32_t reserved_until_{0};
+
+  crypto_stats_t stats_{};
+};
+
+}  // namespace esphome::group_crypto
@@ -3,33 +3,46 @@ import esphome.codegen as cg
 
 from esphome.const import (
     CONF_ID,
-    CONF_MICROPHONE,
-    CONF_SPEAKER,
     CONF_MODE,
 )
 from esphome import automation
 from esphome.automation import register_action
-from esphome.components import microphone, speaker
-from esphome.components.espnow import (
-    ESPNOW_SCHEMA,
-    register_espnow_extention,
-    ESPNowReceivedPacketHandler,
-    ESPNowBroadcastedHandler,
+from esphome.components.espnow import ESPNOW_SCHEMA, register_espnow_extention
+from esphome.components.tx_scheduler import TX_SCHEDULER_SCHEMA, register_tx_scheduler
+from esphome.components.group_crypto import GROUP_CRYPTO_SCHEMA, register_group_crypto
+from esphome.components.intercom_core import (
+    CONF_BUFFER_DURATION,
+    ENGINE_SCHEMA,
+    MODE_ENUM,
+    engine_defaults,
+    intercom_ns,
+    register_engine,
+)
+from esphome.components.network_clock import (
+    CONF_NETWORK_CLOCK_ID,
+    NETWORK_CLOCK_SCHEMA,
+    register_network_clock,
 )
 
 
-AUTO_LOAD = ["microphone", "speaker", "espnow"]
+AUTO_LOAD = ["microphone", "speaker", "espnow", "tx_scheduler", "intercom_core"]
 
 CODEOWNERS = ["@LumenSoftNL"]
 
 
 CONF_INTERCOM = "intercom"
+CONF_PREBUFFER = "prebuffer"
+CONF_DRIFT_COMPENSATION = "drift_compensation"
+CONF_LOSS_CONCEALMENT = "loss_concealment"
+CONF_FEC_BLOCK = "fec_block"
+CONF_SYNC_DELAY = "sync_delay"
+CONF_STREAM_LEAD = "stream_lead"
+CONF_ITERATIONS = "iterations"
 
+DEFAULT_BUFFER_DURATION = "1024ms"
 
-intercom_ns = cg.esphome_ns.namespace("intercom")
-InterCom = intercom_ns.class_(
-    "InterCom", cg.Component, ESPNowReceivedPacketHandler, ESPNowBroadcastedHandler
-)
+
+InterCom = intercom_ns.class_("InterCom", cg.Component)
 
 ModeAction = intercom_ns.class_(
     "ModeAction", automation.Action, cg.Parented.template(InterCom)
@@ -39,46 +52,63 @@ IsModeCondition = intercom_ns.class_(
     "IsModeCondition", automation.Condition, cg.Parented.template(InterCom)
 )
 
-Mode = intercom_ns.enum("Mode", is_class=True)
-MODE_ENUM = {
-    "NONE": Mode.NONE,
-    "MICROPHONE": Mode.MICROPHONE,
-    "SPEAKER": Mode.SPEAKER,
-}
+BenchmarkAction = intercom_ns.class_(
+    "BenchmarkAction", automation.Action, cg.Parented.template(InterCom)
+)
+
+
+def _stream_lead(config):
+    if config[CONF_STREAM_LEAD] >= config[CONF_BUFFER_DURATION]:
+        raise cv.Invalid(f"{CONF_STREAM_LEAD} must be shorter than {CONF_BUFFER_DURATION}")
+    return config
+
 
 CONFIG_SCHEMA = cv.All(
     cv.Schema(
         {
             cv.GenerateID(): cv.declare_id(InterCom),
-            cv.Optional(CONF_MICROPHONE): microphone.microphone_source_schema(
-                min_bits_per_sample=16,
-                max_bits_per_sample=16,
-                min_channels=1,
-                max_channels=1,
+            cv.Optional(
+                CONF_STREAM_LEAD, default="200ms"
+            ): cv.positive_time_period_milliseconds,
+            cv.Optional(
+                CONF_PREBUFFER, default="100ms"
+            ): cv.positive_time_period_milliseconds,
+            cv.Optional(CONF_DRIFT_COMPENSATION, default=True): cv.boolean,
+            cv.Optional(CONF_LOSS_CONCEALMENT, default=True): cv.boolean,
+            # One parity frame per this many broadcast frames: 2, 4 or 8 for 50, 25 or 12.5% overhead.
+            cv.Optional(CONF_FEC_BLOCK, default=0): cv.one_of(0, 2, 4, 8, int=True),
+            cv.Optional(CONF_SYNC_DELAY, default="150ms"): cv.All(
+                cv.positive_time_period_milliseconds,
+                cv.Range(min=cv.TimePeriod(milliseconds=50), max=cv.TimePeriod(milliseconds=1000)),
             ),
-            cv.Optional(CONF_SPEAKER): cv.use_id(speaker.Speaker),
-            cv.Optional(CONF_MODE): cv.enum(MODE_ENUM, upper=True),
         }
     )
     .extend(cv.COMPONENT_SCHEMA)
-    .extend(ESPNOW_SCHEMA),
+    .extend(ENGINE_SCHEMA)
+    .extend(ESPNOW_SCHEMA)
+    .extend(TX_SCHEDULER_SCHEMA)
+    .extend(GROUP_CRYPTO_SCHEMA)
+    .extend(NETWORK_CLOCK_SCHEMA),
+    engine_defaults(DEFAULT_BUFFER_DURATION),
+    _stream_lead,
 )
 
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
     await register_espnow_extention(var, config)
-
-    if mic := config.get(CONF_MICROPHONE):
-        mic_source = await microphone.microphone_source_to_code(mic)
-        cg.add(var.set_microphone_source(mic_source))
-
-    if output := config.get(CONF_SPEAKER):
-        spkr = await cg.get_variable(output)
-        cg.add(var.set_speaker(spkr))
-
-    if value := config.get(CONF_MODE):
-        cg.add(var.set_mode(value))
+    await register_tx_scheduler(var, config)
+    await register_group_crypto(var, config)
+    await register_network_clock(var, config)
+    await register_engine(var, config)
+
+    cg.add(var.set_stream_lead(config[CONF_STREAM_LEAD]))
+    cg.add(var.set_prebuffer(config[CONF_PREBUFFER]))
+    cg.add(var.set_drift_compensation(config[CONF_DRIFT_COMPENSATION]))
+    cg.add(var.set_loss_concealment(config[CONF_LOSS_CONCEALMENT]))
+    cg.add(var.set_fec_block(config[CONF_FEC_BLOCK]))
+    if CONF_NETWORK_CLOCK_ID in config:
+        cg.add(var.set_sync_delay(config[CONF_SYNC_DELAY]))
 
     cg.add_define("USE_INTERCOM")
 
@@ -111,3 +141,23 @@ async def intercom_mode_change_action_code(config, condition_id, template_arg, a
     await cg.register_parented(var, config[CONF_ID])
     cg.add(var.set_mode(config[CONF_MODE]))
     return var
+
+
+@register_action(
+    "intercom.benchmark",
+    BenchmarkAction,
+    cv.Schema(
+        {
+            cv.GenerateID(): cv.use_id(InterCom),
+            cv.Optional(CONF_ITERATIONS, default=100): cv.templatable(
+                cv.int_range(min=1, max=10000)
+            ),
+        }
+    ),
+)
+async def intercom_benchmark_code(config, action_id, template_arg, arg):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    iterations = await cg.templatable(config[CONF_ITERATIONS], arg, cg.uint32)
+    cg.add(var.set_iterations(iterations))
+    return var
@@ -0,0 +1,73 @@
+#include "drift_compensator.h"
+
+#include <algorithm>
+
+namespace esphome::intercom {
+
+static const uint32_t PHASE_ONE = 1u << 24;
+/// Time constant in which the proportional part removes a depth error, in seconds.
+static const float DRIFT_P_SECONDS = 20.0f;
+/// Windows over which the integral part follows the proportional part.
+static const float DRIFT_I_WINDOWS = 16.0f;
+
+void DriftCompensator::reset() {
+  this->drift_ppm_ = 0.0f;
+  this->correction_ppm_ = 0.0f;
+  this->step_ = PHASE_ONE;
+  this->average_fill_ = 0;
+  this->restart();
+}
+
+void DriftCompensator::restart() {
+  this->fill_sum_ = 0;
+  this->fill_count_ = 0;
+  this->window_started_ = false;
+  this->phase_ = 0;
+  this->prev_ = 0;
+}
+
+void DriftCompensator::update(size_t fill_bytes, uint32_t now) {
+  if (!this->window_started_) {
+    this->window_started_ = true;
+    this->window_start_ = now;
+  }
+  this->fill_sum_ += fill_bytes;
+  this->fill_count_++;
+  if (now - this->window_start_ < DRIFT_WINDOW_MS || this->target_ == 0) {
+    return;
+  }
+  this->average_fill_ = this->fill_sum_ / this->fill_count_;
+  this->fill_sum_ = 0;
+  this->fill_count_ = 0;
+  this->window_start_ = now;
+
+  // A buffer that is too deep means the talker is ahead of us: consume faster.
+  float error = (float) this->average_fill_ - (float) this->target_;
+  float proportional = error / (this->bytes_per_second_ * DRIFT_P_SECONDS) * 1e6f;
+  this->drift_ppm_ += proportional / DRIFT_I_WINDOWS;
+  this->drift_ppm_ = std::clamp(this->drift_ppm_, -(float) DRIFT_MAX_PPM / 2, (float) DRIFT_MAX_PPM / 2);
+  this->correction_ppm_ = std::clamp(this->drift_ppm_ + proportional, -(float) DRIFT_MAX_PPM, (float) DRIFT_MAX_PPM);
+  this->step_ = (uint32_t) ((int32_t) PHASE_ONE + (int32_t) (this->correction_ppm_ * PHASE_ONE / 1e6f));
+}
+
+size_t DriftCompensator::process(const int16_t *in, size_t in_len, int16_t *out) {
+  size_t produced = 0;
+  size_t i = 0;
+  while (true) {
+    while (this->phase_ >= PHASE_ONE) {
+      if (i >= in_len) {
+        return produced;
+      }
+      this->prev_ = in[i++];
+      this->phase_ -= PHASE_ONE;
+    }
+    if (i >= in_len) {
+      return produced;
+    }
+    int32_t delta = (int32_t) in[i] - this->prev_;
+    out[produced++] = (int16_t) (this->prev_ + ((delta * (int32_t) (this->phase_ >> 9)) >> 15));
+    this->phase_ += this->step_;
+  }
+}
+
+}  // namespace esphome::intercom
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome::intercom {
+
+/// Fill level is averaged over this window before it moves the correction.
+static const uint32_t DRIFT_WINDOW_MS = 1000;
+/// Largest rate correction applied, far beyond the tolerance of two 16 kHz I2S clocks.
+static const int32_t DRIFT_MAX_PPM = 1000;
+
+/// Keeps the receive buffer at a constant depth while the talker's microphone clock and the listener's DAC clock
+/// run at slightly different rates.
+///
+/// The fill level is sampled on every playout pass and averaged per window. A PI loop turns the distance from the
+/// target depth into a rate correction: the proportional part removes a standing error over about 20 s, the integral
+/// part settles on the actual clock offset, which is reported as the drift estimate. Playout audio then goes through
+/// a linear interpolating resampler that consumes input at 1 + correction times the output rate. A few hundred ppm
+/// of pitch change is inaudible, a buffer overrun or underrun every few minutes is not.
+class DriftCompensator {
+ public:
+  /// Buffer depth to hold, in bytes, and the nominal byte rate of the stream.
+  void set_target(size_t target_bytes, uint32_t bytes_per_second) {
+    this->target_ = target_bytes;
+    this->bytes_per_second_ = bytes_per_second;
+  }
+  /// Start over for a new talker. Keeps nothing, a different talker has a different clock.
+  void reset();
+  /// Resampler state only, for a gap in the same stream.
+  void restart();
+
+  /// Feed the current buffer depth in bytes.
+  void update(size_t fill_bytes, uint32_t now);
+
+  /// Resample all `in_len` 16 bit samples into `out`, which must hold `in_len + in_len / 64 + 2` samples.
+  /// Returns the number of samples written.
+  size_t process(const int16_t *in, size_t in_len, int16_t *out);
+
+  /// Estimated clock offset of the talker against this node, in ppm. Positive means the talker runs fast.
+  float get_drift_ppm() const { return this->drift_ppm_; }
+  /// Correction currently applied, in ppm.
+  float get_correction_ppm() const { return this->correction_ppm_; }
+  /// Average fill over the last window, in bytes.
+  size_t get_average_fill() const { return this->average_fill_; }
+
+ protected:
+  size_t target_{0};
+  uint32_t bytes_per_second_{32000};
+
+  uint64_t fill_sum_{0};
+  uint32_t fill_count_{0};
+  uint32_t window_start_{0};
+  bool window_started_{false};
+  size_t average_fill_{0};
+
+  float drift_ppm_{0.0f};
+  float correction_ppm_{0.0f};
+
+  // Resampler: input step per output sample and position between prev_ and the next input sample, both Q24.
+  uint32_t step_{1u << 24};
+  uint32_t phase_{0};
+  int16_t prev_{0};
+};
+
+}  // namespace esphome::intercom
@@ -0,0 +1,138 @@
+#include "fec.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace esphome::intercom {
+
+bool FecEncoder::add(uint8_t seq, const uint8_t *data, size_t len) {
+  if (this->block_ == 0 || len > FEC_MAX_DATA) {
+    return false;
+  }
+  uint8_t first = seq & ~(this->block_ - 1);
+  uint8_t bit = 1 << (uint8_t) (seq - first);
+  if (first != this->first_ || (this->mask_ & bit) != 0) {
+    // A new block, or the same counters again after a wrap.
+    this->first_ = first;
+    this->mask_ = 0;
+    this->length_xor_ = 0;
+    this->parity_len_ = 0;
+    memset(this->parity_, 0, sizeof(this->parity_));
+  }
+  for (size_t i = 0; i < len; i++) {
+    this->parity_[i] ^= data[i];
+  }
+  this->parity_len_ = std::max(this->parity_len_, len);
+  this->length_xor_ ^= (uint8_t) len;
+  this->mask_ |= bit;
+  return (uint8_t) (seq - first) == this->block_ - 1;
+}
+
+void FecDecoder::reset() {
+  this->block_ = 0;
+  this->held_count_ = 0;
+  this->start_block_(0);
+}
+
+void FecDecoder::start_block_(uint8_t first) {
+  this->first_ = first;
+  this->received_ = 0;
+  this->done_ = false;
+  this->length_xor_ = 0;
+  memset(this->accumulator_, 0, sizeof(this->accumulator_));
+}
+
+void FecDecoder::release_held_() {
+  for (uint8_t i = 0; i < this->held_count_; i++) {
+    this->release_(this->held_[i].data, this->held_[i].len);
+  }
+  this->held_count_ = 0;
+}
+
+void FecDecoder::on_frame(uint8_t seq, const uint8_t *data, size_t len, uint32_t now) {
+  if (this->block_ != 0 && now - this->last_parity_ > FEC_FORGET_MS) {
+    this->release_held_();
+    this->block_ = 0;
+  }
+  if (this->block_ == 0 || len > FEC_MAX_DATA) {
+    this->release_(data, len);
+    return;
+  }
+  uint8_t first = seq & ~(this->block_ - 1);
+  if (first != this->first_) {
+    // The previous block's parity never came, its held frames go out as they are.
+    this->release_held_();
+    this->start_block_(first);
+  }
+  uint8_t bit = 1 << (uint8_t) (seq - first);
+  if (this->received_ & bit) {
+    return;
+  }
+  this->received_ |= bit;
+  this->length_xor_ ^= (uint8_t) len;
+  for (size_t i = 0; i < len; i++) {
+    this->accumulator_[i] ^= data[i];
+  }
+  bool hole = (~this->received_ & (bit - 1)) != 0;
+  if (this->held_count_ == 0 && (this->done_ || !hole)) {
+    this->release_(data, len);
+    return;
+  }
+  if (this->held_count_ == 0) {
+    this->held_since_ = now;
+  }
+  held_frame_t &held = this->held_[this->held_count_++];
+  held.len = len;
+  memcpy(held.data, data, len);
+}
+
+void FecDecoder::on_parity(uint8_t first, uint8_t block, uint8_t mask, uint8_t length_xor, const uint8_t *parity,
+                           size_t len, uint32_t now) {
+  if (block < 2 || block > FEC_MAX_BLOCK || (block & (block - 1)) != 0 || len > FEC_MAX_DATA) {
+    return;
+  }
+  this->last_parity_ = now;
+  if (block != this->block_) {
+    // The frames of this block went by before the block size was known, recovery starts with the next one.
+    this->release_held_();
+    this->block_ = block;
+    this->start_block_(first);
+    this->done_ = true;
+    return;
+  }
+  if (first != this->first_) {
+    if ((int8_t) (first - this->first_) < 0) {
+      return;
+    }
+    // Not a single frame of this block came in.
+    this->release_held_();
+    this->start_block_(first);
+  }
+  if (this->done_) {
+    return;
+  }
+  this->done_ = true;
+  uint8_t missing = mask & ~this->received_;
+  // One frame missing, and nothing received that the parity does not cover.
+  if (missing != 0 && (missing & (missing - 1)) == 0 && (this->received_ & ~mask) == 0) {
+    size_t recovered_len = length_xor ^ this->length_xor_;
+    if (recovered_len > 0 && recovered_len <= len) {
+      uint8_t recovered[FEC_MAX_DATA];
+      for (size_t i = 0; i < recovered_len; i++) {
+        recovered[i] = parity[i] ^ this->accumulator_[i];
+      }
+      this->recovered_++;
+      this->release_(recovered, recovered_len);
+    }
+  }
+  this->release_held_();
+}
+
+void FecDecoder::loop(uint32_t now) {
+  if (this->held_count_ > 0 && now - this->held_since_ >= FEC_HOLD_MS) {
+    this->done_ = true;
+    this->release_held_();
+  }
+}
+
+}  // namespace esphome::intercom
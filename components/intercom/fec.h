@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome::intercom {
+
+/// Longest block, one parity frame per eight audio frames. Blocks are a power of two so they line up with the 8 bit
+/// frame counter across its wrap.
+static const uint8_t FEC_MAX_BLOCK = 8;
+/// Bytes of a frame covered by the parity, everything after the protocol byte of the largest audio frame.
+static const size_t FEC_MAX_DATA = 241;
+/// Frames held after a loss are released unrecovered when the parity does not follow within this time.
+static const uint32_t FEC_HOLD_MS = 60;
+/// The block size learned from a talker's parity frames is forgotten when they stop for this long.
+static const uint32_t FEC_FORGET_MS = 1000;
+
+/// Hands a frame, held or recovered, back in counter order.
+using fec_release_t = std::function<void(const uint8_t *data, size_t len)>;
+
+/// XOR parity over a block of frames on the talker's side.
+///
+/// A block is the frames whose counter shares all but its low bits, so both sides agree on the boundaries without
+/// any signalling. Frames shorter than the longest in the block count as zero padded, the XOR of their lengths
+/// travels with the parity so a recovered frame gets its own length back.
+class FecEncoder {
+ public:
+  /// Frames per block, a power of two up to FEC_MAX_BLOCK. 0 sends no parity.
+  void set_block(uint8_t frames) { this->block_ = frames; }
+  uint8_t get_block() const { return this->block_; }
+
+  /// Add the frame just sent with counter `seq`. Returns true when it completed its block, the parity is then ready.
+  bool add(uint8_t seq, const uint8_t *data, size_t len);
+
+  uint8_t get_first() const { return this->first_; }
+  /// Frames of the block the parity covers, bit i for counter first + i.
+  uint8_t get_mask() const { return this->mask_; }
+  uint8_t get_length_xor() const { return this->length_xor_; }
+  const uint8_t *get_parity() const { return this->parity_; }
+  size_t get_parity_length() const { return this->parity_len_; }
+
+ protected:
+  uint8_t block_{0};
+  uint8_t first_{0};
+  uint8_t mask_{0};
+  uint8_t length_xor_{0};
+  size_t parity_len_{0};
+  uint8_t parity_[FEC_MAX_DATA]{};
+};
+
+/// Recovers a single lost frame per block on the listener's side.
+///
+/// Every frame is XORed into the block accumulator on arrival and released at once while its block has no holes,
+/// so a clean stream is not delayed. After a hole the following frames of the block are held. When the parity
+/// arrives with exactly one covered frame missing, that frame is the parity XOR the accumulator, and it is released
+/// ahead of the held frames. Otherwise the held frames are released as they are and the gap is left to the loss
+/// concealment, as it is when the parity does not follow within FEC_HOLD_MS.
+class FecDecoder {
+ public:
+  void set_release(fec_release_t &&release) { this->release_ = std::move(release); }
+  /// Start over for a new talker.
+  void reset();
+
+  void on_frame(uint8_t seq, const uint8_t *data, size_t len, uint32_t now);
+  void on_parity(uint8_t first, uint8_t block, uint8_t mask, uint8_t length_xor, const uint8_t *parity, size_t len,
+                 uint32_t now);
+  /// Release held frames whose parity is overdue.
+  void loop(uint32_t now);
+
+  /// Whether parity frames are coming in, so a block size is known.
+  bool is_active() const { return this->block_ != 0; }
+  /// Frames recovered from parity since boot.
+  uint32_t get_recovered() const { return this->recovered_; }
+
+ protected:
+  struct held_frame_t {
+    uint8_t len;
+    uint8_t data[FEC_MAX_DATA];
+  };
+
+  void start_block_(uint8_t first);
+  void release_held_();
+
+  fec_release_t release_{};
+  uint8_t block_{0};
+  uint32_t last_parity_{0};
+
+  uint8_t first_{0};
+  uint8_t received_{0};
+  bool done_{false};
+  uint8_t length_xor_{0};
+  uint8_t accumulator_[FEC_MAX_DATA]{};
+
+  held_frame_t held_[FEC_MAX_BLOCK - 1]{};
+  uint8_t held_count_{0};
+  uint32_t held_since_{0};
+
+  uint32_t recovered_{0};
+};
+
+}  // namespace esphome::intercom
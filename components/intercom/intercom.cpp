@@ -1,192 +1,770 @@
 #include "intercom.h"
 
 #include "esphome/core/application.h"
+#include "esphome/core/hal.h"
 #include "esphome/core/log.h"
 
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+
 #include <cinttypes>
+#include <cmath>
 #include <cstdio>
 
 namespace esphome::intercom {
 
 static const char *const TAG = "intercom";
 
-static const size_t SAMPLE_RATE_HZ = 16000;
-static const char *const INTERCOM_HEADER = "EnIc1";
-static const uint8_t INTERCOM_HEADER_SIZE = 5;
+/// Audio frames start with the PROTOCOL_INTERCOM byte and a variant digit, '1' plus the FRAME_* flags: "I1" is plain
+/// audio, "I2" audio sealed by group_crypto, "I3" broadcast audio with a presentation timestamp [pts:4] in network
+/// microseconds after the header and "I4" both. Sequenced frames, "I5" to "I8", add a frame counter [seq] after that.
+static const uint8_t INTERCOM_ID_SIZE = 1;
+static const uint8_t INTERCOM_HEADER_SIZE = 2;
+static const uint8_t INTERCOM_PTS_SIZE = 4;
+static const uint8_t INTERCOM_SEQ_SIZE = 1;
+static const uint8_t FRAME_SEALED = 0x01;
+static const uint8_t FRAME_TIMED = 0x02;
+static const uint8_t FRAME_SEQUENCED = 0x04;
+static const uint8_t FRAME_FLAGS = FRAME_SEALED | FRAME_TIMED | FRAME_SEQUENCED;
+/// Broadcast parity, "IP" [first seq][block][mask][length xor] and the XOR of the block's frames after the protocol
+/// byte.
+static const char INTERCOM_PARITY_VARIANT = 'P';
+static const uint8_t INTERCOM_PARITY_HEADER_SIZE = 6;
 
 static const size_t SEND_BUFFER_SIZE = 240;
 
-static const size_t RING_BUFFER_SIZE = ( 1024 * SAMPLE_RATE_HZ / 1000) * sizeof(int16_t);
+/// Burst the send pacing allows after a stall, keeps receivers from being flooded while catching up.
+static const uint32_t PACE_BURST_MS = 30;
+
+/// How often the drift estimate is logged during a call.
+static const uint32_t DRIFT_REPORT_INTERVAL = 60000;
+/// How often frame loss and recovery are logged while receiving.
+static const uint32_t LOSS_REPORT_INTERVAL = 60000;
+/// Playout further off its timestamps than this is restarted at the right sample instead of slewed.
+static const int32_t SYNC_RESYNC_SAMPLES = SAMPLE_RATE_HZ / 50;
+/// Each frame moves the send side timestamps 1/SYNC_PTS_SLEW of the way towards the send time, which evens out
+/// jitter in when frames leave but follows the talker's sample clock.
+static const int64_t SYNC_PTS_SLEW = 64;
+
+static const uint32_t RTC_STATE_MAGIC = 0x45496331;  // "EIc1"
+static const char *const BOOT_PHASE_NAMES[BOOT_PHASE_COUNT] = {"setup", "audio start", "first tx", "first rx"};
 
-float InterCom::get_setup_priority() const { return setup_priority::LATE - 10; }
+static const char *const BENCHMARK_STAGE_NAMES[BENCH_STAGE_COUNT] = {"ring buffer", "framing", "seal",    "parity",
+                                                                      "conceal",     "drift",   "loopback"};
+/// Parity block the benchmark encodes with, the middle of the configurable range.
+static const uint8_t BENCHMARK_FEC_BLOCK = 4;
+
+static RTC_DATA_ATTR intercom_rtc_state_t rtc_state;
+
+bool InterCom::is_fast_resume() {
+  return rtc_state.magic == RTC_STATE_MAGIC && esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+float InterCom::get_setup_priority() const {
+  // On a wake from deep sleep set up before the radio, so I2S comes up while WiFi/ESP-NOW initialise.
+  return is_fast_resume() ? setup_priority::AFTER_BLUETOOTH : setup_priority::LATE - 10;
+}
+
+void InterCom::mark_boot_phase_(BootPhase phase) {
+  if (this->boot_phase_us_[phase] == 0) {
+    this->boot_phase_us_[phase] = (uint32_t) esp_timer_get_time();
+    ESP_LOGD(TAG, "Boot phase %s at %" PRIu32 " us", BOOT_PHASE_NAMES[phase], this->boot_phase_us_[phase]);
+  }
+}
 
 void InterCom::setup() {
   ESP_LOGCONFIG(TAG, "Setting up Voice Assistant");
-  this->parent_->register_received_handler(this);
-  this->parent_->register_broadcasted_handler(this);
-  if (this->has_mic_source_()) {
-    this->mic_source_->add_data_callback(
-        [this](const std::vector<uint8_t> &data) { this->receive_audio(data.data(), data.size()); });
+  this->mark_boot_phase_(BOOT_SETUP);
+  this->fast_resume_ = is_fast_resume();
+  this->tx_scheduler_->add_protocol(tx_scheduler::PROTOCOL_INTERCOM,
+                                    [this](const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
+                                      this->handle_frame_(info, data, size);
+                                    });
+  this->update_address_filter_();
+  this->setup_audio_();
+  this->fec_rx_.set_release([this](const uint8_t *data, size_t len) {
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    frame[0] = tx_scheduler::PROTOCOL_INTERCOM;
+    memcpy(frame + INTERCOM_ID_SIZE, data, len);
+    this->play_frame_(this->fec_talker_, frame, len + INTERCOM_ID_SIZE);
+  });
+  // Hold the buffer at the prebuffer depth, the margin against radio jitter.
+  this->drift_.set_target((this->prebuffer_ms_ * SAMPLE_RATE_HZ / 1000) * sizeof(int16_t),
+                          SAMPLE_RATE_HZ * sizeof(int16_t));
+
+  if (this->fast_resume_) {
+    // Start the I2S side now instead of on the first received frame.
+    this->mode_ = rtc_state.mode;
+    if (this->mode_ == Mode::SPEAKER && this->has_spr_source_()) {
+      this->speaker_start_();
+      this->speaker_->start();
+      this->mark_boot_phase_(BOOT_AUDIO_START);
+    } else if (this->mode_ == Mode::MICROPHONE && this->has_mic_source_()) {
+      this->mic_start_();
+      this->mark_boot_phase_(BOOT_AUDIO_START);
+    }
   }
-  if (this->has_spr_source_()) {
-    this->add_play_audio_callback([this](uint8_t *data, size_t size) { return this->speaker_->play(data, size); });
+  rtc_state.magic = RTC_STATE_MAGIC;
+  rtc_state.mode = this->mode_;
+}
+
+void InterCom::dump_config() {
+  ESP_LOGCONFIG(TAG, "Intercom:");
+  this->dump_audio_config_();
+  ESP_LOGCONFIG(TAG, "  Stream lead: %" PRIu32 " ms", this->stream_lead_ms_);
+  ESP_LOGCONFIG(TAG, "  Prebuffer: %" PRIu32 " ms", this->prebuffer_ms_);
+  ESP_LOGCONFIG(TAG, "  Drift compensation: %s", YESNO(this->drift_compensation_));
+  ESP_LOGCONFIG(TAG, "  Loss concealment: %s", YESNO(this->loss_concealment_));
+  if (this->fec_tx_.get_block() > 0) {
+    ESP_LOGCONFIG(TAG, "  Broadcast parity: 1 per %u frames", this->fec_tx_.get_block());
+  }
+#ifdef USE_NETWORK_CLOCK
+  if (this->network_clock_ != nullptr) {
+    ESP_LOGCONFIG(TAG, "  Synchronized playout: %" PRIu32 " ms delay", this->sync_delay_ms_);
   }
-  if (this->ring_buffer_mic_.use_count() == 0) {
-    this->ring_buffer_mic_ = RingBuffer::create(RING_BUFFER_SIZE);
-    if (this->ring_buffer_mic_.use_count() == 0) {
-      ESP_LOGE(TAG, "Could not allocate ring buffer");
+#endif
+  ESP_LOGCONFIG(TAG, "  Free internal heap: %u bytes", (unsigned) heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+  ESP_LOGCONFIG(TAG, "  Fast resume: %s", YESNO(this->fast_resume_));
+  for (uint8_t phase = 0; phase < BOOT_PHASE_COUNT; phase++) {
+    if (this->boot_phase_us_[phase] != 0) {
+      ESP_LOGCONFIG(TAG, "  Boot %s: %" PRIu32 " us", BOOT_PHASE_NAMES[phase], this->boot_phase_us_[phase]);
     }
   }
+}
 
-  this->target_stream_info_ = audio::AudioStreamInfo(16, 1, 16000);
-  this->high_freq_.start();
+size_t InterCom::stream_audio(const uint8_t *data, size_t length) {
+  if (this->ring_buffer_mic_ == nullptr) {
+    return 0;
+  }
+  size_t lead = this->stream_bytes_per_second_ / 1000 * this->stream_lead_ms_;
+  size_t queued = this->ring_buffer_mic_->available();
+  if (queued >= lead) {
+    return 0;
+  }
+  // Whole 16 bit samples only, the remainder comes back with the next call.
+  size_t accepted = std::min(length, lead - queued) & ~(size_t) 1;
+  return this->ring_buffer_mic_->write_without_replacement(data, accepted, 0);
 }
 
-void InterCom::dump_config() {
-  ESP_LOGCONFIG(TAG, "Intercom:");
-  ESP_LOGCONFIG(TAG, "  Buffer size: %d", RING_BUFFER_SIZE);
+void InterCom::on_mode_change_(Mode from, Mode to) {
+  EVENT_TRACE(TRACE_INTERCOM_MODE, to, from);
+  if (to == Mode::SPEAKER && from != Mode::SPEAKER) {
+    this->drift_.reset();
+    this->rx_index_ = this->play_index_ = 0;
+    this->rx_seq_valid_ = false;
+    this->fec_talker_valid_ = false;
+  }
+  if (to == Mode::MICROPHONE && from == Mode::SPEAKER) {
+    // Drop the undelivered playout, it must not go out as microphone audio.
+    this->ring_buffer_mic_->reset();
+    this->playout_chunk_len_ = this->playout_chunk_pos_ = 0;
+    this->playout_primed_ = false;
+  }
+  rtc_state.mode = to;
 }
 
-void InterCom::speaker_start_() {
-  if (this->has_spr_source_()) {
-    this->speaker_->set_audio_stream_info(this->target_stream_info_);
+void InterCom::loop() {
+  EVENT_TRACE_LOOP(this);
+  if (this->switch_pending_()) {
+    return;
+  }
+  if (this->mode_ == Mode::SPEAKER) {
+    uint32_t now = millis();
+    this->fec_rx_.loop(now);
+    this->report_loss_(now);
+    this->play_buffered_();
+  } else {
+    this->read_microphone_();
   }
+  App.feed_wdt();
 }
 
-size_t InterCom::buffer_audio(const uint8_t *data, size_t length) {
-  size_t result = this->ring_buffer_mic_->write_without_replacement(data, length, pdMS_TO_TICKS(100));  //
-//  ESP_LOGI(TAG, "%5d,%6d,%5d,%5d ", this->ring_buffer_mic_->available(), this->ring_buffer_mic_->free(), length, result);
-  return result;
+void InterCom::report_loss_(uint32_t now) {
+  if (now - this->loss_reported_ < LOSS_REPORT_INTERVAL) {
+    return;
+  }
+  this->loss_reported_ = now;
+  uint32_t frames = this->rx_frames_ - this->reported_frames_;
+  uint32_t recovered = this->fec_rx_.get_recovered() - this->reported_recovered_;
+  uint32_t concealed = this->lost_frames_ - this->reported_concealed_;
+  this->reported_frames_ = this->rx_frames_;
+  this->reported_recovered_ = this->fec_rx_.get_recovered();
+  this->reported_concealed_ = this->lost_frames_;
+  if (recovered + concealed > 0) {
+    ESP_LOGD(TAG, "%" PRIu32 " frames received, %" PRIu32 " lost", frames, recovered + concealed);
+    ESP_LOGD(TAG, "  %" PRIu32 " recovered by parity (%.0f%%), %" PRIu32 " concealed", recovered,
+             100.0f * recovered / (recovered + concealed), concealed);
+  }
 }
 
-void InterCom::set_mode(Mode direction) {
-  if (this->has_mic_source_() && this->has_spr_source_()) {
-    if (direction == Mode::SPEAKER) {
-      if (this->mode_ == Mode::MICROPHONE && this->mic_source_->is_running()) {
-        this->mic_source_->stop();
-        this->ring_buffer_mic_->reset();
-        this->wait_to_switch_ = true;
-        ESP_LOGI(TAG, "waiting for Speaker start");
+bool InterCom::pace_take_(size_t bytes) {
+  uint32_t now = micros();
+  uint32_t elapsed = now - this->pace_last_us_;
+  this->pace_last_us_ = now;
+  int64_t burst = std::max<int64_t>(SEND_BUFFER_SIZE, this->stream_bytes_per_second_ / 1000 * PACE_BURST_MS);
+  this->pace_credit_ = std::min(this->pace_credit_ + (int64_t) elapsed * this->stream_bytes_per_second_,
+                                burst * 1000000);
+  int64_t cost = (int64_t) bytes * 1000000;
+  if (this->pace_credit_ < cost) {
+    return false;
+  }
+  this->pace_credit_ -= cost;
+  return true;
+}
 
-      } else {
-        ESP_LOGI(TAG, "Start speaker.");
-        this->speaker_start_();
+void InterCom::play_buffered_() {
+  if (!this->has_spr_source_() || this->wait_to_switch_ || this->ring_buffer_mic_ == nullptr) {
+    return;
+  }
+  int64_t now_us = esp_timer_get_time();
+  if (!this->playout_primed_) {
+    if (!this->prime_playout_()) {
+      return;
+    }
+    this->playout_primed_ = true;
+    this->playout_start_us_ = now_us;
+    this->playout_handed_ = 0;
+  }
+  if (this->drift_compensation_) {
+    uint32_t now = millis();
+    size_t fill = this->ring_buffer_mic_->available();
+#ifdef USE_NETWORK_CLOCK
+    if (this->playout_timed_) {
+      int32_t late = this->sync_lateness_();
+      if (std::abs(late) > SYNC_RESYNC_SAMPLES) {
+        EVENT_TRACE(TRACE_INTERCOM_RESYNC, late, 0);
+        ESP_LOGD(TAG, "Playout %" PRId32 " samples off its timestamps, resyncing", late);
+        this->playout_primed_ = false;
+        this->playout_chunk_len_ = this->playout_chunk_pos_ = 0;
+        this->drift_.restart();
+        return;
       }
-    } else if (direction == Mode::MICROPHONE) {
-      if (this->mode_ == Mode::SPEAKER && this->speaker_->is_running()) {
-        this->speaker_->stop();
-        this->wait_to_switch_ = true;
-        ESP_LOGI(TAG, "waiting for Mic start");
-      } else {
-        ESP_LOGI(TAG, "Mic started");
-        this->mic_source_->start();
+      this->sync_error_sum_ += -late * 1000000LL / (int64_t) SAMPLE_RATE_HZ;
+      this->sync_error_count_++;
+      // Late playout acts like a buffer that is too deep: the loop speeds up until the timestamps are met.
+      size_t target = (this->prebuffer_ms_ * SAMPLE_RATE_HZ / 1000) * sizeof(int16_t);
+      fill = (size_t) std::max<int64_t>(0, (int64_t) target + (int64_t) late * (int64_t) sizeof(int16_t));
+    }
+#endif
+    this->drift_.update(fill, now);
+    if (now - this->drift_reported_ >= DRIFT_REPORT_INTERVAL) {
+      this->drift_reported_ = now;
+      ESP_LOGD(TAG, "Clock drift %+.1f ppm, correction %+.1f ppm, buffer %u bytes", this->drift_.get_drift_ppm(),
+               this->drift_.get_correction_ppm(), (unsigned) this->drift_.get_average_fill());
+#ifdef USE_NETWORK_CLOCK
+      if (this->sync_error_count_ > 0) {
+        this->sync_error_us_ = (int32_t) (this->sync_error_sum_ / this->sync_error_count_);
+        this->sync_error_sum_ = 0;
+        this->sync_error_count_ = 0;
+        ESP_LOGD(TAG, "Sync error %+" PRId32 " us, clock uncertainty %" PRIu32 " us", this->sync_error_us_,
+                 this->network_clock_->get_uncertainty());
       }
-    } else {
-      if (this->mode_ == Mode::MICROPHONE && this->mic_source_->is_running()) {
-        this->mic_source_->stop();
-        this->ring_buffer_mic_->reset();
-        ESP_LOGI(TAG, "reset buffer");
-        this->wait_to_switch_ = true;
+#endif
+    }
+  }
+  // Hand over only what the speaker plays until PLAYOUT_LEAD_MS from now.
+  int64_t budget = (now_us - this->playout_start_us_) * (int64_t) (SAMPLE_RATE_HZ * sizeof(int16_t)) / 1000000 +
+                   (int64_t) (PLAYOUT_LEAD_MS * SAMPLE_RATE_HZ / 1000 * sizeof(int16_t)) -
+                   (int64_t) this->playout_handed_;
+  while (budget > 0) {
+    if (this->playout_chunk_pos_ == this->playout_chunk_len_) {
+      // Whole samples only, an odd byte stays in the buffer until its partner arrives.
+      size_t read_size = std::min(this->ring_buffer_mic_->available(), PLAYOUT_CHUNK_SIZE) & ~(size_t) 1;
+      size_t samples;
+      if (this->drift_compensation_) {
+        int16_t input[PLAYOUT_CHUNK_SIZE / sizeof(int16_t)];
+        samples = this->ring_buffer_mic_->read(input, read_size, 0) / sizeof(int16_t);
+        this->playout_chunk_len_ =
+            this->drift_.process(input, samples, reinterpret_cast<int16_t *>(this->playout_chunk_)) * sizeof(int16_t);
+      } else {
+        this->playout_chunk_len_ = this->ring_buffer_mic_->read(this->playout_chunk_, read_size, 0);
+        samples = this->playout_chunk_len_ / sizeof(int16_t);
       }
-      if (this->mode_ == Mode::SPEAKER && this->speaker_->is_running()) {
-        this->speaker_->stop();
-        this->wait_to_switch_ = true;
+      this->play_index_ += samples;
+      this->playout_chunk_pos_ = 0;
+      if (this->playout_chunk_len_ == 0) {
+        // Ran dry: build up the prebuffer again before resuming.
+        this->playout_primed_ = false;
+        this->drift_.restart();
+        if (millis() - this->last_rx_ms_ < this->prebuffer_ms_) {
+          this->underruns_++;
+          EVENT_TRACE(TRACE_INTERCOM_UNDERRUN, this->underruns_, this->ring_buffer_mic_->available());
+          ESP_LOGD(TAG, "Playout underrun (%" PRIu32 ")", this->underruns_);
+        }
+        return;
       }
     }
+    size_t len = std::min<size_t>(this->playout_chunk_len_ - this->playout_chunk_pos_, budget);
+    size_t played = this->speaker_->play(&this->playout_chunk_[this->playout_chunk_pos_], len);
+    if (played == 0) {
+      return;
+    }
+    this->playout_chunk_pos_ += played;
+    this->playout_handed_ += played;
+    budget -= played;
   }
-  this->mode_ = direction;
 }
 
-bool InterCom::is_in_mode(Mode direction) {
-  if (this->has_mic_source_() && this->has_spr_source_()) {
-    switch (direction) {
-      case Mode::MICROPHONE:
-        return (this->mic_source_->is_running());
-      case Mode::SPEAKER:
-        return (this->speaker_->is_running());
-      default:
-        return (this->mic_source_->is_stopped() && this->speaker_->is_stopped());
-    }
-  } else {
-    return direction == this->mode_;
+bool InterCom::prime_playout_() {
+  size_t available = this->ring_buffer_mic_->available();
+  if (available == 0) {
+    return false;
   }
-};
-
-void InterCom::loop() {
-  if (wait_to_switch_) {
-    if (!this->speaker_->is_stopped() || !this->mic_source_->is_stopped()) {
-      return;
+#ifdef USE_NETWORK_CLOCK
+  if (this->playout_timed_) {
+    int32_t late = this->sync_lateness_();
+    if (late < 0) {
+      return false;
     }
-    this->wait_to_switch_ = false;
-    if (this->mode_ == Mode::MICROPHONE) {
-      ESP_LOGI(TAG, "Mic started in loop");
-      this->mic_source_->start();
-    }
-    if (this->mode_ == Mode::SPEAKER) {
-      ESP_LOGI(TAG, "Speaker started in loop");
-      this->speaker_start_();
+    // Joined a broadcast that is already playing: drop what the other listeners have already heard.
+    size_t skip = std::min<size_t>((size_t) late * sizeof(int16_t), available & ~(size_t) 1);
+    while (skip > 0) {
+      uint8_t discard[PLAYOUT_CHUNK_SIZE];
+      size_t read = this->ring_buffer_mic_->read(discard, std::min(skip, PLAYOUT_CHUNK_SIZE), 0);
+      if (read == 0) {
+        break;
+      }
+      skip -= read;
+      this->play_index_ += read / sizeof(int16_t);
     }
+    return this->ring_buffer_mic_->available() > 0;
   }
-  this->read_microphone_();
-  App.feed_wdt();
+#endif
+  size_t prebuffer = (this->prebuffer_ms_ * SAMPLE_RATE_HZ / 1000) * sizeof(int16_t);
+  // A clip shorter than the prebuffer still plays once the sender goes quiet.
+  bool idle = millis() - this->last_rx_ms_ > this->prebuffer_ms_;
+  return available >= prebuffer || idle;
 }
 
+#ifdef USE_NETWORK_CLOCK
+int32_t InterCom::sync_lateness_() {
+  // The sample handed to the speaker now is heard PLAYOUT_LEAD_MS later.
+  uint32_t heard = (uint32_t) (this->network_clock_->now() + PLAYOUT_LEAD_MS * 1000);
+  int64_t due = this->pts_ref_index_ + (int64_t) (int32_t) (heard - this->pts_ref_) * SAMPLE_RATE_HZ / 1000000;
+  // Samples still waiting in the current chunk have not reached the speaker yet.
+  uint32_t handed = this->play_index_ - (this->playout_chunk_len_ - this->playout_chunk_pos_) / sizeof(int16_t);
+  return (int32_t) (due - (int64_t) handed);
+}
+
+uint32_t InterCom::next_pts_(size_t samples) {
+  int64_t delay = (int64_t) this->sync_delay_ms_ * 1000;
+  int64_t ideal = this->network_clock_->now() + delay;
+  if (!this->tx_timed_ || std::abs(ideal - this->tx_pts_next_) > delay) {
+    this->tx_pts_next_ = ideal;
+    this->tx_timed_ = true;
+  } else {
+    this->tx_pts_next_ += (ideal - this->tx_pts_next_) / SYNC_PTS_SLEW;
+  }
+  uint32_t pts = (uint32_t) this->tx_pts_next_;
+  this->tx_pts_next_ += (int64_t) samples * 1000000 / SAMPLE_RATE_HZ;
+  return pts;
+}
+#endif
+
 void InterCom::read_microphone_() {
-  size_t bytes_read = 0;
   uint8_t buffer[SEND_BUFFER_SIZE + INTERCOM_HEADER_SIZE + 1];
   if (this->can_send_packet_) {
-    size_t available = this->ring_buffer_mic_->available();
+    size_t available = this->mic_available_();
     if (available > 0) {
-      memcpy(&buffer, INTERCOM_HEADER, INTERCOM_HEADER_SIZE);
-      size_t read_size = std::min(available, SEND_BUFFER_SIZE);
-      size_t bytes_read = this->ring_buffer_mic_->read((void *) &buffer[INTERCOM_HEADER_SIZE], read_size, pdMS_TO_TICKS(100));
+      size_t payload_size = SEND_BUFFER_SIZE - INTERCOM_SEQ_SIZE;
+      bool sealed = false;
+      bool timed = false;
+#ifdef USE_GROUP_CRYPTO
+      if (this->group_crypto_ != nullptr) {
+        payload_size -= group_crypto::GROUP_CRYPTO_OVERHEAD;
+        sealed = true;
+      }
+#endif
+#ifdef USE_NETWORK_CLOCK
+      // Only broadcasts reach several speakers at once, a call to one peer has nothing to line up with.
+      if (this->network_clock_ != nullptr && !this->address_.has_value() && this->network_clock_->is_synced()) {
+        payload_size -= INTERCOM_PTS_SIZE;
+        timed = true;
+      } else {
+        this->tx_timed_ = false;
+      }
+#endif
+      // Whole samples per frame, so a lost frame cannot shift the byte alignment of everything after it.
+      size_t read_size = std::min(available, payload_size) & ~(size_t) 1;
+      if (read_size == 0 || (this->streaming_ && !this->pace_take_(read_size))) {
+        return;
+      }
+      buffer[0] = tx_scheduler::PROTOCOL_INTERCOM;
+      buffer[INTERCOM_ID_SIZE] = '1' + (FRAME_SEQUENCED | (sealed ? FRAME_SEALED : 0) | (timed ? FRAME_TIMED : 0));
+      size_t offset = INTERCOM_HEADER_SIZE + (timed ? INTERCOM_PTS_SIZE : 0);
+      buffer[offset++] = this->tx_seq_;
+      size_t bytes_read = this->mic_read_(&buffer[offset], read_size, pdMS_TO_TICKS(100));
+#ifdef USE_NETWORK_CLOCK
+      if (bytes_read > 0 && timed) {
+        uint32_t pts = this->next_pts_(bytes_read / sizeof(int16_t));
+        for (uint8_t i = 0; i < INTERCOM_PTS_SIZE; i++) {
+          buffer[INTERCOM_HEADER_SIZE + i] = (uint8_t) (pts >> (8 * i));
+        }
+      }
+#endif
+#ifdef USE_GROUP_CRYPTO
+      if (bytes_read > 0 && sealed) {
+        // The header and timestamp stay readable but are covered by the tag.
+        uint8_t plain[SEND_BUFFER_SIZE];
+        memcpy(plain, &buffer[offset], bytes_read);
+        bytes_read = this->group_crypto_->seal(plain, bytes_read, &buffer[offset], buffer, offset);
+      }
+#endif
       if (bytes_read > 0) {
         this->can_send_packet_ = false;
+        this->tx_seq_++;
         uint8_t *address = nullptr;
         espnow::peer_address_t addr;
         if (this->address_.has_value()) {
           addr = this->address_.value();
           address = addr.data();
         }
-        this->parent_->send(address, (uint8_t *) &buffer, bytes_read + INTERCOM_HEADER_SIZE,
-                            [this](esp_err_t x) { this->can_send_packet_ = true; });
+        this->tx_scheduler_->send(tx_scheduler::TxClass::AUDIO, address, (uint8_t *) &buffer, bytes_read + offset,
+                                  [this](esp_err_t x) { this->can_send_packet_ = true; });
+        EVENT_TRACE(TRACE_INTERCOM_TX, bytes_read + offset, timed);
+        // Broadcasts get no ack and no retry, parity lets the listeners rebuild a lost frame.
+        if (address == nullptr && this->fec_tx_.add(this->tx_seq_ - 1, &buffer[INTERCOM_ID_SIZE],
+                                                    bytes_read + offset - INTERCOM_ID_SIZE)) {
+          this->send_parity_();
+        }
+        this->mark_boot_phase_(BOOT_FIRST_TX);
       }
     }
   }
 }
 
-bool InterCom::validate_address(const uint8_t *address) {
-  uint8_t *current_address = nullptr;
-  auto addr = this->address_.value();
+void InterCom::send_parity_() {
+  uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+  size_t len = this->fec_tx_.get_parity_length();
+  frame[0] = tx_scheduler::PROTOCOL_INTERCOM;
+  frame[INTERCOM_ID_SIZE] = INTERCOM_PARITY_VARIANT;
+  frame[INTERCOM_HEADER_SIZE] = this->fec_tx_.get_first();
+  frame[INTERCOM_HEADER_SIZE + 1] = this->fec_tx_.get_block();
+  frame[INTERCOM_HEADER_SIZE + 2] = this->fec_tx_.get_mask();
+  frame[INTERCOM_HEADER_SIZE + 3] = this->fec_tx_.get_length_xor();
+  memcpy(frame + INTERCOM_PARITY_HEADER_SIZE, this->fec_tx_.get_parity(), len);
+  this->tx_scheduler_->send(tx_scheduler::TxClass::AUDIO, nullptr, frame, len + INTERCOM_PARITY_HEADER_SIZE);
+}
+
+void InterCom::update_address_filter_() {
+  if (this->tx_scheduler_ == nullptr) {
+    return;
+  }
   if (this->address_.has_value()) {
-    current_address = addr.data();
+    espnow::peer_address_t address = this->address_.value();
+    this->tx_scheduler_->set_protocol_filter(tx_scheduler::PROTOCOL_INTERCOM, address.data());
+  } else {
+    this->tx_scheduler_->set_protocol_filter(tx_scheduler::PROTOCOL_INTERCOM, nullptr);
+  }
+}
+
+void InterCom::conceal_loss_(const uint8_t *src, uint8_t seq) {
+  uint8_t lost = seq - this->rx_seq_next_;
+  this->rx_seq_next_ = seq + 1;
+  if (!this->rx_seq_valid_ || memcmp(src, this->rx_talker_, ESP_NOW_ETH_ALEN) != 0) {
+    // A different talker, its audio does not continue what we have heard.
+    memcpy(this->rx_talker_, src, ESP_NOW_ETH_ALEN);
+    this->rx_seq_valid_ = true;
+    this->plc_.reset();
+    return;
   }
-  if (current_address == nullptr) {
-    return true;
-  } else if (memcmp(address, current_address, ESP_NOW_ETH_ALEN) == 0) {
-    return true;
+  // A counter that went backwards is a duplicate or late frame, not a gap.
+  size_t gap = (size_t) lost * this->rx_frame_samples_;
+  if (lost == 0 || lost > 127 || gap > PLC_MAX_GAP) {
+    return;
+  }
+  this->lost_frames_ += lost;
+  EVENT_TRACE(TRACE_INTERCOM_CONCEAL, lost, gap);
+  ESP_LOGV(TAG, "%u frames lost, concealed", lost);
+  int16_t fill[PLAYOUT_CHUNK_SIZE / sizeof(int16_t)];
+  while (gap > 0) {
+    size_t samples = std::min(gap, sizeof(fill) / sizeof(int16_t));
+    this->plc_.conceal(fill, samples);
+    size_t written = this->ring_buffer_mic_->write_without_replacement(fill, samples * sizeof(int16_t), 0);
+    this->rx_index_ += written / sizeof(int16_t);
+    gap -= samples;
   }
-  return false;
 }
 
-bool InterCom::on_received(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
-  if (this->validate_address(info.des_addr) && memcmp(data, INTERCOM_HEADER, INTERCOM_HEADER_SIZE) == 0) {
-    if (this->mode_ == Mode::SPEAKER && !this->wait_to_switch_) {
-      this->speaker_->play(data + INTERCOM_HEADER_SIZE, size - INTERCOM_HEADER_SIZE);
+void InterCom::receive_frame_(const uint8_t *src, const uint8_t *data, size_t length, bool timed, uint32_t pts,
+                              int seq) {
+  if (this->mode_ != Mode::SPEAKER || this->wait_to_switch_) {
+    return;
+  }
+  this->last_rx_ms_ = millis();
+  this->rx_frames_++;
+  int16_t samples[ESP_NOW_MAX_DATA_LEN / sizeof(int16_t)];
+  if (this->loss_concealment_ && seq >= 0) {
+    // The gap goes in first, so the frame and its timestamp land at the right sample.
+    this->conceal_loss_(src, seq);
+    length &= ~(size_t) 1;
+    memcpy(samples, data, length);
+    this->rx_frame_samples_ = length / sizeof(int16_t);
+    this->plc_.receive(samples, this->rx_frame_samples_);
+    data = reinterpret_cast<const uint8_t *>(samples);
+  }
+#ifdef USE_NETWORK_CLOCK
+  // Without a synced clock the timestamp means nothing here; fall back to prebuffered playout.
+  timed = timed && this->network_clock_ != nullptr && this->network_clock_->is_synced();
+  if (timed) {
+    this->pts_ref_ = pts;
+    this->pts_ref_index_ = this->rx_index_;
+  }
+#endif
+  this->playout_timed_ = timed;
+  size_t written = this->ring_buffer_mic_->write_without_replacement(data, length, 0);
+  this->rx_index_ += written / sizeof(int16_t);
+  EVENT_TRACE(TRACE_INTERCOM_RX, length, timed);
+  if (written < length) {
+    EVENT_TRACE(TRACE_INTERCOM_DROP, length - written, this->ring_buffer_mic_->available());
+    ESP_LOGV(TAG, "Playout buffer full, frame dropped");
+  }
+  this->mark_boot_phase_(BOOT_FIRST_RX);
+}
+
+bool InterCom::fec_listen_(const uint8_t *src) {
+  if (this->mode_ != Mode::SPEAKER || this->wait_to_switch_) {
+    return false;
+  }
+  if (!this->fec_talker_valid_ || memcmp(src, this->fec_talker_, ESP_NOW_ETH_ALEN) != 0) {
+    memcpy(this->fec_talker_, src, ESP_NOW_ETH_ALEN);
+    this->fec_talker_valid_ = true;
+    this->fec_rx_.reset();
+  }
+  return true;
+}
+
+void InterCom::handle_frame_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
+  // Protocol byte and destination were checked by the scheduler's demultiplexer.
+  if (size < INTERCOM_HEADER_SIZE) {
+    return;
+  }
+  if (data[INTERCOM_ID_SIZE] == INTERCOM_PARITY_VARIANT) {
+    if (size > INTERCOM_PARITY_HEADER_SIZE && this->fec_listen_(info.src_addr)) {
+      const uint8_t *header = data + INTERCOM_HEADER_SIZE;
+      uint32_t recovered = this->fec_rx_.get_recovered();
+      this->fec_rx_.on_parity(header[0], header[1], header[2], header[3], data + INTERCOM_PARITY_HEADER_SIZE,
+                              size - INTERCOM_PARITY_HEADER_SIZE, millis());
+      if (this->fec_rx_.get_recovered() != recovered) {
+        EVENT_TRACE(TRACE_INTERCOM_RECOVER, header[0], this->fec_rx_.get_recovered());
+      }
     }
-    return true;
+    return;
+  }
+  uint8_t flags = data[INTERCOM_ID_SIZE] - '1';
+  if (flags > FRAME_FLAGS) {
+    return;
   }
-  return false;
+  size_t seq_at = INTERCOM_HEADER_SIZE + ((flags & FRAME_TIMED) ? INTERCOM_PTS_SIZE : 0);
+  if ((flags & FRAME_SEQUENCED) && size > seq_at && this->fec_listen_(info.src_addr)) {
+    // Through the parity stage, which hands the frame to play_frame_() now or after the block's parity.
+    this->fec_rx_.on_frame(data[seq_at], data + INTERCOM_ID_SIZE, size - INTERCOM_ID_SIZE, millis());
+    return;
+  }
+  this->play_frame_(info.src_addr, data, size);
 }
 
-bool InterCom::on_broadcasted(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
-  if (this->validate_address(info.des_addr) && memcmp(data, INTERCOM_HEADER, INTERCOM_HEADER_SIZE) == 0) {
-    if (this->mode_ == Mode::SPEAKER && !this->wait_to_switch_) {
-      this->speaker_->play(data + INTERCOM_HEADER_SIZE, size - INTERCOM_HEADER_SIZE);
+void InterCom::play_frame_(const uint8_t *src, const uint8_t *data, size_t size) {
+  if (size < INTERCOM_HEADER_SIZE) {
+    return;
+  }
+  uint8_t flags = data[INTERCOM_ID_SIZE] - '1';
+  if (flags > FRAME_FLAGS) {
+    return;
+  }
+  bool sealed = flags & FRAME_SEALED;
+  bool timed = flags & FRAME_TIMED;
+  bool sequenced = flags & FRAME_SEQUENCED;
+  size_t offset = INTERCOM_HEADER_SIZE + (timed ? INTERCOM_PTS_SIZE : 0) + (sequenced ? INTERCOM_SEQ_SIZE : 0);
+  if (size < offset) {
+    return;
+  }
+  uint32_t pts = 0;
+  if (timed) {
+    for (uint8_t i = 0; i < INTERCOM_PTS_SIZE; i++) {
+      pts |= (uint32_t) data[INTERCOM_HEADER_SIZE + i] << (8 * i);
+    }
+  }
+  int seq = sequenced ? data[offset - INTERCOM_SEQ_SIZE] : -1;
+  if (sealed) {
+#ifdef USE_GROUP_CRYPTO
+    uint8_t plain[ESP_NOW_MAX_DATA_LEN];
+    int len = -1;
+    if (this->group_crypto_ != nullptr) {
+      len = this->group_crypto_->open(src, data + offset, size - offset, plain, data, offset);
     }
-    return true;
+    if (len > 0) {
+      this->receive_frame_(src, plain, len, timed, pts, seq);
+    }
+#endif
+    return;
+  }
+#ifdef USE_GROUP_CRYPTO
+  // With a group key configured, audio in the clear is not played.
+  if (this->group_crypto_ != nullptr) {
+    return;
+  }
+#endif
+  this->receive_frame_(src, data + offset, size - offset, timed, pts, seq);
+}
+
+/// Everything a benchmark pass works on, so the live stream state is left alone.
+struct BenchmarkScratch {
+  std::unique_ptr<AudioRingBuffer> ring;
+  DriftCompensator drift;
+  LossConcealer plc;
+  FecEncoder fec_tx;
+  FecDecoder fec_rx;
+  int16_t audio[SEND_BUFFER_SIZE / sizeof(int16_t)];
+  int16_t samples[SEND_BUFFER_SIZE / sizeof(int16_t)];
+  int16_t resampled[PLAYOUT_RESAMPLED_SIZE / sizeof(int16_t)];
+  uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+  uint8_t plain[ESP_NOW_MAX_DATA_LEN];
+};
+
+void InterCom::run_benchmark(uint32_t iterations) {
+  if (iterations == 0) {
+    return;
+  }
+  auto scratch = std::make_unique<BenchmarkScratch>();
+  scratch->ring = AudioRingBuffer::create(SEND_BUFFER_SIZE * 4, this->buffer_placement_);
+  if (scratch->ring == nullptr) {
+    ESP_LOGE(TAG, "Benchmark: could not allocate its ring buffer");
+    return;
+  }
+  scratch->drift.set_target(SEND_BUFFER_SIZE * 2, SAMPLE_RATE_HZ * sizeof(int16_t));
+  scratch->fec_tx.set_block(BENCHMARK_FEC_BLOCK);
+  scratch->fec_rx.set_release([](const uint8_t *data, size_t len) {});
+  // The largest payload read_microphone_() sends, so every stage sees a full live frame.
+  size_t payload_size = SEND_BUFFER_SIZE - INTERCOM_SEQ_SIZE;
+#ifdef USE_GROUP_CRYPTO
+  if (this->group_crypto_ != nullptr) {
+    payload_size -= group_crypto::GROUP_CRYPTO_OVERHEAD;
+  }
+#endif
+  payload_size &= ~(size_t) 1;
+  const size_t samples = payload_size / sizeof(int16_t);
+  // A voiced 200 Hz tone, so the concealer's pitch search finds a period like it does in speech.
+  for (size_t i = 0; i < samples; i++) {
+    float phase = 2.0f * (float) M_PI * 200.0f * (float) i / (float) SAMPLE_RATE_HZ;
+    scratch->audio[i] = (int16_t) (8000.0f * sinf(phase) + 3000.0f * sinf(2.0f * phase));
+  }
+
+#ifdef USE_GROUP_CRYPTO
+  // The cipher runs on a scratch context with the TX key. Going through group_crypto would spend nonce counters,
+  // with a flash write per block of them, and leave our own MAC in its replay windows.
+  mbedtls_ccm_context ccm;
+  mbedtls_ccm_init(&ccm);
+  bool seal = this->group_crypto_ != nullptr && this->group_crypto_->load_tx_key(&ccm);
+  uint8_t nonce[group_crypto::GROUP_CRYPTO_NONCE_SIZE]{};
+#endif
+
+  uint64_t total[BENCH_STAGE_COUNT]{};
+  uint32_t worst[BENCH_STAGE_COUNT]{};
+  for (uint32_t n = 0; n < iterations; n++) {
+    uint32_t cycles[BENCH_STAGE_COUNT]{};
+    uint8_t seq = n;
+    uint32_t pass = arch_get_cpu_cycle_count();
+
+    // Send side: frame the audio the way read_microphone_() does, then parse the header back as handle_frame_().
+    uint32_t start = arch_get_cpu_cycle_count();
+    scratch->frame[0] = tx_scheduler::PROTOCOL_INTERCOM;
+    scratch->frame[INTERCOM_ID_SIZE] = '1' + FRAME_SEQUENCED;
+    scratch->frame[INTERCOM_HEADER_SIZE] = seq;
+    size_t offset = INTERCOM_HEADER_SIZE + INTERCOM_SEQ_SIZE;
+    memcpy(scratch->frame + offset, scratch->audio, payload_size);
+    size_t len = offset + payload_size;
+    uint8_t flags = scratch->frame[INTERCOM_ID_SIZE] - '1';
+    bool ours = scratch->frame[0] == tx_scheduler::PROTOCOL_INTERCOM && flags <= FRAME_FLAGS;
+    cycles[BENCH_FRAMING] = arch_get_cpu_cycle_count() - start;
+    if (!ours) {
+      ESP_LOGE(TAG, "Benchmark: frame header did not parse back");
+#ifdef USE_GROUP_CRYPTO
+      mbedtls_ccm_free(&ccm);
+#endif
+      return;
+    }
+
+    const uint8_t *payload = scratch->frame + offset;
+#ifdef USE_GROUP_CRYPTO
+    if (seal) {
+      using group_crypto::GROUP_CRYPTO_HEADER_SIZE;
+      using group_crypto::GROUP_CRYPTO_TAG_SIZE;
+      uint8_t *sealed = scratch->frame + offset;
+      uint8_t *tag = sealed + GROUP_CRYPTO_HEADER_SIZE + payload_size;
+      memcpy(nonce + 7, &n, sizeof(n));
+      start = arch_get_cpu_cycle_count();
+      int err = mbedtls_ccm_encrypt_and_tag(&ccm, payload_size, nonce, sizeof(nonce), scratch->frame, offset,
+                                            reinterpret_cast<const uint8_t *>(scratch->audio),
+                                            sealed + GROUP_CRYPTO_HEADER_SIZE, tag, GROUP_CRYPTO_TAG_SIZE);
+      if (err == 0) {
+        err = mbedtls_ccm_auth_decrypt(&ccm, payload_size, nonce, sizeof(nonce), scratch->frame, offset,
+                                       sealed + GROUP_CRYPTO_HEADER_SIZE, scratch->plain, tag, GROUP_CRYPTO_TAG_SIZE);
+      }
+      cycles[BENCH_SEAL] = arch_get_cpu_cycle_count() - start;
+      len = offset + payload_size + group_crypto::GROUP_CRYPTO_OVERHEAD;
+      if (err == 0) {
+        payload = scratch->plain;
+      }
+    }
+#endif
+
+    start = arch_get_cpu_cycle_count();
+    scratch->fec_tx.add(seq, scratch->frame + INTERCOM_ID_SIZE, len - INTERCOM_ID_SIZE);
+    scratch->fec_rx.on_frame(seq, scratch->frame + INTERCOM_ID_SIZE, len - INTERCOM_ID_SIZE, n);
+    cycles[BENCH_PARITY] = arch_get_cpu_cycle_count() - start;
+
+    // Receive side: through the playout buffer, the concealer and the resampler.
+    start = arch_get_cpu_cycle_count();
+    scratch->ring->write_without_replacement(payload, payload_size, 0);
+    scratch->ring->read(scratch->samples, payload_size, 0);
+    cycles[BENCH_RING_BUFFER] = arch_get_cpu_cycle_count() - start;
+
+    start = arch_get_cpu_cycle_count();
+    scratch->plc.receive(scratch->samples, samples);
+    scratch->plc.conceal(scratch->resampled, samples);
+    cycles[BENCH_CONCEAL] = arch_get_cpu_cycle_count() - start;
+
+    start = arch_get_cpu_cycle_count();
+    scratch->drift.process(scratch->samples, samples, scratch->resampled);
+    cycles[BENCH_DRIFT] = arch_get_cpu_cycle_count() - start;
+
+    cycles[BENCH_LOOPBACK] = arch_get_cpu_cycle_count() - pass;
+    for (uint8_t stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+      total[stage] += cycles[stage];
+      worst[stage] = std::max(worst[stage], cycles[stage]);
+    }
+    if (n % 32 == 31) {
+      App.feed_wdt();
+    }
+  }
+
+#ifdef USE_GROUP_CRYPTO
+  mbedtls_ccm_free(&ccm);
+#endif
+
+  float per_us = arch_get_cpu_freq_hz() / 1e6f;
+  float frame_us = samples * 1e6f / SAMPLE_RATE_HZ;
+  ESP_LOGI(TAG, "Benchmark, %" PRIu32 " frames of %.1f ms at %.0f MHz:", iterations, frame_us / 1000.0f, per_us);
+  for (uint8_t stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+    float average = (float) total[stage] / iterations / per_us;
+    ESP_LOGI(TAG, "  %-11s %7.1f us average, %7.1f us worst", BENCHMARK_STAGE_NAMES[stage], average,
+             worst[stage] / per_us);
+#ifdef USE_SENSOR
+    if (this->benchmark_sensors_[stage] != nullptr) {
+      this->benchmark_sensors_[stage]->publish_state(average);
+    }
+#endif
+  }
+  float headroom = 100.0f * (1.0f - (float) total[BENCH_LOOPBACK] / iterations / per_us / frame_us);
+  ESP_LOGI(TAG, "  Headroom: %.1f%% of each frame", headroom);
+#ifdef USE_SENSOR
+  if (this->headroom_sensor_ != nullptr) {
+    this->headroom_sensor_->publish_state(headroom);
   }
-  return false;
+#endif
 }
 
 }  // namespace esphome::intercom
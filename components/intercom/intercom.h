@@ -5,92 +5,237 @@
 #include "esphome/core/automation.h"
 #include "esphome/core/component.h"
 #include "esphome/core/helpers.h"
-#include "esphome/core/ring_buffer.h"
 
-#include "esphome/components/audio/audio.h"
-#include "esphome/components/microphone/microphone_source.h"
-#include "esphome/components/speaker/speaker.h"
 #include "esphome/components/espnow/espnow_component.h"
+#include "esphome/components/intercom_core/intercom_engine.h"
+#include "esphome/components/tx_scheduler/tx_scheduler.h"
+#ifdef USE_GROUP_CRYPTO
+#include "esphome/components/group_crypto/group_crypto.h"
+#endif
+#ifdef USE_NETWORK_CLOCK
+#include "esphome/components/network_clock/network_clock.h"
+#endif
+#ifdef USE_SENSOR
+#include "esphome/components/sensor/sensor.h"
+#endif
+#include "esphome/components/intercom_core/event_trace_hooks.h"
+
+#include "drift_compensator.h"
+#include "fec.h"
+#include "loss_concealer.h"
 
 #include <unordered_map>
 #include <vector>
 
 namespace esphome::intercom {
 
-enum class Mode { NONE, MICROPHONE, SPEAKER };
+/// Boot phases timed from reset, so the wake-to-first-audio cost can be tracked per phase.
+enum BootPhase : uint8_t { BOOT_SETUP, BOOT_AUDIO_START, BOOT_FIRST_TX, BOOT_FIRST_RX, BOOT_PHASE_COUNT };
+
+/// Stages timed by the benchmark action, per audio frame.
+enum BenchmarkStage : uint8_t {
+  BENCH_RING_BUFFER,  // write and read back through a buffer placed like the live one
+  BENCH_FRAMING,      // header, counter and payload in, header parsed back out
+  BENCH_SEAL,         // AES-CCM seal and open with the group key, nothing without group_crypto
+  BENCH_PARITY,       // parity encode and decode
+  BENCH_CONCEAL,      // concealer history and one concealed frame, pitch search included
+  BENCH_DRIFT,        // resampling one frame
+  BENCH_LOOPBACK,     // all of the above in one pass, one frame sent and received
+  BENCH_STAGE_COUNT,
+};
+
+/// Largest chunk handed to the speaker at once from the receive buffer.
+static const size_t PLAYOUT_CHUNK_SIZE = 240;
+/// Audio handed to the speaker ahead of time. The rest of the jitter buffer stays in our ring buffer, where its depth
+/// is measured, instead of disappearing into the speaker's.
+static const uint32_t PLAYOUT_LEAD_MS = 40;
+/// A resampled chunk can come out slightly longer than it went in.
+static const size_t PLAYOUT_RESAMPLED_SIZE = PLAYOUT_CHUNK_SIZE + (PLAYOUT_CHUNK_SIZE / 128 + 2) * sizeof(int16_t);
+
+/// Stream state kept in RTC memory across deep sleep.
+struct intercom_rtc_state_t {
+  uint32_t magic;
+  Mode mode;
+};
 
 class InterCom : public Component,
-                 public Parented<espnow::ESPNowComponent>,
-                 public espnow::ESPNowReceivedPacketHandler,
-                 public espnow::ESPNowBroadcastedHandler {
+                 public InterComEngine<InterCom>,
+                 public Parented<espnow::ESPNowComponent> {
  public:
   void setup() override;
   void dump_config() override;
   void loop() override;
 
-  void set_microphone_source(microphone::MicrophoneSource *mic_source) { this->mic_source_ = mic_source; }
-  void set_speaker(speaker::Speaker *speaker) { this->speaker_ = speaker; }
-
-  void add_play_audio_callback(std::function<size_t(uint8_t *, size_t)> &&callback) {
-    this->play_audio_callback_.add(std::move(callback));
+  void set_tx_scheduler(tx_scheduler::TxScheduler *tx_scheduler) { this->tx_scheduler_ = tx_scheduler; }
+#ifdef USE_GROUP_CRYPTO
+  /// Seal outgoing audio and only play sealed audio from the group.
+  void set_group_crypto(group_crypto::GroupCrypto *group_crypto) { this->group_crypto_ = group_crypto; }
+#endif
+#ifdef USE_NETWORK_CLOCK
+  /// Timestamp broadcast audio against the network clock and play timestamped audio at its presentation time.
+  void set_network_clock(network_clock::NetworkClock *network_clock) { this->network_clock_ = network_clock; }
+  /// Time between capture and the presentation time stamped on broadcast frames, shared by all listeners.
+  void set_sync_delay(uint32_t delay_ms) { this->sync_delay_ms_ = delay_ms; }
+  /// Average playout error against the presentation timestamps over the last report interval, in us.
+  /// Positive when playing early.
+  int32_t get_sync_error() const { return this->sync_error_us_; }
+#endif
+
+  /// Peer to talk to and only listen to; none for broadcast. A lambda is evaluated once, when it is set.
+  void set_address(Templatable<espnow::peer_address_t> address) {
+    this->address_ = address;
+    this->update_address_filter_();
   }
-  void set_address(Templatable<espnow::peer_address_t> address) { this->address_ = address; }
-  void set_mode(Mode mode);
-  bool is_in_mode(Mode mode);
+  /// How far a streamed announcement may run ahead of real time in the send buffer.
+  void set_stream_lead(uint32_t lead_ms) { this->stream_lead_ms_ = lead_ms; }
+  /// Audio collected at the receiver before playback starts, absorbs radio jitter.
+  void set_prebuffer(uint32_t prebuffer_ms) { this->prebuffer_ms_ = prebuffer_ms; }
+  /// Resample playout to follow the talker's clock, so the receive buffer neither fills up nor drains on long calls.
+  void set_drift_compensation(bool enabled) { this->drift_compensation_ = enabled; }
+  /// Fill the gaps of lost frames with a repetition of the audio before them instead of skipping over them.
+  void set_loss_concealment(bool enabled) { this->loss_concealment_ = enabled; }
+  /// Received frames found missing by their sequence number and concealed.
+  uint32_t get_lost_frames() const { return this->lost_frames_; }
+  /// Send a parity frame after every `frames` broadcast frames, 0 for none. Listeners rebuild one lost frame per block.
+  void set_fec_block(uint8_t frames) { this->fec_tx_.set_block(frames); }
+  /// Received frames rebuilt from parity.
+  uint32_t get_recovered_frames() const { return this->fec_rx_.get_recovered(); }
+  /// Byte rate of the outgoing stream, the refill rate of the send pacing.
+  void set_stream_rate(uint32_t bytes_per_second) { this->stream_bytes_per_second_ = bytes_per_second; }
+  /// Set while an IntercomSpeaker streams into us. Only then is sending paced, live microphone audio already comes
+  /// in at real time and must go out as soon as it is there.
+  void set_streaming(bool streaming) { this->streaming_ = streaming; }
 
   float get_setup_priority() const override;
 
-  bool on_received(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) override;
-  bool on_broadcasted(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) override;
+  /// Queue audio from a faster than real time source without blocking. Accepts at most up to the stream lead.
+  size_t stream_audio(const uint8_t *data, size_t length);
 
-  void receive_audio(const uint8_t *data, size_t length) { this->buffer_audio(data, length); }
-  size_t buffer_audio(const uint8_t *data, size_t length);
-  bool has_buffered_data() { return (this->ring_buffer_mic_.use_count() >= 0) && this->ring_buffer_mic_->available(); }
+  /// Time the frame pipeline on synthetic audio, `iterations` frames through every stage. Logs the cost per stage and
+  /// publishes it to the benchmark sensors. Works on scratch copies, a running stream is only delayed.
+  void run_benchmark(uint32_t iterations);
+#ifdef USE_SENSOR
+  void set_benchmark_sensor(BenchmarkStage stage, sensor::Sensor *sensor) { this->benchmark_sensors_[stage] = sensor; }
+  /// Share of a frame's duration left after the loopback pass, in percent.
+  void set_headroom_sensor(sensor::Sensor *sensor) { this->headroom_sensor_ = sensor; }
+#endif
 
-  bool validate_address(const uint8_t *address);
+  /// True when woken from deep sleep with a valid RTC stream state; setup then starts audio right away.
+  static bool is_fast_resume();
 
   // void set_address(espnow::peer_address_t address) {this->address_ = address; }
 
  protected:
-  void read_microphone_();
-  void speaker_start_();
-  bool has_mic_source_() { return this->mic_source_ != nullptr; }
-  bool has_spr_source_() { return this->speaker_ != nullptr; }
-
-  microphone::MicrophoneSource *mic_source_{nullptr};
-  speaker::Speaker *speaker_{nullptr};
+  friend class InterComEngine<InterCom>;
 
-  std::shared_ptr<RingBuffer> ring_buffer_mic_;
+  void on_mode_change_(Mode from, Mode to);
+  void read_microphone_();
+  void handle_frame_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size);
+  /// Hand the destination check for our frames to the receive demultiplexer.
+  void update_address_filter_();
+  /// Whether frames from `src` go through the parity stage, resets it for a new talker.
+  bool fec_listen_(const uint8_t *src);
+  /// An audio frame from its protocol byte on, received or rebuilt from parity.
+  void play_frame_(const uint8_t *src, const uint8_t *data, size_t size);
+  void send_parity_();
+  void report_loss_(uint32_t now);
+  bool pace_take_(size_t bytes);
+  void play_buffered_();
+  bool prime_playout_();
+#ifdef USE_NETWORK_CLOCK
+  /// Input samples playout is behind the presentation timestamps, negative when ahead.
+  int32_t sync_lateness_();
+  uint32_t next_pts_(size_t samples);
+#endif
+  /// `seq` is the frame counter of sequenced frames, -1 for frames without one.
+  void receive_frame_(const uint8_t *src, const uint8_t *data, size_t length, bool timed, uint32_t pts, int seq);
+  /// Write concealment for the frames missing before `seq` into the receive buffer.
+  void conceal_loss_(const uint8_t *src, uint8_t seq);
+  void mark_boot_phase_(BootPhase phase);
+
+  tx_scheduler::TxScheduler *tx_scheduler_{nullptr};
+#ifdef USE_GROUP_CRYPTO
+  group_crypto::GroupCrypto *group_crypto_{nullptr};
+#endif
+#ifdef USE_NETWORK_CLOCK
+  network_clock::NetworkClock *network_clock_{nullptr};
+  uint32_t sync_delay_ms_{150};
+  // Send side: presentation time of the next sample, in network us.
+  int64_t tx_pts_next_{0};
+  bool tx_timed_{false};
+  // Receive side: the latest timestamp and the input sample it belongs to.
+  uint32_t pts_ref_{0};
+  uint32_t pts_ref_index_{0};
+  int32_t sync_error_us_{0};
+  int64_t sync_error_sum_{0};
+  uint32_t sync_error_count_{0};
+#endif
+
+  // Send side token bucket, credit in byte-microseconds.
+  bool streaming_{false};
+  uint32_t stream_bytes_per_second_{32000};
+  uint32_t stream_lead_ms_{200};
+  int64_t pace_credit_{0};
+  uint32_t pace_last_us_{0};
+
+  // Receive side prebuffer.
+  uint32_t prebuffer_ms_{100};
+  bool playout_primed_{false};
+  uint32_t last_rx_ms_{0};
+  uint32_t underruns_{0};
+  alignas(int16_t) uint8_t playout_chunk_[PLAYOUT_RESAMPLED_SIZE]{};
+  size_t playout_chunk_len_{0};
+  size_t playout_chunk_pos_{0};
+  int64_t playout_start_us_{0};
+  uint64_t playout_handed_{0};
+  // Input samples written to and read from the ring buffer since the speaker started.
+  uint32_t rx_index_{0};
+  uint32_t play_index_{0};
+  bool playout_timed_{false};
+  bool drift_compensation_{true};
+  DriftCompensator drift_;
+  // Receive side loss concealment, sequence numbers are followed per talker.
+  bool loss_concealment_{true};
+  LossConcealer plc_;
+  uint8_t rx_talker_[ESP_NOW_ETH_ALEN]{};
+  bool rx_seq_valid_{false};
+  uint8_t rx_seq_next_{0};
+  size_t rx_frame_samples_{0};
+  uint32_t lost_frames_{0};
+  uint8_t tx_seq_{0};
+  // Broadcast parity, sent and received.
+  FecEncoder fec_tx_;
+  FecDecoder fec_rx_;
+  uint8_t fec_talker_[ESP_NOW_ETH_ALEN]{};
+  bool fec_talker_valid_{false};
+  uint32_t rx_frames_{0};
+  uint32_t loss_reported_{0};
+  uint32_t reported_frames_{0};
+  uint32_t reported_recovered_{0};
+  uint32_t reported_concealed_{0};
+  uint32_t drift_reported_{0};
 
   Templatable<espnow::peer_address_t> address_{};
 
-  audio::AudioStreamInfo target_stream_info_;
-
-  Mode mode_{Mode::NONE};
-
-  bool wait_to_switch_{false};
   bool can_send_packet_{true};
 
-  HighFrequencyLoopRequester high_freq_;
-  CallbackManager<void(uint8_t *, size_t)> play_audio_callback_{};
-};
-
-template<typename... Ts> class ModeAction : public Action<Ts...>, public Parented<InterCom> {
- public:
-  void set_mode(Mode mode) { this->mode_ = mode; }
-  void play(Ts... x) override { this->parent_->set_mode(this->mode_); }
+#ifdef USE_SENSOR
+  sensor::Sensor *benchmark_sensors_[BENCH_STAGE_COUNT]{};
+  sensor::Sensor *headroom_sensor_{nullptr};
+#endif
 
- protected:
-  Mode mode_{Mode::NONE};
+  bool fast_resume_{false};
+  uint32_t boot_phase_us_[BOOT_PHASE_COUNT]{};
 };
 
-template<typename... Ts> class IsModeCondition : public Condition<Ts...>, public Parented<InterCom> {
+template<typename... Ts> using ModeAction = EngineModeAction<InterCom, Ts...>;
+template<typename... Ts> using IsModeCondition = EngineModeCondition<InterCom, Ts...>;
+
+template<typename... Ts> class BenchmarkAction : public Action<Ts...>, public Parented<InterCom> {
  public:
-  void set_mode(Mode mode) { this->mode_ = mode; }
-  bool check(Ts... x) override { return this->parent_->is_in_mode(this->mode_); }
+  TEMPLATABLE_VALUE(uint32_t, iterations)
 
- protected:
-  Mode mode_{Mode::NONE};
+  void play(Ts... x) override { this->parent_->run_benchmark(this->iterations_.value(x...)); }
 };
 
 }  // namespace esphome::intercom
@@ -0,0 +1,119 @@
+#include "loss_concealer.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace esphome::intercom {
+
+/// Samples compared per candidate period in the pitch search, the most recent 10 ms.
+static const size_t PLC_CORRELATION = 160;
+
+void LossConcealer::reset() {
+  this->history_len_ = 0;
+  this->pitch_ = 0;
+  this->pos_ = 0;
+  this->gap_ = 0;
+  this->concealing_ = false;
+}
+
+void LossConcealer::receive(int16_t *samples, size_t len) {
+  if (this->concealing_) {
+    size_t fade = std::min(len, PLC_CROSSFADE);
+    for (size_t i = 0; i < fade; i++) {
+      int32_t weight = (int32_t) ((i + 1) * 32768 / (fade + 1));
+      samples[i] = (int16_t) ((samples[i] * weight + this->next_() * (32768 - weight)) >> 15);
+    }
+    this->concealing_ = false;
+  }
+  if (len >= PLC_HISTORY) {
+    memcpy(this->history_, samples + len - PLC_HISTORY, PLC_HISTORY * sizeof(int16_t));
+    this->history_len_ = PLC_HISTORY;
+    return;
+  }
+  size_t keep = std::min(this->history_len_, PLC_HISTORY - len);
+  memmove(this->history_, this->history_ + this->history_len_ - keep, keep * sizeof(int16_t));
+  memcpy(this->history_ + keep, samples, len * sizeof(int16_t));
+  this->history_len_ = keep + len;
+}
+
+void LossConcealer::conceal(int16_t *out, size_t len) {
+  if (!this->concealing_) {
+    this->start_gap_();
+  }
+  for (size_t i = 0; i < len; i++) {
+    out[i] = this->next_();
+  }
+  this->concealed_total_ += len;
+}
+
+void LossConcealer::start_gap_() {
+  this->concealing_ = true;
+  this->gap_ = 0;
+  this->pos_ = 0;
+  this->pitch_ = 0;
+  if (this->history_len_ < PLC_HISTORY) {
+    // Too little audio to find a period in, the gap stays silent.
+    return;
+  }
+  const int16_t *end = this->history_ + PLC_HISTORY;
+  // Normalized autocorrelation of the last PLC_CORRELATION samples against the same span one period earlier,
+  // every other lag first and then the neighbours of the best one.
+  auto correlate = [end](size_t lag, float *score) {
+    int64_t cross = 0;
+    int64_t energy = 1;
+    for (const int16_t *x = end - PLC_CORRELATION; x < end; x++) {
+      cross += (int32_t) x[0] * x[-(ptrdiff_t) lag];
+      energy += (int32_t) x[-(ptrdiff_t) lag] * x[-(ptrdiff_t) lag];
+    }
+    *score = cross > 0 ? (float) cross * (float) cross / (float) energy : 0.0f;
+  };
+  // Without any periodicity the audio is unvoiced, and repeating the longest period sounds least like a tone.
+  size_t best = PLC_MAX_PITCH;
+  float best_score = 0.0f;
+  for (size_t lag = PLC_MIN_PITCH; lag <= PLC_MAX_PITCH; lag += 2) {
+    float score;
+    correlate(lag, &score);
+    if (score > best_score) {
+      best_score = score;
+      best = lag;
+    }
+  }
+  size_t coarse = best;
+  for (size_t lag = std::max(coarse - 1, PLC_MIN_PITCH); lag <= std::min(coarse + 1, PLC_MAX_PITCH); lag++) {
+    float score;
+    correlate(lag, &score);
+    if (score > best_score) {
+      best_score = score;
+      best = lag;
+    }
+  }
+  this->pitch_ = best;
+
+  // The last period, with its final quarter blended into the samples before it, so the end runs into the start.
+  const int16_t *last = end - this->pitch_;
+  const int16_t *before = last - this->pitch_;
+  size_t blend = this->pitch_ / 4;
+  memcpy(this->period_, last, this->pitch_ * sizeof(int16_t));
+  for (size_t i = 0; i < blend; i++) {
+    size_t k = this->pitch_ - blend + i;
+    int32_t weight = (int32_t) ((i + 1) * 32768 / (blend + 1));
+    this->period_[k] = (int16_t) ((last[k] * (32768 - weight) + before[k] * weight) >> 15);
+  }
+}
+
+int16_t LossConcealer::next_() {
+  if (this->pitch_ == 0 || this->gap_ >= PLC_MAX_GAP) {
+    return 0;
+  }
+  int32_t sample = this->period_[this->pos_];
+  if (++this->pos_ == this->pitch_) {
+    this->pos_ = 0;
+  }
+  if (this->gap_ >= PLC_HOLD) {
+    sample = sample * (int32_t) (PLC_MAX_GAP - this->gap_) / (int32_t) (PLC_MAX_GAP - PLC_HOLD);
+  }
+  this->gap_++;
+  return (int16_t) sample;
+}
+
+}  // namespace esphome::intercom
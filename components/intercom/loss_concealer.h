@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome::intercom {
+
+/// Pitch search range, 400 Hz down to 67 Hz at 16 kHz.
+static const size_t PLC_MIN_PITCH = 40;
+static const size_t PLC_MAX_PITCH = 240;
+/// Received audio kept for the pitch search, two of the longest periods.
+static const size_t PLC_HISTORY = 2 * PLC_MAX_PITCH;
+/// Concealment plays at full level for 10 ms, then fades to silence at 60 ms. Longer gaps are not concealed.
+static const size_t PLC_HOLD = 160;
+static const size_t PLC_MAX_GAP = 960;
+/// Real audio fades in over the concealment when the stream resumes, 4 ms.
+static const size_t PLC_CROSSFADE = 64;
+
+/// Fills gaps left by lost frames in a 16 kHz mono stream.
+///
+/// Received audio goes through receive() on its way to the playout buffer, which costs a copy into the history. On a
+/// gap, conceal() searches the history for its pitch period once and repeats the last period for the length of the
+/// gap. The period's tail is blended with the one before it so the repetition loops without a click. Repetition
+/// buzzes when held for long, so the level holds for PLC_HOLD samples and fades to silence at PLC_MAX_GAP. When real
+/// audio resumes, its first PLC_CROSSFADE samples are crossfaded from the continuing concealment.
+class LossConcealer {
+ public:
+  /// Forget the history, for a new talker.
+  void reset();
+
+  /// Received audio, in place: crossfaded when it follows a gap, then kept as history.
+  void receive(int16_t *samples, size_t len);
+  /// Write `len` samples for a gap to `out`. Consecutive calls continue the same gap until the next receive().
+  void conceal(int16_t *out, size_t len);
+
+  /// Samples synthesized since boot.
+  uint32_t get_concealed() const { return this->concealed_total_; }
+
+ protected:
+  void start_gap_();
+  int16_t next_();
+
+  int16_t history_[PLC_HISTORY]{};
+  size_t history_len_{0};
+
+  // Current gap: the period being repeated, the read position in it and the samples produced so far.
+  int16_t period_[PLC_MAX_PITCH]{};
+  size_t pitch_{0};
+  size_t pos_{0};
+  size_t gap_{0};
+  bool concealing_{false};
+
+  uint32_t concealed_total_{0};
+};
+
+}  // namespace esphome::intercom
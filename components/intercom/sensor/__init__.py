@@ -0,0 +1,60 @@
+import esphome.codegen as cg
+from esphome.components import sensor
+import esphome.config_validation as cv
+from esphome.const import (
+    ENTITY_CATEGORY_DIAGNOSTIC,
+    STATE_CLASS_MEASUREMENT,
+    UNIT_PERCENT,
+)
+
+from .. import CONF_INTERCOM, InterCom, intercom_ns
+
+DEPENDENCIES = ["intercom"]
+CODEOWNERS = ["@LumenSoftNL"]
+
+CONF_HEADROOM = "headroom"
+UNIT_MICROSECOND = "µs"
+
+BenchmarkStage = intercom_ns.enum("BenchmarkStage")
+
+# Average time per frame of each stage timed by intercom.benchmark.
+BENCHMARK_STAGES = {
+    "ring_buffer": BenchmarkStage.BENCH_RING_BUFFER,
+    "framing": BenchmarkStage.BENCH_FRAMING,
+    "seal": BenchmarkStage.BENCH_SEAL,
+    "parity": BenchmarkStage.BENCH_PARITY,
+    "conceal": BenchmarkStage.BENCH_CONCEAL,
+    "drift": BenchmarkStage.BENCH_DRIFT,
+    "loopback": BenchmarkStage.BENCH_LOOPBACK,
+}
+
+STAGE_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_MICROSECOND,
+    accuracy_decimals=1,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+
+CONFIG_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(CONF_INTERCOM): cv.use_id(InterCom),
+        cv.Optional(CONF_HEADROOM): sensor.sensor_schema(
+            unit_of_measurement=UNIT_PERCENT,
+            accuracy_decimals=1,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        **{cv.Optional(stage): STAGE_SCHEMA for stage in BENCHMARK_STAGES},
+    }
+)
+
+
+async def to_code(config):
+    parent = await cg.get_variable(config[CONF_INTERCOM])
+    for key, stage in BENCHMARK_STAGES.items():
+        if key in config:
+            sens = await sensor.new_sensor(config[key])
+            cg.add(parent.set_benchmark_sensor(stage, sens))
+    if CONF_HEADROOM in config:
+        sens = await sensor.new_sensor(config[CONF_HEADROOM])
+        cg.add(parent.set_headroom_sensor(sens))
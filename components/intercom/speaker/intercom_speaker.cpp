@@ -10,22 +10,15 @@ size_t IntercomSpeaker::play(const uint8_t *data, size_t length) {
   if (this->is_stopped()) {
     this->start();
   }
-  size_t copied_size = 0;
-  while (length > copied_size) {
-    this->wdt_counter_++;
-    size_t copy_size = std::min(length - copied_size, INTERIM_BUFFER_SIZE);
-    memcpy((void *) &this->interim_buffer_, data + copied_size, copy_size);
-    size_t copied = this->parent_->buffer_audio((uint8_t *) &this->interim_buffer_, copy_size);
-    if (copied == 0) {
-      break;
-    }
-    copied_size += copied;
-    yield();
-  }
-  return copied_size;
+  // The decoder runs far ahead of real time; the parent only takes audio up to its stream lead and paces it out,
+  // so this never blocks. The ticks variant of play() waits and retries when nothing was taken.
+  this->wdt_counter_++;
+  return this->parent_->stream_audio(data, length);
 }
 
 void IntercomSpeaker::start() {
+  this->parent_->set_stream_rate(this->audio_stream_info_.ms_to_bytes(1000));
+  this->parent_->set_streaming(true);
   this->parent_->set_mode(intercom::Mode::MICROPHONE);
   this->state_ = speaker::STATE_RUNNING;
 }
@@ -41,6 +34,7 @@ void IntercomSpeaker::loop() {
     this->wdt_counter_ = 0;
   }
   if (this->state_ == speaker::STATE_STOPPING && !this->has_buffered_data()) {
+    this->parent_->set_streaming(false);
     this->state_ = speaker::STATE_STOPPED;
   }
 }
@@ -9,7 +9,6 @@
 
 namespace esphome::intercom {
 
-static const size_t INTERIM_BUFFER_SIZE = 512;
 class IntercomSpeaker : public Component, public speaker::Speaker, public Parented<intercom::InterCom> {
 public:
   float get_setup_priority() const override { return esphome::setup_priority::DATA; }
@@ -23,7 +22,6 @@ public:
   bool has_buffered_data() const override;
  protected:
   uint16_t wdt_counter_{0};
-  uint8_t interim_buffer_[INTERIM_BUFFER_SIZE] {};
 
 };
 
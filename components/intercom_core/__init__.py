@@ -0,0 +1,95 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.const import CONF_MICROPHONE, CONF_MODE, CONF_SPEAKER
+from esphome.components import microphone, speaker
+from esphome.components.shared_capture import (
+    CONF_SHARED_CAPTURE_ID,
+    SHARED_CAPTURE_SCHEMA,
+    register_shared_capture,
+)
+
+# The audio engine shared by intercom (ESP-NOW) and mesh_intercom (meshmesh); loaded by them, not configured.
+CODEOWNERS = ["@LumenSoftNL"]
+
+CONF_BUFFER_DURATION = "buffer_duration"
+CONF_BUFFER_PLACEMENT = "buffer_placement"
+CONF_LOW_MEMORY = "low_memory"
+
+LOW_MEMORY_BUFFER_DURATION = "256ms"
+
+intercom_ns = cg.esphome_ns.namespace("intercom")
+
+Mode = intercom_ns.enum("Mode", is_class=True)
+MODE_ENUM = {
+    "NONE": Mode.NONE,
+    "MICROPHONE": Mode.MICROPHONE,
+    "SPEAKER": Mode.SPEAKER,
+}
+
+BufferPlacement = intercom_ns.enum("BufferPlacement", is_class=True)
+BUFFER_PLACEMENT_ENUM = {
+    "AUTO": BufferPlacement.AUTO,
+    "INTERNAL": BufferPlacement.INTERNAL,
+    "PSRAM": BufferPlacement.PSRAM,
+}
+
+CONFIG_SCHEMA = cv.All(cv.Schema({}))
+
+# Audio options of every intercom, whatever carries its frames.
+ENGINE_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_MICROPHONE): microphone.microphone_source_schema(
+            min_bits_per_sample=16,
+            max_bits_per_sample=16,
+            min_channels=1,
+            max_channels=1,
+        ),
+        cv.Optional(CONF_SPEAKER): cv.use_id(speaker.Speaker),
+        cv.Optional(CONF_MODE): cv.enum(MODE_ENUM, upper=True),
+        cv.Optional(CONF_BUFFER_DURATION): cv.All(
+            cv.positive_time_period_milliseconds,
+            cv.Range(min=cv.TimePeriod(milliseconds=64), max=cv.TimePeriod(milliseconds=8192)),
+        ),
+        cv.Optional(CONF_BUFFER_PLACEMENT): cv.enum(BUFFER_PLACEMENT_ENUM, upper=True),
+        cv.Optional(CONF_LOW_MEMORY, default=False): cv.boolean,
+    }
+).extend(SHARED_CAPTURE_SCHEMA)
+
+
+def engine_defaults(default_buffer_duration):
+    """Fill in the buffer defaults; the low memory profile keeps a short buffer in internal RAM, for badges
+    without PSRAM."""
+
+    def validator(config):
+        if CONF_MICROPHONE in config and CONF_SHARED_CAPTURE_ID in config:
+            raise cv.Invalid(f"{CONF_MICROPHONE} cannot be combined with {CONF_SHARED_CAPTURE_ID}")
+        low_memory = config[CONF_LOW_MEMORY]
+        if CONF_BUFFER_DURATION not in config:
+            config[CONF_BUFFER_DURATION] = cv.positive_time_period_milliseconds(
+                LOW_MEMORY_BUFFER_DURATION if low_memory else default_buffer_duration
+            )
+        if CONF_BUFFER_PLACEMENT not in config:
+            config[CONF_BUFFER_PLACEMENT] = "INTERNAL" if low_memory else "AUTO"
+        elif low_memory and config[CONF_BUFFER_PLACEMENT] == "PSRAM":
+            raise cv.Invalid(f"{CONF_LOW_MEMORY} cannot be combined with PSRAM placement")
+        return config
+
+    return validator
+
+
+async def register_engine(var, config):
+    await register_shared_capture(var, config)
+
+    if mic := config.get(CONF_MICROPHONE):
+        mic_source = await microphone.microphone_source_to_code(mic)
+        cg.add(var.set_microphone_source(mic_source))
+
+    if output := config.get(CONF_SPEAKER):
+        spkr = await cg.get_variable(output)
+        cg.add(var.set_speaker(spkr))
+
+    if value := config.get(CONF_MODE):
+        cg.add(var.set_mode(value))
+
+    cg.add(var.set_buffer_duration(config[CONF_BUFFER_DURATION]))
+    cg.add(var.set_buffer_placement(BUFFER_PLACEMENT_ENUM[config[CONF_BUFFER_PLACEMENT]]))
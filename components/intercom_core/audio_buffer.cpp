@@ -0,0 +1,53 @@
+#include "audio_buffer.h"
+
+#include <esp_heap_caps.h>
+
+namespace esphome::intercom {
+
+AudioRingBuffer::~AudioRingBuffer() {
+  if (this->handle_ != nullptr) {
+    vStreamBufferDelete(this->handle_);
+  }
+  if (this->storage_ != nullptr) {
+    heap_caps_free(this->storage_);
+  }
+}
+
+std::unique_ptr<AudioRingBuffer> AudioRingBuffer::create(size_t len, BufferPlacement placement) {
+  bool has_psram = heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0;
+  bool external = placement == BufferPlacement::PSRAM ||
+                  (placement == BufferPlacement::AUTO && has_psram && len > AUTO_INTERNAL_LIMIT);
+
+  std::unique_ptr<AudioRingBuffer> rb = std::make_unique<AudioRingBuffer>();
+  rb->size_ = len;
+  // A stream buffer needs one byte more storage than its capacity.
+  const uint32_t internal_caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  rb->storage_ = (uint8_t *) heap_caps_malloc(len + 1, external ? MALLOC_CAP_SPIRAM : internal_caps);
+  if (rb->storage_ == nullptr && external) {
+    // PSRAM exhausted or absent: fall back to internal RAM rather than running without a buffer.
+    external = false;
+    rb->storage_ = (uint8_t *) heap_caps_malloc(len + 1, internal_caps);
+  }
+  if (rb->storage_ == nullptr) {
+    return nullptr;
+  }
+  rb->external_ = external;
+  rb->handle_ = xStreamBufferCreateStatic(len + 1, 1, rb->storage_, &rb->structure_);
+  return rb;
+}
+
+size_t AudioRingBuffer::read(void *data, size_t len, TickType_t ticks_to_wait) {
+  return xStreamBufferReceive(this->handle_, data, len, ticks_to_wait);
+}
+
+size_t AudioRingBuffer::write_without_replacement(const void *data, size_t len, TickType_t ticks_to_wait) {
+  return xStreamBufferSend(this->handle_, data, len, ticks_to_wait);
+}
+
+size_t AudioRingBuffer::available() const { return xStreamBufferBytesAvailable(this->handle_); }
+
+size_t AudioRingBuffer::free() const { return xStreamBufferSpacesAvailable(this->handle_); }
+
+BaseType_t AudioRingBuffer::reset() { return xStreamBufferReset(this->handle_); }
+
+}  // namespace esphome::intercom
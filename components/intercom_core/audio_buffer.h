@@ -0,0 +1,43 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/stream_buffer.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace esphome::intercom {
+
+enum class BufferPlacement : uint8_t { AUTO, INTERNAL, PSRAM };
+
+/// Stream buffer with the same interface as esphome::RingBuffer, but with explicit control over where the storage
+/// lives. Internal RAM is shared with WiFi and I2S DMA, PSRAM is plentiful but slower.
+class AudioRingBuffer {
+ public:
+  ~AudioRingBuffer();
+
+  /// Buffers up to this size stay in internal RAM in AUTO placement, larger ones go to PSRAM when it exists.
+  static const size_t AUTO_INTERNAL_LIMIT = 8 * 1024;
+
+  static std::unique_ptr<AudioRingBuffer> create(size_t len, BufferPlacement placement = BufferPlacement::AUTO);
+
+  size_t read(void *data, size_t len, TickType_t ticks_to_wait = 0);
+  size_t write_without_replacement(const void *data, size_t len, TickType_t ticks_to_wait = 0);
+
+  size_t available() const;
+  size_t free() const;
+  BaseType_t reset();
+
+  size_t size() const { return this->size_; }
+  bool is_external() const { return this->external_; }
+
+ protected:
+  StreamBufferHandle_t handle_{nullptr};
+  StaticStreamBuffer_t structure_;
+  uint8_t *storage_{nullptr};
+  size_t size_{0};
+  bool external_{false};
+};
+
+}  // namespace esphome::intercom
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+
+// The trace points of intercom, mesh_intercom and nowtalk. Without event_trace in the configuration its header is
+// not part of the build, so the macros are defined empty here.
+#ifdef USE_EVENT_TRACE
+#include "esphome/components/event_trace/event_trace.h"
+#else
+#define EVENT_TRACE(id, arg0, arg1)
+#define EVENT_TRACE_LOOP(component)
+#endif
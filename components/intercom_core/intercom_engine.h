@@ -0,0 +1,309 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+
+#include "esphome/core/automation.h"
+#include "esphome/core/helpers.h"
+#include "esphome/core/log.h"
+
+#include "esphome/components/audio/audio.h"
+#include "esphome/components/microphone/microphone_source.h"
+#include "esphome/components/speaker/speaker.h"
+#ifdef USE_SHARED_CAPTURE
+#include "esphome/components/shared_capture/shared_capture.h"
+#endif
+
+#include "audio_buffer.h"
+
+#include <cinttypes>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace esphome::intercom {
+
+static const char *const INTERCOM_TAG = "intercom";
+
+static const size_t SAMPLE_RATE_HZ = 16000;
+
+enum class Mode { NONE, MICROPHONE, SPEAKER };
+
+/// The audio side of an intercom, shared by every transport: microphone and speaker, the mode switch between them
+/// and the buffer that sits between the audio and the radio.
+///
+/// `Transport` is the component that derives from the engine and moves frames over its link (ESP-NOW, meshmesh, or
+/// anything else that carries a few hundred bytes). The engine reaches it through static_cast, so the frame path is
+/// resolved at compile time and inlines like a single class would. A transport can hide these hooks:
+///
+///  void on_mode_change_(Mode from, Mode to)   before the microphone and speaker are switched
+///
+/// A transport that hides a hook in its protected section declares the engine a friend.
+template<typename Transport> class InterComEngine {
+ public:
+  void set_microphone_source(microphone::MicrophoneSource *mic_source) { this->mic_source_ = mic_source; }
+  void set_speaker(speaker::Speaker *speaker) { this->speaker_ = speaker; }
+#ifdef USE_SHARED_CAPTURE
+  /// Take microphone audio from a capture shared with other consumers instead of a microphone of our own.
+  void set_shared_capture(shared_capture::SharedCapture *capture) { this->capture_ = capture; }
+#endif
+  void add_play_audio_callback(std::function<size_t(uint8_t *, size_t)> &&callback) {
+    this->play_audio_callback_.add(std::move(callback));
+  }
+  /// Depth of the audio buffer in milliseconds of 16 kHz mono audio.
+  void set_buffer_duration(uint32_t duration_ms) { this->buffer_duration_ms_ = duration_ms; }
+  void set_buffer_placement(BufferPlacement placement) { this->buffer_placement_ = placement; }
+
+  void set_mode(Mode mode);
+  bool is_in_mode(Mode mode);
+
+  void receive_audio(const uint8_t *data, size_t length) { this->buffer_audio(data, length); }
+  size_t buffer_audio(const uint8_t *data, size_t length) {
+    return this->ring_buffer_mic_->write_without_replacement(data, length, pdMS_TO_TICKS(100));
+  }
+  bool has_buffered_data() { return (this->ring_buffer_mic_.use_count() >= 0) && this->ring_buffer_mic_->available(); }
+  std::shared_ptr<AudioRingBuffer> ring_buffer() { return this->ring_buffer_mic_; }
+
+ protected:
+  Transport *transport_() { return static_cast<Transport *>(this); }
+  void on_mode_change_(Mode from, Mode to) {}
+
+  /// Connect the microphone and speaker and allocate the buffer, from the transport's setup().
+  void setup_audio_();
+  void dump_audio_config_();
+  /// Finishes a mode switch that waits for the microphone or speaker to stop, from the transport's loop().
+  /// Returns true while still waiting.
+  bool switch_pending_();
+
+  void speaker_start_() {
+    if (this->has_spr_source_()) {
+      this->speaker_->set_audio_stream_info(this->target_stream_info_);
+    }
+  }
+  bool has_spr_source_() { return this->speaker_ != nullptr; }
+  bool has_mic_source_();
+  void mic_start_();
+  void mic_stop_();
+  bool mic_is_running_();
+  bool mic_is_stopped_();
+  /// Outgoing audio ready to send: what is queued in our buffer first, otherwise the shared capture.
+  size_t mic_available_();
+  size_t mic_read_(uint8_t *data, size_t length, TickType_t ticks_to_wait);
+
+  microphone::MicrophoneSource *mic_source_{nullptr};
+  speaker::Speaker *speaker_{nullptr};
+#ifdef USE_SHARED_CAPTURE
+  shared_capture::SharedCapture *capture_{nullptr};
+  uint8_t capture_tap_{0};
+#endif
+
+  std::shared_ptr<AudioRingBuffer> ring_buffer_mic_;
+  uint32_t buffer_duration_ms_{1024};
+  BufferPlacement buffer_placement_{BufferPlacement::AUTO};
+
+  audio::AudioStreamInfo target_stream_info_;
+  Mode mode_{Mode::NONE};
+  bool wait_to_switch_{false};
+
+  HighFrequencyLoopRequester high_freq_;
+  CallbackManager<void(uint8_t *, size_t)> play_audio_callback_{};
+};
+
+template<typename Transport> void InterComEngine<Transport>::setup_audio_() {
+#ifdef USE_SHARED_CAPTURE
+  if (this->capture_ != nullptr) {
+    // No pre-roll: frames go out at real-time pace, a backlog would stay as added latency for the whole call.
+    this->capture_tap_ = this->capture_->add_tap(false);
+  }
+#endif
+  if (this->mic_source_ != nullptr) {
+    this->mic_source_->add_data_callback(
+        [this](const std::vector<uint8_t> &data) { this->receive_audio(data.data(), data.size()); });
+  }
+  if (this->has_spr_source_()) {
+    this->add_play_audio_callback([this](uint8_t *data, size_t size) { return this->speaker_->play(data, size); });
+  }
+  if (this->ring_buffer_mic_.use_count() == 0) {
+    size_t size = (this->buffer_duration_ms_ * SAMPLE_RATE_HZ / 1000) * sizeof(int16_t);
+    this->ring_buffer_mic_ = AudioRingBuffer::create(size, this->buffer_placement_);
+    if (this->ring_buffer_mic_.use_count() == 0) {
+      ESP_LOGE(INTERCOM_TAG, "Could not allocate ring buffer");
+    }
+  }
+  this->target_stream_info_ = audio::AudioStreamInfo(16, 1, SAMPLE_RATE_HZ);
+  this->high_freq_.start();
+}
+
+template<typename Transport> void InterComEngine<Transport>::dump_audio_config_() {
+  ESP_LOGCONFIG(INTERCOM_TAG, "  Buffer duration: %" PRIu32 " ms", this->buffer_duration_ms_);
+  if (this->ring_buffer_mic_ != nullptr) {
+    ESP_LOGCONFIG(INTERCOM_TAG, "  Buffer size: %u bytes in %s", (unsigned) this->ring_buffer_mic_->size(),
+                  this->ring_buffer_mic_->is_external() ? "PSRAM" : "internal RAM");
+  }
+#ifdef USE_SHARED_CAPTURE
+  if (this->capture_ != nullptr) {
+    ESP_LOGCONFIG(INTERCOM_TAG, "  Microphone: shared capture, tap %u", this->capture_tap_);
+  }
+#endif
+}
+
+template<typename Transport> void InterComEngine<Transport>::set_mode(Mode direction) {
+  this->transport_()->on_mode_change_(this->mode_, direction);
+  if (this->has_mic_source_() && this->has_spr_source_()) {
+    if (direction == Mode::SPEAKER) {
+      if (this->mode_ == Mode::MICROPHONE && this->mic_is_running_()) {
+        this->mic_stop_();
+        this->ring_buffer_mic_->reset();
+        this->wait_to_switch_ = true;
+        ESP_LOGD(INTERCOM_TAG, "waiting for Speaker start");
+
+      } else {
+        ESP_LOGD(INTERCOM_TAG, "Start speaker.");
+        this->speaker_start_();
+      }
+    } else if (direction == Mode::MICROPHONE) {
+      if (this->mode_ == Mode::SPEAKER && this->speaker_->is_running()) {
+        this->speaker_->stop();
+        this->wait_to_switch_ = true;
+        ESP_LOGD(INTERCOM_TAG, "waiting for Mic start");
+      } else {
+        ESP_LOGD(INTERCOM_TAG, "Mic started");
+        this->mic_start_();
+      }
+    } else {
+      if (this->mode_ == Mode::MICROPHONE && this->mic_is_running_()) {
+        this->mic_stop_();
+        this->ring_buffer_mic_->reset();
+        ESP_LOGD(INTERCOM_TAG, "reset buffer");
+        this->wait_to_switch_ = true;
+      }
+      if (this->mode_ == Mode::SPEAKER && this->speaker_->is_running()) {
+        this->speaker_->stop();
+        this->wait_to_switch_ = true;
+      }
+    }
+  }
+  this->mode_ = direction;
+}
+
+template<typename Transport> bool InterComEngine<Transport>::is_in_mode(Mode direction) {
+  if (this->has_mic_source_() && this->has_spr_source_()) {
+    switch (direction) {
+      case Mode::MICROPHONE:
+        return (this->mic_is_running_());
+      case Mode::SPEAKER:
+        return (this->speaker_->is_running());
+      default:
+        return (this->mic_is_stopped_() && this->speaker_->is_stopped());
+    }
+  } else {
+    return direction == this->mode_;
+  }
+}
+
+template<typename Transport> bool InterComEngine<Transport>::switch_pending_() {
+  if (!this->wait_to_switch_) {
+    return false;
+  }
+  if (!this->speaker_->is_stopped() || !this->mic_is_stopped_()) {
+    return true;
+  }
+  this->wait_to_switch_ = false;
+  if (this->mode_ == Mode::MICROPHONE) {
+    ESP_LOGD(INTERCOM_TAG, "Mic started in loop");
+    this->mic_start_();
+  }
+  if (this->mode_ == Mode::SPEAKER) {
+    ESP_LOGD(INTERCOM_TAG, "Speaker started in loop");
+    this->speaker_start_();
+  }
+  return false;
+}
+
+template<typename Transport> bool InterComEngine<Transport>::has_mic_source_() {
+#ifdef USE_SHARED_CAPTURE
+  if (this->capture_ != nullptr) {
+    return true;
+  }
+#endif
+  return this->mic_source_ != nullptr;
+}
+
+template<typename Transport> void InterComEngine<Transport>::mic_start_() {
+#ifdef USE_SHARED_CAPTURE
+  if (this->capture_ != nullptr) {
+    this->capture_->start_tap(this->capture_tap_);
+    return;
+  }
+#endif
+  this->mic_source_->start();
+}
+
+template<typename Transport> void InterComEngine<Transport>::mic_stop_() {
+#ifdef USE_SHARED_CAPTURE
+  if (this->capture_ != nullptr) {
+    this->capture_->stop_tap(this->capture_tap_);
+    return;
+  }
+#endif
+  this->mic_source_->stop();
+}
+
+template<typename Transport> bool InterComEngine<Transport>::mic_is_running_() {
+#ifdef USE_SHARED_CAPTURE
+  if (this->capture_ != nullptr) {
+    return this->capture_->is_tap_running(this->capture_tap_);
+  }
+#endif
+  return this->mic_source_->is_running();
+}
+
+template<typename Transport> bool InterComEngine<Transport>::mic_is_stopped_() {
+#ifdef USE_SHARED_CAPTURE
+  if (this->capture_ != nullptr) {
+    // The capture keeps running for its other consumers, the tap is stopped as soon as it is released.
+    return !this->capture_->is_tap_running(this->capture_tap_);
+  }
+#endif
+  return this->mic_source_->is_stopped();
+}
+
+template<typename Transport> size_t InterComEngine<Transport>::mic_available_() {
+  size_t available = this->ring_buffer_mic_->available();
+#ifdef USE_SHARED_CAPTURE
+  if (available == 0 && this->capture_ != nullptr) {
+    return this->capture_->available(this->capture_tap_);
+  }
+#endif
+  return available;
+}
+
+template<typename Transport>
+size_t InterComEngine<Transport>::mic_read_(uint8_t *data, size_t length, TickType_t ticks_to_wait) {
+#ifdef USE_SHARED_CAPTURE
+  // The shared capture is read in place, straight into the outgoing frame.
+  if (this->capture_ != nullptr && this->ring_buffer_mic_->available() == 0) {
+    return this->capture_->read(this->capture_tap_, data, length);
+  }
+#endif
+  return this->ring_buffer_mic_->read((void *) data, length, ticks_to_wait);
+}
+
+template<typename T, typename... Ts> class EngineModeAction : public Action<Ts...>, public Parented<T> {
+ public:
+  void set_mode(Mode mode) { this->mode_ = mode; }
+  void play(Ts... x) override { this->parent_->set_mode(this->mode_); }
+
+ protected:
+  Mode mode_{Mode::NONE};
+};
+
+template<typename T, typename... Ts> class EngineModeCondition : public Condition<Ts...>, public Parented<T> {
+ public:
+  void set_mode(Mode mode) { this->mode_ = mode; }
+  bool check(Ts... x) override { return this->parent_->is_in_mode(this->mode_); }
+
+ protected:
+  Mode mode_{Mode::NONE};
+};
+
+}  // namespace esphome::intercom
@@ -4,17 +4,21 @@ import esphome.codegen as cg
 from esphome.const import (
     CONF_ADDRESS,
     CONF_ID,
-    CONF_MICROPHONE,
-    CONF_SPEAKER,
     CONF_MODE,
 )
 from esphome import automation
 from esphome.automation import register_action
-from esphome.components import microphone, speaker
+from esphome.components.intercom_core import (
+    ENGINE_SCHEMA,
+    MODE_ENUM,
+    engine_defaults,
+    intercom_ns,
+    register_engine,
+)
 from esphome.components.meshmesh import MeshmeshComponent
 
 
-AUTO_LOAD = ["microphone", "speaker"]
+AUTO_LOAD = ["microphone", "speaker", "intercom_core"]
 
 CODEOWNERS = ["@LumenSoftNL"]
 
@@ -22,8 +26,12 @@ CODEOWNERS = ["@LumenSoftNL"]
 CONF_INTERCOM = "intercom"
 CONF_ALLOW_BROADCAST = "allow_broadcast"
 CONF_MESHMESH_ID = "meshmesh_id"
+CONF_MULTICAST_GROUP = "multicast_group"
+CONF_MIN_FRAME_DURATION = "min_frame_duration"
+CONF_MAX_FRAME_DURATION = "max_frame_duration"
+
+DEFAULT_BUFFER_DURATION = "2048ms"
 
-intercom_ns = cg.esphome_ns.namespace("intercom")
 InterCom = intercom_ns.class_("InterCom", cg.Component)
 
 ModeAction = intercom_ns.class_(
@@ -39,30 +47,35 @@ IsModeCondition = intercom_ns.class_(
     "IsModeCondition", automation.Condition, cg.Parented.template(InterCom)
 )
 
-Mode = intercom_ns.enum("Mode", is_class=True)
-MODE_ENUM = {
-    "NONE": Mode.NONE,
-    "MICROPHONE": Mode.MICROPHONE,
-    "SPEAKER": Mode.SPEAKER,
-}
+FRAME_DURATION = cv.All(
+    cv.positive_time_period_milliseconds,
+    # A frame holds at most 512 bytes, 16 ms of 16 kHz audio.
+    cv.Range(min=cv.TimePeriod(milliseconds=2), max=cv.TimePeriod(milliseconds=16)),
+)
+
+
+def _frame_duration(config):
+    if config[CONF_MIN_FRAME_DURATION] > config[CONF_MAX_FRAME_DURATION]:
+        raise cv.Invalid(f"{CONF_MIN_FRAME_DURATION} must not be longer than {CONF_MAX_FRAME_DURATION}")
+    return config
+
 
 CONFIG_SCHEMA = cv.All(
     cv.Schema(
         {
             cv.GenerateID(): cv.declare_id(InterCom),
-            cv.Optional(CONF_MICROPHONE): microphone.microphone_source_schema(
-                min_bits_per_sample=16,
-                max_bits_per_sample=16,
-                min_channels=1,
-                max_channels=1,
-            ),
-            cv.Optional(CONF_SPEAKER): cv.use_id(speaker.Speaker),
-            cv.Optional(CONF_MODE): cv.enum(MODE_ENUM, upper=True),
             cv.Optional(CONF_ALLOW_BROADCAST): cv.boolean,
             cv.GenerateID(CONF_MESHMESH_ID): cv.use_id(MeshmeshComponent),
             cv.Required(CONF_ADDRESS): cv.hex_uint32_t,
+            cv.Optional(CONF_MULTICAST_GROUP): cv.uint8_t,
+            cv.Optional(CONF_MIN_FRAME_DURATION, default="4ms"): FRAME_DURATION,
+            cv.Optional(CONF_MAX_FRAME_DURATION, default="16ms"): FRAME_DURATION,
         }
-    ).extend(cv.COMPONENT_SCHEMA)
+    )
+    .extend(cv.COMPONENT_SCHEMA)
+    .extend(ENGINE_SCHEMA),
+    engine_defaults(DEFAULT_BUFFER_DURATION),
+    _frame_duration,
 )
 
 
@@ -74,18 +87,16 @@ async def to_code(config):
     cg.add(var.set_parent(meshmesh))
     cg.add(var.set_address(config[CONF_ADDRESS]))
 
-    if mic := config.get(CONF_MICROPHONE):
-        mic_source = await microphone.microphone_source_to_code(mic)
-        cg.add(var.set_microphone_source(mic_source))
-
-    if output := config.get(CONF_SPEAKER):
-        spkr = await cg.get_variable(output)
-        cg.add(var.set_speaker(spkr))
-
-    if value := config.get(CONF_MODE):
-        cg.add(var.set_mode(value))
+    await register_engine(var, config)
 
     cg.add(var.set_broadcast_allowed(config.get(CONF_ALLOW_BROADCAST, False)))
+    if CONF_MULTICAST_GROUP in config:
+        cg.add(var.set_multicast_group(config[CONF_MULTICAST_GROUP]))
+    cg.add(
+        var.set_frame_duration(
+            config[CONF_MIN_FRAME_DURATION], config[CONF_MAX_FRAME_DURATION]
+        )
+    )
 
     cg.add_define("USE_INTERCOM")
 
@@ -0,0 +1,108 @@
+#include "frame_sizer.h"
+
+#include <algorithm>
+
+namespace esphome::intercom {
+
+/// A frame grows by 1 ms of audio per clean ACK while the loss average stays under 2%.
+static const uint16_t GROW_BYTES = LINK_BYTES_PER_MS;
+static const uint16_t GROW_MAX_LOSS = 20;
+
+link_stats_t &FrameSizer::link_(uint32_t address, uint32_t now) {
+  link_stats_t *slot = &this->links_[0];
+  for (link_stats_t &link : this->links_) {
+    if (link.used && link.address == address) {
+      link.last_used = now;
+      return link;
+    }
+    if (!link.used || (slot->used && now - link.last_used > now - slot->last_used)) {
+      slot = &link;
+    }
+  }
+  // A new peer starts at the largest frame, the first losses or round trips bring it where it belongs.
+  *slot = {};
+  slot->address = address;
+  slot->used = true;
+  slot->last_used = now;
+  slot->frame_bytes = this->max_;
+  slot->window_start = now;
+  return *slot;
+}
+
+const link_stats_t *FrameSizer::get(uint32_t address) const {
+  for (const link_stats_t &link : this->links_) {
+    if (link.used && link.address == address) {
+      return &link;
+    }
+  }
+  return nullptr;
+}
+
+void FrameSizer::for_each(const std::function<void(const link_stats_t &link)> &link) const {
+  for (const link_stats_t &entry : this->links_) {
+    if (entry.used) {
+      link(entry);
+    }
+  }
+}
+
+size_t FrameSizer::frame_bytes(uint32_t address, uint32_t now) { return this->link_(address, now).frame_bytes; }
+
+uint32_t FrameSizer::ack_timeout(uint32_t address, uint32_t now) {
+  const link_stats_t &link = this->link_(address, now);
+  if (link.srtt_us == 0) {
+    return LINK_TIMEOUT_MAX_MS;
+  }
+  uint32_t timeout = (link.srtt_us + 4 * link.rttvar_us) / 1000;
+  return std::max(LINK_TIMEOUT_MIN_MS, std::min(timeout, LINK_TIMEOUT_MAX_MS));
+}
+
+void FrameSizer::on_ack(uint32_t address, size_t bytes, uint32_t rtt_us, uint32_t now) {
+  link_stats_t &link = this->link_(address, now);
+  if (link.srtt_us == 0) {
+    link.srtt_us = rtt_us;
+    link.rttvar_us = rtt_us / 2;
+  } else {
+    uint32_t deviation = rtt_us > link.srtt_us ? rtt_us - link.srtt_us : link.srtt_us - rtt_us;
+    link.rttvar_us = link.rttvar_us - link.rttvar_us / 4 + deviation / 4;
+    link.srtt_us = link.srtt_us - link.srtt_us / 8 + rtt_us / 8;
+  }
+  link.sent++;
+  link.window_bytes += bytes;
+  link.loss -= link.loss / 16;
+  this->adapt_(link, false);
+  this->measure_(link, now);
+}
+
+void FrameSizer::on_loss(uint32_t address, uint32_t now) {
+  link_stats_t &link = this->link_(address, now);
+  link.sent++;
+  link.lost++;
+  link.loss += (1000 - link.loss) / 16;
+  this->adapt_(link, true);
+  this->measure_(link, now);
+}
+
+void FrameSizer::adapt_(link_stats_t &link, bool lost) {
+  size_t frame = link.frame_bytes;
+  if (lost) {
+    frame -= frame / 4;
+  } else if (link.loss < GROW_MAX_LOSS) {
+    frame += GROW_BYTES;
+  }
+  // A round trip of audio plus a quarter, whole samples.
+  size_t floor = (size_t) ((uint64_t) link.srtt_us * LINK_BYTES_PER_MS * 5 / 4000) & ~(size_t) 1;
+  frame = std::max(frame, std::max(this->min_, floor));
+  link.frame_bytes = std::min(frame, this->max_) & ~(size_t) 1;
+}
+
+void FrameSizer::measure_(link_stats_t &link, uint32_t now) {
+  uint32_t elapsed = now - link.window_start;
+  if (elapsed >= LINK_WINDOW_MS) {
+    link.goodput = (uint32_t) ((uint64_t) link.window_bytes * 1000 / elapsed);
+    link.window_bytes = 0;
+    link.window_start = now;
+  }
+}
+
+}  // namespace esphome::intercom
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome::intercom {
+
+/// Peers whose link state is kept, the least recently used is forgotten first.
+static const uint8_t LINK_MAX_PEERS = 4;
+/// 16 kHz mono 16 bit audio.
+static const uint32_t LINK_BYTES_PER_MS = 32;
+/// Goodput is measured over windows of this length.
+static const uint32_t LINK_WINDOW_MS = 2000;
+/// Bounds of the ACK timeout. The upper one is the fixed timeout used before any RTT is known.
+static const uint32_t LINK_TIMEOUT_MIN_MS = 40;
+static const uint32_t LINK_TIMEOUT_MAX_MS = 600;
+
+struct link_stats_t {
+  uint32_t address;
+  bool used;
+  uint32_t last_used;  // ms
+  uint16_t frame_bytes;
+  uint32_t srtt_us;    // smoothed round trip, frame sent until its ACK
+  uint32_t rttvar_us;  // mean deviation of the round trip
+  uint16_t loss;       // EWMA of lost frames, 1/1000
+  uint32_t sent;
+  uint32_t lost;
+  uint32_t goodput;  // acknowledged audio bytes per second over the last window
+  uint32_t window_start;
+  uint32_t window_bytes;
+
+  /// Mouth to ear estimate: filling a frame plus the one way trip, in us.
+  uint32_t latency_us() const { return this->frame_bytes * 1000 / LINK_BYTES_PER_MS + this->srtt_us / 2; }
+};
+
+/// Picks the audio frame size per peer from the round trip and loss seen on the stop-and-wait ACK path.
+///
+/// Every frame waits for its ACK before the next is sent, so a frame has to hold at least a round trip of audio or
+/// the stream falls behind; that is the floor, with a quarter of margin. Above the floor the size is AIMD like TCP's
+/// window: a clean ACK grows it by 1 ms of audio, since fewer and larger frames spend less airtime on headers and
+/// ACKs, and a lost frame shrinks it by a quarter, since over a lossy multi-hop route every loss costs a whole frame
+/// of audio. Round trip and timeout follow RFC 6298, so a lost ACK stalls the stream for a few round trips instead of
+/// the fixed LINK_TIMEOUT_MAX_MS.
+class FrameSizer {
+ public:
+  /// Frame size bounds in bytes.
+  void set_bounds(size_t min_bytes, size_t max_bytes) {
+    this->min_ = min_bytes;
+    this->max_ = max_bytes;
+  }
+  size_t get_min() const { return this->min_; }
+  size_t get_max() const { return this->max_; }
+
+  /// Bytes of audio to put in the next frame to `address`.
+  size_t frame_bytes(uint32_t address, uint32_t now);
+  /// How long to wait for the ACK of a frame to `address`, in ms.
+  uint32_t ack_timeout(uint32_t address, uint32_t now);
+  /// A frame of `bytes` audio to `address` was acknowledged after `rtt_us`. Only for frames that were not timed out,
+  /// the round trip of a late ACK is ambiguous.
+  void on_ack(uint32_t address, size_t bytes, uint32_t rtt_us, uint32_t now);
+  /// The ACK of a frame to `address` did not come in time.
+  void on_loss(uint32_t address, uint32_t now);
+
+  const link_stats_t *get(uint32_t address) const;
+  void for_each(const std::function<void(const link_stats_t &link)> &link) const;
+
+ protected:
+  link_stats_t &link_(uint32_t address, uint32_t now);
+  void adapt_(link_stats_t &link, bool lost);
+  void measure_(link_stats_t &link, uint32_t now);
+
+  size_t min_{128};
+  size_t max_{512};
+  std::array<link_stats_t, LINK_MAX_PEERS> links_{};
+};
+
+}  // namespace esphome::intercom
@@ -4,6 +4,7 @@
 #include "esphome/core/log.h"
 
 #include <espmeshmesh.h>
+#include <esp_heap_caps.h>
 #include <cinttypes>
 #include <cstdio>
 
@@ -11,15 +12,29 @@ namespace esphome::intercom {
 
 static const char *const TAG = "intercom";
 
-static const size_t SAMPLE_RATE_HZ = 16000;
-
 static const uint8_t INTERCOM_HEADER_REQ = 0x34;
 
 static const uint8_t INTERCOM_HEADER_SIZE = 1;
 
 static const size_t SEND_BUFFER_SIZE = 512;
 
-static const size_t RING_BUFFER_SIZE = (2048 * SAMPLE_RATE_HZ / 1000) * sizeof(int16_t);
+// Group call frames, all carry [group][root:4] after the code:
+//  BEACON  0x04 [seq:2][hops]
+//  JOIN    0x06 [members][links]
+//  AUDIO   0x08 [counter:2][audio]
+// The low two bits of a code are never both set, those mark a reply to handle_received_.
+static const uint8_t INTERCOM_MCAST_BEACON = 0x04;
+static const uint8_t INTERCOM_MCAST_JOIN = 0x06;
+static const uint8_t INTERCOM_MCAST_AUDIO = 0x08;
+static const uint8_t MULTICAST_HEADER_SIZE = 7;
+static const size_t MULTICAST_AUDIO_SIZE = SEND_BUFFER_SIZE - 8;
+
+// Airtime estimate for one mesh transmission: long DSSS preamble plus MAC and meshmesh headers at 1 Mbit/s.
+static const uint32_t MESH_PREAMBLE_US = 192;
+static const uint32_t MESH_FRAME_OVERHEAD = 40;
+static const uint32_t MULTICAST_REPORT_INTERVAL = 10000;
+static const uint32_t LINK_REPORT_INTERVAL = 10000;
+
 
 float InterCom::get_setup_priority() const { return setup_priority::LATE - 10; }
 
@@ -29,129 +44,140 @@ void InterCom::setup() {
   this->parent_->getNetwork()->addHandleFrameCb(
       std::bind(&InterCom::handleFrame, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
 
-  if (this->has_mic_source_()) {
-    this->mic_source_->add_data_callback(
-        [this](const std::vector<uint8_t> &data) { this->receive_audio(data.data(), data.size()); });
-  }
-  if (this->has_spr_source_()) {
-    this->add_play_audio_callback([this](uint8_t *data, size_t size) { return this->speaker_->play(data, size); });
-  }
-  if (this->ring_buffer_mic_.use_count() == 0) {
-    this->ring_buffer_mic_ = RingBuffer::create(RING_BUFFER_SIZE);
-    if (this->ring_buffer_mic_.use_count() == 0) {
-      ESP_LOGE(TAG, "Could not allocate ring buffer");
-    }
+  this->setup_audio_();
+  if (this->multicast_) {
+    this->setup_multicast_();
   }
+}
 
-  this->target_stream_info_ = audio::AudioStreamInfo(16, 1, 16000);
-  this->high_freq_.start();
+void InterCom::setup_multicast_() {
+  // meshmesh addresses a node by the last three bytes of its MAC.
+  uint8_t mac[6];
+  get_mac_address_raw(mac);
+  this->tree_.set_self(((uint32_t) mac[3] << 16) | ((uint32_t) mac[4] << 8) | mac[5]);
+  this->tree_.set_member(this->has_spr_source_());
+  this->tree_.set_beacon([this](uint32_t root, uint16_t seq, uint8_t hops) {
+    uint8_t frame[MULTICAST_HEADER_SIZE + 3] = {INTERCOM_HEADER_REQ, INTERCOM_MCAST_BEACON, this->multicast_group_};
+    espmeshmesh::uint32toBuffer(frame + 3, root);
+    espmeshmesh::uint16toBuffer(frame + MULTICAST_HEADER_SIZE, seq);
+    frame[MULTICAST_HEADER_SIZE + 2] = hops;
+    this->parent_->getNetwork()->broadCastSendData(frame, sizeof(frame));
+  });
+  this->tree_.set_join([this](uint32_t parent, uint32_t root, uint8_t members, uint8_t links) {
+    uint8_t frame[MULTICAST_HEADER_SIZE + 2] = {INTERCOM_HEADER_REQ, INTERCOM_MCAST_JOIN, this->multicast_group_};
+    espmeshmesh::uint32toBuffer(frame + 3, root);
+    frame[MULTICAST_HEADER_SIZE] = members;
+    frame[MULTICAST_HEADER_SIZE + 1] = links;
+    this->parent_->getNetwork()->uniCastSendData(frame, sizeof(frame), parent);
+  });
+  // register_engine sets the mode before the group, so on_mode_change_ saw no tree to root.
+  if (this->mode_ == Mode::MICROPHONE) {
+    this->tree_.start_root(millis());
+  }
 }
 
 void InterCom::dump_config() {
   ESP_LOGCONFIG(TAG, "Mesh Intercom: V2");
-  ESP_LOGCONFIG(TAG, "  Buffer size: %d", RING_BUFFER_SIZE);
-}
-
-void InterCom::speaker_start_() {
-  if (this->has_spr_source_()) {
-    this->speaker_->set_audio_stream_info(this->target_stream_info_);
+  this->dump_audio_config_();
+  ESP_LOGCONFIG(TAG, "  Free internal heap: %u bytes", (unsigned) heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+  if (this->multicast_) {
+    ESP_LOGCONFIG(TAG, "  Multicast group: %u", this->multicast_group_);
   }
+  ESP_LOGCONFIG(TAG, "  Broadcast allowed: %s", YESNO(this->broadcast_allowed_));
+  ESP_LOGCONFIG(TAG, "  Frame duration: %u to %u ms", (unsigned) (this->sizer_.get_min() / LINK_BYTES_PER_MS),
+                (unsigned) (this->sizer_.get_max() / LINK_BYTES_PER_MS));
 }
 
-size_t InterCom::buffer_audio(const uint8_t *data, size_t length) {
-  size_t result = this->ring_buffer_mic_->write_without_replacement(data, length, pdMS_TO_TICKS(100));  //
-  //  ESP_LOGI(TAG, "%5d,%6d,%5d,%5d ", this->ring_buffer_mic_->available(), this->ring_buffer_mic_->free(), length,
-  //  result);
-  return result;
-}
-
-void InterCom::set_mode(Mode direction) {
-  if (this->has_mic_source_() && this->has_spr_source_()) {
-    if (direction == Mode::SPEAKER) {
-      if (this->mode_ == Mode::MICROPHONE && this->mic_source_->is_running()) {
-        this->mic_source_->stop();
-        this->ring_buffer_mic_->reset();
-        this->wait_to_switch_ = true;
-        ESP_LOGI(TAG, "waiting for Speaker start");
-
-      } else {
-        ESP_LOGI(TAG, "Start speaker.");
-        this->speaker_start_();
-      }
-    } else if (direction == Mode::MICROPHONE) {
-      if (this->mode_ == Mode::SPEAKER && this->speaker_->is_running()) {
-        this->speaker_->stop();
-        this->wait_to_switch_ = true;
-        ESP_LOGI(TAG, "waiting for Mic start");
-      } else {
-        ESP_LOGI(TAG, "Mic started");
-        this->mic_source_->start();
-      }
+void InterCom::on_mode_change_(Mode from, Mode to) {
+  EVENT_TRACE(TRACE_MESH_MODE, to, from);
+  if (this->multicast_) {
+    // The talking node roots the group tree.
+    if (to == Mode::MICROPHONE) {
+      this->tree_.start_root(millis());
     } else {
-      if (this->mode_ == Mode::MICROPHONE && this->mic_source_->is_running()) {
-        this->mic_source_->stop();
-        this->ring_buffer_mic_->reset();
-        ESP_LOGI(TAG, "reset buffer");
-        this->wait_to_switch_ = true;
-      }
-      if (this->mode_ == Mode::SPEAKER && this->speaker_->is_running()) {
-        this->speaker_->stop();
-        this->wait_to_switch_ = true;
-      }
+      this->tree_.stop_root();
     }
   }
-  this->mode_ = direction;
 }
 
-bool InterCom::is_in_mode(Mode direction) {
-  if (this->has_mic_source_() && this->has_spr_source_()) {
-    switch (direction) {
-      case Mode::MICROPHONE:
-        return (this->mic_source_->is_running());
-      case Mode::SPEAKER:
-        return (this->speaker_->is_running());
-      default:
-        return (this->mic_source_->is_stopped() && this->speaker_->is_stopped());
-    }
-  } else {
-    return direction == this->mode_;
+void InterCom::loop() {
+  EVENT_TRACE_LOOP(this);
+  if (this->switch_pending_()) {
+    return;
   }
+  if (this->multicast_) {
+    this->tree_.loop(millis());
+  }
+  this->send_audio_packet_();
+  this->report_links_(millis());
+  App.feed_wdt();
 }
 
-void InterCom::loop() {
-  if (wait_to_switch_) {
-    if (!this->speaker_->is_stopped() || !this->mic_source_->is_stopped()) {
+void InterCom::report_links_(uint32_t now) {
+  if (now - this->links_reported_ < LINK_REPORT_INTERVAL) {
+    return;
+  }
+  this->links_reported_ = now;
+  this->sizer_.for_each([now](const link_stats_t &link) {
+    if (now - link.last_used > LINK_REPORT_INTERVAL) {
       return;
     }
-    this->wait_to_switch_ = false;
-    if (this->mode_ == Mode::MICROPHONE) {
-      ESP_LOGI(TAG, "Mic started in loop");
-      this->mic_source_->start();
-    }
-    if (this->mode_ == Mode::SPEAKER) {
-      ESP_LOGI(TAG, "Speaker started in loop");
-      this->speaker_start_();
-    }
-  }
-  this->send_audio_packet_();
-  App.feed_wdt();
+    ESP_LOGD(TAG, "Link %06" PRIX32 ": %u byte frames, RTT %" PRIu32 " us, loss %.1f%%, %" PRIu32 " B/s, %" PRIu32
+             " us latency", link.address, link.frame_bytes, link.srtt_us, link.loss / 10.0f, link.goodput,
+             link.latency_us());
+  });
 }
 
 void InterCom::send_audio_packet_() {
   size_t bytes_read = 0;
   uint8_t buffer[SEND_BUFFER_SIZE + INTERCOM_HEADER_SIZE + sizeof(packet_counter_) + 2];
+  if (this->multicast_ && this->address_ == UINT32_MAX) {
+    // No per frame acknowledgement down a tree, so send full frames as soon as the microphone filled one.
+    if (this->mic_available_() < MULTICAST_AUDIO_SIZE) {
+      return;
+    }
+    size_t header = MULTICAST_HEADER_SIZE + sizeof(this->multicast_counter_);
+    buffer[0] = INTERCOM_HEADER_REQ;
+    buffer[1] = INTERCOM_MCAST_AUDIO;
+    buffer[2] = this->multicast_group_;
+    espmeshmesh::uint32toBuffer(buffer + 3, this->tree_.get_root());
+    espmeshmesh::uint16toBuffer(buffer + MULTICAST_HEADER_SIZE, this->multicast_counter_++);
+    bytes_read = this->mic_read_(&buffer[header], MULTICAST_AUDIO_SIZE, 0);
+    if (bytes_read == 0) {
+      return;
+    }
+    if (this->tree_.is_root() && this->tree_.child_count() > 0) {
+      this->forward_multicast_(buffer, bytes_read + header);
+      this->update_airtime_(bytes_read + header);
+    } else if (this->broadcast_allowed_) {
+      this->parent_->getNetwork()->broadCastSendData(buffer, bytes_read + header);
+    }
+    return;
+  }
   if (this->can_send_packet_) {
-    size_t available = this->ring_buffer_mic_->available();
-    if (available > 0) {
+    uint32_t now = millis();
+    size_t available = this->mic_available_();
+    size_t target = available > 0 ? this->sizer_.frame_bytes(this->address_, now) : 0;
+    // Wait for a whole frame, except for the tail of a talk spurt or audio handed in without a microphone.
+    bool tail = !this->has_mic_source_() || !this->mic_is_running_();
+    if (available > 0 && (available >= target || tail)) {
       buffer[0] = INTERCOM_HEADER_REQ;
       buffer[1] = 2;
       espmeshmesh::uint16toBuffer(buffer + 2, this->packet_counter_++);
 
-      size_t read_size = std::min(available, SEND_BUFFER_SIZE);
-      size_t bytes_read = this->ring_buffer_mic_->read((void *) &buffer[4], read_size, pdMS_TO_TICKS(100));
-      this->set_timeout("InterCom", 600, [this]() { this->can_send_packet_ = true; });
+      // The backlog left behind by a lost ACK drains in the largest frames.
+      size_t read_size = std::min(available, available > 2 * target ? this->sizer_.get_max() : target);
+      size_t bytes_read = this->mic_read_(&buffer[4], read_size, pdMS_TO_TICKS(100));
       if (bytes_read > 0) {
+        this->set_timeout("InterCom", this->sizer_.ack_timeout(this->address_, now), [this]() {
+          this->sizer_.on_loss(this->sent_address_, millis());
+          this->can_send_packet_ = true;
+        });
         this->can_send_packet_ = false;
+        this->sent_address_ = this->address_;
+        this->sent_bytes_ = bytes_read;
+        this->sent_us_ = micros();
+        EVENT_TRACE(TRACE_MESH_TX, bytes_read + 4, this->packet_counter_ - 1);
         if (this->address_ != UINT32_MAX)
           this->parent_->getNetwork()->uniCastSendData((uint8_t *) &buffer, bytes_read + 4, this->address_);
         else
@@ -172,6 +198,7 @@ bool InterCom::validate_address_(uint32_t address) {
 }
 
 bool InterCom::handle_received_(uint8_t *data, size_t size, uint32_t from) {
+  EVENT_TRACE(TRACE_MESH_RX, size, from);
   uint16_t new_counter_value = 0;
   uint8_t reply[4] = {INTERCOM_HEADER_REQ, 0x03, 0, 0};
   if (data[1] == 2) {
@@ -182,7 +209,9 @@ bool InterCom::handle_received_(uint8_t *data, size_t size, uint32_t from) {
       espmeshmesh::uint16toBuffer(reply + 2, new_counter_value);
 
       if (new_counter_value != this->old_counter_value_) {
-        ESP_LOGE(TAG, "packet counter missmatch: %d vs %d", new_counter_value, this->old_counter_value_);
+        // Once per lost frame, a log line here stalls the audio path at verbose log levels.
+        EVENT_TRACE(TRACE_MESH_COUNTER, new_counter_value, this->old_counter_value_);
+        ESP_LOGV(TAG, "packet counter missmatch: %d vs %d", new_counter_value, this->old_counter_value_);
         reply[1] = 0x83;
       }
       this->old_counter_value_ = new_counter_value + 1;
@@ -194,9 +223,18 @@ bool InterCom::handle_received_(uint8_t *data, size_t size, uint32_t from) {
     }
 
     return true;
-  } else if (data[1] & 0x03 == 0x03) {
+  } else if ((data[1] & 0x03) == 0x03) {
     if (espmeshmesh::uint16FromBuffer(data + 2) == this->packet_counter_ - 1) {
       this->cancel_timeout("InterCom");
+      // An ACK after the timeout has no usable round trip, the frame was already counted lost.
+      if (!this->can_send_packet_) {
+        if (data[1] == 0x83) {
+          // The receiver missed frames before this one, the link is dropping them.
+          this->sizer_.on_loss(this->sent_address_, millis());
+        } else {
+          this->sizer_.on_ack(this->sent_address_, this->sent_bytes_, micros() - this->sent_us_, millis());
+        }
+      }
       this->can_send_packet_ = true;
     }
     return true;
@@ -204,7 +242,73 @@ bool InterCom::handle_received_(uint8_t *data, size_t size, uint32_t from) {
   return false;
 }
 
+bool InterCom::handle_multicast_(uint8_t *data, size_t size, uint32_t from) {
+  uint8_t code = data[1];
+  if (code != INTERCOM_MCAST_BEACON && code != INTERCOM_MCAST_JOIN && code != INTERCOM_MCAST_AUDIO) {
+    return false;
+  }
+  if (size < MULTICAST_HEADER_SIZE + 2 || data[2] != this->multicast_group_) {
+    return true;
+  }
+  uint32_t root = espmeshmesh::uint32FromBuffer(data + 3);
+  uint32_t now = millis();
+  switch (code) {
+    case INTERCOM_MCAST_BEACON:
+      if (size >= MULTICAST_HEADER_SIZE + 3) {
+        this->tree_.on_beacon(from, root, espmeshmesh::uint16FromBuffer(data + MULTICAST_HEADER_SIZE),
+                              data[MULTICAST_HEADER_SIZE + 2], now);
+      }
+      break;
+    case INTERCOM_MCAST_JOIN:
+      this->tree_.on_join(from, root, data[MULTICAST_HEADER_SIZE], data[MULTICAST_HEADER_SIZE + 1], now);
+      break;
+    case INTERCOM_MCAST_AUDIO: {
+      // Only frames from our parent in the current tree, anything else is a stale or looping copy.
+      if (root != this->tree_.get_root() || from != this->tree_.get_parent()) {
+        break;
+      }
+      uint16_t counter = espmeshmesh::uint16FromBuffer(data + MULTICAST_HEADER_SIZE);
+      if (counter != this->old_counter_value_) {
+        ESP_LOGV(TAG, "Group frame %u, expected %u", counter, this->old_counter_value_);
+      }
+      this->old_counter_value_ = counter + 1;
+      this->forward_multicast_(data, size);
+      size_t header = MULTICAST_HEADER_SIZE + sizeof(counter);
+      if (this->mode_ == Mode::SPEAKER && !this->wait_to_switch_ && this->has_spr_source_() && size > header) {
+        this->speaker_->play(data + header, size - header);
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+void InterCom::forward_multicast_(uint8_t *data, size_t size) {
+  EVENT_TRACE(TRACE_MESH_FORWARD, size, this->tree_.child_count());
+  this->tree_.for_each_child(
+      [this, data, size](uint32_t child) { this->parent_->getNetwork()->uniCastSendData(data, size, child); });
+}
+
+void InterCom::update_airtime_(size_t size) {
+  // The root only sees its own transmissions, the JOIN reports tell how many edges and members hang below it.
+  uint8_t members = this->tree_.subtree_members();
+  uint8_t links = this->tree_.subtree_links();
+  if (members > 0) {
+    uint32_t airtime = MESH_PREAMBLE_US + (size + MESH_FRAME_OVERHEAD) * 8;
+    this->airtime_per_delivery_us_ = airtime * links / members;
+  }
+  uint32_t now = millis();
+  if (now - this->airtime_reported_ >= MULTICAST_REPORT_INTERVAL) {
+    this->airtime_reported_ = now;
+    ESP_LOGD(TAG, "Group tree: %u members over %u links, %.2f transmissions and %" PRIu32 " us per delivered frame",
+             members, links, members > 0 ? (float) links / members : 0.0f, this->airtime_per_delivery_us_);
+  }
+}
+
 int8_t InterCom::handleFrame(uint8_t *buf, uint16_t len, uint32_t from) {
+  if (len >= 2 && buf[0] == INTERCOM_HEADER_REQ && this->multicast_ && this->handle_multicast_(buf, len, from)) {
+    return HANDLE_UART_OK;
+  }
   if (this->validate_address_(from) && (buf[0] == INTERCOM_HEADER_REQ)) {
     bool result = this->handle_received_(buf, (size_t) len, from);
     return result ? HANDLE_UART_OK : FRAME_NOT_HANDLED;
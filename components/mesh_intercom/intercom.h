@@ -5,89 +5,86 @@
 #include "esphome/core/automation.h"
 #include "esphome/core/component.h"
 #include "esphome/core/helpers.h"
-#include "esphome/core/ring_buffer.h"
-
-#include "esphome/components/audio/audio.h"
-#include "esphome/components/microphone/microphone_source.h"
-#include "esphome/components/speaker/speaker.h"
 
+#include "esphome/components/intercom_core/intercom_engine.h"
 #include "esphome/components/meshmesh/meshmesh.h"
+#include "esphome/components/intercom_core/event_trace_hooks.h"
+
+#include "frame_sizer.h"
+#include "multicast_tree.h"
 
 #include <unordered_map>
 #include <vector>
 
 namespace esphome::intercom {
 
-enum class Mode { NONE, MICROPHONE, SPEAKER };
-
-class InterCom : public Component, public Parented<meshmesh::MeshmeshComponent> {
+class InterCom : public Component,
+                 public InterComEngine<InterCom>,
+                 public Parented<meshmesh::MeshmeshComponent> {
  public:
   void setup() override;
   void dump_config() override;
   void loop() override;
 
-  void set_microphone_source(microphone::MicrophoneSource *mic_source) { this->mic_source_ = mic_source; }
-  void set_speaker(speaker::Speaker *speaker) { this->speaker_ = speaker; }
-
-  void add_play_audio_callback(std::function<size_t(uint8_t *, size_t)> &&callback) {
-    this->play_audio_callback_.add(std::move(callback));
-  }
-
   void set_address(uint32_t address) { this->address_ = address; }
 
+  /// Allow flooding group audio with a mesh broadcast when there is no multicast tree (yet).
   void set_broadcast_allowed(bool value) { this->broadcast_allowed_ = value; }
-
-  void set_mode(Mode mode);
-  bool is_in_mode(Mode mode);
+  /// Send group audio (address 0xFFFFFFFF) down a multicast tree of all nodes in `group` instead of flooding it.
+  void set_multicast_group(uint8_t group) {
+    this->multicast_group_ = group;
+    this->multicast_ = true;
+  }
+  /// Radio time spent per frame that reaches a group member, in us. Only known on the talking node.
+  uint32_t get_airtime_per_delivery() const { return this->airtime_per_delivery_us_; }
+  /// Bounds of the adaptive frame size for unicast audio, in ms of audio.
+  void set_frame_duration(uint32_t min_ms, uint32_t max_ms) {
+    this->sizer_.set_bounds(min_ms * LINK_BYTES_PER_MS, max_ms * LINK_BYTES_PER_MS);
+  }
+  /// Round trip, loss, frame size, goodput and latency towards `address`, nullptr when never talked to.
+  const link_stats_t *get_link_stats(uint32_t address) const { return this->sizer_.get(address); }
 
   float get_setup_priority() const override;
 
   int8_t handleFrame(uint8_t *buf, uint16_t len, uint32_t from);
 
-  void receive_audio(const uint8_t *data, size_t length) { this->buffer_audio(data, length); }
-  size_t buffer_audio(const uint8_t *data, size_t length);
-  bool has_buffered_data() { return (this->ring_buffer_mic_.use_count() >= 0) && this->ring_buffer_mic_->available(); }
-
-  std::shared_ptr<RingBuffer> ring_buffer() { return this->ring_buffer_mic_; }
-
  protected:
+  friend class InterComEngine<InterCom>;
+
+  void on_mode_change_(Mode from, Mode to);
   void send_audio_packet_();
   bool handle_received_(uint8_t *data, size_t size, uint32_t from);
-  void speaker_start_();
-  bool has_mic_source_() { return this->mic_source_ != nullptr; }
-  bool has_spr_source_() { return this->speaker_ != nullptr; }
-
-  microphone::MicrophoneSource *mic_source_{nullptr};
-  speaker::Speaker *speaker_{nullptr};
-
-  std::shared_ptr<RingBuffer> ring_buffer_mic_;
+  void setup_multicast_();
+  bool handle_multicast_(uint8_t *data, size_t size, uint32_t from);
+  /// Hand a group audio frame to every child in the tree.
+  void forward_multicast_(uint8_t *data, size_t size);
+  void update_airtime_(size_t size);
+  void report_links_(uint32_t now);
 
   bool validate_address_(uint32_t address);
   uint32_t address_{0xffffffff};
 
-  audio::AudioStreamInfo target_stream_info_;
-
-  Mode mode_{Mode::NONE};
-
-  bool wait_to_switch_{false};
   bool can_send_packet_{true};
   bool broadcast_allowed_{false};
+  bool multicast_{false};
+  uint8_t multicast_group_{0};
+  MulticastTree tree_;
+  uint16_t multicast_counter_{0};
+  uint32_t airtime_per_delivery_us_{0};
+  uint32_t airtime_reported_{0};
   uint16_t old_counter_value_ = 0;
   uint16_t packet_counter_ = 0;
 
-
-  HighFrequencyLoopRequester high_freq_;
-  CallbackManager<void(uint8_t *, size_t)> play_audio_callback_{};
+  // The frame waiting for its ACK.
+  FrameSizer sizer_;
+  uint32_t sent_address_{0};
+  uint32_t sent_us_{0};
+  size_t sent_bytes_{0};
+  uint32_t links_reported_{0};
 };
 
-template<typename... Ts> class ModeAction : public Action<Ts...>, public Parented<InterCom> {
- public:
-  void set_mode(Mode mode) { this->mode_ = mode; }
-  void play(Ts... x) override { this->parent_->set_mode(this->mode_); }
-
- protected:
-  Mode mode_{Mode::NONE};
-};
+template<typename... Ts> using ModeAction = EngineModeAction<InterCom, Ts...>;
+template<typename... Ts> using IsModeCondition = EngineModeCondition<InterCom, Ts...>;
 
 template<typename... Ts> class ChangeAddressAction : public Action<Ts...>, public Parented<InterCom> {
   TEMPLATABLE_VALUE(uint32_t, address)
@@ -97,14 +94,4 @@ template<typename... Ts> class ChangeAddressAction : public Action<Ts...>, publi
     this->parent_->set_address(address); }
 };
 
-
-template<typename... Ts> class IsModeCondition : public Condition<Ts...>, public Parented<InterCom> {
- public:
-  void set_mode(Mode mode) { this->mode_ = mode; }
-  bool check(Ts... x) override { return this->parent_->is_in_mode(this->mode_); }
-
- protected:
-  Mode mode_{Mode::NONE};
-};
-
 }  // namespace esphome::intercom
@@ -0,0 +1,179 @@
+#include "multicast_tree.h"
+
+namespace esphome::intercom {
+
+void MulticastTree::start_root(uint32_t now) {
+  if (!this->is_root()) {
+    this->clear_children_();
+  }
+  this->rooted_ = true;
+  this->root_ = this->self_;
+  this->parent_ = 0;
+  this->hops_ = 0;
+  this->joined_ = false;
+  this->seq_++;
+  this->last_beacon_ = now;
+  if (this->beacon_) {
+    this->beacon_(this->root_, this->seq_, 0);
+  }
+}
+
+void MulticastTree::stop_root() {
+  if (!this->is_root()) {
+    return;
+  }
+  // Without beacons the children time out on their own, no need to tear the tree down explicitly.
+  this->rooted_ = false;
+  this->root_ = 0;
+  this->clear_children_();
+}
+
+void MulticastTree::on_beacon(uint32_t from, uint32_t root, uint16_t seq, uint8_t hops, uint32_t now) {
+  if (root == this->self_ || hops == UINT8_MAX) {
+    return;
+  }
+  if (root != this->root_) {
+    // A new talker: whatever tree we were part of is finished.
+    if (this->joined_) {
+      this->send_join_(this->parent_, true);
+    }
+    this->rooted_ = false;
+    this->root_ = root;
+    this->seq_ = seq - 1;
+    this->hops_ = UINT8_MAX;
+    this->parent_ = 0;
+    this->joined_ = false;
+    this->clear_children_();
+  }
+
+  bool newer = (int16_t) (seq - this->seq_) > 0;
+  bool shorter = seq == this->seq_ && hops + 1 < this->hops_;
+  if (!newer && !shorter) {
+    return;
+  }
+  uint32_t old_parent = this->parent_;
+  this->seq_ = seq;
+  this->hops_ = hops + 1;
+  this->parent_ = from;
+  this->last_beacon_ = now;
+  if (this->beacon_) {
+    this->beacon_(root, seq, this->hops_);
+  }
+  if (this->joined_ && old_parent != from) {
+    this->send_join_(old_parent, true);
+  }
+  // The JOIN doubles as the refresh, so a branch that lost its last member is pruned by the next beacon.
+  bool wanted = this->member_ || this->child_count() > 0;
+  if (wanted || this->joined_) {
+    this->send_join_(from, !wanted);
+  }
+}
+
+void MulticastTree::on_join(uint32_t from, uint32_t root, uint8_t members, uint8_t links, uint32_t now) {
+  if (root != this->root_) {
+    return;
+  }
+  child_t *free_slot = nullptr;
+  for (auto &child : this->children_) {
+    if (child.address == from) {
+      if (members == 0) {
+        child.address = 0;
+      } else {
+        child.members = members;
+        child.links = links;
+        child.last_seen = now;
+      }
+      return;
+    }
+    if (child.address == 0 && free_slot == nullptr) {
+      free_slot = &child;
+    }
+  }
+  if (members == 0 || free_slot == nullptr) {
+    return;
+  }
+  *free_slot = {from, members, links, now};
+  if (!this->is_root() && !this->joined_ && this->parent_ != 0) {
+    // A relay that had no reason to be in the tree has one now.
+    this->send_join_(this->parent_, false);
+  }
+}
+
+void MulticastTree::loop(uint32_t now) {
+  for (auto &child : this->children_) {
+    if (child.address != 0 && now - child.last_seen > MULTICAST_TIMEOUT) {
+      child.address = 0;
+    }
+  }
+  if (this->is_root()) {
+    if (now - this->last_beacon_ >= MULTICAST_BEACON_INTERVAL) {
+      this->last_beacon_ = now;
+      this->seq_++;
+      if (this->beacon_) {
+        this->beacon_(this->root_, this->seq_, 0);
+      }
+    }
+  } else if (this->root_ != 0 && now - this->last_beacon_ > MULTICAST_TIMEOUT) {
+    // The talker is gone or out of reach.
+    this->root_ = 0;
+    this->parent_ = 0;
+    this->joined_ = false;
+    this->clear_children_();
+  }
+}
+
+void MulticastTree::for_each_child(const std::function<void(uint32_t address)> &child) const {
+  for (const auto &entry : this->children_) {
+    if (entry.address != 0) {
+      child(entry.address);
+    }
+  }
+}
+
+uint8_t MulticastTree::child_count() const {
+  uint8_t count = 0;
+  for (const auto &child : this->children_) {
+    if (child.address != 0) {
+      count++;
+    }
+  }
+  return count;
+}
+
+uint8_t MulticastTree::subtree_members() const {
+  uint32_t members = 0;
+  for (const auto &child : this->children_) {
+    if (child.address != 0) {
+      members += child.members;
+    }
+  }
+  if (this->member_ && !this->is_root()) {
+    members++;
+  }
+  return members > UINT8_MAX ? UINT8_MAX : members;
+}
+
+uint8_t MulticastTree::subtree_links() const {
+  uint32_t links = 0;
+  for (const auto &child : this->children_) {
+    if (child.address != 0) {
+      links += child.links + 1;
+    }
+  }
+  return links > UINT8_MAX ? UINT8_MAX : links;
+}
+
+void MulticastTree::send_join_(uint32_t parent, bool leave) {
+  this->joined_ = !leave;
+  if (this->join_ && parent != 0) {
+    this->join_(parent, this->root_, leave ? 0 : this->subtree_members(), leave ? 0 : this->subtree_links());
+  }
+}
+
+void MulticastTree::clear_children_() {
+  for (auto &child : this->children_) {
+    child.address = 0;
+  }
+}
+
+}  // namespace esphome::intercom
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome::intercom {
+
+/// Nodes that can hang directly below one node in the tree.
+static const uint8_t MULTICAST_MAX_CHILDREN = 8;
+/// The talker re-announces the tree this often, which also refreshes every JOIN below it.
+static const uint32_t MULTICAST_BEACON_INTERVAL = 2000;
+/// A parent or child that missed this many beacon rounds is gone.
+static const uint32_t MULTICAST_TIMEOUT = 3 * MULTICAST_BEACON_INTERVAL;
+
+/// One-hop broadcast of a beacon for the tree rooted at `root`.
+using multicast_beacon_t = std::function<void(uint32_t root, uint16_t seq, uint8_t hops)>;
+/// Unicast of a JOIN to `parent`; members and links describe the subtree of the sender, 0 members means leave.
+using multicast_join_t = std::function<void(uint32_t parent, uint32_t root, uint8_t members, uint8_t links)>;
+
+/// Source rooted distribution tree for group calls, built the way RPL builds its DODAG:
+///
+///  BEACON  root -> everyone (one hop, relayed once per sequence)   [root][seq][hops]
+///  JOIN    child -> parent (unicast, refreshed on every beacon)    [root][members][links]
+///
+/// Each node picks the neighbour it heard the fewest-hop beacon from as its parent. Nodes that are members, or that
+/// have members below them, join their parent; other branches are pruned. Audio then travels down the tree with one
+/// unicast per tree edge, so every link carries a frame at most once. Joins and leaves show up within one beacon
+/// round, silent nodes after MULTICAST_TIMEOUT.
+class MulticastTree {
+ public:
+  void set_self(uint32_t address) { this->self_ = address; }
+  /// Whether this node plays the group audio, relays forward without being members.
+  void set_member(bool member) { this->member_ = member; }
+  void set_beacon(multicast_beacon_t &&beacon) { this->beacon_ = std::move(beacon); }
+  void set_join(multicast_join_t &&join) { this->join_ = std::move(join); }
+
+  /// Become the root of a new tree, e.g. when this node starts talking.
+  void start_root(uint32_t now);
+  void stop_root();
+  bool is_root() const { return this->root_ == this->self_ && this->rooted_; }
+
+  void on_beacon(uint32_t from, uint32_t root, uint16_t seq, uint8_t hops, uint32_t now);
+  void on_join(uint32_t from, uint32_t root, uint8_t members, uint8_t links, uint32_t now);
+  void loop(uint32_t now);
+
+  /// Root of the tree this node is part of, 0 when there is none.
+  uint32_t get_root() const { return this->root_; }
+  uint32_t get_parent() const { return this->parent_; }
+  /// Call `child` once for every live child.
+  void for_each_child(const std::function<void(uint32_t address)> &child) const;
+  uint8_t child_count() const;
+
+  /// Members and tree edges below this node, as last reported by the children.
+  uint8_t subtree_members() const;
+  uint8_t subtree_links() const;
+
+ protected:
+  struct child_t {
+    uint32_t address;
+    uint8_t members;
+    uint8_t links;
+    uint32_t last_seen;
+  };
+
+  void send_join_(uint32_t parent, bool leave);
+  void clear_children_();
+
+  uint32_t self_{0};
+  bool member_{true};
+  multicast_beacon_t beacon_;
+  multicast_join_t join_;
+
+  bool rooted_{false};
+  uint32_t root_{0};
+  uint16_t seq_{0};
+  uint8_t hops_{0};
+  uint32_t parent_{0};
+  uint32_t last_beacon_{0};
+  bool joined_{false};
+
+  std::array<child_t, MULTICAST_MAX_CHILDREN> children_{};
+};
+
+}  // namespace esphome::intercom
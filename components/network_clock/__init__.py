@@ -0,0 +1,48 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.const import CONF_ID
+from esphome.components.espnow import ESPNOW_SCHEMA, register_espnow_extention
+from esphome.components.tx_scheduler import TX_SCHEDULER_SCHEMA, register_tx_scheduler
+
+AUTO_LOAD = ["espnow", "tx_scheduler"]
+
+CODEOWNERS = ["@LumenSoftNL"]
+
+CONF_NETWORK_CLOCK_ID = "network_clock_id"
+CONF_MASTER = "master"
+
+network_clock_ns = cg.esphome_ns.namespace("network_clock")
+NetworkClock = network_clock_ns.class_("NetworkClock", cg.Component)
+
+CONFIG_SCHEMA = (
+    cv.Schema(
+        {
+            cv.GenerateID(): cv.declare_id(NetworkClock),
+            cv.Optional(CONF_MASTER, default=False): cv.boolean,
+        }
+    )
+    .extend(cv.COMPONENT_SCHEMA)
+    .extend(ESPNOW_SCHEMA)
+    .extend(TX_SCHEDULER_SCHEMA)
+)
+
+NETWORK_CLOCK_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_NETWORK_CLOCK_ID): cv.use_id(NetworkClock),
+    }
+)
+
+
+async def register_network_clock(var, config):
+    if clock_id := config.get(CONF_NETWORK_CLOCK_ID):
+        clock = await cg.get_variable(clock_id)
+        cg.add(var.set_network_clock(clock))
+
+
+async def to_code(config):
+    var = cg.new_Pvariable(config[CONF_ID])
+    await cg.register_component(var, config)
+    await register_espnow_extention(var, config)
+    await register_tx_scheduler(var, config)
+    cg.add(var.set_master(config[CONF_MASTER]))
+    cg.add_define("USE_NETWORK_CLOCK")
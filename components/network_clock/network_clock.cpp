@@ -0,0 +1,165 @@
+#include "network_clock.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+namespace esphome::network_clock {
+
+static const char *const TAG = "network_clock";
+
+static const uint8_t CLOCK_REQUEST[] = {tx_scheduler::PROTOCOL_CLOCK, 'Q'};
+static const uint8_t CLOCK_RESPONSE[] = {tx_scheduler::PROTOCOL_CLOCK, 'R'};
+static const uint8_t CLOCK_HEADER_SIZE = 2;
+static const uint8_t CLOCK_REQUEST_SIZE = CLOCK_HEADER_SIZE + 1 + 8;
+static const uint8_t CLOCK_RESPONSE_SIZE = CLOCK_HEADER_SIZE + ESP_NOW_ETH_ALEN + 1 + 3 * 8;
+static const uint8_t BROADCAST[ESP_NOW_ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+static void put_int64(uint8_t *buffer, int64_t value) {
+  for (uint8_t i = 0; i < 8; i++) {
+    buffer[i] = (uint8_t) ((uint64_t) value >> (8 * i));
+  }
+}
+
+static int64_t get_int64(const uint8_t *buffer) {
+  uint64_t value = 0;
+  for (uint8_t i = 0; i < 8; i++) {
+    value |= (uint64_t) buffer[i] << (8 * i);
+  }
+  return (int64_t) value;
+}
+
+void NetworkClock::setup() {
+  get_mac_address_raw(this->own_address_);
+  this->tx_scheduler_->add_protocol(tx_scheduler::PROTOCOL_CLOCK,
+                                    [this](const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
+                                      this->handle_frame_(info, data, size);
+                                    });
+}
+
+void NetworkClock::loop() {
+  if (!this->master_ && millis() - this->last_request_ >= CLOCK_POLL_INTERVAL) {
+    this->last_request_ = millis();
+    this->send_request_();
+  }
+}
+
+void NetworkClock::dump_config() {
+  ESP_LOGCONFIG(TAG, "Network clock:");
+  ESP_LOGCONFIG(TAG, "  Role: %s", this->master_ ? "master" : "follower");
+  if (!this->master_) {
+    ESP_LOGCONFIG(TAG, "  Synced: %s", YESNO(this->is_synced()));
+    ESP_LOGCONFIG(TAG, "  Uncertainty: %" PRIu32 " us", this->uncertainty_);
+  }
+}
+
+int64_t NetworkClock::now() const { return esp_timer_get_time() + this->offset_; }
+
+bool NetworkClock::is_synced() const {
+  return this->master_ || (this->has_offset_ && millis() - this->last_heard_ < CLOCK_HOLDOVER);
+}
+
+void NetworkClock::send_request_() {
+  if (this->has_master_ && !this->is_synced()) {
+    // The master went quiet, ask whoever answers.
+    this->has_master_ = false;
+    this->sample_count_ = 0;
+  }
+  uint8_t frame[CLOCK_REQUEST_SIZE];
+  memcpy(frame, CLOCK_REQUEST, CLOCK_HEADER_SIZE);
+  frame[CLOCK_HEADER_SIZE] = ++this->seq_;
+  put_int64(frame + CLOCK_HEADER_SIZE + 1, esp_timer_get_time());
+  this->tx_scheduler_->send(tx_scheduler::TxClass::CONTROL, this->has_master_ ? this->master_address_ : BROADCAST,
+                            frame, sizeof(frame));
+}
+
+void NetworkClock::handle_frame_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
+  int64_t rx_time = esp_timer_get_time();
+  if (size < CLOCK_HEADER_SIZE) {
+    return;
+  }
+  if (this->master_ && memcmp(data, CLOCK_REQUEST, CLOCK_HEADER_SIZE) == 0) {
+    this->handle_request_(info, data, size, rx_time);
+  } else if (!this->master_ && memcmp(data, CLOCK_RESPONSE, CLOCK_HEADER_SIZE) == 0) {
+    this->handle_response_(info, data, size, rx_time);
+  }
+}
+
+void NetworkClock::handle_request_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size,
+                                   int64_t rx_time) {
+  if (size != CLOCK_REQUEST_SIZE) {
+    return;
+  }
+  uint8_t frame[CLOCK_RESPONSE_SIZE];
+  uint8_t *pos = frame;
+  memcpy(pos, CLOCK_RESPONSE, CLOCK_HEADER_SIZE);
+  pos += CLOCK_HEADER_SIZE;
+  memcpy(pos, info.src_addr, ESP_NOW_ETH_ALEN);
+  pos += ESP_NOW_ETH_ALEN;
+  // [seq][t1] echoed as received.
+  memcpy(pos, data + CLOCK_HEADER_SIZE, 1 + 8);
+  pos += 1 + 8;
+  put_int64(pos, rx_time);
+  put_int64(pos + 8, esp_timer_get_time());
+  this->tx_scheduler_->send(tx_scheduler::TxClass::CONTROL, BROADCAST, frame, sizeof(frame));
+}
+
+void NetworkClock::handle_response_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size,
+                                    int64_t rx_time) {
+  if (size != CLOCK_RESPONSE_SIZE || memcmp(data + CLOCK_HEADER_SIZE, this->own_address_, ESP_NOW_ETH_ALEN) != 0) {
+    return;
+  }
+  const uint8_t *pos = data + CLOCK_HEADER_SIZE + ESP_NOW_ETH_ALEN;
+  if (pos[0] != this->seq_) {
+    // Answer to an older request, or to one sent before a restart.
+    return;
+  }
+  if (!this->has_master_) {
+    // Follow a single master, the first one that answers.
+    memcpy(this->master_address_, info.src_addr, ESP_NOW_ETH_ALEN);
+    this->has_master_ = true;
+    this->sample_count_ = 0;
+  } else if (memcmp(info.src_addr, this->master_address_, ESP_NOW_ETH_ALEN) != 0) {
+    return;
+  }
+  int64_t t1 = get_int64(pos + 1);
+  int64_t t2 = get_int64(pos + 9);
+  int64_t t3 = get_int64(pos + 17);
+  int64_t t4 = rx_time;
+  int64_t delay = (t4 - t1) - (t3 - t2);
+  if (delay < 0) {
+    return;
+  }
+  this->add_sample_(((t2 - t1) + (t3 - t4)) / 2, delay);
+}
+
+void NetworkClock::add_sample_(int64_t offset, int64_t delay) {
+  this->samples_[this->sample_pos_] = {offset, delay};
+  this->sample_pos_ = (this->sample_pos_ + 1) % CLOCK_SAMPLES;
+  this->sample_count_ = std::min<uint8_t>(this->sample_count_ + 1, CLOCK_SAMPLES);
+
+  // Every delay in the path makes the round trip longer, so the shortest one is the least disturbed.
+  const sample_t *best = &this->samples_[0];
+  for (uint8_t i = 1; i < this->sample_count_; i++) {
+    if (this->samples_[i].delay < best->delay) {
+      best = &this->samples_[i];
+    }
+  }
+  this->uncertainty_ = (uint32_t) std::min<int64_t>(best->delay / 2, UINT32_MAX);
+  int64_t offset_before = this->offset_;
+  this->offset_ = best->offset;
+  this->last_heard_ = millis();
+  if (!this->has_offset_) {
+    this->has_offset_ = true;
+    ESP_LOGI(TAG, "Synced to the network clock");
+  } else if (std::abs(this->offset_ - offset_before) > 1000) {
+    ESP_LOGD(TAG, "Offset stepped by %" PRId64 " us", this->offset_ - offset_before);
+  }
+}
+
+}  // namespace esphome::network_clock
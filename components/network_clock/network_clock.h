@@ -0,0 +1,86 @@
+#pragma once
+
+#include "esphome/core/component.h"
+#include "esphome/core/helpers.h"
+
+#include "esphome/components/espnow/espnow_component.h"
+#include "esphome/components/tx_scheduler/tx_scheduler.h"
+
+#include <array>
+#include <cstdint>
+
+namespace esphome::network_clock {
+
+/// A follower asks the master for the time this often.
+static const uint32_t CLOCK_POLL_INTERVAL = 1000;
+/// Round trips kept by a follower; the window is short enough that crystal drift stays far below 1 ms.
+static const uint8_t CLOCK_SAMPLES = 4;
+/// Without responses a follower keeps its last offset this long before it reports itself unsynced.
+static const uint32_t CLOCK_HOLDOVER = 10000;
+
+/// Shared microsecond time base for a room full of badges, distributed by the switchboard over ESP-NOW:
+///
+///  REQUEST   "TQ" [seq][t1:8]                              follower -> master
+///  RESPONSE  "TR" [follower:6][seq][t1:8][t2:8][t3:8]      master -> broadcast
+///
+/// "T" is the PROTOCOL_CLOCK byte. t1 is the follower's send time, t2 and t3 the master's receive and send time, and
+/// the follower stamps the response t4 on arrival. Every exchange gives an offset and the round trip delay it was
+/// measured over:
+///
+///  offset = ((t2 - t1) + (t3 - t4)) / 2        delay = (t4 - t1) - (t3 - t2)
+///
+/// The stamps are taken in loop context, so queueing and loop latency end up in them, but on both legs alike: they
+/// lengthen the delay far more than they move the offset. Of the last CLOCK_SAMPLES exchanges the one with the
+/// least delay wins, its offset is off by at most half that delay. Responses are broadcast, so the master needs no
+/// ESP-NOW peer per badge. Until a master answers, requests are broadcast too.
+class NetworkClock : public Component, public Parented<espnow::ESPNowComponent> {
+ public:
+  void setup() override;
+  void loop() override;
+  void dump_config() override;
+  float get_setup_priority() const override { return setup_priority::AFTER_WIFI; }
+
+  /// Distribute the time base instead of following it; set on the switchboard.
+  void set_master(bool master) { this->master_ = master; }
+  void set_tx_scheduler(tx_scheduler::TxScheduler *tx_scheduler) { this->tx_scheduler_ = tx_scheduler; }
+
+  /// Network time in microseconds.
+  int64_t now() const;
+  /// Local esp_timer time at which the network clock reads `network`.
+  int64_t to_local(int64_t network) const { return network - this->offset_; }
+  /// True on the master, and on a follower that heard the master within the holdover time.
+  bool is_synced() const;
+  /// Half the round trip of the exchange the offset comes from, an upper bound on the error of this follower, in us.
+  uint32_t get_uncertainty() const { return this->uncertainty_; }
+
+ protected:
+  struct sample_t {
+    int64_t offset;
+    int64_t delay;
+  };
+
+  void send_request_();
+  void handle_frame_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size);
+  void handle_request_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size, int64_t rx_time);
+  void handle_response_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size, int64_t rx_time);
+  void add_sample_(int64_t offset, int64_t delay);
+
+  tx_scheduler::TxScheduler *tx_scheduler_{nullptr};
+  bool master_{false};
+
+  // Follower
+  uint8_t own_address_[ESP_NOW_ETH_ALEN]{};
+  uint8_t seq_{0};
+  uint32_t last_request_{0};
+  int64_t offset_{0};
+  bool has_offset_{false};
+  uint8_t master_address_[ESP_NOW_ETH_ALEN]{};
+  bool has_master_{false};
+  uint32_t last_heard_{0};
+  std::array<sample_t, CLOCK_SAMPLES> samples_{};
+  uint8_t sample_count_{0};
+  uint8_t sample_pos_{0};
+  uint32_t uncertainty_{0};
+};
+
+}  // namespace esphome::network_clock
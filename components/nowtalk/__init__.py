@@ -1,39 +1,91 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
-from esphome.core import coroutine_with_priority
-
-CODEOWNERS = ["@LumenSoftNL"]
-nowtalk_ns = cg.esphome_ns.namespace("nowtalk")
-
 from esphome import automation
-import esphome.config_validation as cv
-import esphome.codegen as cg
-from esphome.const import CONF_ID
-from esphome.components.espnow import espnow_ns, ESPNowListener, CONF_ESPNOW
+from esphome.automation import register_action
+from esphome.const import CONF_ID, CONF_SIZE
+from esphome.components.espnow import ESPNOW_SCHEMA, register_espnow_extention
+from esphome.components.tx_scheduler import TX_SCHEDULER_SCHEMA, register_tx_scheduler
+from esphome.components.group_crypto import GROUP_CRYPTO_SCHEMA, register_group_crypto
+from esphome.components.network_clock import CONF_NETWORK_CLOCK_ID, NETWORK_CLOCK_SCHEMA
 
+AUTO_LOAD = ["espnow", "tx_scheduler", "intercom_core"]
 
 CODEOWNERS = ["@LumenSoftNL"]
 
+CONF_NOWTALK = "nowtalk"
+CONF_ACCEPT_FLEET_UPDATE = "accept_fleet_update"
+CONF_COALESCE_WINDOW = "coalesce_window"
+CONF_ROAM_THRESHOLD = "roam_threshold"
+CONF_SCAN_DWELL = "scan_dwell"
+CONF_SWITCHBOARD = "switchboard"
+CONF_LOSS = "loss"
 
-NowTalkComponent = espnow_ns.class_("NowTalkComponent", cg.Component, ESPNowListener)
-
-
-CONF_NOWTALK = "NowTalk"
-CONF_ON_PACKET_RECEIVED = "on_packet_received"
-CONF_ON_PACKET_SEND = "on_packet_send"
+nowtalk_ns = cg.esphome_ns.namespace("nowtalk")
+NowTalkComponent = nowtalk_ns.class_("NowTalkComponent", cg.Component)
 
-CONFIG_SCHEMA = cv.Schema(
-    {
-        cv.GenerateID(): cv.declare_id(NowTalkComponent),
+StreamBenchmarkAction = nowtalk_ns.class_(
+    "StreamBenchmarkAction", automation.Action, cg.Parented.template(NowTalkComponent)
+)
 
-    }
-).extend(cv.COMPONENT_SCHEMA)
+CONFIG_SCHEMA = (
+    cv.Schema(
+        {
+            cv.GenerateID(): cv.declare_id(NowTalkComponent),
+            cv.Optional(CONF_SWITCHBOARD, default=False): cv.boolean,
+            cv.Optional(CONF_ACCEPT_FLEET_UPDATE, default=False): cv.boolean,
+            cv.Optional(CONF_COALESCE_WINDOW, default="4ms"): cv.All(
+                cv.positive_time_period_milliseconds,
+                cv.Range(max=cv.TimePeriod(milliseconds=50)),
+            ),
+            cv.Optional(CONF_SCAN_DWELL, default="40ms"): cv.All(
+                cv.positive_time_period_milliseconds,
+                cv.Range(min=cv.TimePeriod(milliseconds=10), max=cv.TimePeriod(milliseconds=500)),
+            ),
+            cv.Optional(CONF_ROAM_THRESHOLD, default=-80): cv.int_range(min=-100, max=-30),
+        }
+    )
+    .extend(cv.COMPONENT_SCHEMA)
+    .extend(ESPNOW_SCHEMA)
+    .extend(TX_SCHEDULER_SCHEMA)
+    .extend(GROUP_CRYPTO_SCHEMA)
+    .extend(NETWORK_CLOCK_SCHEMA)
+)
 
 
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
-    trigger = cg.new_Pvariable(config[CONF_ESPNOW], var)
-    cg.add(var.set_esphome(trigger))
+    await register_espnow_extention(var, config)
+    await register_tx_scheduler(var, config)
+    await register_group_crypto(var, config)
+    cg.add(var.set_switchboard(config[CONF_SWITCHBOARD]))
+    if config[CONF_SWITCHBOARD] and (clock_id := config.get(CONF_NETWORK_CLOCK_ID)):
+        # The switchboard is the time reference of its badges.
+        clock = await cg.get_variable(clock_id)
+        cg.add(clock.set_master(True))
+    cg.add(var.set_accept_fleet_update(config[CONF_ACCEPT_FLEET_UPDATE]))
+    cg.add(var.set_coalesce_window(config[CONF_COALESCE_WINDOW]))
+    cg.add(var.set_scan_dwell(config[CONF_SCAN_DWELL]))
+    cg.add(var.set_roam_threshold(config[CONF_ROAM_THRESHOLD]))
     cg.add_define("USE_NOWTALK")
-    cg.add_global(nowtalk_ns.using)
+
+
+@register_action(
+    "nowtalk.stream_benchmark",
+    StreamBenchmarkAction,
+    cv.Schema(
+        {
+            cv.GenerateID(): cv.use_id(NowTalkComponent),
+            cv.Optional(CONF_SIZE, default=65536): cv.templatable(cv.int_range(min=1, max=1048576)),
+            cv.Optional(CONF_LOSS, default=10): cv.templatable(cv.int_range(min=0, max=100)),
+        }
+    ),
+)
+async def nowtalk_stream_benchmark_code(config, action_id, template_arg, arg):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    size = await cg.templatable(config[CONF_SIZE], arg, cg.uint32)
+    cg.add(var.set_size(size))
+    loss = await cg.templatable(config[CONF_LOSS], arg, cg.uint8)
+    cg.add(var.set_loss(loss))
+    return var
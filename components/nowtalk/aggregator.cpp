@@ -0,0 +1,127 @@
+#include "aggregator.h"
+#include "protocol.h"
+
+#include <cstring>
+
+namespace esphome {
+namespace nowtalk {
+
+static const uint32_t RATE_INTERVAL = 10000;
+
+FrameAggregator::slot_t *FrameAggregator::find_(const uint8_t *address, uint8_t tx_class) {
+  for (slot_t &slot : this->slots_) {
+    if (slot.used && slot.tx_class == tx_class && memcmp(slot.address, address, 6) == 0) {
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+bool FrameAggregator::add(const uint8_t *address, uint8_t code, const uint8_t *data, size_t len, uint32_t now) {
+  uint8_t tx_class = this->classify_ ? this->classify_(code) : 0;
+  slot_t *slot = this->find_(address, tx_class);
+  bool ok = true;
+  if (this->window_ == 0 || len + 2 > AGGREGATE_MAX_RECORD) {
+    if (slot != nullptr) {
+      ok = this->flush_(*slot);
+    }
+    return this->send_(address, code, data, len) && ok;
+  }
+  if (slot != nullptr && slot->len + len + 2 > this->max_body_) {
+    ok = this->flush_(*slot);
+  } else if (slot == nullptr) {
+    // Take a free slot, or make room by sending the frame that has waited longest.
+    slot = &this->slots_[0];
+    for (slot_t &candidate : this->slots_) {
+      if (!candidate.used || now - candidate.opened > now - slot->opened) {
+        slot = &candidate;
+        if (!candidate.used) {
+          break;
+        }
+      }
+    }
+    // Another peer's frame, its failure is only counted.
+    this->flush_(*slot);
+    memcpy(slot->address, address, 6);
+    slot->tx_class = tx_class;
+  }
+  if (!slot->used) {
+    slot->used = true;
+    slot->records = 0;
+    slot->len = 0;
+    slot->opened = now;
+  }
+  slot->body[slot->len] = len + 1;
+  slot->body[slot->len + 1] = code;
+  memcpy(slot->body + slot->len + 2, data, len);
+  slot->len += len + 2;
+  slot->records++;
+  return ok;
+}
+
+bool FrameAggregator::flush_(slot_t &slot) {
+  if (!slot.used) {
+    return true;
+  }
+  slot.used = false;
+  bool ok;
+  if (slot.records == 1) {
+    ok = this->send_(slot.address, slot.body[1], slot.body + 2, slot.body[0] - 1);
+  } else {
+    ok = this->send_(slot.address, NOWTALK_AGGREGATE, slot.body, slot.len);
+    if (ok) {
+      this->frames_saved_ += slot.records - 1;
+    }
+  }
+  if (!ok) {
+    this->records_failed_ += slot.records;
+  }
+  return ok;
+}
+
+bool FrameAggregator::flush(const uint8_t *address) {
+  bool ok = true;
+  for (slot_t &slot : this->slots_) {
+    if (slot.used && memcmp(slot.address, address, 6) == 0) {
+      ok = this->flush_(slot) && ok;
+    }
+  }
+  return ok;
+}
+
+bool FrameAggregator::flush_all() {
+  bool ok = true;
+  for (slot_t &slot : this->slots_) {
+    ok = this->flush_(slot) && ok;
+  }
+  return ok;
+}
+
+void FrameAggregator::loop(uint32_t now) {
+  for (slot_t &slot : this->slots_) {
+    if (slot.used && now - slot.opened >= this->window_) {
+      this->flush_(slot);
+    }
+  }
+  if (now - this->rate_start_ >= RATE_INTERVAL) {
+    this->saved_rate_ = (this->frames_saved_ - this->rate_saved_) * 1000 / (now - this->rate_start_);
+    this->rate_saved_ = this->frames_saved_;
+    this->rate_start_ = now;
+  }
+}
+
+bool FrameAggregator::unpack(const uint8_t *data, size_t len, const aggregate_record_t &record) {
+  size_t offset = 0;
+  while (offset < len) {
+    uint8_t size = data[offset];
+    if (size == 0 || offset + 1 + size > len) {
+      return false;
+    }
+    record(data[offset + 1], data + offset + 2, size - 1);
+    offset += 1 + size;
+  }
+  return true;
+}
+
+}  // namespace nowtalk
+}  // namespace esphome
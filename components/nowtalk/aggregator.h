@@ -0,0 +1,91 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome {
+namespace nowtalk {
+
+/// Room for records in one NOWTALK_AGGREGATE frame.
+static const uint8_t AGGREGATE_MAX_BODY = NOWTALK_MAX_BODY;
+/// Larger messages are sent on their own, they would leave too little room to be worth the wait.
+static const uint8_t AGGREGATE_MAX_RECORD = 64;
+/// Peers with a frame under construction at the same time.
+static const uint8_t AGGREGATE_SLOTS = 4;
+
+/// Sends one NowTalk frame to `address`.
+using aggregate_send_t = std::function<bool(const uint8_t *address, uint8_t code, const uint8_t *data, size_t len)>;
+/// Maps a message code to the send class it is queued in; messages of different classes never share a frame.
+using aggregate_class_t = std::function<uint8_t(uint8_t code)>;
+/// Called once per record while unpacking.
+using aggregate_record_t = std::function<void(uint8_t code, const uint8_t *data, size_t len)>;
+
+/// Packs small control messages for the same peer into one NOWTALK_AGGREGATE frame:
+///
+///  AGGREGATE  [len][code][body]...     len counts code + body
+///
+/// A message waits at most `window` ms for company. A frame that ends up holding a single message goes out as that
+/// plain message, so a lone ACK costs nothing extra. Frames are collected per peer and send class, so a frame can be
+/// queued in the class of every record it carries.
+class FrameAggregator {
+ public:
+  void set_send(aggregate_send_t &&send) { this->send_ = std::move(send); }
+  void set_classify(aggregate_class_t &&classify) { this->classify_ = std::move(classify); }
+  /// Coalescing window in ms, 0 sends every message right away.
+  void set_window(uint32_t window) { this->window_ = window; }
+  uint32_t get_window() const { return this->window_; }
+  /// Room for records per frame, lowered when frames are sealed.
+  void set_max_body(uint8_t max_body) { this->max_body_ = max_body; }
+
+  /// Queue a message. Messages too large to aggregate are sent immediately, after the peer's pending frame of the same
+  /// class. Returns false when a send made by this call failed; later sends of the frame are counted in
+  /// get_records_failed().
+  bool add(const uint8_t *address, uint8_t code, const uint8_t *data, size_t len, uint32_t now);
+  /// Send the pending frames for `address` now, e.g. before a frame that must not overtake them.
+  /// Returns false when a send failed.
+  bool flush(const uint8_t *address);
+  bool flush_all();
+  void loop(uint32_t now);
+
+  /// Walk the records of an AGGREGATE body once. Returns false when a record was truncated.
+  static bool unpack(const uint8_t *data, size_t len, const aggregate_record_t &record);
+
+  uint32_t get_frames_saved() const { return this->frames_saved_; }
+  /// Frames saved per second over the last rate interval.
+  uint32_t get_saved_rate() const { return this->saved_rate_; }
+  /// Messages lost because the send of their frame failed.
+  uint32_t get_records_failed() const { return this->records_failed_; }
+
+ protected:
+  struct slot_t {
+    uint8_t address[6];
+    uint8_t tx_class;
+    bool used;
+    uint8_t records;
+    uint8_t len;
+    uint32_t opened;
+    uint8_t body[AGGREGATE_MAX_BODY];
+  };
+
+  slot_t *find_(const uint8_t *address, uint8_t tx_class);
+  bool flush_(slot_t &slot);
+
+  aggregate_send_t send_{};
+  aggregate_class_t classify_{};
+  std::array<slot_t, AGGREGATE_SLOTS> slots_{};
+  uint32_t window_{4};
+  uint8_t max_body_{AGGREGATE_MAX_BODY};
+
+  uint32_t frames_saved_{0};
+  uint32_t records_failed_{0};
+  uint32_t rate_start_{0};
+  uint32_t rate_saved_{0};
+  uint32_t saved_rate_{0};
+};
+
+}  // namespace nowtalk
+}  // namespace esphome
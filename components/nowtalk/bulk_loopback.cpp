@@ -0,0 +1,109 @@
+#include "bulk_loopback.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+
+namespace esphome {
+namespace nowtalk {
+
+/// A transfer still running after this much simulated time is given up.
+static const uint32_t BULK_LOOPBACK_LIMIT_MS = 600000;
+
+namespace {
+
+struct air_frame_t {
+  bool to_receiver;
+  uint8_t code;
+  uint8_t len;
+  uint8_t data[NOWTALK_MAX_BODY];
+  uint64_t arrival_us;
+};
+
+}  // namespace
+
+bulk_loopback_result_t bulk_loopback(uint32_t size, uint8_t loss_percent, uint32_t link_kbps, uint8_t chunk_size,
+                                     uint32_t seed) {
+  bulk_loopback_result_t result;
+  if (link_kbps == 0) {
+    return result;
+  }
+  std::deque<air_frame_t> air;
+  uint64_t now_us = 0;
+  uint64_t air_free_us = 0;
+  uint32_t random = seed == 0 ? 1 : seed;
+
+  // Frames go out one after the other, whichever side sends them, so they arrive in the order they were sent.
+  auto transmit = [&](bool to_receiver, uint8_t code, const uint8_t *data, size_t len) {
+    if (air.size() >= BULK_LOOPBACK_QUEUE || len > NOWTALK_MAX_BODY) {
+      return false;
+    }
+    air_frame_t frame;
+    frame.to_receiver = to_receiver;
+    frame.code = code;
+    frame.len = len;
+    memcpy(frame.data, data, len);
+    air_free_us = std::max(air_free_us, now_us) + BULK_LOOPBACK_FRAME_OVERHEAD_US +
+                  (uint64_t) (NOWTALK_HEADER_SIZE + len) * 8000 / link_kbps;
+    frame.arrival_us = air_free_us;
+    air.push_back(frame);
+    result.frames++;
+    return true;
+  };
+
+  BulkSender sender;
+  BulkReceiver receiver;
+  sender.set_send([&](uint8_t code, const uint8_t *data, size_t len) { return transmit(true, code, data, len); });
+  receiver.set_send([&](uint8_t code, const uint8_t *data, size_t len) { return transmit(false, code, data, len); });
+  receiver.set_write([](uint32_t offset, const uint8_t *data, size_t len) { return true; });
+  bulk_read_t read = [](uint32_t offset, uint8_t *buffer, size_t len) {
+    memset(buffer, offset & 0xff, len);
+    return len;
+  };
+  if (!sender.begin(1, BulkKind::BLOB, size, std::move(read), 0, chunk_size)) {
+    return result;
+  }
+
+  for (uint32_t now = 0; now < BULK_LOOPBACK_LIMIT_MS; now++) {
+    now_us = (uint64_t) now * 1000;
+    while (!air.empty() && air.front().arrival_us <= now_us) {
+      air_frame_t frame = air.front();
+      air.pop_front();
+      // xorshift32, the same losses for the same seed on every platform
+      random ^= random << 13;
+      random ^= random >> 17;
+      random ^= random << 5;
+      if (random % 100 < loss_percent) {
+        result.lost++;
+        continue;
+      }
+      if (!frame.to_receiver) {
+        if (frame.code == NOWTALK_CLIENT_ACK && frame.len > 1) {
+          sender.on_ack(frame.data[0], frame.data + 1, frame.len - 1, now);
+        }
+      } else if (frame.code == NOWTALK_STREAM_START) {
+        receiver.on_start(frame.data, frame.len, now);
+      } else if (frame.code == NOWTALK_STREAM_DATA) {
+        receiver.on_data(frame.data, frame.len, now);
+      } else if (frame.code == NOWTALK_STREAM_END) {
+        receiver.on_end(frame.data, frame.len, now);
+      }
+    }
+    sender.loop(now);
+    receiver.loop(now);
+    if (sender.get_state() == BulkState::DONE || sender.get_state() == BulkState::FAILED) {
+      break;
+    }
+  }
+
+  const bulk_stats_t &stats = sender.get_stats();
+  result.done = sender.get_state() == BulkState::DONE;
+  result.bytes = stats.bytes;
+  result.elapsed_ms = result.done ? stats.finished - stats.started : (uint32_t) (now_us / 1000);
+  result.retransmits = stats.retransmits;
+  return result;
+}
+
+}  // namespace nowtalk
+}  // namespace esphome
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "bulk_transfer.h"
+
+#include <cstdint>
+
+namespace esphome {
+namespace nowtalk {
+
+/// Airtime of one ESP-NOW frame besides its body: preamble, MAC and vendor headers and the MAC level ack, in us.
+static const uint32_t BULK_LOOPBACK_FRAME_OVERHEAD_US = 500;
+/// Frames the simulated radio queues before a send is refused, like a full TX scheduler queue.
+static const uint8_t BULK_LOOPBACK_QUEUE = 8;
+
+struct bulk_loopback_result_t {
+  bool done{false};
+  uint32_t bytes{0};
+  uint32_t elapsed_ms{0};  // simulated time from START until the END was acked
+  uint32_t frames{0};      // both directions, lost ones included
+  uint32_t lost{0};
+  uint32_t retransmits{0};
+
+  uint32_t bytes_per_second() const {
+    return this->elapsed_ms == 0 ? 0 : (uint32_t) ((uint64_t) this->bytes * 1000 / this->elapsed_ms);
+  }
+};
+
+/// Push `size` bytes from a BulkSender to a BulkReceiver over a simulated half duplex link.
+///
+/// Frames in both directions share the air at `link_kbps`, and each is lost with `loss_percent` chance. Time is
+/// simulated, so the result is the goodput the window and retransmit logic reach on such a link, not the CPU cost;
+/// it runs the same on the host as on a badge. `seed` makes the losses repeatable.
+bulk_loopback_result_t bulk_loopback(uint32_t size, uint8_t loss_percent, uint32_t link_kbps = 1000,
+                                     uint8_t chunk_size = BULK_MAX_CHUNK_SIZE, uint32_t seed = 1);
+
+}  // namespace nowtalk
+}  // namespace esphome
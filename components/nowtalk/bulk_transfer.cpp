@@ -0,0 +1,307 @@
+#include "bulk_transfer.h"
+#include "protocol.h"
+
+#include <algorithm>
+
+namespace esphome {
+namespace nowtalk {
+
+static const uint8_t BULK_ACK_SIZE = 8;     // [code][stream][base:2][bitmap:4]
+static const uint32_t BULK_ACK_DELAY = 20;  // ms of silence before a partial ack is flushed
+
+static void put_u16(uint8_t *buffer, uint16_t value) {
+  buffer[0] = value & 0xff;
+  buffer[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *buffer, uint32_t value) {
+  for (uint8_t i = 0; i < 4; i++) {
+    buffer[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+static uint16_t get_u16(const uint8_t *buffer) { return buffer[0] | (buffer[1] << 8); }
+
+static uint32_t get_u32(const uint8_t *buffer) {
+  return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t) buffer[3] << 24);
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// BulkSender
+
+bool BulkSender::begin(uint8_t stream_id, BulkKind kind, uint32_t size, bulk_read_t &&read, uint32_t now,
+                       uint8_t chunk_size) {
+  if (this->state_ == BulkState::STARTING || this->state_ == BulkState::SENDING || this->state_ == BulkState::ENDING) {
+    return false;
+  }
+  if (chunk_size == 0 || chunk_size > BULK_MAX_CHUNK_SIZE || size == 0 ||
+      (size + chunk_size - 1) / chunk_size > UINT16_MAX) {
+    return false;
+  }
+  this->read_ = std::move(read);
+  this->stream_id_ = stream_id;
+  this->kind_ = kind;
+  this->size_ = size;
+  this->chunk_size_ = chunk_size;
+  this->chunks_ = (size + chunk_size - 1) / chunk_size;
+  this->base_ = 0;
+  this->next_ = 0;
+  this->acked_ = 0;
+  this->fast_resent_ = 0;
+  this->retries_ = 0;
+  this->stats_ = {};
+  this->stats_.started = now;
+  this->state_ = BulkState::STARTING;
+  this->send_control_(NOWTALK_STREAM_START, now);
+  return true;
+}
+
+void BulkSender::abort() {
+  if (this->state_ != BulkState::DONE) {
+    this->state_ = BulkState::IDLE;
+  }
+}
+
+void BulkSender::fail_() {
+  this->state_ = BulkState::FAILED;
+  this->read_ = nullptr;
+}
+
+bool BulkSender::send_control_(uint8_t code, uint32_t now) {
+  uint8_t buffer[7];
+  size_t len = 0;
+  buffer[len++] = this->stream_id_;
+  if (code == NOWTALK_STREAM_START) {
+    buffer[len++] = (uint8_t) this->kind_;
+    put_u32(buffer + len, this->size_);
+    len += 4;
+    buffer[len++] = this->chunk_size_;
+  } else {
+    put_u32(buffer + len, this->size_);
+    len += 4;
+  }
+  this->control_sent_ = now;
+  this->stats_.frames++;
+  return this->send_(code, buffer, len);
+}
+
+bool BulkSender::send_chunk_(uint16_t seq, uint32_t now) {
+  uint8_t buffer[BULK_DATA_HEADER_SIZE + BULK_MAX_CHUNK_SIZE];
+  uint32_t offset = (uint32_t) seq * this->chunk_size_;
+  size_t len = std::min<uint32_t>(this->chunk_size_, this->size_ - offset);
+  buffer[0] = this->stream_id_;
+  put_u16(buffer + 1, seq);
+  if (this->read_(offset, buffer + BULK_DATA_HEADER_SIZE, len) != len) {
+    this->fail_();
+    return false;
+  }
+  if (!this->send_(NOWTALK_STREAM_DATA, buffer, len + BULK_DATA_HEADER_SIZE)) {
+    return false;
+  }
+  this->sent_at_[seq % BULK_MAX_WINDOW] = now;
+  this->stats_.frames++;
+  return true;
+}
+
+void BulkSender::loop(uint32_t now) {
+  switch (this->state_) {
+    case BulkState::STARTING:
+    case BulkState::ENDING:
+      if (now - this->control_sent_ > this->rto_ * 4) {
+        if (++this->retries_ > this->max_retries_) {
+          this->fail_();
+          return;
+        }
+        this->send_control_(this->state_ == BulkState::STARTING ? NOWTALK_STREAM_START : NOWTALK_STREAM_END, now);
+      }
+      return;
+    case BulkState::SENDING:
+      break;
+    default:
+      return;
+  }
+
+  // Selective retransmit of expired chunks inside the window, oldest first.
+  for (uint16_t seq = this->base_; seq < this->next_; seq++) {
+    if ((this->acked_ >> (seq - this->base_)) & 1) {
+      continue;
+    }
+    if (now - this->sent_at_[seq % BULK_MAX_WINDOW] < this->rto_) {
+      continue;
+    }
+    if (seq == this->base_ && this->retries_ >= this->max_retries_) {
+      this->fail_();
+      return;
+    }
+    // Only a retransmit that went out counts, a full radio queue is not a lost chunk.
+    if (!this->send_chunk_(seq, now)) {
+      return;
+    }
+    if (seq == this->base_) {
+      this->retries_++;
+    }
+    this->stats_.retransmits++;
+  }
+
+  // New chunks as long as the window allows.
+  while (this->next_ < this->chunks_ && this->next_ - this->base_ < this->window_) {
+    if (!this->send_chunk_(this->next_, now)) {
+      return;
+    }
+    this->next_++;
+  }
+
+  if (this->base_ >= this->chunks_) {
+    this->state_ = BulkState::ENDING;
+    this->retries_ = 0;
+    this->send_control_(NOWTALK_STREAM_END, now);
+  }
+}
+
+void BulkSender::on_ack(uint8_t code, const uint8_t *data, size_t len, uint32_t now) {
+  if (len < BULK_ACK_SIZE - 1 || data[0] != this->stream_id_) {
+    return;
+  }
+  uint16_t base = get_u16(data + 1);
+  uint32_t bitmap = get_u32(data + 3);
+
+  if (code == NOWTALK_STREAM_START && this->state_ == BulkState::STARTING) {
+    // Receiver already holds everything below `base` from an interrupted attempt.
+    this->base_ = this->next_ = std::min(base, this->chunks_);
+    this->acked_ = 0;
+    this->fast_resent_ = 0;
+    this->retries_ = 0;
+    this->state_ = BulkState::SENDING;
+    this->loop(now);
+  } else if (code == NOWTALK_STREAM_DATA && this->state_ == BulkState::SENDING) {
+    if (base < this->base_ || base > this->next_) {
+      return;
+    }
+    if (base > this->base_) {
+      uint16_t shift = base - this->base_;
+      this->acked_ = shift >= 32 ? 0 : this->acked_ >> shift;
+      this->fast_resent_ = shift >= 32 ? 0 : this->fast_resent_ >> shift;
+      this->stats_.bytes += std::min<uint32_t>((uint32_t) shift * this->chunk_size_,
+                                               this->size_ - (uint32_t) this->base_ * this->chunk_size_);
+      this->base_ = base;
+      this->retries_ = 0;
+    }
+    this->acked_ |= bitmap;
+    // Fast retransmit: chunks below the highest acked one are lost, resend each of them once without waiting
+    // for the timeout. A lost fast retransmit falls back to the normal timeout.
+    for (uint16_t bit = 0; bit < BULK_MAX_WINDOW && (bitmap >> bit) > 1; bit++) {
+      uint32_t mask = 1UL << bit;
+      if (!(bitmap & mask) && !(this->fast_resent_ & mask)) {
+        this->sent_at_[(this->base_ + bit) % BULK_MAX_WINDOW] = now - this->rto_;
+        this->fast_resent_ |= mask;
+      }
+    }
+  } else if (code == NOWTALK_STREAM_END && this->state_ == BulkState::ENDING) {
+    this->state_ = base == this->chunks_ ? BulkState::DONE : BulkState::FAILED;
+    this->stats_.bytes = this->size_;
+    this->stats_.finished = now;
+    this->read_ = nullptr;
+  }
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// BulkReceiver
+
+void BulkReceiver::send_ack_(uint8_t code, uint32_t now) {
+  uint8_t buffer[BULK_ACK_SIZE];
+  buffer[0] = code;
+  buffer[1] = this->stream_id_;
+  put_u16(buffer + 2, this->base_);
+  put_u32(buffer + 4, code == NOWTALK_STREAM_DATA ? this->received_ : 0);
+  this->unacked_ = 0;
+  this->stats_.frames++;
+  this->send_(NOWTALK_CLIENT_ACK, buffer, sizeof(buffer));
+}
+
+void BulkReceiver::on_start(const uint8_t *data, size_t len, uint32_t now) {
+  if (len < 7) {
+    return;
+  }
+  uint8_t stream_id = data[0];
+  BulkKind kind = (BulkKind) data[1];
+  uint32_t size = get_u32(data + 2);
+  uint8_t chunk_size = data[6];
+  if (chunk_size == 0 || chunk_size > BULK_MAX_CHUNK_SIZE) {
+    return;
+  }
+  bool resume = stream_id == this->stream_id_ && size == this->size_ && chunk_size == this->chunk_size_ &&
+                kind == this->kind_ && this->base_ < this->chunks_;
+  if (!resume) {
+    this->stream_id_ = stream_id;
+    this->kind_ = kind;
+    this->size_ = size;
+    this->chunk_size_ = chunk_size;
+    this->chunks_ = (size + chunk_size - 1) / chunk_size;
+    this->base_ = 0;
+    this->stats_ = {};
+    this->stats_.started = now;
+  }
+  // Out of order chunks beyond the resume point are not kept across a restart.
+  this->received_ = 0;
+  this->active_ = true;
+  this->last_data_ = now;
+  this->send_ack_(NOWTALK_STREAM_START, now);
+}
+
+void BulkReceiver::on_data(const uint8_t *data, size_t len, uint32_t now) {
+  if (!this->active_ || len < 4 || data[0] != this->stream_id_) {
+    return;
+  }
+  uint16_t seq = get_u16(data + 1);
+  this->last_data_ = now;
+  if (seq < this->base_) {
+    // Our ack got lost, repeat it.
+    this->send_ack_(NOWTALK_STREAM_DATA, now);
+    return;
+  }
+  uint16_t bit = seq - this->base_;
+  if (seq >= this->chunks_ || bit >= BULK_MAX_WINDOW) {
+    return;
+  }
+  if (!((this->received_ >> bit) & 1)) {
+    uint32_t offset = (uint32_t) seq * this->chunk_size_;
+    size_t expected = std::min<uint32_t>(this->chunk_size_, this->size_ - offset);
+    if (len - 3 != expected || !this->write_(offset, data + 3, expected)) {
+      return;
+    }
+    this->received_ |= 1UL << bit;
+    this->stats_.bytes += expected;
+  }
+
+  bool gap = bit > 0;
+  while (this->received_ & 1) {
+    this->received_ >>= 1;
+    this->base_++;
+  }
+  if (gap || ++this->unacked_ >= this->ack_every_ || this->base_ == this->chunks_) {
+    this->send_ack_(NOWTALK_STREAM_DATA, now);
+  }
+}
+
+void BulkReceiver::on_end(const uint8_t *data, size_t len, uint32_t now) {
+  if (len < 5 || data[0] != this->stream_id_) {
+    return;
+  }
+  this->send_ack_(NOWTALK_STREAM_END, now);
+  if (this->active_ && this->base_ == this->chunks_) {
+    this->active_ = false;
+    this->stats_.finished = now;
+    if (this->on_complete_) {
+      this->on_complete_(this->stream_id_, this->kind_, this->size_);
+    }
+  }
+}
+
+void BulkReceiver::loop(uint32_t now) {
+  if (this->active_ && this->unacked_ > 0 && now - this->last_data_ > BULK_ACK_DELAY) {
+    this->send_ack_(NOWTALK_STREAM_DATA, now);
+  }
+}
+
+}  // namespace nowtalk
+}  // namespace esphome
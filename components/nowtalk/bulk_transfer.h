@@ -0,0 +1,155 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome {
+namespace nowtalk {
+
+/// DATA body ahead of the chunk: stream id (1) and sequence number (2).
+static const uint8_t BULK_DATA_HEADER_SIZE = 3;
+/// Largest chunk that still fits an ESP-NOW frame, 245 bytes.
+static const uint8_t BULK_MAX_CHUNK_SIZE = NOWTALK_MAX_BODY - BULK_DATA_HEADER_SIZE;
+/// Maximum number of unacknowledged chunks in flight; matches the width of the selective ack bitmap.
+static const uint8_t BULK_MAX_WINDOW = 32;
+/// A receiver that heard nothing of its stream for this long treats it as abandoned, well past a sender's retries.
+static const uint32_t BULK_RX_TIMEOUT = 5000;
+
+enum class BulkState : uint8_t { IDLE, STARTING, SENDING, ENDING, DONE, FAILED };
+
+/// Kind of payload carried by a stream, so the receiver knows where to put it.
+enum class BulkKind : uint8_t { BLOB = 0, PROMPT = 1, TONE = 2, CONFIG = 3, FIRMWARE = 4 };
+
+struct bulk_stats_t {
+  uint32_t bytes{0};
+  uint32_t frames{0};
+  uint32_t retransmits{0};
+  uint32_t started{0};
+  uint32_t finished{0};
+
+  /// Goodput in bytes per second over the whole transfer.
+  uint32_t bytes_per_second() const {
+    uint32_t elapsed = this->finished - this->started;
+    return elapsed == 0 ? 0 : (uint32_t) ((uint64_t) this->bytes * 1000 / elapsed);
+  }
+};
+
+/// Sends one frame: opcode plus body. Returns false when the radio queue is full, the frame is then retried later.
+using bulk_send_t = std::function<bool(uint8_t code, const uint8_t *data, size_t len)>;
+/// Produces `len` bytes of the stream at `offset`, returns the number of bytes copied.
+using bulk_read_t = std::function<size_t(uint32_t offset, uint8_t *buffer, size_t len)>;
+/// Consumes `len` bytes of the stream at `offset`. Chunks may arrive out of order.
+using bulk_write_t = std::function<bool(uint32_t offset, const uint8_t *data, size_t len)>;
+
+/// Sender side of the NOWTALK_STREAM_START/DATA/END protocol.
+///
+///  START  [stream][kind][size:4][chunk]       -> ACK [START][stream][resume chunk:2][0:4]
+///  DATA   [stream][seq:2][payload]            -> ACK [DATA][stream][base:2][bitmap:4]
+///  END    [stream][size:4]                    -> ACK [END][stream][chunks:2][0:4]
+///
+/// `base` is the first chunk the receiver is still missing, bit n of `bitmap` marks chunk base + n as received.
+/// Only chunks that are neither acked nor recently sent are retransmitted.
+class BulkSender {
+ public:
+  void set_send(bulk_send_t &&send) { this->send_ = std::move(send); }
+  void set_window(uint8_t window) { this->window_ = window > BULK_MAX_WINDOW ? BULK_MAX_WINDOW : window; }
+  void set_retransmit_timeout(uint32_t timeout) { this->rto_ = timeout; }
+  void set_max_retries(uint8_t retries) { this->max_retries_ = retries; }
+
+  bool begin(uint8_t stream_id, BulkKind kind, uint32_t size, bulk_read_t &&read, uint32_t now,
+             uint8_t chunk_size = BULK_MAX_CHUNK_SIZE);
+  void abort();
+  /// Push out new and expired chunks. Call from loop().
+  void loop(uint32_t now);
+  /// Feed the body of an ACK frame (without the acknowledged opcode).
+  void on_ack(uint8_t code, const uint8_t *data, size_t len, uint32_t now);
+
+  BulkState get_state() const { return this->state_; }
+  uint8_t get_stream_id() const { return this->stream_id_; }
+  BulkKind get_kind() const { return this->kind_; }
+  uint32_t get_size() const { return this->size_; }
+  const bulk_stats_t &get_stats() const { return this->stats_; }
+
+ protected:
+  bool send_chunk_(uint16_t seq, uint32_t now);
+  bool send_control_(uint8_t code, uint32_t now);
+  void fail_();
+
+  bulk_send_t send_{};
+  bulk_read_t read_{};
+
+  BulkState state_{BulkState::IDLE};
+  BulkKind kind_{BulkKind::BLOB};
+  uint8_t stream_id_{0};
+  uint8_t chunk_size_{BULK_MAX_CHUNK_SIZE};
+  uint32_t size_{0};
+  uint16_t chunks_{0};
+
+  uint16_t base_{0};         // first unacknowledged chunk
+  uint16_t next_{0};         // first chunk never sent
+  uint32_t acked_{0};        // bit n: chunk base_ + n acknowledged
+  uint32_t fast_resent_{0};  // bit n: chunk base_ + n already fast retransmitted
+  std::array<uint32_t, BULK_MAX_WINDOW> sent_at_{};
+
+  uint8_t window_{16};
+  uint32_t rto_{60};
+  uint8_t max_retries_{20};
+  uint8_t retries_{0};
+  uint32_t control_sent_{0};
+
+  bulk_stats_t stats_{};
+};
+
+/// Receiver side of the stream protocol. Keeps the resume point of an interrupted stream, so a START for the
+/// same stream id and size continues where the last one stopped.
+class BulkReceiver {
+ public:
+  void set_send(bulk_send_t &&send) { this->send_ = std::move(send); }
+  void set_write(bulk_write_t &&write) { this->write_ = std::move(write); }
+  void set_on_complete(std::function<void(uint8_t, BulkKind, uint32_t)> &&callback) {
+    this->on_complete_ = std::move(callback);
+  }
+  /// Number of in-order chunks received before an ack is sent without a gap forcing it.
+  void set_ack_every(uint8_t count) { this->ack_every_ = count; }
+
+  void on_start(const uint8_t *data, size_t len, uint32_t now);
+  void on_data(const uint8_t *data, size_t len, uint32_t now);
+  void on_end(const uint8_t *data, size_t len, uint32_t now);
+  /// Flush a pending ack when the sender went quiet. Call from loop().
+  void loop(uint32_t now);
+
+  bool is_active() const { return this->active_; }
+  /// Active and heard from within BULK_RX_TIMEOUT.
+  bool is_receiving(uint32_t now) const { return this->active_ && now - this->last_data_ < BULK_RX_TIMEOUT; }
+  uint32_t get_resume_offset() const { return (uint32_t) this->base_ * this->chunk_size_; }
+  const bulk_stats_t &get_stats() const { return this->stats_; }
+
+ protected:
+  void send_ack_(uint8_t code, uint32_t now);
+
+  bulk_send_t send_{};
+  bulk_write_t write_{};
+  std::function<void(uint8_t, BulkKind, uint32_t)> on_complete_{};
+
+  bool active_{false};
+  BulkKind kind_{BulkKind::BLOB};
+  uint8_t stream_id_{0};
+  uint8_t chunk_size_{BULK_MAX_CHUNK_SIZE};
+  uint32_t size_{0};
+  uint16_t chunks_{0};
+
+  uint16_t base_{0};      // first missing chunk, everything below is written
+  uint32_t received_{0};  // bit n: chunk base_ + n written
+  uint8_t unacked_{0};
+  uint8_t ack_every_{8};
+  uint32_t last_data_{0};
+
+  bulk_stats_t stats_{};
+};
+
+}  // namespace nowtalk
+}  // namespace esphome
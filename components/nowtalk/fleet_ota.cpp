@@ -0,0 +1,337 @@
+#include "fleet_ota.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace esphome {
+namespace nowtalk {
+
+static const uint8_t FLEET_OTA_CONTROL_REPEATS = 3;  // control broadcasts are repeated, nothing acks them
+static const uint32_t FLEET_OTA_CONTROL_INTERVAL = 50;
+static const uint32_t FLEET_OTA_NACK_JITTER = 400;  // spread NACKs so badges do not answer in the same slot
+static const uint32_t FLEET_OTA_IDLE_TIMEOUT = 5000;
+
+static void put_u16(uint8_t *buffer, uint16_t value) {
+  buffer[0] = value & 0xff;
+  buffer[1] = value >> 8;
+}
+
+static uint16_t get_u16(const uint8_t *buffer) { return buffer[0] | (buffer[1] << 8); }
+
+static uint32_t get_u32(const uint8_t *buffer) {
+  return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t) buffer[3] << 24);
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// BlockBitmap
+
+void BlockBitmap::resize(uint16_t blocks) {
+  this->size_ = blocks;
+  this->bits_.assign((blocks + 7) / 8, 0);
+}
+
+void BlockBitmap::clear() { std::fill(this->bits_.begin(), this->bits_.end(), 0); }
+
+void BlockBitmap::fill() {
+  std::fill(this->bits_.begin(), this->bits_.end(), 0xff);
+  if (this->size_ & 7) {
+    this->bits_.back() = (1 << (this->size_ & 7)) - 1;
+  }
+}
+
+uint16_t BlockBitmap::next_set(uint16_t from) const {
+  uint32_t block = from;
+  while (block < this->size_) {
+    uint8_t byte = this->bits_[block >> 3] >> (block & 7);
+    if (byte == 0) {
+      block = (block | 7) + 1;
+      continue;
+    }
+    return block + __builtin_ctz(byte);
+  }
+  return this->size_;
+}
+
+uint16_t BlockBitmap::count() const {
+  uint16_t total = 0;
+  for (uint8_t byte : this->bits_) {
+    total += __builtin_popcount(byte);
+  }
+  return total;
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// FleetOtaSender
+
+bool FleetOtaSender::begin(uint16_t session, uint32_t size, bulk_read_t &&read, uint32_t now) {
+  uint32_t blocks = (size + this->block_size_ - 1) / this->block_size_;
+  if (size == 0 || blocks > UINT16_MAX) {
+    return false;
+  }
+  this->read_ = std::move(read);
+  this->session_ = session;
+  this->size_ = size;
+  this->round_ = 0;
+  this->pending_.resize(blocks);
+  this->repair_.resize(blocks);
+  this->stats_ = {};
+  this->stats_.blocks = blocks;
+  this->stats_.started = now;
+  this->quiet_ = false;
+  this->state_ = FleetOtaState::PREPARING;
+  this->deadline_ = now + this->prepare_time_;
+  this->repeats_ = 0;
+  this->send_control_(NOWTALK_OTA_ANNOUNCE, now);
+  return true;
+}
+
+bool FleetOtaSender::send_control_(uint8_t code, uint32_t now) {
+  uint8_t buffer[8];
+  size_t len = 3;
+  put_u16(buffer, this->session_);
+  buffer[2] = this->round_;
+  if (code == NOWTALK_OTA_ANNOUNCE) {
+    for (uint8_t i = 0; i < 4; i++) {
+      buffer[len++] = (this->size_ >> (8 * i)) & 0xff;
+    }
+    buffer[len++] = this->block_size_;
+  }
+  this->last_sent_ = now;
+  this->stats_.frames++;
+  return this->send_(code, buffer, len);
+}
+
+void FleetOtaSender::start_round_(uint32_t now) {
+  if (this->round_ == 0) {
+    this->pending_.fill();
+  } else {
+    // The repair set becomes the send set, a fresh repair set collects the next NACKs.
+    std::swap(this->pending_, this->repair_);
+    this->repair_.clear();
+    this->stats_.repairs += this->pending_.count();
+  }
+  this->stats_.rounds = this->round_ + 1;
+  this->cursor_ = 0;
+  this->state_ = FleetOtaState::SENDING;
+  this->send_control_(NOWTALK_OTA_ANNOUNCE, now);
+}
+
+void FleetOtaSender::loop(uint32_t now) {
+  switch (this->state_) {
+    case FleetOtaState::PREPARING:
+      if ((int32_t) (now - this->deadline_) >= 0) {
+        this->start_round_(now);
+      } else if (now - this->last_sent_ >= this->prepare_time_ / 4) {
+        this->send_control_(NOWTALK_OTA_ANNOUNCE, now);
+      }
+      return;
+
+    case FleetOtaState::SENDING: {
+      if (now - this->last_sent_ < this->block_interval_) {
+        return;
+      }
+      uint16_t block = this->pending_.next_set(this->cursor_);
+      if (block >= this->pending_.size()) {
+        this->state_ = FleetOtaState::COLLECTING;
+        this->deadline_ = now + this->nack_window_;
+        this->repeats_ = 1;
+        this->send_control_(NOWTALK_OTA_ROUND_END, now);
+        return;
+      }
+      uint8_t buffer[FLEET_OTA_BLOCK_HEADER_SIZE + FLEET_OTA_BLOCK_SIZE];
+      uint32_t offset = (uint32_t) block * this->block_size_;
+      size_t len = std::min<uint32_t>(this->block_size_, this->size_ - offset);
+      put_u16(buffer, this->session_);
+      put_u16(buffer + 2, block);
+      if (this->read_(offset, buffer + FLEET_OTA_BLOCK_HEADER_SIZE, len) != len) {
+        this->state_ = FleetOtaState::FAILED;
+        return;
+      }
+      if (this->send_(NOWTALK_OTA_BLOCK, buffer, len + FLEET_OTA_BLOCK_HEADER_SIZE)) {
+        this->pending_.reset(block);
+        this->cursor_ = block + 1;
+        this->last_sent_ = now;
+        this->stats_.frames++;
+      }
+      return;
+    }
+
+    case FleetOtaState::COLLECTING:
+      if (this->repeats_ < FLEET_OTA_CONTROL_REPEATS && now - this->last_sent_ >= FLEET_OTA_CONTROL_INTERVAL) {
+        this->repeats_++;
+        this->send_control_(NOWTALK_OTA_ROUND_END, now);
+      }
+      if ((int32_t) (now - this->deadline_) < 0) {
+        return;
+      }
+      if (this->repair_.count() > 0 && this->round_ + 1 < this->max_rounds_) {
+        this->round_++;
+        this->quiet_ = false;
+        this->start_round_(now);
+        return;
+      }
+      if (this->repair_.count() == 0 && !this->quiet_) {
+        // NACKs are unicast without retry, poll once more before calling it done.
+        this->quiet_ = true;
+        this->deadline_ = now + this->nack_window_;
+        this->repeats_ = 1;
+        this->send_control_(NOWTALK_OTA_ROUND_END, now);
+        return;
+      }
+      this->state_ = this->repair_.count() == 0 ? FleetOtaState::DONE : FleetOtaState::FAILED;
+      this->stats_.finished = now;
+      this->read_ = nullptr;
+      for (uint8_t i = 0; i < FLEET_OTA_CONTROL_REPEATS; i++) {
+        this->send_control_(NOWTALK_OTA_DONE, now);
+      }
+      return;
+
+    default:
+      return;
+  }
+}
+
+void FleetOtaSender::on_nack(const uint8_t *data, size_t len) {
+  if (len < 3 || get_u16(data) != this->session_) {
+    return;
+  }
+  if (this->state_ != FleetOtaState::COLLECTING && this->state_ != FleetOtaState::SENDING) {
+    return;
+  }
+  this->stats_.nacks++;
+  for (size_t pos = 3; pos + 4 <= len; pos += 4) {
+    uint32_t start = get_u16(data + pos);
+    uint32_t end = std::min<uint32_t>(start + get_u16(data + pos + 2), this->repair_.size());
+    for (uint32_t block = start; block < end; block++) {
+      this->repair_.set(block);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// FleetOtaReceiver
+
+void FleetOtaReceiver::on_announce(const uint8_t *data, size_t len, uint32_t now) {
+  if (len < 8) {
+    return;
+  }
+  uint16_t session = get_u16(data);
+  this->round_ = data[2];
+  this->last_frame_ = now;
+  if (this->active_ && session == this->session_) {
+    return;
+  }
+  if (this->complete_sent_ && session == this->session_) {
+    return;  // already installed, waiting for the reboot
+  }
+  uint32_t size = get_u32(data + 3);
+  // Any multiple of 16 up to the full block, so writes stay aligned for flash encryption.
+  if (data[7] == 0 || data[7] > FLEET_OTA_BLOCK_SIZE || data[7] % 16 != 0 || size == 0) {
+    return;
+  }
+  if (!this->begin_ || !this->begin_(size)) {
+    return;
+  }
+  this->session_ = session;
+  this->size_ = size;
+  this->block_size_ = data[7];
+  this->missing_.resize((size + this->block_size_ - 1) / this->block_size_);
+  this->missing_.fill();
+  this->active_ = true;
+  this->complete_sent_ = false;
+  this->nack_pending_ = false;
+}
+
+void FleetOtaReceiver::on_block(const uint8_t *data, size_t len, uint32_t now) {
+  if (!this->active_ || len < 5 || get_u16(data) != this->session_) {
+    return;
+  }
+  uint16_t block = get_u16(data + 2);
+  this->last_frame_ = now;
+  if (block >= this->missing_.size() || !this->missing_.test(block)) {
+    return;
+  }
+  uint32_t offset = (uint32_t) block * this->block_size_;
+  size_t expected = std::min<uint32_t>(this->block_size_, this->size_ - offset);
+  if (len - 4 != expected || !this->write_(offset, data + 4, expected)) {
+    return;
+  }
+  this->missing_.reset(block);
+  if (this->missing_.next_set(0) == this->missing_.size()) {
+    this->complete_();
+  }
+}
+
+void FleetOtaReceiver::on_round_end(const uint8_t *data, size_t len, uint32_t now) {
+  if (!this->active_ || len < 3 || get_u16(data) != this->session_) {
+    return;
+  }
+  this->last_frame_ = now;
+  if (this->nack_pending_ && this->round_ == data[2]) {
+    return;  // repeated ROUND_END of a round we already answer
+  }
+  this->round_ = data[2];
+  this->nack_pending_ = true;
+  this->nack_at_ = now + std::rand() % FLEET_OTA_NACK_JITTER;
+}
+
+void FleetOtaReceiver::on_done(const uint8_t *data, size_t len, uint32_t now) {
+  if (!this->active_ || len < 3 || get_u16(data) != this->session_) {
+    return;
+  }
+  // The switchboard gave up on us. Every update starts a new session, so nothing of this one will come again.
+  this->active_ = false;
+  this->nack_pending_ = false;
+  if (this->abort_) {
+    this->abort_();
+  }
+}
+
+void FleetOtaReceiver::loop(uint32_t now) {
+  if (!this->active_) {
+    return;
+  }
+  if (this->nack_pending_ && (int32_t) (now - this->nack_at_) >= 0) {
+    this->nack_pending_ = false;
+    this->send_nack_();
+  } else if (!this->nack_pending_ && now - this->last_frame_ > FLEET_OTA_IDLE_TIMEOUT) {
+    // Missed the ROUND_END, ask for repairs anyway.
+    this->last_frame_ = now;
+    this->send_nack_();
+  }
+}
+
+void FleetOtaReceiver::send_nack_() {
+  uint8_t buffer[FLEET_OTA_NACK_HEADER_SIZE + FLEET_OTA_RUN_SIZE * FLEET_OTA_MAX_RUNS];
+  size_t len = FLEET_OTA_NACK_HEADER_SIZE;
+  size_t end_of_runs = FLEET_OTA_NACK_HEADER_SIZE + FLEET_OTA_RUN_SIZE * this->max_runs_;
+  put_u16(buffer, this->session_);
+  buffer[2] = this->round_;
+  uint16_t block = this->missing_.next_set(0);
+  while (block < this->missing_.size() && len + FLEET_OTA_RUN_SIZE <= end_of_runs) {
+    uint16_t end = block;
+    while (end < this->missing_.size() && this->missing_.test(end)) {
+      end++;
+    }
+    put_u16(buffer + len, block);
+    put_u16(buffer + len + 2, end - block);
+    len += FLEET_OTA_RUN_SIZE;
+    block = this->missing_.next_set(end);
+  }
+  if (len > FLEET_OTA_NACK_HEADER_SIZE) {
+    this->send_(NOWTALK_OTA_NACK, buffer, len);
+  }
+}
+
+void FleetOtaReceiver::complete_() {
+  this->active_ = false;
+  this->nack_pending_ = false;
+  this->complete_sent_ = true;
+  if (this->finish_) {
+    this->finish_(this->size_);
+  }
+}
+
+}  // namespace nowtalk
+}  // namespace esphome
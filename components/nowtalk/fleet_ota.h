@@ -0,0 +1,167 @@
+#pragma once
+
+#include "bulk_transfer.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace esphome {
+namespace nowtalk {
+
+/// BLOCK body ahead of the data: session (2) and block number (2).
+static const uint8_t FLEET_OTA_BLOCK_HEADER_SIZE = 4;
+/// NACK body ahead of the runs: session (2) and round (1).
+static const uint8_t FLEET_OTA_NACK_HEADER_SIZE = 3;
+/// One [start:2][count:2] run of missing blocks in a NACK.
+static const uint8_t FLEET_OTA_RUN_SIZE = 4;
+/// Largest block that fits a frame, rounded down to 16 bytes so every block stays aligned for encrypted flash
+/// writes: 240 bytes.
+static const uint8_t FLEET_OTA_BLOCK_SIZE = (NOWTALK_MAX_BODY - FLEET_OTA_BLOCK_HEADER_SIZE) & ~15;
+/// Runs that fit a single NACK frame.
+static const uint8_t FLEET_OTA_MAX_RUNS = (NOWTALK_MAX_BODY - FLEET_OTA_NACK_HEADER_SIZE) / FLEET_OTA_RUN_SIZE;
+
+enum class FleetOtaState : uint8_t { IDLE, PREPARING, SENDING, COLLECTING, DONE, FAILED };
+
+struct fleet_ota_stats_t {
+  uint16_t blocks{0};
+  uint8_t rounds{0};
+  uint32_t frames{0};
+  uint32_t repairs{0};  // blocks resent in repair rounds
+  uint32_t nacks{0};
+  uint32_t started{0};
+  uint32_t finished{0};
+};
+
+/// Fixed size bit set over all blocks of an image.
+class BlockBitmap {
+ public:
+  void resize(uint16_t blocks);
+  void clear();
+  void fill();
+  void set(uint16_t block) { this->bits_[block >> 3] |= 1 << (block & 7); }
+  void reset(uint16_t block) { this->bits_[block >> 3] &= ~(1 << (block & 7)); }
+  bool test(uint16_t block) const { return (this->bits_[block >> 3] >> (block & 7)) & 1; }
+  /// First set bit at or after `from`, or `size()` when there is none.
+  uint16_t next_set(uint16_t from) const;
+  uint16_t count() const;
+  uint16_t size() const { return this->size_; }
+
+ protected:
+  std::vector<uint8_t> bits_{};
+  uint16_t size_{0};
+};
+
+/// Switchboard side of the broadcast firmware update.
+///
+///  ANNOUNCE   [session:2][round][size:4][block size]     broadcast, repeated while badges erase the partition
+///  BLOCK      [session:2][block:2][data]                 broadcast, each block once per round
+///  ROUND_END  [session:2][round]                         broadcast, badges answer with NACKs
+///  NACK       [session:2][round][start:2][count:2]...    unicast from each badge that still misses blocks
+///  DONE       [session:2][round]                         broadcast, no NACKs were received
+///
+/// A round resends only the union of all NACKed blocks, so the airtime does not grow with the number of badges.
+class FleetOtaSender {
+ public:
+  void set_send(bulk_send_t &&send) { this->send_ = std::move(send); }
+  /// Time the badges get to erase the inactive partition before the first block goes out.
+  void set_prepare_time(uint32_t time) { this->prepare_time_ = time; }
+  /// Minimum time between two broadcast blocks. Broadcasts are not acked by the MAC, so this is the pacing.
+  void set_block_interval(uint32_t interval) { this->block_interval_ = interval; }
+  void set_nack_window(uint32_t window) { this->nack_window_ = window; }
+  void set_max_rounds(uint8_t rounds) { this->max_rounds_ = rounds; }
+  /// Smaller blocks leave room for a sealed frame; must be a multiple of 16.
+  void set_block_size(uint8_t block_size) { this->block_size_ = block_size; }
+
+  bool begin(uint16_t session, uint32_t size, bulk_read_t &&read, uint32_t now);
+  void abort() { this->state_ = FleetOtaState::IDLE; }
+  void loop(uint32_t now);
+  void on_nack(const uint8_t *data, size_t len);
+
+  FleetOtaState get_state() const { return this->state_; }
+  uint16_t get_session() const { return this->session_; }
+  const fleet_ota_stats_t &get_stats() const { return this->stats_; }
+
+ protected:
+  bool send_control_(uint8_t code, uint32_t now);
+  void start_round_(uint32_t now);
+
+  bulk_send_t send_{};
+  bulk_read_t read_{};
+
+  FleetOtaState state_{FleetOtaState::IDLE};
+  uint16_t session_{0};
+  uint32_t size_{0};
+  uint8_t block_size_{FLEET_OTA_BLOCK_SIZE};
+  uint8_t round_{0};
+  uint16_t cursor_{0};
+
+  BlockBitmap pending_{};  // blocks still to send in this round
+  BlockBitmap repair_{};   // blocks NACKed for the next round
+
+  uint32_t prepare_time_{10000};
+  uint32_t block_interval_{2};
+  uint32_t nack_window_{1500};
+  uint8_t max_rounds_{10};
+  uint32_t last_sent_{0};
+  uint32_t deadline_{0};
+  uint8_t repeats_{0};
+  bool quiet_{false};  // a round end without NACKs was seen once
+
+  fleet_ota_stats_t stats_{};
+};
+
+/// Badge side of the broadcast firmware update. Blocks are written straight to their offset in the inactive
+/// partition; a bitmap tracks what is missing across rounds.
+class FleetOtaReceiver {
+ public:
+  void set_send(bulk_send_t &&send) { this->send_ = std::move(send); }
+  /// Prepare storage for an image of `size` bytes, e.g. esp_ota_begin on the next update partition.
+  void set_begin(std::function<bool(uint32_t size)> &&begin) { this->begin_ = std::move(begin); }
+  void set_write(bulk_write_t &&write) { this->write_ = std::move(write); }
+  /// Validate and activate the image once every block is written.
+  void set_finish(std::function<bool(uint32_t size)> &&finish) { this->finish_ = std::move(finish); }
+  /// Release the storage of an image the switchboard gave up on, e.g. esp_ota_abort.
+  void set_abort(std::function<void()> &&abort) { this->abort_ = std::move(abort); }
+  /// Fewer runs per NACK leave room for a sealed frame.
+  void set_max_runs(uint8_t runs) { this->max_runs_ = std::min(runs, FLEET_OTA_MAX_RUNS); }
+
+  void on_announce(const uint8_t *data, size_t len, uint32_t now);
+  void on_block(const uint8_t *data, size_t len, uint32_t now);
+  void on_round_end(const uint8_t *data, size_t len, uint32_t now);
+  void on_done(const uint8_t *data, size_t len, uint32_t now);
+  /// Send a jittered NACK once it is due. Call from loop().
+  void loop(uint32_t now);
+
+  bool is_active() const { return this->active_; }
+  uint16_t get_missing() const { return this->missing_.count(); }
+  uint16_t get_blocks() const { return this->missing_.size(); }
+
+ protected:
+  void send_nack_();
+  void complete_();
+
+  bulk_send_t send_{};
+  std::function<bool(uint32_t)> begin_{};
+  bulk_write_t write_{};
+  std::function<bool(uint32_t)> finish_{};
+  std::function<void()> abort_{};
+
+  bool active_{false};
+  bool complete_sent_{false};
+  uint16_t session_{0};
+  uint8_t round_{0};
+  uint32_t size_{0};
+  uint8_t block_size_{FLEET_OTA_BLOCK_SIZE};
+  uint8_t max_runs_{FLEET_OTA_MAX_RUNS};
+  BlockBitmap missing_{};
+
+  uint32_t nack_at_{0};
+  bool nack_pending_{false};
+  uint32_t last_frame_{0};
+};
+
+}  // namespace nowtalk
+}  // namespace esphome
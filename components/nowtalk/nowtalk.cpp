@@ -1,139 +1,790 @@
-#include "nowtalk_component.h"
+#include "nowtalk.h"
 
+#include "esphome/core/application.h"
+#include "esphome/core/log.h"
+
+#include <esp_attr.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+
+#include <cinttypes>
 #include <string.h>
+#include <string>
 
 namespace esphome {
 namespace nowtalk {
 
+static const char *const TAG = "nowtalk";
+
+static const uint8_t NOWTALK_BROADCAST[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+static const uint32_t RTC_STATE_MAGIC = 0x4e547231;  // "NTr1"
+static const uint32_t DEFERRED_SETUP_DELAY = 500;
+/// A call that neither the callee nor the switchboard answered in this time is given up.
+static const uint32_t CALL_SETUP_TIMEOUT = 2000;
+/// Intercom audio counts as running until it has been quiet for this long.
+static const uint32_t AUDIO_QUIET_TIME = 1000;
+
+static RTC_DATA_ATTR nowtalk_rtc_state_t rtc_state;
+
+/// Printable badge id: the low three bytes of the factory MAC in base 36, then a check character.
+static std::string badge_id() {
+  static const char *const CHARS = "0123456789AbCdEfGhIjKlMnOpQrStUvWxYz";
+  static const uint8_t BASE = 36;
+  uint8_t mac[6];
+  get_mac_address_raw(mac);
+  uint32_t chip_id = 0xa5000000 | (mac[3] << 16) | (mac[4] << 8) | mac[5];
+  std::string id;
+  uint8_t crc = 0;
+  do {
+    id.insert(id.begin(), CHARS[chip_id % BASE]);
+    crc += chip_id % BASE;
+    chip_id /= BASE;
+  } while (chip_id != 0);
+  id += CHARS[crc % BASE];
+  return id;
+}
+
+/// Send priority of a request code. SOS and call setup must never wait behind audio or bulk data.
+static tx_scheduler::TxClass tx_class(uint8_t code) {
+  switch (code) {
+    case NOWTALK_CLIENT_HELPSOS:
+      return tx_scheduler::TxClass::EMERGENCY;
+    case NOWTALK_CLIENT_START_CALL:
+    case NOWTALK_CLIENT_DIRECT_CALL:
+    case NOWTALK_SERVER_SEND_PEER:
+    case NOWTALK_SERVER_PEER_GONE:
+    case NOWTALK_CLIENT_CLOSED:
+    case NOWTALK_CLIENT_ACK:
+    case NOWTALK_CLIENT_NACK:
+    case NOWTALK_CLIENT_PING:
+    case NOWTALK_SERVER_PONG:
+    case NOWTALK_OTA_NACK:
+    case NOWTALK_CLIENT_PROBE:
+    case NOWTALK_SERVER_BEACON:
+      return tx_scheduler::TxClass::CONTROL;
+    default:
+      return tx_scheduler::TxClass::BULK;
+  }
+}
+
 void NowTalkComponent::setup() {
-  this->cfg_ = global_preferences->make_preference<nowTalkConfig>(this->get_object_id_hash());
-  this->cfg_.load(&this->recovered);
+  this->fast_resume_ = this->restore_rtc_state_();
+  if (this->fast_resume_) {
+    this->set_timeout("deferred_setup", DEFERRED_SETUP_DELAY, [this]() { this->deferred_setup_(); });
+  } else {
+    this->deferred_setup_();
+  }
+
+  // Registered before anything can fire, timers restored from RTC memory may be due on the first loop().
+  this->timers_.register_handler(TimerHandler::PING, [this](int8_t slot) { this->roster_client_.request_ping(); });
+  this->timers_.register_handler(TimerHandler::SLEEP, [this](int8_t slot) { this->enter_sleep_(); });
+
+  this->tx_scheduler_->add_protocol(NOWTALK_HEADER,
+                                    [this](const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
+                                      this->handle_frame_(info, data, size);
+                                    });
+
+  this->aggregator_.set_send([this](const uint8_t *address, uint8_t code, const uint8_t *data, size_t len) {
+    return this->send_raw_(address, code, data, len);
+  });
+  this->aggregator_.set_classify([](uint8_t code) { return (uint8_t) tx_class(code); });
+  this->stream_tx_.set_send([this](uint8_t code, const uint8_t *data, size_t len) {
+    return this->send_frame_(this->stream_peer_.data(), code, data, len);
+  });
+  this->stream_rx_.set_send([this](uint8_t code, const uint8_t *data, size_t len) {
+    return this->send_frame_(this->stream_source_.data(), code, data, len);
+  });
+  this->stream_rx_.set_on_complete([this](uint8_t stream_id, BulkKind kind, uint32_t size) {
+    ESP_LOGD(TAG, "Stream %u complete: %" PRIu32 " bytes at %" PRIu32 " B/s", stream_id, size,
+             this->stream_rx_.get_stats().bytes_per_second());
+    this->stream_complete_callback_.call(kind, size);
+  });
+
+  this->fleet_tx_.set_send([this](uint8_t code, const uint8_t *data, size_t len) {
+    return this->send_frame_(NOWTALK_BROADCAST, code, data, len);
+  });
+  if (this->switchboard_) {
+    this->roster_server_.set_send([this](uint8_t code, const uint8_t *data, size_t len) {
+      return this->send_frame_(NOWTALK_BROADCAST, code, data, len);
+    });
+    this->switchboard_engine_.set_roster(&this->roster_server_);
+    this->switchboard_engine_.set_send([this](const uint8_t *mac, uint8_t code, const uint8_t *data, size_t len) {
+      return this->send_frame_(mac, code, data, len);
+    });
+  } else {
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    get_mac_address_raw(mac);
+    this->roster_client_.set_own_mac(mac);
+    this->roster_client_.set_send([this](uint8_t code, const uint8_t *data, size_t len) {
+      return this->send_frame_(currentSwitchboard, code, data, len);
+    });
+    // The keepalive lives in the timer scheduler, so it is kept across deep sleep and wakes the badge when due.
+    this->roster_client_.set_schedule([this](uint32_t delay) {
+      if (!this->timers_.reschedule(this->ping_timer_, delay)) {
+        this->ping_timer_ = this->timers_.arm(TimerHandler::PING, delay);
+      }
+    });
+
+    // Probes go out directly, the radio moves to the next channel before an aggregate would be flushed.
+    this->finder_.set_send([this](uint8_t code, const uint8_t *data, size_t len) {
+      return this->send_raw_(NOWTALK_BROADCAST, code, data, len);
+    });
+    this->finder_.set_tune([this](uint8_t channel) { this->parent_->set_wifi_channel(channel); });
+    this->finder_.set_on_select([this](const switchboard_candidate_t &candidate) {
+      ESP_LOGI(TAG, "Switchboard %02X:%02X:%02X:%02X:%02X:%02X on channel %u (RSSI %d dBm), reconnect %" PRIu32 " ms",
+               candidate.mac[0], candidate.mac[1], candidate.mac[2], candidate.mac[3], candidate.mac[4],
+               candidate.mac[5], candidate.channel, candidate.rssi, this->finder_.get_last_reconnect_time());
+      if (memcmp(currentSwitchboard, candidate.mac, ESP_NOW_ETH_ALEN) != 0) {
+        memcpy(currentSwitchboard, candidate.mac, ESP_NOW_ETH_ALEN);
+        this->roster_client_.reset();
+      }
+      rtc_state.channel = candidate.channel;
+      if (this->config_.channel != candidate.channel) {
+        this->config_.channel = candidate.channel;
+        this->cfg_.save(&this->config_);
+      }
+      this->add_peer_(candidate.mac);
+    });
+    this->finder_.set_current(currentSwitchboard, this->parent_->get_wifi_channel(), millis());
+  }
 };
 
-void NowTalkComponent::on_receive(ESPNowPacket &packet) {};
-void NowTalkComponent::on_sent(ESPNowPacket &packet, bool status) {};
-
-std::string NowTalkComponent::get_value(std::string data, char separator, uint8_t index) {
-  uint8_t found = 0;
-  uint8_t strIndex[] = {0, -1};
-  uint8_t maxIndex = data.length() - 1;
-
-  for (uint8_t i = 0; i <= maxIndex && found <= index; i++) {
-    if (data.charAt(i) == separator || i == maxIndex) {
-      found++;
-      strIndex[0] = strIndex[1] + 1;
-      strIndex[1] = (i == maxIndex) ? i + 1 : i;
-    }
-  }
-
-  return found > index ? data.substring(strIndex[0], strIndex[1]) : "";
-}
-
-void NowTalkComponent::load_config_(bool clear) {
-  if (clear) {
-    this->cfg_.reset()
-  }
-    SPIFFS.remove(configFile);
-  // Allocate a temporary JsonDocument
-  // Don't forget to change the capacity to match your requirements.
-  // Use arduinojson.org/v6/assistant to compute the capacity.
-  StaticJsonDocument<524> doc;
-
-  // memset(*config, 0, sizeof(config));
-  // Open file for reading
-  if (SPIFFS.exists(configFile)) {
-    fs::File file = SPIFFS.open(configFile);
-    deserializeJson(doc, file);
-    file.close();
-  }
-  //   serializeJsonPretty(doc, Serial);
-  // Copy values from the JsonDocument to the Config
-  config.channel = doc["channel"] | 0;
-  // config.port = doc["port"] | 2731;
-  strlcpy(config.switchboard, doc["switchboard"] | "", sizeof(config.switchboard));  // <- destination's capacity
-  const char *mac = doc["switchboardMac64"].as<const char *>();
-  //   Serial.print("\n{");
-  // Serial.print(mac);
-  //  Serial.print("}");
-  // Serial.println(mac == nullptr);
-  if (mac != nullptr) {
-    size_t outputLength;
-
-    unsigned char *decode = base64_decode((const unsigned char *) mac, strlen(mac), &outputLength);
-    memcpy(config.masterSwitchboard, decode, 6);  // <- destination's capacity
-    if (currentSwitchboard[0] == 0) {
-      memcpy(currentSwitchboard, decode, 6);  // <- destination's capacity
-    }
-    free(decode);
-  }
-  config.timerPing = doc["timerPing"] | 30000;    // send readings timer
-  config.timerSleep = doc["timerSleep"] | 90000;  // EVENT_INTERVAL_MS
-  config.ledBacklight =
-      doc["ledBacklight"] | 80;  // Initial TFT backlight intensity on a scale of 0 to 255. Initial value is 80.
-  config.sprVolume = doc["sprVolume"] | 40;
-  config.heartbeat = doc["heartbeat"] | 0;
-
-  strlcpy(config.masterIP, doc["masterIP"] | "<None>", sizeof(config.masterIP));  // <- destination's capacity
-  strlcpy(config.userName, doc["userName"] | "<None>", sizeof(config.userName));  // <- destination's capacity
-  if ((strcmp(config.masterIP, "<None>") == 0) || (strcmp(config.userName, "<None>") == 0)) {
-    config.registrationMode = true;
-  }
-
-  for (JsonObject elem : doc["alarms"].as<JsonArray>()) {
-    int id = elem["id"];
-    uint64_t nt = elem["nextTrigger"].as<uint64_t>();
-    alarms[id].value = elem["time"];
-    alarms[id].nextTrigger = nt;
-    alarms[id].Mode.alarmType = elem["mode_alarmType"];
-    alarms[id].Mode.isEnabled = elem["mode_isEnabled"];
-    alarms[id].Mode.isOneShot = elem["mode_isOneShot"];
-    alarms[id].onTickHandler = (OnTick_t) elem["trigger"].as<uint32_t>();
-    Serial.printf("timeleft %lld\n", myEvents.timeNow() - nt);
-    myEvents.updateNextTrigger(id);
-  }
-}
-
-// Saves the configuration to a file
-void NowTalkComponent::save_config_() {
-
-  // Copy values from the JsonDocument to the Config
-  doc["channel"] = config.channel;
-  // doc["port"] = config.port;
-  doc["switchboard"] = config.switchboard;
-  size_t outputLength;
-  unsigned char *encode = base64_encode((const unsigned char *) config.masterSwitchboard, 6, &outputLength);
-  doc["switchboardMac64"] = encode;
-  free(encode);
-
-  doc["timerPing"] = config.timerPing;    // send readings timer
-  doc["timerSleep"] = config.timerSleep;  // EVENT_INTERVAL_MS
-
-  doc["masterIP"] = config.masterIP;
-  doc["userName"] = config.userName;
-  doc["ledBacklight"] =
-      config.ledBacklight;  // Initial TFT backlight intensity on a scale of 0 to 255. Initial value is 80.
-  doc["sprVolume"] = config.sprVolume;
-
-  JsonArray data = doc.createNestedArray("alarms");
-  for (uint8_t id = 0; id < dtNBR_ALARMS; id++) {
-    if (alarms[id].Mode.alarmType != dtNotAllocated) {
-      JsonObject data_0 = data.createNestedObject();
-      data_0["id"] = id;
-      data_0["time"] = alarms[id].value;
-      data_0["nextTrigger"] = alarms[id].nextTrigger;
-      data_0["mode_alarmType"] = alarms[id].Mode.alarmType;
-      data_0["mode_isEnabled"] = alarms[id].Mode.isEnabled;
-      data_0["mode_isOneShot"] = alarms[id].Mode.isOneShot;
-      data_0["trigger"] = (uint32_t) alarms[id].onTickHandler;
-    }
-  }
-  // serializeJsonPretty(doc, Serial);
-  if (serializeJson(doc, file) == 0) {
-    Serial.println(F("Failed to write to file"));
-  }
-
-  // Close the file
-  file.close();
+bool NowTalkComponent::restore_rtc_state_() {
+  if (rtc_state.magic != RTC_STATE_MAGIC || esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED) {
+    rtc_state = {};
+    rtc_state.magic = RTC_STATE_MAGIC;
+    return false;
+  }
+  // Same channel and peers as before the sleep, no scan or switchboard handshake needed.
+  this->parent_->set_wifi_channel(rtc_state.channel);
+  for (uint8_t i = 0; i < rtc_state.peer_count; i++) {
+    this->parent_->add_peer(rtc_state.peers[i]);
+  }
+  // Same slots as before the sleep, the PING timer is found again by its handler.
+  for (int8_t slot = 0; slot < NOWTALK_MAX_TIMERS; slot++) {
+    const nowtalk_timer_t &timer = rtc_state.timers[slot];
+    if (timer.enabled) {
+      this->timers_.arm_at(timer.handler, timer.deadline, timer.interval, slot);
+      if (timer.handler == TimerHandler::PING) {
+        this->ping_timer_ = slot;
+      }
+    }
+  }
+  this->resume_us_ = (uint32_t) esp_timer_get_time();
+  return true;
+}
+
+void NowTalkComponent::deferred_setup_() {
+  this->cfg_ = global_preferences->make_preference<config_t>(this->get_object_id_hash());
+  this->cfg_.load(&this->config_);
+  if (this->accept_fleet_update_) {
+    this->setup_fleet_update_();
+  }
+  if (!this->switchboard_) {
+    this->arm_timers_();
+  }
+  this->deferred_done_ = true;
+  this->deferred_us_ = (uint32_t) esp_timer_get_time();
+}
+
+void NowTalkComponent::add_peer_(const uint8_t *address) {
+  for (uint8_t i = 0; i < rtc_state.peer_count; i++) {
+    if (memcmp(rtc_state.peers[i], address, ESP_NOW_ETH_ALEN) == 0) {
+      return;
+    }
+  }
+  this->parent_->add_peer(address);
+  if (rtc_state.peer_count < NOWTALK_RTC_PEERS) {
+    memcpy(rtc_state.peers[rtc_state.peer_count++], address, ESP_NOW_ETH_ALEN);
+  }
+}
+
+void NowTalkComponent::setup_fleet_update_() {
+  this->fleet_rx_.set_send([this](uint8_t code, const uint8_t *data, size_t len) {
+    return this->send_frame_(currentSwitchboard, code, data, len);
+  });
+  this->fleet_rx_.set_begin([this](uint32_t size) {
+    if (this->ota_handle_ != 0) {
+      esp_ota_abort(this->ota_handle_);
+      this->ota_handle_ = 0;
+    }
+    this->ota_partition_ = esp_ota_get_next_update_partition(nullptr);
+    if (this->ota_partition_ == nullptr || size > this->ota_partition_->size) {
+      ESP_LOGW(TAG, "No OTA partition for a %" PRIu32 " byte image", size);
+      return false;
+    }
+    // Erases the whole image range up front, the switchboard waits for this before sending blocks.
+    esp_err_t err = esp_ota_begin(this->ota_partition_, size, &this->ota_handle_);
+    if (err != ESP_OK) {
+      ESP_LOGW(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+      this->ota_handle_ = 0;
+      return false;
+    }
+    ESP_LOGI(TAG, "Receiving fleet update (%" PRIu32 " bytes) into %s", size, this->ota_partition_->label);
+    return true;
+  });
+  this->fleet_rx_.set_write([this](uint32_t offset, const uint8_t *data, size_t len) {
+    return esp_ota_write_with_offset(this->ota_handle_, data, len, offset) == ESP_OK;
+  });
+  this->fleet_rx_.set_finish([this](uint32_t size) {
+    esp_err_t err = esp_ota_end(this->ota_handle_);
+    this->ota_handle_ = 0;
+    if (err == ESP_OK) {
+      err = esp_ota_set_boot_partition(this->ota_partition_);
+    }
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Fleet update rejected: %s", esp_err_to_name(err));
+      return false;
+    }
+    ESP_LOGI(TAG, "Fleet update installed, rebooting");
+    this->set_timeout("fleet_reboot", 1000, []() { App.safe_reboot(); });
+    return true;
+  });
+  this->fleet_rx_.set_abort([this]() {
+    ESP_LOGW(TAG, "Fleet update ended by the switchboard, %u of %u blocks missing", this->fleet_rx_.get_missing(),
+             this->fleet_rx_.get_blocks());
+    if (this->ota_handle_ != 0) {
+      esp_ota_abort(this->ota_handle_);
+      this->ota_handle_ = 0;
+    }
+  });
+}
+
+void NowTalkComponent::dump_config() {
+  ESP_LOGCONFIG(TAG, "NowTalk:");
+  ESP_LOGCONFIG(TAG, "  Badge ID: %s", badge_id().c_str());
+  ESP_LOGCONFIG(TAG, "  Stream chunk size: %u", this->chunk_size_);
+  ESP_LOGCONFIG(TAG, "  Role: %s", this->switchboard_ ? "switchboard" : "badge");
+  ESP_LOGCONFIG(TAG, "  Accept fleet update: %s", YESNO(this->accept_fleet_update_));
+  if (this->switchboard_) {
+    const switchboard_stats_t &stats = this->switchboard_engine_.get_stats();
+    ESP_LOGCONFIG(TAG, "  Switchboard requests: %" PRIu32 " (%" PRIu32 " dropped) in %" PRIu32 " batches",
+                  stats.requests, stats.dropped, stats.batches);
+    ESP_LOGCONFIG(TAG, "  Switchboard calls: %" PRIu32 ", active: %u", stats.calls,
+                  this->switchboard_engine_.get_active_calls());
+    ESP_LOGCONFIG(TAG, "  Switchboard reply latency: %" PRIu32 " us avg, %" PRIu32 " us max", stats.latency_avg_us,
+                  stats.latency_max_us);
+  } else {
+    ESP_LOGCONFIG(TAG, "  Switchboard sweeps: %" PRIu32 ", roams: %" PRIu32 ", last reconnect: %" PRIu32 " ms",
+                  this->finder_.get_sweeps(), this->finder_.get_roams(), this->finder_.get_last_reconnect_time());
+    const call_stats_t &calls = this->call_stats_;
+    ESP_LOGCONFIG(TAG, "  Calls direct: %" PRIu32 ", ready for audio in %" PRIu32 " us avg", calls.direct,
+                  calls.direct_avg_us);
+    ESP_LOGCONFIG(TAG, "  Calls through the switchboard: %" PRIu32 ", ready for audio in %" PRIu32 " us avg",
+                  calls.routed, calls.routed_avg_us);
+  }
+  ESP_LOGCONFIG(TAG, "  Coalesce window: %" PRIu32 " ms", this->aggregator_.get_window());
+  ESP_LOGCONFIG(TAG, "  Fast resume: %s", YESNO(this->fast_resume_));
+  if (this->fast_resume_) {
+    ESP_LOGCONFIG(TAG, "  Boot radio restored: %" PRIu32 " us", this->resume_us_);
+  }
+  ESP_LOGCONFIG(TAG, "  Boot deferred setup: %" PRIu32 " us", this->deferred_us_);
+}
+
+void NowTalkComponent::loop() {
+  EVENT_TRACE_LOOP(this);
+  uint32_t now = millis();
+  this->timers_.run();
+
+  uint32_t saved_rate = this->aggregator_.get_saved_rate();
+  uint32_t records_failed = this->aggregator_.get_records_failed();
+  this->aggregator_.loop(now);
+  if (saved_rate != this->aggregator_.get_saved_rate()) {
+    ESP_LOGD(TAG, "Aggregation saves %" PRIu32 " frames/s (%" PRIu32 " total)", this->aggregator_.get_saved_rate(),
+             this->aggregator_.get_frames_saved());
+  }
+  if (records_failed != this->aggregator_.get_records_failed()) {
+    ESP_LOGW(TAG, "Send of an aggregated frame failed, %" PRIu32 " messages lost in total",
+             this->aggregator_.get_records_failed());
+  }
+
+  BulkState state = this->stream_tx_.get_state();
+  this->stream_tx_.loop(now);
+  if (state != this->stream_tx_.get_state()) {
+    const bulk_stats_t &stats = this->stream_tx_.get_stats();
+    if (this->stream_tx_.get_state() == BulkState::DONE) {
+      ESP_LOGD(TAG, "Stream %u sent: %" PRIu32 " bytes at %" PRIu32 " B/s, %" PRIu32 " retransmits",
+               this->stream_tx_.get_stream_id(), stats.bytes, stats.bytes_per_second(), stats.retransmits);
+    } else if (this->stream_tx_.get_state() == BulkState::FAILED) {
+      ESP_LOGW(TAG, "Stream %u failed after %" PRIu32 " bytes", this->stream_tx_.get_stream_id(), stats.bytes);
+    }
+  }
+  this->stream_rx_.loop(now);
+
+  if (this->switchboard_) {
+#ifdef USE_EVENT_TRACE
+    size_t requests = this->switchboard_engine_.queued();
+    uint32_t start = arch_get_cpu_cycle_count();
+#endif
+    this->switchboard_engine_.process(now, micros());
+#ifdef USE_EVENT_TRACE
+    if (requests > 0) {
+      EVENT_TRACE(TRACE_NOWTALK_BATCH, requests, arch_get_cpu_cycle_count() - start);
+    }
+#endif
+    this->roster_server_.loop(now);
+  } else if (this->deferred_done_) {
+    // The wake-up PING waits for the deferred setup so it does not compete with the first audio frames.
+    // A roam sweep takes the radio off the channel for the whole sweep, it waits until nothing is running.
+    this->finder_.loop(now, !this->is_busy_(now));
+    if (this->finder_.get_state() == FinderState::IDLE) {
+      this->roster_client_.loop(now);
+    }
+  }
+  if (this->call_state_ == CallState::DIALING && now - this->call_dialed_ > CALL_SETUP_TIMEOUT) {
+    ESP_LOGW(TAG, "Call to %02X:%02X:%02X:%02X:%02X:%02X not answered", this->call_peer_[0], this->call_peer_[1],
+             this->call_peer_[2], this->call_peer_[3], this->call_peer_[4], this->call_peer_[5]);
+    this->call_ended_();
+  }
+
+  FleetOtaState fleet_state = this->fleet_tx_.get_state();
+  this->fleet_tx_.loop(now);
+  if (this->fleet_tx_.get_state() == FleetOtaState::SENDING) {
+    this->fleet_high_freq_.start();
+  } else {
+    this->fleet_high_freq_.stop();
+  }
+  if (fleet_state != this->fleet_tx_.get_state() &&
+      (this->fleet_tx_.get_state() == FleetOtaState::DONE || this->fleet_tx_.get_state() == FleetOtaState::FAILED)) {
+    const fleet_ota_stats_t &stats = this->fleet_tx_.get_stats();
+    ESP_LOGI(TAG, "Fleet update %s: %u blocks in %u rounds, %" PRIu32 " repairs, %" PRIu32 " NACKs, %" PRIu32 " ms",
+             this->fleet_tx_.get_state() == FleetOtaState::DONE ? "done" : "incomplete", stats.blocks, stats.rounds,
+             stats.repairs, stats.nacks, stats.finished - stats.started);
+  }
+  if (this->accept_fleet_update_) {
+    this->fleet_rx_.loop(now);
+  }
+}
+
+#ifdef USE_GROUP_CRYPTO
+void NowTalkComponent::set_group_crypto(group_crypto::GroupCrypto *group_crypto) {
+  this->group_crypto_ = group_crypto;
+  // Everything that fills a whole frame shrinks to the sealed budget.
+  this->chunk_size_ = NOWTALK_SEALED_MAX_BODY - BULK_DATA_HEADER_SIZE;
+  this->fleet_tx_.set_block_size((NOWTALK_SEALED_MAX_BODY - FLEET_OTA_BLOCK_HEADER_SIZE) & ~15);
+  this->fleet_rx_.set_max_runs((NOWTALK_SEALED_MAX_BODY - FLEET_OTA_NACK_HEADER_SIZE) / FLEET_OTA_RUN_SIZE);
+  this->aggregator_.set_max_body(NOWTALK_SEALED_MAX_BODY);
+}
+#endif
+
+bool NowTalkComponent::start_fleet_update(uint32_t size, bulk_read_t &&read) {
+  // A fresh session id makes badges drop any half received image of an older update.
+  uint16_t session = random_uint32() & 0xffff;
+  return this->fleet_tx_.begin(session, size, std::move(read), millis());
+}
+
+bool NowTalkComponent::is_switchboard_(const uint8_t *address) {
+  return memcmp(address, currentSwitchboard, ESP_NOW_ETH_ALEN) == 0;
+}
+
+bool NowTalkComponent::send_stream(const uint8_t *address, BulkKind kind, uint32_t size, bulk_read_t &&read) {
+  BulkState state = this->stream_tx_.get_state();
+  if (state == BulkState::STARTING || state == BulkState::SENDING || state == BulkState::ENDING) {
+    return false;
+  }
+  // Pushing the same transfer to the same peer again after it failed or was aborted keeps its stream id, so the
+  // receiver resumes from the chunks it already holds.
+  bool retry = this->stream_counter_ != 0 && (state == BulkState::FAILED || state == BulkState::IDLE) &&
+               memcmp(this->stream_peer_.data(), address, ESP_NOW_ETH_ALEN) == 0 &&
+               this->stream_tx_.get_kind() == kind && this->stream_tx_.get_size() == size;
+  uint8_t stream_id = retry ? this->stream_tx_.get_stream_id() : this->stream_counter_ + 1;
+  memcpy(this->stream_peer_.data(), address, ESP_NOW_ETH_ALEN);
+  this->add_peer_(address);
+  if (!this->stream_tx_.begin(stream_id, kind, size, std::move(read), millis(), this->chunk_size_)) {
+    return false;
+  }
+  this->stream_counter_ = stream_id;
+  return true;
+}
+
+bool NowTalkComponent::start_call(const uint8_t *peer) {
+  if (this->switchboard_) {
+    return false;
+  }
+  if (this->call_state_ != CallState::IDLE) {
+    if (memcmp(peer, this->call_peer_.data(), ESP_NOW_ETH_ALEN) == 0) {
+      return true;
+    }
+    this->end_call();
+  }
+  memcpy(this->call_peer_.data(), peer, ESP_NOW_ETH_ALEN);
+  this->call_state_ = CallState::DIALING;
+  this->call_started_us_ = micros();
+  this->call_dialed_ = millis();
+  // A route learned on another channel is useless, the callee cannot hear us there.
+  const peer_route_t *route = rtc_state.routes.find(peer);
+  bool direct = route != nullptr && route->channel == this->parent_->get_wifi_channel();
+  if (direct) {
+    this->add_peer_(peer);
+    this->send_raw_(peer, NOWTALK_CLIENT_DIRECT_CALL, nullptr, 0);
+  }
+  // Always sent: it keeps the switchboard's call table right after a direct setup and is the fallback when the
+  // cached route is stale. It waits for the aggregator, the direct request does not.
+  bool queued = this->send_frame_(currentSwitchboard, NOWTALK_CLIENT_START_CALL, peer, ESP_NOW_ETH_ALEN);
+  return direct || queued;
+}
+
+void NowTalkComponent::end_call() {
+  if (this->call_state_ == CallState::IDLE) {
+    return;
+  }
+  // The peer hears it at once; the switchboard clears the call and sends it PEER_GONE in case this frame is lost.
+  if (this->call_state_ == CallState::CONNECTED) {
+    this->send_raw_(this->call_peer_.data(), NOWTALK_CLIENT_CLOSED, nullptr, 0);
+  }
+  this->send_frame_(currentSwitchboard, NOWTALK_CLIENT_CLOSED, nullptr, 0);
+  this->call_ended_();
+}
+
+void NowTalkComponent::call_connected_(const uint8_t *peer, bool direct) {
+  bool outgoing = this->call_state_ == CallState::DIALING;
+  memcpy(this->call_peer_.data(), peer, ESP_NOW_ETH_ALEN);
+  this->call_state_ = CallState::CONNECTED;
+  rtc_state.routes.put(peer, this->parent_->get_wifi_channel());
+  if (outgoing) {
+    uint32_t elapsed = micros() - this->call_started_us_;
+    call_stats_t &stats = this->call_stats_;
+    uint32_t &count = direct ? stats.direct : stats.routed;
+    uint32_t &average = direct ? stats.direct_avg_us : stats.routed_avg_us;
+    count++;
+    average = count == 1 ? elapsed : average - average / 8 + elapsed / 8;
+    stats.last_us = elapsed;
+    EVENT_TRACE(TRACE_NOWTALK_CALL, direct, elapsed);
+    ESP_LOGD(TAG, "Call to %02X:%02X:%02X:%02X:%02X:%02X ready for audio in %" PRIu32 " us (%s)", peer[0], peer[1],
+             peer[2], peer[3], peer[4], peer[5], elapsed, direct ? "direct" : "switchboard");
+  } else {
+    ESP_LOGD(TAG, "Call from %02X:%02X:%02X:%02X:%02X:%02X", peer[0], peer[1], peer[2], peer[3], peer[4], peer[5]);
+  }
+  this->call_callback_.call(peer, true);
+}
+
+void NowTalkComponent::call_ended_() {
+  bool connected = this->call_state_ == CallState::CONNECTED;
+  this->call_state_ = CallState::IDLE;
+  if (connected) {
+    this->call_callback_.call(this->call_peer_.data(), false);
+  }
+}
+
+bool NowTalkComponent::send_frame_(const uint8_t *address, uint8_t code, const uint8_t *data, size_t len) {
+  if (tx_class(code) == tx_scheduler::TxClass::EMERGENCY) {
+    // Never held back, but whatever is pending for the peer still goes first.
+    bool flushed = this->aggregator_.flush(address);
+    return this->send_raw_(address, code, data, len) && flushed;
+  }
+  return this->aggregator_.add(address, code, data, len, millis());
+}
+
+bool NowTalkComponent::send_raw_(const uint8_t *address, uint8_t code, const uint8_t *data, size_t len) {
+  uint8_t buffer[ESP_NOW_MAX_DATA_LEN];
+  if (len > NOWTALK_MAX_BODY) {
+    return false;
+  }
+  EVENT_TRACE(TRACE_NOWTALK_TX, code, len);
+  buffer[0] = NOWTALK_HEADER;
+  buffer[1] = code;
+  if (len > 0) {
+    memcpy(buffer + NOWTALK_HEADER_SIZE, data, len);
+  }
+  const uint8_t *frame = buffer;
+  size_t size = len + NOWTALK_HEADER_SIZE;
+#ifdef USE_GROUP_CRYPTO
+  uint8_t sealed[ESP_NOW_MAX_DATA_LEN];
+  if (this->group_crypto_ != nullptr) {
+    // [HEADER][SECURE] stays in the clear and is authenticated, code and body are sealed.
+    if (len > NOWTALK_SEALED_MAX_BODY) {
+      return false;
+    }
+    sealed[0] = NOWTALK_HEADER;
+    sealed[1] = NOWTALK_SECURE;
+    size = this->group_crypto_->seal(buffer + 1, len + 1, sealed + NOWTALK_HEADER_SIZE, sealed, NOWTALK_HEADER_SIZE);
+    if (size == 0) {
+      return false;
+    }
+    frame = sealed;
+    size += NOWTALK_HEADER_SIZE;
+  }
+#endif
+  tx_scheduler::tx_callback_t callback = nullptr;
+  if (!this->switchboard_ && this->is_switchboard_(address)) {
+    // Failed unicasts to the switchboard are the quickest sign that it is gone.
+    callback = [this](esp_err_t err) { this->finder_.on_send_result(err == ESP_OK, millis()); };
+  }
+  // The aggregator only packs messages of one class together, the first record tells which.
+  uint8_t record_code = code == NOWTALK_AGGREGATE && len > 1 ? data[1] : code;
+  return this->tx_scheduler_->send(tx_class(record_code), address, frame, size, std::move(callback));
+}
+
+void NowTalkComponent::handle_frame_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
+  // The header byte was matched by the scheduler's demultiplexer.
+  if (size < NOWTALK_HEADER_SIZE) {
+    return;
+  }
+  uint32_t now = millis();
+  uint8_t code = data[1];
+  const uint8_t *body = data + NOWTALK_HEADER_SIZE;
+  size_t len = size - NOWTALK_HEADER_SIZE;
+#ifdef USE_GROUP_CRYPTO
+  uint8_t plain[ESP_NOW_MAX_DATA_LEN];
+  if (this->group_crypto_ != nullptr) {
+    // Unsealed or forged frames are dropped before they can touch any state.
+    int plain_len = -1;
+    if (code == NOWTALK_SECURE) {
+      plain_len = this->group_crypto_->open(info.src_addr, body, len, plain, data, NOWTALK_HEADER_SIZE);
+    }
+    if (plain_len < 1) {
+      return;
+    }
+    code = plain[0];
+    body = plain + 1;
+    len = plain_len - 1;
+  }
+#endif
+  if (!this->switchboard_ && this->is_switchboard_(info.src_addr)) {
+    this->finder_.on_frame(info.rx_ctrl->rssi, now);
+  }
+  if (this->switchboard_) {
+    this->roster_server_.seen(info.src_addr, now);
+  }
+  if (code == NOWTALK_AGGREGATE) {
+    if (!FrameAggregator::unpack(body, len, [this, &info, now](uint8_t code, const uint8_t *body, size_t len) {
+          this->handle_message_(info, code, body, len, now);
+        })) {
+      ESP_LOGV(TAG, "Truncated aggregate frame");
+    }
+  } else {
+    this->handle_message_(info, code, body, len, now);
+  }
+}
+
+void NowTalkComponent::handle_message_(const espnow::ESPNowRecvInfo &info, uint8_t code, const uint8_t *body,
+                                       size_t len, uint32_t now) {
+  EVENT_TRACE(TRACE_NOWTALK_RX, code, len);
+  if (this->switchboard_ && this->switchboard_engine_.handles(code)) {
+    if (!this->switchboard_engine_.submit(info.src_addr, code, body, len, micros())) {
+      ESP_LOGV(TAG, "Switchboard queue full, dropped request 0x%02X", code);
+    }
+    return;
+  }
+  switch (code) {
+    case NOWTALK_CLIENT_PROBE:
+      if (this->switchboard_) {
+        // [channel][badges], so badges sweeping channels can rank the switchboards they hear.
+        uint8_t reply[2] = {this->parent_->get_wifi_channel(), this->roster_server_.get_count()};
+        this->send_raw_(info.src_addr, NOWTALK_SERVER_BEACON, reply, sizeof(reply));
+      }
+      break;
+    case NOWTALK_SERVER_BEACON:
+      if (!this->switchboard_) {
+        this->finder_.on_beacon(info.src_addr, body, len, info.rx_ctrl->rssi, now);
+      }
+      break;
+    case NOWTALK_SERVER_PONG:
+      if (!this->switchboard_ && this->is_switchboard_(info.src_addr)) {
+        this->roster_client_.on_pong(body, len, now);
+      }
+      break;
+    case NOWTALK_SERVER_ROSTER:
+      if (!this->switchboard_ && this->is_switchboard_(info.src_addr)) {
+        this->roster_client_.on_roster(body, len, now);
+      }
+      break;
+    case NOWTALK_STREAM_START:
+      // One stream at a time, another badge only gets in once the current one is done or has gone quiet.
+      if (this->stream_rx_.is_receiving(now) &&
+          memcmp(this->stream_source_.data(), info.src_addr, ESP_NOW_ETH_ALEN) != 0) {
+        break;
+      }
+      memcpy(this->stream_source_.data(), info.src_addr, ESP_NOW_ETH_ALEN);
+      this->stream_rx_.on_start(body, len, now);
+      break;
+    case NOWTALK_STREAM_DATA:
+      if (memcmp(this->stream_source_.data(), info.src_addr, ESP_NOW_ETH_ALEN) == 0) {
+        this->stream_rx_.on_data(body, len, now);
+      }
+      break;
+    case NOWTALK_STREAM_END:
+      if (memcmp(this->stream_source_.data(), info.src_addr, ESP_NOW_ETH_ALEN) == 0) {
+        this->stream_rx_.on_end(body, len, now);
+      }
+      break;
+    case NOWTALK_CLIENT_ACK:
+      // The first body byte is the request code being acknowledged.
+      if (len > 1 && body[0] >= NOWTALK_STREAM_START && body[0] <= NOWTALK_STREAM_END) {
+        // Only the badge we stream to moves the window.
+        if (memcmp(this->stream_peer_.data(), info.src_addr, ESP_NOW_ETH_ALEN) == 0) {
+          this->stream_tx_.on_ack(body[0], body + 1, len - 1, now);
+        }
+      } else if (len > 0 && body[0] == NOWTALK_CLIENT_DIRECT_CALL && !this->switchboard_) {
+        this->handle_call_message_(info.src_addr, code, body, len);
+      }
+      break;
+    case NOWTALK_CLIENT_NACK:
+    case NOWTALK_CLIENT_DIRECT_CALL:
+    case NOWTALK_CLIENT_CLOSED:
+    case NOWTALK_SERVER_SEND_PEER:
+    case NOWTALK_SERVER_PEER_GONE:
+      if (!this->switchboard_) {
+        this->handle_call_message_(info.src_addr, code, body, len);
+      }
+      break;
+    case NOWTALK_OTA_NACK:
+      this->fleet_tx_.on_nack(body, len);
+      break;
+    case NOWTALK_OTA_ANNOUNCE:
+    case NOWTALK_OTA_BLOCK:
+    case NOWTALK_OTA_ROUND_END:
+    case NOWTALK_OTA_DONE:
+      // Firmware is only taken from our own switchboard.
+      if (!this->accept_fleet_update_ || !this->is_switchboard_(info.src_addr)) {
+        break;
+      }
+      if (code == NOWTALK_OTA_ANNOUNCE) {
+        this->fleet_rx_.on_announce(body, len, now);
+      } else if (code == NOWTALK_OTA_BLOCK) {
+        this->fleet_rx_.on_block(body, len, now);
+      } else if (code == NOWTALK_OTA_ROUND_END) {
+        this->fleet_rx_.on_round_end(body, len, now);
+      } else {
+        this->fleet_rx_.on_done(body, len, now);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void NowTalkComponent::handle_call_message_(const uint8_t *src, uint8_t code, const uint8_t *body, size_t len) {
+  bool from_switchboard = this->is_switchboard_(src);
+  bool from_peer = this->call_state_ != CallState::IDLE && memcmp(src, this->call_peer_.data(), ESP_NOW_ETH_ALEN) == 0;
+  switch (code) {
+    case NOWTALK_CLIENT_DIRECT_CALL: {
+      if (this->call_state_ != CallState::IDLE && !from_peer) {
+        uint8_t nack[2] = {NOWTALK_CLIENT_DIRECT_CALL, SWITCHBOARD_BUSY};
+        this->send_raw_(src, NOWTALK_CLIENT_NACK, nack, sizeof(nack));
+        break;
+      }
+      // Only badges of our own group: in the roster, or called before when the roster is not synced yet.
+      if (!this->roster_client_.is_present(src) && rtc_state.routes.find(src) == nullptr) {
+        break;
+      }
+      this->add_peer_(src);
+      uint8_t ack[1] = {NOWTALK_CLIENT_DIRECT_CALL};
+      this->send_raw_(src, NOWTALK_CLIENT_ACK, ack, sizeof(ack));
+      // From the peer we are dialing ourselves, both sides called at once.
+      if (this->call_state_ != CallState::CONNECTED) {
+        this->call_connected_(src, true);
+      }
+      break;
+    }
+    case NOWTALK_CLIENT_ACK:
+      if (from_peer && this->call_state_ == CallState::DIALING) {
+        this->call_connected_(src, true);
+      }
+      break;
+    case NOWTALK_SERVER_SEND_PEER:
+      if (!from_switchboard || len < ESP_NOW_ETH_ALEN) {
+        break;
+      }
+      if (this->call_state_ == CallState::CONNECTED) {
+        if (memcmp(body, this->call_peer_.data(), ESP_NOW_ETH_ALEN) == 0) {
+          // Confirms the call that was set up directly.
+          break;
+        }
+        // The switchboard put us in another call, its call table is what the other badges go by.
+        this->call_ended_();
+      }
+      this->add_peer_(body);
+      this->call_connected_(body, false);
+      break;
+    case NOWTALK_SERVER_PEER_GONE:
+      if (!from_switchboard || len < ESP_NOW_ETH_ALEN || this->call_state_ == CallState::IDLE ||
+          memcmp(body, this->call_peer_.data(), ESP_NOW_ETH_ALEN) != 0) {
+        break;
+      }
+      if (this->call_state_ == CallState::DIALING) {
+        // Not in the roster, the cached route leads nowhere.
+        rtc_state.routes.remove(body);
+      }
+      this->call_ended_();
+      break;
+    case NOWTALK_CLIENT_NACK:
+      if (len < 2 || this->call_state_ != CallState::DIALING) {
+        break;
+      }
+      if ((body[0] == NOWTALK_CLIENT_DIRECT_CALL && from_peer) ||
+          (body[0] == NOWTALK_CLIENT_START_CALL && from_switchboard)) {
+        ESP_LOGD(TAG, "Call refused by the %s, reason %u", from_peer ? "peer" : "switchboard", body[1]);
+        this->call_ended_();
+      }
+      break;
+    case NOWTALK_CLIENT_CLOSED:
+      if (from_peer) {
+        this->call_ended_();
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void NowTalkComponent::run_stream_benchmark(uint32_t size, uint8_t loss_percent) {
+  bulk_loopback_result_t result = bulk_loopback(size, loss_percent, 1000, this->chunk_size_);
+  ESP_LOGI(TAG, "Stream benchmark, %" PRIu32 " bytes in %u byte chunks at %u%% loss over 1 Mbit/s:", size,
+           this->chunk_size_, loss_percent);
+  ESP_LOGI(TAG, "  %s after %" PRIu32 " ms, %.1f KB/s", result.done ? "Done" : "Failed", result.elapsed_ms,
+           result.bytes_per_second() / 1024.0f);
+  ESP_LOGI(TAG, "  %" PRIu32 " frames, %" PRIu32 " lost, %" PRIu32 " retransmits", result.frames, result.lost,
+           result.retransmits);
+}
+
+void NowTalkComponent::arm_timers_() {
+  // Every wake gets the full awake window.
+  this->timers_.cancel(this->sleep_timer_);
+  this->sleep_timer_ = this->timers_.arm(TimerHandler::SLEEP, this->config_.timerSleep);
+}
+
+bool NowTalkComponent::is_busy_(uint32_t now) {
+  BulkState stream = this->stream_tx_.get_state();
+  return this->call_state_ != CallState::IDLE || stream == BulkState::STARTING || stream == BulkState::SENDING ||
+         stream == BulkState::ENDING || this->stream_rx_.is_active() || this->fleet_rx_.is_active() ||
+         this->tx_scheduler_->is_audio_active(now, AUDIO_QUIET_TIME);
+}
+
+void NowTalkComponent::enter_sleep_() {
+  if (this->is_busy_(millis())) {
+    ESP_LOGD(TAG, "Busy, sleep postponed");
+    this->sleep_timer_ = this->timers_.arm(TimerHandler::SLEEP, this->config_.timerSleep);
+    return;
+  }
+  ESP_LOGI(TAG, "Going to deep sleep");
+  App.run_safe_shutdown_hooks();
+  esp_deep_sleep_start();
+}
+
+void NowTalkComponent::on_safe_shutdown() {
+  if (!this->switchboard_) {
+    this->prepare_sleep_();
+  }
+}
+
+uint64_t NowTalkComponent::prepare_sleep_() {
+  rtc_state.channel = this->parent_->get_wifi_channel();
+  // SLEEP is left out, it is armed afresh on every wake.
+  for (int8_t slot = 0; slot < NOWTALK_MAX_TIMERS; slot++) {
+    rtc_state.timers[slot] = this->timers_.get(slot);
+    if (!this->timers_.is_armed(slot) || rtc_state.timers[slot].handler == TimerHandler::SLEEP) {
+      rtc_state.timers[slot].enabled = false;
+    }
+  }
+  if (this->timers_.is_armed(this->sleep_timer_)) {
+    // Not due while asleep, it must not cut the sleep short either.
+    this->timers_.cancel(this->sleep_timer_);
+  }
+  uint64_t sleep_ms = this->timers_.program_wakeup(TimerScheduler::now_ms());
+  ESP_LOGD(TAG, "Next wakeup in %" PRIu64 " ms (%u timers)", sleep_ms, (unsigned) this->timers_.size());
+  return sleep_ms;
 }
 
 }  // namespace nowtalk
@@ -5,9 +5,26 @@
 #include "esphome/core/helpers.h"
 #include "esphome/core/preferences.h"
 
-#include "../espnow/espnow.h"
+#include "esphome/components/espnow/espnow_component.h"
+#include "esphome/components/tx_scheduler/tx_scheduler.h"
+#ifdef USE_GROUP_CRYPTO
+#include "esphome/components/group_crypto/group_crypto.h"
+#endif
+#include "esphome/components/intercom_core/event_trace_hooks.h"
+
+#include "aggregator.h"
+#include "bulk_loopback.h"
+#include "bulk_transfer.h"
+#include "fleet_ota.h"
+#include "peer_cache.h"
+#include "roster.h"
+#include "switchboard.h"
+#include "switchboard_finder.h"
+#include "timer_scheduler.h"
 #include "variables.h"
 
+#include <esp_ota_ops.h>
+
 #include <array>
 #include <memory>
 #include <queue>
@@ -16,84 +33,175 @@
 namespace esphome {
 namespace nowtalk {
 
+#ifdef USE_GROUP_CRYPTO
+/// Largest request body of a sealed frame, the sealed request code and the seal come out of NOWTALK_MAX_BODY.
+static const uint8_t NOWTALK_SEALED_MAX_BODY = NOWTALK_MAX_BODY - 1 - group_crypto::GROUP_CRYPTO_OVERHEAD;
+#endif
+
+static const uint8_t NOWTALK_RTC_PEERS = 8;
+
+/// Radio state kept in RTC memory, so a badge waking from deep sleep can skip discovery and peer setup.
+struct nowtalk_rtc_state_t {
+  uint32_t magic;
+  uint8_t channel;
+  uint8_t peer_count;
+  uint8_t peers[NOWTALK_RTC_PEERS][6];
+  PeerCache routes;
+  /// Timers pending when the badge went to sleep, by slot. Their deadlines are on TimerScheduler::now_ms().
+  nowtalk_timer_t timers[NOWTALK_MAX_TIMERS];
+};
+
+enum class CallState : uint8_t {
+  IDLE,
+  DIALING,  // waiting for the callee's ACK or the switchboard's SEND_PEER
+  CONNECTED,
+};
+
+/// Time from start_call() until the peer is added and audio can flow, per way the call was set up.
+struct call_stats_t {
+  uint32_t direct{0};
+  uint32_t routed{0};
+  uint32_t direct_avg_us{0};  // EWMA
+  uint32_t routed_avg_us{0};  // EWMA
+  uint32_t last_us{0};
+};
 
-uint64_t getEfuseMac(void)
-{
-    uint64_t _chipmacid = 0LL;
-    esp_efuse_mac_get_default((uint8_t*) (&_chipmacid));
-    return _chipmacid;
-}
-
-std::vector<unsigned char> badgeID_;
-
-std::vector<unsigned char> badgeID(){
-    if (badgeID_.empty()) {
-        static char chars[] = "0123456789AbCdEfGhIjKlMnOpQrStUvWxYz"; //aBcDeFgHiJkLmNoPqRsTuVwXyZ
-        uint8_t base = sizeof(chars);
-
-        uint32_t chipId = 0xa5000000;
-        uint8_t crc = 0;
-        uint64_t mac = getEfuseMac() ;
-        for (int i = 0; i < 17; i = i + 8)
-        {
-            chipId |= ((mac >> (40 - i)) & 0xff) << i;
-        }
-
-        do {
-            badgeID_.push_back(baseChars[chipId % base]); // Add on the left
-            crc += chipId % base;
-            chipId /= base;
-        } while (chipId != 0);
-        badgeID_.push_back(baseChars[crc % base]);
-    }
-    return badgeID_;
-}
-
-std::string badgeIDStr() {
-    if (badgeID_.empty()) {
-        badgeID();
-    }
-    std::string result(badgeID_.begin(), badgeID_.end()) ;
-    return result;
-}
-
-bool checkBadgeID(std::vector< unsigned uint8_t > code) {
-    std::string baseChars = "0123456789AbCdEfGhIjKlMnOpQrStUvWxYz";
-    uint8_t baseCount = baseChars.size() + 1;
-    baseChars += "aBcDeFgHiJkLmNoPqRsTuVwXyZ";
-    uint8_t length = code.size();
-    uint16_t count = 0;
-    if (length != 8) return false;
-    for (int8_t index = 6; index >= 0; index--) {
-        std::string::size_type chr = code.at(index);
-        count += baseChars.find((char) chr);
-    }
-    uint8_t crc = count % baseCount;
-    std::string::size_type chr = code.at(7);
-    return crc == baseChars.find((char) chr);
-}
-
-
-class NowTalkClient  : public PollingComponent, public ESPNowProtocol {
+class NowTalkComponent : public Component,
+                         public Parented<espnow::ESPNowComponent> {
  public:
   void setup() override;
-  void on_receive(ESPNowPacket &packet) override;
-  void on_sent(ESPNowPacket &packet, bool status) override;
+  void loop() override;
+  void dump_config() override;
+  /// Also runs right before deep sleep, where it arms the wakeup for the earliest timer. A sleep_duration set on
+  /// the deep_sleep component takes precedence.
+  void on_safe_shutdown() override;
+
+  /// Push `size` bytes to `address` over NOWTALK_STREAM_*. Only one outgoing stream runs at a time.
+  bool send_stream(const uint8_t *address, BulkKind kind, uint32_t size, bulk_read_t &&read);
+  /// Push `size` bytes through the stream engines over a simulated link that loses `loss_percent` of the frames,
+  /// and log the goodput. Nothing goes on the air.
+  void run_stream_benchmark(uint32_t size, uint8_t loss_percent);
+  /// Where incoming stream chunks are written, e.g. a SPIFFS file or a flash partition.
+  void set_stream_writer(bulk_write_t &&write) { this->stream_rx_.set_write(std::move(write)); }
+  void add_on_stream_complete_callback(std::function<void(BulkKind, uint32_t)> &&callback) {
+    this->stream_complete_callback_.add(std::move(callback));
+  }
+
+  /// Switchboard: broadcast a firmware image of `size` bytes to every badge in range.
+  bool start_fleet_update(uint32_t size, bulk_read_t &&read);
+  /// Badge: accept firmware broadcast by the switchboard and flash it into the inactive OTA partition.
+  void set_accept_fleet_update(bool accept) { this->accept_fleet_update_ = accept; }
+  /// Run the switchboard side (roster epochs, fleet updates) instead of the badge side.
+  void set_switchboard(bool switchboard) { this->switchboard_ = switchboard; }
+  void set_tx_scheduler(tx_scheduler::TxScheduler *tx_scheduler) { this->tx_scheduler_ = tx_scheduler; }
+#ifdef USE_GROUP_CRYPTO
+  /// Seal every outgoing frame and drop frames that are not sealed with a group key.
+  void set_group_crypto(group_crypto::GroupCrypto *group_crypto);
+#endif
+  /// How long small control messages wait to share a frame with others for the same peer, 0 disables aggregation.
+  void set_coalesce_window(uint32_t window) { this->aggregator_.set_window(window); }
+  /// Badge: report a new presence status (NOWTALK_STATUS_*). Only a change costs a PING.
+  void set_status(uint8_t status) { this->roster_client_.set_status(status); }
+  bool is_peer_present(const uint8_t *address) const { return this->roster_client_.is_present(address); }
+  /// Badge: channel sweep dwell time and the RSSI under which a better switchboard is looked for.
+  void set_scan_dwell(uint32_t dwell) { this->finder_.set_dwell(dwell); }
+  void set_roam_threshold(int8_t rssi) { this->finder_.set_roam_threshold(rssi); }
+  /// Badge: time from losing the switchboard until the last reconnect, in ms.
+  uint32_t get_reconnect_time() const { return this->finder_.get_last_reconnect_time(); }
+
+  /// Badge: call `peer`. A badge called before on our channel is called directly and the switchboard is told in
+  /// parallel; otherwise the call goes through the switchboard.
+  bool start_call(const uint8_t *peer);
+  /// Badge: hang up, or stop dialing.
+  void end_call();
+  CallState get_call_state() const { return this->call_state_; }
+  const uint8_t *get_call_peer() const { return this->call_peer_.data(); }
+  /// Called with the peer when a call connects (true) and when it ends (false).
+  void add_on_call_callback(std::function<void(const uint8_t *, bool)> &&callback) {
+    this->call_callback_.add(std::move(callback));
+  }
+  const call_stats_t &get_call_stats() const { return this->call_stats_; }
 
-  uint32_t get_protocol_id() override { return 0x547c6b; }
-  std::string get_protocol_name() override { return "NowTalk Intergration"; }
  protected:
-  void load_config_(bool clear = false);
-  void save_config_();
-  std::string get_value_(std::string data, char separator, uint8_t index);
-
+  bool send_frame_(const uint8_t *address, uint8_t code, const uint8_t *data, size_t len);
+  bool send_raw_(const uint8_t *address, uint8_t code, const uint8_t *data, size_t len);
+  void handle_frame_(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size);
+  void handle_message_(const espnow::ESPNowRecvInfo &info, uint8_t code, const uint8_t *body, size_t len, uint32_t now);
+  bool is_switchboard_(const uint8_t *address);
+  void setup_fleet_update_();
+  /// Add an ESP-NOW peer and remember it for the next fast resume.
+  void add_peer_(const uint8_t *address);
+  bool restore_rtc_state_();
+  /// Setup that is not needed before the first audio frame; delayed on a fast resume.
+  void deferred_setup_();
+  void handle_call_message_(const uint8_t *src, uint8_t code, const uint8_t *body, size_t len);
+  void call_connected_(const uint8_t *peer, bool direct);
+  void call_ended_();
+
+  /// Badge: arm the SLEEP timer from config_.timerSleep. The roster client arms its own keepalive PING.
+  void arm_timers_();
+  /// A call, a transfer or intercom audio is running.
+  bool is_busy_(uint32_t now);
+  /// SLEEP timer: go to deep sleep unless the badge is busy.
+  void enter_sleep_();
+  /// Keep the pending timers in RTC memory and arm the RTC wakeup for the earliest one, returns the sleep time in ms.
+  uint64_t prepare_sleep_();
+
+  /// Settings kept in flash, loaded by deferred_setup_().
   ESPPreferenceObject cfg_;
-  nowTalkConfig config_; //
+  config_t config_{};
+  tx_scheduler::TxScheduler *tx_scheduler_{nullptr};
+#ifdef USE_GROUP_CRYPTO
+  group_crypto::GroupCrypto *group_crypto_{nullptr};
+#endif
+  uint8_t chunk_size_{BULK_MAX_CHUNK_SIZE};
+  FrameAggregator aggregator_;
 
   nowtalk_t circbuf[QUEUE_SIZE] = {};
+  TimerScheduler timers_;
+  int8_t ping_timer_{NOWTALK_NO_TIMER};
+  int8_t sleep_timer_{NOWTALK_NO_TIMER};
+
+  BulkSender stream_tx_;
+  BulkReceiver stream_rx_;
+  espnow::peer_address_t stream_peer_{};    // destination of the outgoing stream
+  espnow::peer_address_t stream_source_{};  // origin of the incoming stream
+  uint8_t stream_counter_{0};
+  CallbackManager<void(BulkKind, uint32_t)> stream_complete_callback_{};
+
+  bool fast_resume_{false};
+  bool deferred_done_{false};
+  uint32_t resume_us_{0};
+  uint32_t deferred_us_{0};
+
+  CallState call_state_{CallState::IDLE};
+  espnow::peer_address_t call_peer_{};
+  uint32_t call_started_us_{0};
+  uint32_t call_dialed_{0};
+  call_stats_t call_stats_{};
+  CallbackManager<void(const uint8_t *, bool)> call_callback_{};
+
+  bool switchboard_{false};
+  RosterServer roster_server_;
+  SwitchboardEngine switchboard_engine_;
+  RosterClient roster_client_;
+  SwitchboardFinder finder_;
+
+  FleetOtaSender fleet_tx_;
+  // Blocks are paced a few ms apart, well below the default loop interval.
+  HighFrequencyLoopRequester fleet_high_freq_;
+  FleetOtaReceiver fleet_rx_;
+  bool accept_fleet_update_{false};
+  esp_ota_handle_t ota_handle_{0};
+  const esp_partition_t *ota_partition_{nullptr};
+};
+
+template<typename... Ts> class StreamBenchmarkAction : public Action<Ts...>, public Parented<NowTalkComponent> {
+ public:
+  TEMPLATABLE_VALUE(uint32_t, size)
+  TEMPLATABLE_VALUE(uint8_t, loss)
 
-  std::string inputString_ = "";     // a String to hold incoming data
-  bool stringComplete_ = false; // whether the string is complete
+  void play(Ts... x) override { this->parent_->run_stream_benchmark(this->size_.value(x...), this->loss_.value(x...)); }
 };
 
 
@@ -0,0 +1,46 @@
+#include "peer_cache.h"
+
+#include <cstring>
+
+namespace esphome {
+namespace nowtalk {
+
+const peer_route_t *PeerCache::find(const uint8_t *mac) const {
+  for (const peer_route_t &route : this->routes_) {
+    if (route.used && memcmp(route.mac, mac, 6) == 0) {
+      return &route;
+    }
+  }
+  return nullptr;
+}
+
+void PeerCache::put(const uint8_t *mac, uint8_t channel) {
+  peer_route_t *slot = const_cast<peer_route_t *>(this->find(mac));
+  if (slot == nullptr) {
+    // A free entry, or the one unused for longest.
+    slot = &this->routes_[0];
+    for (peer_route_t &route : this->routes_) {
+      if (!route.used) {
+        slot = &route;
+        break;
+      }
+      if (route.last_used < slot->last_used) {
+        slot = &route;
+      }
+    }
+    memcpy(slot->mac, mac, 6);
+    slot->used = true;
+  }
+  slot->channel = channel;
+  slot->last_used = ++this->clock_;
+}
+
+void PeerCache::remove(const uint8_t *mac) {
+  peer_route_t *route = const_cast<peer_route_t *>(this->find(mac));
+  if (route != nullptr) {
+    route->used = false;
+  }
+}
+
+}  // namespace nowtalk
+}  // namespace esphome
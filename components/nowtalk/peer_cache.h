@@ -0,0 +1,38 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace nowtalk {
+
+/// Badges a badge remembers a route to. A handful covers the people someone actually calls.
+static const uint8_t PEER_CACHE_SIZE = 8;
+
+struct peer_route_t {
+  uint8_t mac[6];
+  uint8_t channel;  // WiFi channel the badge was reached on
+  bool used;
+  uint32_t last_used;  // value of the cache's use counter, the lowest is evicted first
+};
+
+/// Routes to recently called badges, so a repeat call can go to the callee directly instead of through the
+/// switchboard. Eviction is least recently used. Ages are a use counter rather than a time, so the order holds
+/// across the clock restarts of deep sleep.
+class PeerCache {
+ public:
+  /// Route to `mac`, or nullptr. Looking a route up does not make it recent, only put() does.
+  const peer_route_t *find(const uint8_t *mac) const;
+  /// Add or refresh the route to `mac` as the most recently used.
+  void put(const uint8_t *mac, uint8_t channel);
+  void remove(const uint8_t *mac);
+  void clear() { this->routes_ = {}; }
+
+ protected:
+  std::array<peer_route_t, PEER_CACHE_SIZE> routes_{};
+  uint32_t clock_{0};
+};
+
+}  // namespace nowtalk
+}  // namespace esphome
@@ -0,0 +1,67 @@
+#pragma once
+
+/// Every NowTalk frame starts with [NOWTALK_HEADER][request code], followed by the request body.
+#define NOWTALK_HEADER 0x4e
+#define NOWTALK_HEADER_SIZE 2
+/// Largest request body of a plain frame, an ESP-NOW frame carries at most 250 bytes. Every payload budget derives
+/// from this one.
+#define NOWTALK_MAX_BODY (250 - NOWTALK_HEADER_SIZE)
+
+/// Request message codes :
+
+#define NOWTALK_CLIENT_PING 0x01
+#define NOWTALK_SERVER_PONG 0x02
+#define NOWTALK_SERVER_REQUEST_DETAILS 0x03
+#define NOWTALK_CLIENT_DETAILS 0x04
+#define NOWTALK_CLIENT_NEWPEER 0x05
+#define NOWTALK_CLIENT_PROBE 0x06
+
+#define NOWTALK_SERVER_ACCEPT 0x07
+#define NOWTALK_SERVER_BEACON 0x08
+
+#define NOWTALK_SERVER_NEW_NAME 0x0d
+#define NOWTALK_SERVER_NEW_IP 0x0e
+
+#define NOWTALK_CLIENT_ACK 0x10
+#define NOWTALK_CLIENT_NACK 0x11
+
+#define NOWTALK_CLIENT_START_CALL 0x30
+#define NOWTALK_SERVER_SEND_PEER 0x31
+#define NOWTALK_SERVER_PEER_GONE 0x32
+#define NOWTALK_SERVER_OVER_WEB 0x33
+#define NOWTALK_SERVER_ROSTER 0x34
+/// Badge to badge call setup over a cached route, answered with ACK or NACK [DIRECT_CALL][reason].
+#define NOWTALK_CLIENT_DIRECT_CALL 0x35
+
+#define NOWTALK_CLIENT_REQUEST 0x37
+#define NOWTALK_CLIENT_RECEIVE 0x38
+#define NOWTALK_CLIENT_CLOSED 0x39
+
+/// [sealed [code][body]], a frame protected by group_crypto.
+#define NOWTALK_SECURE 0x3b
+/// Several small messages for the same peer in one frame, see FrameAggregator.
+#define NOWTALK_AGGREGATE 0x3c
+
+#define NOWTALK_STREAM_START 0x3d
+#define NOWTALK_STREAM_DATA 0x3e
+#define NOWTALK_STREAM_END 0x3f
+
+#define NOWTALK_OTA_ANNOUNCE 0x40
+#define NOWTALK_OTA_BLOCK 0x41
+#define NOWTALK_OTA_ROUND_END 0x42
+#define NOWTALK_OTA_NACK 0x43
+#define NOWTALK_OTA_DONE 0x44
+
+
+#define NOWTALK_CLIENT_HELPSOS 0xff
+
+
+
+#define NOWTALK_STATUS_GONE 0x00
+#define NOWTALK_STATUS_ALIVE 0x01
+#define NOWTALK_STATUS_GUEST 0x02
+
+
+#define NOWTALK_PEER_MEMBER 0x10
+#define NOWTALK_PEER_FRIEND 0x20
+#define NOWTALK_PEER_BLOCKED 0x80
@@ -0,0 +1,384 @@
+#include "roster.h"
+#include "protocol.h"
+
+#include <cstring>
+
+namespace esphome {
+namespace nowtalk {
+
+static const uint8_t ROSTER_HEADER_SIZE = 4;  // [epoch:2][base:2]
+static const uint16_t ROSTER_DUMP = 0xffff;   // base of a unicast dump page: [epoch:2][0xffff][page]
+static const uint8_t ROSTER_ASSIGN = 0x80;
+static const uint8_t ROSTER_MAX_FRAME = 232;  // leaves room for the group_crypto overhead
+static const uint8_t ROSTER_DUMP_PER_PAGE = (ROSTER_MAX_FRAME - ROSTER_HEADER_SIZE - 1) / 8;
+
+static void put_u16(uint8_t *buffer, uint16_t value) {
+  buffer[0] = value & 0xff;
+  buffer[1] = value >> 8;
+}
+
+static uint16_t get_u16(const uint8_t *buffer) { return buffer[0] | (buffer[1] << 8); }
+
+static size_t put_record(uint8_t *buffer, uint8_t slot, const roster_entry_t &entry, bool assigned) {
+  if (!assigned) {
+    buffer[0] = slot;
+    buffer[1] = entry.status;
+    return 2;
+  }
+  buffer[0] = slot | ROSTER_ASSIGN;
+  buffer[1] = entry.status;
+  memcpy(buffer + 2, entry.mac, 6);
+  return 8;
+}
+
+static uint16_t mac_hash(const uint8_t *mac) {
+  // The vendor prefix is shared by most badges, the last three bytes carry the entropy.
+  return (mac[5] ^ (mac[4] * 31) ^ (mac[3] * 131)) % ROSTER_INDEX_SIZE;
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// RosterServer
+
+uint8_t RosterServer::find(const uint8_t *mac) const {
+  for (uint16_t i = mac_hash(mac), probes = 0; probes < ROSTER_INDEX_SIZE; i = (i + 1) % ROSTER_INDEX_SIZE, probes++) {
+    uint8_t slot = this->index_[i];
+    if (slot == NOWTALK_NO_SLOT) {
+      break;
+    }
+    if (memcmp(this->entries_[slot].mac, mac, 6) == 0) {
+      return slot;
+    }
+  }
+  return NOWTALK_NO_SLOT;
+}
+
+void RosterServer::index_insert_(uint8_t slot) {
+  uint16_t i = mac_hash(this->entries_[slot].mac);
+  while (this->index_[i] != NOWTALK_NO_SLOT) {
+    i = (i + 1) % ROSTER_INDEX_SIZE;
+  }
+  this->index_[i] = slot;
+}
+
+void RosterServer::rebuild_index_() {
+  this->index_.fill(NOWTALK_NO_SLOT);
+  for (uint8_t slot = 0; slot < NOWTALK_ROSTER_SIZE; slot++) {
+    if (this->entries_[slot].known) {
+      this->index_insert_(slot);
+    }
+  }
+}
+
+uint8_t RosterServer::get_count() const {
+  uint8_t count = 0;
+  for (const roster_entry_t &entry : this->entries_) {
+    count += entry.known && entry.status != NOWTALK_STATUS_GONE;
+  }
+  return count;
+}
+
+void RosterServer::mark_(uint8_t slot, bool assigned) {
+  this->changed_.set(slot);
+  if (assigned) {
+    this->assigned_.set(slot);
+  }
+}
+
+uint8_t RosterServer::touch(const uint8_t *mac, uint8_t status, uint32_t now) {
+  uint8_t slot = this->find(mac);
+  if (slot == NOWTALK_NO_SLOT) {
+    // Prefer a never used slot, then the one that has been gone the longest.
+    uint32_t oldest = 0;
+    for (uint8_t i = 0; i < NOWTALK_ROSTER_SIZE; i++) {
+      const roster_entry_t &entry = this->entries_[i];
+      if (!entry.known) {
+        slot = i;
+        break;
+      }
+      if (entry.status == NOWTALK_STATUS_GONE && now - entry.last_seen >= oldest) {
+        oldest = now - entry.last_seen;
+        slot = i;
+      }
+    }
+    if (slot == NOWTALK_NO_SLOT) {
+      return NOWTALK_NO_SLOT;
+    }
+    roster_entry_t &entry = this->entries_[slot];
+    bool reused = entry.known;
+    memcpy(entry.mac, mac, 6);
+    entry.known = true;
+    entry.status = status;
+    this->mark_(slot, true);
+    // Taking over a slot leaves the old MAC in the index, that only happens once the table has filled up.
+    if (reused) {
+      this->rebuild_index_();
+    } else {
+      this->index_insert_(slot);
+    }
+  } else if (this->entries_[slot].status != status) {
+    this->entries_[slot].status = status;
+    this->mark_(slot, false);
+  }
+  this->entries_[slot].last_seen = now;
+  return slot;
+}
+
+void RosterServer::seen(const uint8_t *mac, uint32_t now) {
+  uint8_t slot = this->find(mac);
+  if (slot != NOWTALK_NO_SLOT) {
+    this->entries_[slot].last_seen = now;
+  }
+}
+
+void RosterServer::remove(const uint8_t *mac) {
+  uint8_t slot = this->find(mac);
+  if (slot != NOWTALK_NO_SLOT && this->entries_[slot].status != NOWTALK_STATUS_GONE) {
+    this->entries_[slot].status = NOWTALK_STATUS_GONE;
+    this->mark_(slot, false);
+  }
+}
+
+void RosterServer::loop(uint32_t now) {
+  if (now - this->last_tick_ < this->epoch_interval_) {
+    return;
+  }
+  this->last_tick_ = now;
+
+  for (uint8_t slot = 0; slot < NOWTALK_ROSTER_SIZE; slot++) {
+    roster_entry_t &entry = this->entries_[slot];
+    if (entry.known && entry.status != NOWTALK_STATUS_GONE && now - entry.last_seen > this->expire_after_) {
+      entry.status = NOWTALK_STATUS_GONE;
+      this->mark_(slot, false);
+    }
+  }
+
+  if (this->changed_.any()) {
+    this->send_delta_();
+  } else if (++this->ticks_ >= this->keyframe_every_) {
+    this->send_keyframe_();
+  }
+}
+
+void RosterServer::send_delta_() {
+  // Changes that do not fit in one frame carry over to the next epoch, each frame bumps the epoch by one.
+  while (this->changed_.any()) {
+    uint8_t buffer[ROSTER_MAX_FRAME];
+    size_t len = ROSTER_HEADER_SIZE;
+    put_u16(buffer + 2, this->epoch_);
+    for (uint8_t slot = 0; slot < NOWTALK_ROSTER_SIZE; slot++) {
+      if (!this->changed_.test(slot)) {
+        continue;
+      }
+      bool assigned = this->assigned_.test(slot);
+      if (len + (assigned ? 8 : 2) > sizeof(buffer)) {
+        break;
+      }
+      len += put_record(buffer + len, slot, this->entries_[slot], assigned);
+      this->changed_.reset(slot);
+      this->assigned_.reset(slot);
+    }
+    // 0xffff marks a dump page in the base field, so the epoch never takes that value.
+    if (++this->epoch_ == ROSTER_DUMP) {
+      this->epoch_ = 0;
+    }
+    put_u16(buffer, this->epoch_);
+    this->frames_++;
+    this->send_(NOWTALK_SERVER_ROSTER, buffer, len);
+  }
+}
+
+void RosterServer::send_keyframe_() {
+  uint8_t buffer[ROSTER_HEADER_SIZE + NOWTALK_ROSTER_SIZE / 8] = {};
+  this->ticks_ = 0;
+  put_u16(buffer, this->epoch_);
+  put_u16(buffer + 2, this->epoch_);
+  for (uint8_t slot = 0; slot < NOWTALK_ROSTER_SIZE; slot++) {
+    if (this->entries_[slot].known && this->entries_[slot].status != NOWTALK_STATUS_GONE) {
+      buffer[ROSTER_HEADER_SIZE + (slot >> 3)] |= 1 << (slot & 7);
+    }
+  }
+  this->frames_++;
+  this->send_(NOWTALK_SERVER_ROSTER, buffer, sizeof(buffer));
+}
+
+bool RosterServer::send_dump(uint8_t page, const bulk_send_t &send) {
+  uint8_t buffer[ROSTER_MAX_FRAME];
+  size_t len = ROSTER_HEADER_SIZE + 1;
+  put_u16(buffer, this->epoch_);
+  put_u16(buffer + 2, ROSTER_DUMP);
+  buffer[4] = page;
+  uint16_t skip = page * ROSTER_DUMP_PER_PAGE;
+  bool more = false;
+  for (uint8_t slot = 0; slot < NOWTALK_ROSTER_SIZE; slot++) {
+    const roster_entry_t &entry = this->entries_[slot];
+    if (!entry.known || entry.status == NOWTALK_STATUS_GONE) {
+      continue;
+    }
+    if (skip > 0) {
+      skip--;
+      continue;
+    }
+    if (len + 8 > sizeof(buffer)) {
+      more = true;
+      break;
+    }
+    len += put_record(buffer + len, slot, entry, true);
+  }
+  if (page > 0 && len == ROSTER_HEADER_SIZE + 1) {
+    return false;
+  }
+  this->frames_++;
+  send(NOWTALK_SERVER_ROSTER, buffer, len);
+  return more;
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// RosterClient
+
+void RosterClient::set_own_mac(const uint8_t *mac) { memcpy(this->own_mac_, mac, 6); }
+
+void RosterClient::set_status(uint8_t status) {
+  if (status != this->status_) {
+    this->status_ = status;
+    this->ping_needed_ = true;
+  }
+}
+
+void RosterClient::reset() {
+  this->entries_ = {};
+  this->own_slot_ = NOWTALK_NO_SLOT;
+  this->epoch_ = 0;
+  this->synced_ = false;
+  this->ping_needed_ = true;
+}
+
+bool RosterClient::is_present(const uint8_t *mac) const {
+  for (const roster_entry_t &entry : this->entries_) {
+    if (entry.known && entry.status != NOWTALK_STATUS_GONE && memcmp(entry.mac, mac, 6) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint8_t RosterClient::get_count() const {
+  uint8_t count = 0;
+  for (const roster_entry_t &entry : this->entries_) {
+    count += entry.status != NOWTALK_STATUS_GONE;
+  }
+  return count;
+}
+
+void RosterClient::set_entry_(uint8_t slot, uint8_t status, const uint8_t *mac) {
+  roster_entry_t &entry = this->entries_[slot];
+  bool changed = entry.status != status;
+  if (mac != nullptr) {
+    changed |= !entry.known || memcmp(entry.mac, mac, 6) != 0;
+    memcpy(entry.mac, mac, 6);
+    entry.known = true;
+  }
+  entry.status = status;
+  if (entry.known && memcmp(entry.mac, this->own_mac_, 6) == 0) {
+    this->own_slot_ = slot;
+    if (status != this->status_) {
+      // The switchboard has a stale view of us (e.g. expired us), correct it.
+      this->ping_needed_ = true;
+    }
+  }
+  if (changed && this->on_change_) {
+    this->on_change_(entry);
+  }
+}
+
+void RosterClient::apply_records_(const uint8_t *data, size_t len) {
+  size_t pos = 0;
+  while (pos + 2 <= len) {
+    uint8_t slot = data[pos] & ~ROSTER_ASSIGN;
+    bool assigned = data[pos] & ROSTER_ASSIGN;
+    if (slot >= NOWTALK_ROSTER_SIZE || (assigned && pos + 8 > len)) {
+      return;
+    }
+    this->set_entry_(slot, data[pos + 1], assigned ? data + pos + 2 : nullptr);
+    pos += assigned ? 8 : 2;
+  }
+}
+
+void RosterClient::on_roster(const uint8_t *data, size_t len, uint32_t now) {
+  if (len < ROSTER_HEADER_SIZE) {
+    return;
+  }
+  uint16_t epoch = get_u16(data);
+  uint16_t base = get_u16(data + 2);
+
+  if (base == ROSTER_DUMP) {
+    if (len < ROSTER_HEADER_SIZE + 1) {
+      return;
+    }
+    if (data[4] == 0) {
+      for (uint8_t slot = 0; slot < NOWTALK_ROSTER_SIZE; slot++) {
+        if (this->entries_[slot].status != NOWTALK_STATUS_GONE) {
+          this->set_entry_(slot, NOWTALK_STATUS_GONE, nullptr);
+        }
+      }
+    }
+    this->apply_records_(data + ROSTER_HEADER_SIZE + 1, len - ROSTER_HEADER_SIZE - 1);
+    this->epoch_ = epoch;
+    this->synced_ = true;
+  } else if (base == epoch) {
+    if (len < ROSTER_HEADER_SIZE + NOWTALK_ROSTER_SIZE / 8) {
+      return;
+    }
+    const uint8_t *bitmap = data + ROSTER_HEADER_SIZE;
+    bool unknown = false;
+    for (uint8_t slot = 0; slot < NOWTALK_ROSTER_SIZE; slot++) {
+      bool present = (bitmap[slot >> 3] >> (slot & 7)) & 1;
+      roster_entry_t &entry = this->entries_[slot];
+      if (!present && entry.status != NOWTALK_STATUS_GONE) {
+        this->set_entry_(slot, NOWTALK_STATUS_GONE, nullptr);
+      } else if (present && !entry.known) {
+        unknown = true;
+      } else if (present && entry.status == NOWTALK_STATUS_GONE) {
+        this->set_entry_(slot, NOWTALK_STATUS_ALIVE, nullptr);
+      }
+    }
+    bool self_missing =
+        this->own_slot_ == NOWTALK_NO_SLOT || !((bitmap[this->own_slot_ >> 3] >> (this->own_slot_ & 7)) & 1);
+    this->epoch_ = epoch;
+    this->synced_ = !unknown;
+    // Ask for a dump when slots are present we have no mac for, or the switchboard forgot us.
+    this->ping_needed_ |= unknown || self_missing;
+  } else if (this->synced_ && base == this->epoch_) {
+    this->apply_records_(data + ROSTER_HEADER_SIZE, len - ROSTER_HEADER_SIZE);
+    this->epoch_ = epoch;
+  } else {
+    // Missed a delta; presence is resynchronised by the next keyframe.
+    this->synced_ = false;
+  }
+}
+
+void RosterClient::on_pong(const uint8_t *data, size_t len, uint32_t now) {
+  if (len >= 1 && data[0] < NOWTALK_ROSTER_SIZE) {
+    this->own_slot_ = data[0];
+  }
+}
+
+void RosterClient::ping_(uint32_t now) {
+  // [status][epoch:2][synced]; an unsynced badge gets a roster dump with the PONG.
+  uint8_t buffer[4] = {this->status_, 0, 0, this->synced_};
+  put_u16(buffer + 1, this->epoch_);
+  this->ping_needed_ = false;
+  this->pings_++;
+  this->send_(NOWTALK_CLIENT_PING, buffer, sizeof(buffer));
+  if (this->schedule_) {
+    this->schedule_(this->keepalive_);
+  }
+}
+
+void RosterClient::loop(uint32_t now) {
+  if (this->ping_needed_) {
+    this->ping_(now);
+  }
+}
+
+}  // namespace nowtalk
+}  // namespace esphome
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "bulk_transfer.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome {
+namespace nowtalk {
+
+static const uint8_t NOWTALK_ROSTER_SIZE = 128;
+static const uint8_t NOWTALK_NO_SLOT = 0xff;
+/// Open addressing index from MAC to slot, twice the roster size so probe chains stay short.
+static const uint16_t ROSTER_INDEX_SIZE = 2 * NOWTALK_ROSTER_SIZE;
+
+struct roster_entry_t {
+  uint8_t mac[6];
+  uint8_t status;      // NOWTALK_STATUS_*
+  bool known;          // mac is valid for this slot
+  uint32_t last_seen;  // server only
+};
+
+/// Fixed 128 bit set, one bit per roster slot.
+struct roster_bits_t {
+  std::array<uint32_t, NOWTALK_ROSTER_SIZE / 32> words{};
+
+  void set(uint8_t slot) { this->words[slot >> 5] |= 1UL << (slot & 31); }
+  void reset(uint8_t slot) { this->words[slot >> 5] &= ~(1UL << (slot & 31)); }
+  bool test(uint8_t slot) const { return (this->words[slot >> 5] >> (slot & 31)) & 1; }
+  bool any() const { return (this->words[0] | this->words[1] | this->words[2] | this->words[3]) != 0; }
+  void clear() { this->words.fill(0); }
+};
+
+/// Switchboard side of the roster.
+///
+/// Presence is collected from every frame a badge sends and published in numbered epochs as NOWTALK_SERVER_ROSTER
+/// broadcasts:
+///
+///  delta     [epoch:2][base:2] records...      applies on top of epoch `base`
+///  keyframe  [epoch:2][epoch:2][bitmap:16]     base == epoch, one presence bit per slot
+///
+/// A record is [slot][status] for a known slot or [slot | 0x80][status][mac:6] when the slot is (re)assigned.
+/// Epochs without changes are not sent at all; a keyframe goes out every `keyframe_every` epoch ticks so badges
+/// that missed a delta resynchronise and know the switchboard is still there.
+class RosterServer {
+ public:
+  void set_send(bulk_send_t &&send) { this->send_ = std::move(send); }
+  void set_epoch_interval(uint32_t interval) { this->epoch_interval_ = interval; }
+  void set_keyframe_every(uint8_t ticks) { this->keyframe_every_ = ticks; }
+  /// A badge that was not heard from for this long is marked gone. Keep it above the badge keepalive.
+  void set_expire_after(uint32_t time) { this->expire_after_ = time; }
+
+  /// Record that `mac` is alive with `status`. Returns its slot or NOWTALK_NO_SLOT when the table is full.
+  uint8_t touch(const uint8_t *mac, uint8_t status, uint32_t now);
+  /// Refresh the liveness of a known badge without changing its status. Any frame from a badge counts.
+  void seen(const uint8_t *mac, uint32_t now);
+  /// Mark a badge as gone right away, e.g. when it announces it goes to sleep.
+  void remove(const uint8_t *mac);
+  void loop(uint32_t now);
+  /// Unicast page `page` of the full roster (assignment records for all present slots) via `send`.
+  /// Returns false when `page` is past the end.
+  bool send_dump(uint8_t page, const bulk_send_t &send);
+
+  uint8_t find(const uint8_t *mac) const;
+  uint16_t get_epoch() const { return this->epoch_; }
+  uint8_t get_count() const;
+  const roster_entry_t &get(uint8_t slot) const { return this->entries_[slot]; }
+  uint32_t get_frames() const { return this->frames_; }
+
+ protected:
+  static std::array<uint8_t, ROSTER_INDEX_SIZE> make_empty_index_() {
+    std::array<uint8_t, ROSTER_INDEX_SIZE> index;
+    index.fill(NOWTALK_NO_SLOT);
+    return index;
+  }
+  void mark_(uint8_t slot, bool assigned);
+  void send_delta_();
+  void send_keyframe_();
+  void index_insert_(uint8_t slot);
+  void rebuild_index_();
+
+  bulk_send_t send_{};
+  std::array<roster_entry_t, NOWTALK_ROSTER_SIZE> entries_{};
+  // Every request from a badge starts with a lookup, with a hundred badges a linear scan adds up.
+  std::array<uint8_t, ROSTER_INDEX_SIZE> index_ = make_empty_index_();
+  roster_bits_t changed_{};
+  roster_bits_t assigned_{};  // changed slots that need their mac in the next delta
+
+  uint16_t epoch_{0};
+  uint32_t epoch_interval_{5000};
+  uint8_t keyframe_every_{12};
+  uint8_t ticks_{0};
+  uint32_t expire_after_{600000};
+  uint32_t last_tick_{0};
+  uint32_t frames_{0};
+};
+
+/// Badge side of the roster. Applies deltas incrementally and only pings the switchboard when its own state
+/// changed, when the roster shows it as gone, or when the long keepalive runs out.
+class RosterClient {
+ public:
+  /// Unicast to the switchboard.
+  void set_send(bulk_send_t &&send) { this->send_ = std::move(send); }
+  void set_keepalive(uint32_t interval) { this->keepalive_ = interval; }
+  /// Arms the keepalive PING timer `delay` ms out; called after every PING, so any PING pushes the keepalive back.
+  /// The timer calls request_ping().
+  void set_schedule(std::function<void(uint32_t)> &&schedule) { this->schedule_ = std::move(schedule); }
+  void set_own_mac(const uint8_t *mac);
+  void set_on_change(std::function<void(const roster_entry_t &)> &&callback) { this->on_change_ = std::move(callback); }
+
+  void set_status(uint8_t status);
+  /// Ping at the next loop() whether or not anything changed, for the keepalive PING timer.
+  void request_ping() { this->ping_needed_ = true; }
+  /// Forget everything learned from the old switchboard after moving to another one.
+  void reset();
+  void on_roster(const uint8_t *data, size_t len, uint32_t now);
+  /// PONG body [slot][epoch:2], the switchboard's answer to our PING.
+  void on_pong(const uint8_t *data, size_t len, uint32_t now);
+  void loop(uint32_t now);
+
+  bool is_present(const uint8_t *mac) const;
+  uint8_t get_count() const;
+  uint16_t get_epoch() const { return this->epoch_; }
+  bool is_synced() const { return this->synced_; }
+  const roster_entry_t &get(uint8_t slot) const { return this->entries_[slot]; }
+  uint32_t get_pings() const { return this->pings_; }
+
+ protected:
+  void set_entry_(uint8_t slot, uint8_t status, const uint8_t *mac);
+  void apply_records_(const uint8_t *data, size_t len);
+  void ping_(uint32_t now);
+
+  bulk_send_t send_{};
+  std::function<void(const roster_entry_t &)> on_change_{};
+  std::function<void(uint32_t)> schedule_{};
+  std::array<roster_entry_t, NOWTALK_ROSTER_SIZE> entries_{};
+
+  uint8_t own_mac_[6]{};
+  uint8_t own_slot_{NOWTALK_NO_SLOT};
+  uint8_t status_{0x01};  // NOWTALK_STATUS_ALIVE
+  uint16_t epoch_{0};
+  bool synced_{false};
+  bool ping_needed_{true};
+  uint32_t keepalive_{240000};
+  uint32_t pings_{0};
+};
+
+}  // namespace nowtalk
+}  // namespace esphome
@@ -0,0 +1,195 @@
+#include "switchboard.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace esphome {
+namespace nowtalk {
+
+/// How often calls are checked for badges that dropped out of the roster.
+static const uint32_t SWITCHBOARD_EXPIRE_INTERVAL = 1000;
+
+SwitchboardEngine::SwitchboardEngine() {
+  this->handlers_[NOWTALK_CLIENT_PING] = &SwitchboardEngine::on_ping_;
+  this->handlers_[NOWTALK_CLIENT_START_CALL] = &SwitchboardEngine::on_start_call_;
+  this->handlers_[NOWTALK_CLIENT_CLOSED] = &SwitchboardEngine::on_closed_;
+}
+
+bool SwitchboardEngine::submit(const uint8_t *mac, uint8_t code, const uint8_t *body, size_t len, uint32_t now_us) {
+  if (len > SWITCHBOARD_MAX_BODY || this->queue_count_ == SWITCHBOARD_QUEUE_SIZE) {
+    this->stats_.dropped++;
+    return false;
+  }
+  request_t &request = this->queue_[(this->queue_head_ + this->queue_count_) % SWITCHBOARD_QUEUE_SIZE];
+  memcpy(request.mac, mac, 6);
+  request.code = code;
+  request.len = len;
+  if (len > 0) {
+    memcpy(request.body, body, len);
+  }
+  request.queued_us = now_us;
+  this->queue_count_++;
+  return true;
+}
+
+void SwitchboardEngine::process(uint32_t now, uint32_t now_us) {
+  if (this->roster_ == nullptr) {
+    return;
+  }
+  if (this->queue_count_ > 0) {
+    this->stats_.batches++;
+  }
+  while (this->queue_count_ > 0) {
+    const request_t &request = this->queue_[this->queue_head_];
+    this->stats_.requests++;
+    handler_t handler = this->handlers_[request.code];
+    uint8_t slot = this->roster_->find(request.mac);
+    if (handler != nullptr) {
+      (this->*handler)(request, slot, now, now_us);
+    }
+    this->queue_head_ = (this->queue_head_ + 1) % SWITCHBOARD_QUEUE_SIZE;
+    this->queue_count_--;
+  }
+  if (now - this->last_expire_ >= SWITCHBOARD_EXPIRE_INTERVAL) {
+    this->last_expire_ = now;
+    this->expire_calls_(now_us);
+  }
+  this->flush_(now_us);
+}
+
+uint8_t SwitchboardEngine::get_active_calls() const {
+  uint8_t count = 0;
+  for (const call_t &call : this->calls_) {
+    count += call.peer != NOWTALK_NO_SLOT;
+  }
+  return count / 2;
+}
+
+void SwitchboardEngine::on_ping_(const request_t &request, uint8_t slot, uint32_t now, uint32_t now_us) {
+  if (request.len < 4) {
+    return;
+  }
+  uint8_t reply[3];
+  reply[0] = this->roster_->touch(request.mac, request.body[0], now);
+  reply[1] = this->roster_->get_epoch() & 0xff;
+  reply[2] = this->roster_->get_epoch() >> 8;
+  if (reply[0] == NOWTALK_NO_SLOT) {
+    // Roster full: the PONG tells the badge, there is no slot to queue a reply under.
+    this->send_(request.mac, NOWTALK_SERVER_PONG, reply, sizeof(reply));
+    this->stats_.replies++;
+    return;
+  }
+  this->reply_(reply[0], NOWTALK_SERVER_PONG, reply, sizeof(reply), request.queued_us, now_us);
+  if (!request.body[3]) {
+    // The dump follows the PONG, so what is queued so far goes out first.
+    this->flush_(now_us);
+    bulk_send_t send = [this, &request](uint8_t code, const uint8_t *data, size_t len) {
+      return this->send_(request.mac, code, data, len);
+    };
+    for (uint8_t page = 0; this->roster_->send_dump(page, send); page++) {
+    }
+  }
+}
+
+void SwitchboardEngine::on_start_call_(const request_t &request, uint8_t slot, uint32_t now, uint32_t now_us) {
+  if (slot == NOWTALK_NO_SLOT) {
+    uint8_t nack[2] = {NOWTALK_CLIENT_START_CALL, SWITCHBOARD_NOT_REGISTERED};
+    this->send_(request.mac, NOWTALK_CLIENT_NACK, nack, sizeof(nack));
+    this->stats_.replies++;
+    return;
+  }
+  if (request.len < 6) {
+    return;
+  }
+  uint8_t peer = this->roster_->find(request.body);
+  if (peer == NOWTALK_NO_SLOT || peer == slot || this->roster_->get(peer).status == NOWTALK_STATUS_GONE) {
+    this->reply_(slot, NOWTALK_SERVER_PEER_GONE, request.body, 6, request.queued_us, now_us);
+    return;
+  }
+  if (this->calls_[peer].peer == slot) {
+    // Repeated request for the call we already set up, the SEND_PEER may have been lost.
+    this->reply_(slot, NOWTALK_SERVER_SEND_PEER, request.body, 6, request.queued_us, now_us);
+    return;
+  }
+  if (this->calls_[peer].peer != NOWTALK_NO_SLOT) {
+    uint8_t nack[2] = {NOWTALK_CLIENT_START_CALL, SWITCHBOARD_BUSY};
+    this->reply_(slot, NOWTALK_CLIENT_NACK, nack, sizeof(nack), request.queued_us, now_us);
+    return;
+  }
+  // Calling someone else ends the call the badge was in.
+  this->end_call_(slot, request.queued_us, now_us);
+  this->calls_[slot].peer = peer;
+  this->calls_[peer].peer = slot;
+  this->stats_.calls++;
+  this->reply_(slot, NOWTALK_SERVER_SEND_PEER, this->roster_->get(peer).mac, 6, request.queued_us, now_us);
+  this->reply_(peer, NOWTALK_SERVER_SEND_PEER, request.mac, 6, request.queued_us, now_us);
+}
+
+void SwitchboardEngine::on_closed_(const request_t &request, uint8_t slot, uint32_t now, uint32_t now_us) {
+  if (slot != NOWTALK_NO_SLOT) {
+    this->end_call_(slot, request.queued_us, now_us);
+  }
+}
+
+void SwitchboardEngine::end_call_(uint8_t slot, uint32_t queued_us, uint32_t now_us) {
+  uint8_t peer = this->calls_[slot].peer;
+  if (peer == NOWTALK_NO_SLOT) {
+    return;
+  }
+  this->calls_[slot].peer = NOWTALK_NO_SLOT;
+  this->calls_[peer].peer = NOWTALK_NO_SLOT;
+  this->reply_(peer, NOWTALK_SERVER_PEER_GONE, this->roster_->get(slot).mac, 6, queued_us, now_us);
+}
+
+void SwitchboardEngine::expire_calls_(uint32_t now_us) {
+  for (uint8_t slot = 0; slot < NOWTALK_ROSTER_SIZE; slot++) {
+    if (this->calls_[slot].peer != NOWTALK_NO_SLOT && this->roster_->get(slot).status == NOWTALK_STATUS_GONE) {
+      this->end_call_(slot, now_us, now_us);
+    }
+  }
+}
+
+void SwitchboardEngine::reply_(uint8_t slot, uint8_t code, const uint8_t *data, size_t len, uint32_t queued_us,
+                               uint32_t now_us) {
+  if (this->outbox_count_ == SWITCHBOARD_OUTBOX_SIZE) {
+    this->flush_(now_us);
+  }
+  reply_t &reply = this->outbox_[this->outbox_count_++];
+  reply.slot = slot;
+  reply.code = code;
+  reply.len = len;
+  memcpy(reply.body, data, len);
+  reply.queued_us = queued_us;
+}
+
+void SwitchboardEngine::flush_(uint32_t now_us) {
+  // Send grouped by badge: everything for the first badge, then the next, in queue order within a badge.
+  for (uint8_t i = 0; i < this->outbox_count_; i++) {
+    if (this->outbox_[i].slot == NOWTALK_NO_SLOT) {
+      continue;
+    }
+    uint8_t slot = this->outbox_[i].slot;
+    const uint8_t *mac = this->roster_->get(slot).mac;
+    for (uint8_t j = i; j < this->outbox_count_; j++) {
+      reply_t &reply = this->outbox_[j];
+      if (reply.slot != slot) {
+        continue;
+      }
+      this->send_(mac, reply.code, reply.body, reply.len);
+      reply.slot = NOWTALK_NO_SLOT;
+
+      uint32_t latency = now_us - reply.queued_us;
+      switchboard_stats_t &stats = this->stats_;
+      stats.replies++;
+      stats.latency_samples++;
+      stats.latency_avg_us =
+          stats.latency_samples == 1 ? latency : stats.latency_avg_us - stats.latency_avg_us / 16 + latency / 16;
+      stats.latency_max_us = std::max(stats.latency_max_us, latency);
+    }
+  }
+  this->outbox_count_ = 0;
+}
+
+}  // namespace nowtalk
+}  // namespace esphome
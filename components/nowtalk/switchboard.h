@@ -0,0 +1,119 @@
+#pragma once
+
+#include "roster.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome {
+namespace nowtalk {
+
+/// Requests waiting for the next processing pass.
+static const uint8_t SWITCHBOARD_QUEUE_SIZE = 32;
+/// Longest request body the engine takes; larger requests are not switchboard operations.
+static const uint8_t SWITCHBOARD_MAX_BODY = 16;
+/// Replies collected during one pass before they are sent.
+static const uint8_t SWITCHBOARD_OUTBOX_SIZE = 48;
+static const uint8_t SWITCHBOARD_MAX_REPLY = 8;
+
+/// NACK reasons, NACK body is [request code][reason].
+static const uint8_t SWITCHBOARD_NOT_REGISTERED = 0x01;
+static const uint8_t SWITCHBOARD_BUSY = 0x02;
+
+/// Sends one NowTalk message to `mac`.
+using switchboard_send_t = std::function<bool(const uint8_t *mac, uint8_t code, const uint8_t *data, size_t len)>;
+
+struct switchboard_stats_t {
+  uint32_t requests{0};
+  uint32_t dropped{0};  // queue full
+  uint32_t replies{0};
+  uint32_t batches{0};
+  uint32_t calls{0};
+  uint32_t latency_samples{0};  // replies sent from the outbox, the only ones with a queue time
+  uint32_t latency_avg_us{0};   // EWMA, queued until its reply went out
+  uint32_t latency_max_us{0};
+};
+
+/// Request side of the switchboard, sized for well over a hundred badges.
+///
+/// Frames are queued as they arrive and handled in passes from loop(). Each opcode has an entry in a dispatch
+/// table, the badge is looked up once through the roster's MAC index, and per-badge call state is a single byte in a
+/// table indexed by roster slot. Replies are collected during a pass and sent grouped by badge, so the aggregator
+/// can pack a PONG and a SEND_PEER for the same badge into one frame.
+///
+///  PING        [status][epoch:2][synced]   -> PONG [slot][epoch:2] (+ roster dump when not synced)
+///  START_CALL  [peer:6]                    -> SEND_PEER [peer:6] to both sides, or PEER_GONE [peer:6], or NACK
+///  CLOSED                                  -> PEER_GONE [badge:6] to the other side of its call
+///
+/// A call also ends when either badge drops out of the roster.
+class SwitchboardEngine {
+ public:
+  SwitchboardEngine();
+
+  void set_roster(RosterServer *roster) { this->roster_ = roster; }
+  void set_send(switchboard_send_t &&send) { this->send_ = std::move(send); }
+
+  /// Whether requests with `code` are handled here.
+  bool handles(uint8_t code) const { return this->handlers_[code] != nullptr; }
+  /// Queue a request. Returns false when the queue is full or the body too long.
+  bool submit(const uint8_t *mac, uint8_t code, const uint8_t *body, size_t len, uint32_t now_us);
+  /// Handle everything queued, then send the replies. `now_us` is on the clock passed to submit() and is the send
+  /// time the reply latency is measured to.
+  void process(uint32_t now, uint32_t now_us);
+
+  /// Slot of the badge `slot` is in a call with, NOWTALK_NO_SLOT when idle.
+  uint8_t get_peer(uint8_t slot) const { return this->calls_[slot].peer; }
+  uint8_t get_active_calls() const;
+  size_t queued() const { return this->queue_count_; }
+  const switchboard_stats_t &get_stats() const { return this->stats_; }
+
+ protected:
+  struct request_t {
+    uint8_t mac[6];
+    uint8_t code;
+    uint8_t len;
+    uint8_t body[SWITCHBOARD_MAX_BODY];
+    uint32_t queued_us;
+  };
+  struct reply_t {
+    uint8_t slot;
+    uint8_t code;
+    uint8_t len;
+    uint8_t body[SWITCHBOARD_MAX_REPLY];
+    uint32_t queued_us;
+  };
+  struct call_t {
+    uint8_t peer{NOWTALK_NO_SLOT};
+  };
+  using handler_t = void (SwitchboardEngine::*)(const request_t &request, uint8_t slot, uint32_t now,
+                                               uint32_t now_us);
+
+  void on_ping_(const request_t &request, uint8_t slot, uint32_t now, uint32_t now_us);
+  void on_start_call_(const request_t &request, uint8_t slot, uint32_t now, uint32_t now_us);
+  void on_closed_(const request_t &request, uint8_t slot, uint32_t now, uint32_t now_us);
+
+  void reply_(uint8_t slot, uint8_t code, const uint8_t *data, size_t len, uint32_t queued_us, uint32_t now_us);
+  void end_call_(uint8_t slot, uint32_t queued_us, uint32_t now_us);
+  void expire_calls_(uint32_t now_us);
+  void flush_(uint32_t now_us);
+
+  RosterServer *roster_{nullptr};
+  switchboard_send_t send_{};
+  std::array<handler_t, 256> handlers_{};
+  std::array<call_t, NOWTALK_ROSTER_SIZE> calls_{};
+
+  std::array<request_t, SWITCHBOARD_QUEUE_SIZE> queue_{};
+  uint8_t queue_head_{0};
+  uint8_t queue_count_{0};
+
+  std::array<reply_t, SWITCHBOARD_OUTBOX_SIZE> outbox_{};
+  uint8_t outbox_count_{0};
+
+  uint32_t last_expire_{0};
+  switchboard_stats_t stats_{};
+};
+
+}  // namespace nowtalk
+}  // namespace esphome
@@ -0,0 +1,204 @@
+#include "switchboard_finder.h"
+#include "protocol.h"
+
+#include <cstring>
+
+namespace esphome {
+namespace nowtalk {
+
+/// Consecutive failed unicasts to the switchboard that count as a lost link.
+static const uint8_t FINDER_MAX_FAILED_SENDS = 5;
+/// A candidate this far above the roam threshold ends a sweep early.
+static const int8_t FINDER_GOOD_MARGIN = 15;
+/// A roam needs a candidate this much stronger than the current link.
+static const int8_t FINDER_ROAM_HYSTERESIS = 8;
+/// Minimum time between two roam sweeps while the link still works.
+static const uint32_t FINDER_ROAM_INTERVAL = 30000;
+static const uint32_t FINDER_MIN_RETRY = 2000;
+static const uint32_t FINDER_MAX_RETRY = 60000;
+
+bool SwitchboardFinder::is_current_(const uint8_t *mac) const { return memcmp(this->current_, mac, 6) == 0; }
+
+void SwitchboardFinder::set_current(const uint8_t *mac, uint8_t channel, uint32_t now) {
+  memcpy(this->current_, mac, 6);
+  this->current_channel_ = channel;
+  this->last_heard_ = now;
+  this->failed_sends_ = 0;
+  this->rssi_known_ = false;
+}
+
+void SwitchboardFinder::on_frame(int8_t rssi, uint32_t now) {
+  if (!this->rssi_known_) {
+    this->rssi_x16_ = rssi * 16;
+    this->rssi_known_ = true;
+  } else {
+    this->rssi_x16_ += (rssi * 16 - this->rssi_x16_) / 8;
+  }
+  this->last_heard_ = now;
+  this->failed_sends_ = 0;
+  if (this->lost_ && this->state_ == FinderState::IDLE) {
+    // The switchboard came back by itself.
+    this->lost_ = false;
+    this->last_reconnect_ = now - this->lost_since_;
+  }
+}
+
+void SwitchboardFinder::on_send_result(bool success, uint32_t now) {
+  if (success) {
+    this->failed_sends_ = 0;
+  } else if (++this->failed_sends_ >= FINDER_MAX_FAILED_SENDS && !this->lost_) {
+    this->start_sweep(true, now);
+  }
+}
+
+void SwitchboardFinder::on_beacon(const uint8_t *mac, const uint8_t *data, size_t len, int8_t rssi, uint32_t now) {
+  if (len < 2) {
+    return;
+  }
+  switchboard_candidate_t *slot = nullptr;
+  for (switchboard_candidate_t &candidate : this->candidates_) {
+    if (candidate.used && memcmp(candidate.mac, mac, 6) == 0) {
+      slot = &candidate;
+      break;
+    }
+  }
+  if (slot == nullptr) {
+    // Replace a free or the longest unheard entry.
+    slot = &this->candidates_[0];
+    for (switchboard_candidate_t &candidate : this->candidates_) {
+      if (!candidate.used || (slot->used && now - candidate.last_seen > now - slot->last_seen)) {
+        slot = &candidate;
+      }
+    }
+    memcpy(slot->mac, mac, 6);
+    slot->used = true;
+  }
+  slot->channel = data[0];
+  slot->badges = data[1];
+  slot->rssi = rssi;
+  slot->last_seen = now;
+  if (this->is_current_(mac) && slot->channel == this->current_channel_) {
+    this->on_frame(rssi, now);
+  }
+}
+
+void SwitchboardFinder::start_sweep(bool lost, uint32_t now) {
+  if (lost && !this->lost_) {
+    this->lost_ = true;
+    this->lost_since_ = now;
+  }
+  if (this->state_ == FinderState::SWEEPING) {
+    return;
+  }
+  // Current channel first, then where candidates were last heard, then the rest.
+  this->order_len_ = 0;
+  this->swept_ = 0;
+  auto add = [this](uint8_t channel) {
+    if (channel < 16 && (this->channel_mask_ >> channel) & 1 && !((this->swept_ >> channel) & 1)) {
+      this->swept_ |= 1 << channel;
+      this->order_[this->order_len_++] = channel;
+    }
+  };
+  add(this->current_channel_);
+  for (const switchboard_candidate_t &candidate : this->candidates_) {
+    if (candidate.used) {
+      add(candidate.channel);
+    }
+  }
+  for (uint8_t channel = 1; channel < 16; channel++) {
+    add(channel);
+  }
+  this->order_pos_ = 0;
+  this->state_ = FinderState::SWEEPING;
+  this->sweep_started_ = now;
+  this->sweeps_++;
+  this->tune_next_(now);
+}
+
+void SwitchboardFinder::tune_next_(uint32_t now) {
+  if (this->order_pos_ == this->order_len_) {
+    this->finish_sweep_(now);
+    return;
+  }
+  this->tune_(this->order_[this->order_pos_++]);
+  this->send_(NOWTALK_CLIENT_PROBE, nullptr, 0);
+  this->dwell_until_ = now + this->dwell_;
+}
+
+void SwitchboardFinder::finish_sweep_(uint32_t now) {
+  this->state_ = FinderState::IDLE;
+  const switchboard_candidate_t *best = nullptr;
+  for (const switchboard_candidate_t &candidate : this->candidates_) {
+    if (candidate.used && candidate.last_seen - this->sweep_started_ <= now - this->sweep_started_ &&
+        (best == nullptr || candidate.rssi > best->rssi)) {
+      best = &candidate;
+    }
+  }
+
+  bool select = false;
+  if (this->lost_) {
+    select = best != nullptr;
+  } else if (best != nullptr && !this->is_current_(best->mac)) {
+    select = !this->rssi_known_ || best->rssi >= this->get_rssi() + FINDER_ROAM_HYSTERESIS;
+    this->roams_ += select;
+  }
+
+  if (select) {
+    switchboard_candidate_t chosen = *best;
+    if (this->lost_) {
+      this->lost_ = false;
+      this->last_reconnect_ = now - this->lost_since_;
+    }
+    this->set_current(chosen.mac, chosen.channel, now);
+    this->on_frame(chosen.rssi, now);
+    this->tune_(chosen.channel);
+    this->retry_delay_ = 0;
+    this->next_sweep_ = now + FINDER_ROAM_INTERVAL;
+    if (this->on_select_) {
+      this->on_select_(chosen);
+    }
+    return;
+  }
+
+  this->tune_(this->current_channel_);
+  if (this->lost_) {
+    // Nobody answered; back off so a badge out of range does not sweep continuously.
+    this->retry_delay_ = this->retry_delay_ == 0 ? FINDER_MIN_RETRY : this->retry_delay_ * 2;
+    if (this->retry_delay_ > FINDER_MAX_RETRY) {
+      this->retry_delay_ = FINDER_MAX_RETRY;
+    }
+    this->next_sweep_ = now + this->retry_delay_;
+  } else {
+    this->next_sweep_ = now + FINDER_ROAM_INTERVAL;
+  }
+}
+
+void SwitchboardFinder::loop(uint32_t now, bool can_roam) {
+  if (this->state_ == FinderState::SWEEPING) {
+    if ((int32_t) (now - this->dwell_until_) < 0) {
+      return;
+    }
+    for (const switchboard_candidate_t &candidate : this->candidates_) {
+      if (candidate.used && candidate.last_seen - this->sweep_started_ <= now - this->sweep_started_ &&
+          candidate.rssi >= this->roam_threshold_ + FINDER_GOOD_MARGIN &&
+          (this->lost_ || !this->is_current_(candidate.mac))) {
+        this->finish_sweep_(now);
+        return;
+      }
+    }
+    this->tune_next_(now);
+    return;
+  }
+
+  bool due = (int32_t) (now - this->next_sweep_) >= 0;
+  if (!this->lost_ && now - this->last_heard_ > this->lost_after_) {
+    this->start_sweep(true, now);
+  } else if (this->lost_ && due) {
+    this->start_sweep(true, now);
+  } else if (!this->lost_ && due && can_roam && this->rssi_known_ && this->get_rssi() < this->roam_threshold_) {
+    this->start_sweep(false, now);
+  }
+}
+
+}  // namespace nowtalk
+}  // namespace esphome
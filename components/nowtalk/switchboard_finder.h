@@ -0,0 +1,108 @@
+#pragma once
+
+#include "bulk_transfer.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome {
+namespace nowtalk {
+
+static const uint8_t FINDER_MAX_CANDIDATES = 4;
+
+enum class FinderState : uint8_t { IDLE, SWEEPING };
+
+struct switchboard_candidate_t {
+  uint8_t mac[6];
+  uint8_t channel;
+  int8_t rssi;
+  uint8_t badges;  // load reported in the beacon
+  uint32_t last_seen;
+  bool used;
+};
+
+/// Badge side switchboard discovery and roaming.
+///
+///  PROBE   []                   broadcast on each channel of the sweep
+///  BEACON  [channel][badges]    unicast answer from every switchboard that hears the probe
+///
+/// A sweep tunes to each channel in turn, probes and listens for `dwell` ms. The current channel and channels of
+/// cached candidates go first, and a strong answer ends the sweep early. A sweep starts when the link is lost
+/// (silence or failed sends) and, while the link still works, when its RSSI falls below the roam threshold; the
+/// badge then moves only to a clearly better switchboard. Such a roam sweep waits until the badge is idle.
+class SwitchboardFinder {
+ public:
+  /// Broadcast a frame on the channel currently tuned.
+  void set_send(bulk_send_t &&send) { this->send_ = std::move(send); }
+  void set_tune(std::function<void(uint8_t channel)> &&tune) { this->tune_ = std::move(tune); }
+  void set_on_select(std::function<void(const switchboard_candidate_t &)> &&callback) {
+    this->on_select_ = std::move(callback);
+  }
+  /// Bit n set: channel n is swept.
+  void set_channel_mask(uint16_t mask) { this->channel_mask_ = mask; }
+  void set_dwell(uint32_t dwell) { this->dwell_ = dwell; }
+  void set_roam_threshold(int8_t rssi) { this->roam_threshold_ = rssi; }
+  void set_lost_after(uint32_t time) { this->lost_after_ = time; }
+
+  void set_current(const uint8_t *mac, uint8_t channel, uint32_t now);
+  /// Any frame from the current switchboard.
+  void on_frame(int8_t rssi, uint32_t now);
+  void on_beacon(const uint8_t *mac, const uint8_t *data, size_t len, int8_t rssi, uint32_t now);
+  /// Outcome of a unicast send to the current switchboard.
+  void on_send_result(bool success, uint32_t now);
+  void start_sweep(bool lost, uint32_t now);
+  /// `can_roam`: the badge is idle, a roam sweep may take the radio off the channel now. A lost link is always swept.
+  void loop(uint32_t now, bool can_roam = true);
+
+  FinderState get_state() const { return this->state_; }
+  bool is_connected() const { return !this->lost_; }
+  int8_t get_rssi() const { return this->rssi_x16_ / 16; }
+  /// Time from losing the switchboard until one was found again, of the last outage.
+  uint32_t get_last_reconnect_time() const { return this->last_reconnect_; }
+  uint32_t get_sweeps() const { return this->sweeps_; }
+  uint32_t get_roams() const { return this->roams_; }
+  const switchboard_candidate_t &get_candidate(uint8_t index) const { return this->candidates_[index]; }
+
+ protected:
+  void tune_next_(uint32_t now);
+  void finish_sweep_(uint32_t now);
+  bool is_current_(const uint8_t *mac) const;
+
+  bulk_send_t send_{};
+  std::function<void(uint8_t)> tune_{};
+  std::function<void(const switchboard_candidate_t &)> on_select_{};
+  std::array<switchboard_candidate_t, FINDER_MAX_CANDIDATES> candidates_{};
+
+  uint8_t current_[6]{};
+  uint8_t current_channel_{1};
+  int32_t rssi_x16_{0};
+  bool rssi_known_{false};
+  uint32_t last_heard_{0};
+  uint8_t failed_sends_{0};
+  bool lost_{false};
+  uint32_t lost_since_{0};
+
+  FinderState state_{FinderState::IDLE};
+  uint16_t channel_mask_{0x3ffe};  // channels 1-13
+  uint16_t swept_{0};
+  uint8_t order_[16]{};
+  uint8_t order_len_{0};
+  uint8_t order_pos_{0};
+  uint32_t dwell_until_{0};
+  uint32_t sweep_started_{0};
+  uint32_t next_sweep_{0};
+  uint32_t retry_delay_{0};
+
+  uint32_t dwell_{40};
+  int8_t roam_threshold_{-80};
+  uint32_t lost_after_{180000};
+
+  uint32_t last_reconnect_{0};
+  uint32_t sweeps_{0};
+  uint32_t roams_{0};
+};
+
+}  // namespace nowtalk
+}  // namespace esphome
@@ -0,0 +1,192 @@
+#include "timer_scheduler.h"
+
+#ifdef USE_ESP32
+#include <esp_attr.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#else
+#include <chrono>
+#endif
+#include <utility>
+
+namespace esphome {
+namespace nowtalk {
+
+#ifdef USE_ESP32
+/// Clock value at boot. esp_timer starts from zero on every wake, so the time spent asleep is added here.
+static RTC_DATA_ATTR uint64_t clock_offset_ms = 0;
+#endif
+
+TimerScheduler::TimerScheduler() { this->position_.fill(NOWTALK_NO_TIMER); }
+
+uint64_t TimerScheduler::now_ms() {
+#ifdef USE_ESP32
+  // Monotonic, unlike the wall clock that SNTP may step.
+  return clock_offset_ms + esp_timer_get_time() / 1000;
+#else
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+void TimerScheduler::register_handler(TimerHandler id, handler_t &&handler) {
+  uint8_t index = (uint8_t) id;
+  if (index < NOWTALK_MAX_HANDLERS) {
+    this->handlers_[index] = std::move(handler);
+  }
+}
+
+int8_t TimerScheduler::arm(TimerHandler handler, uint32_t delay, bool repeat) {
+  return this->arm_at(handler, now_ms() + delay, repeat ? delay : 0);
+}
+
+int8_t TimerScheduler::arm_at(TimerHandler handler, uint64_t deadline, uint32_t interval, int8_t slot) {
+  if (slot < 0 || slot >= NOWTALK_MAX_TIMERS || this->position_[slot] != NOWTALK_NO_TIMER) {
+    slot = NOWTALK_NO_TIMER;
+    for (int8_t i = 0; i < NOWTALK_MAX_TIMERS; i++) {
+      if (this->position_[i] == NOWTALK_NO_TIMER) {
+        slot = i;
+        break;
+      }
+    }
+    if (slot == NOWTALK_NO_TIMER) {
+      return NOWTALK_NO_TIMER;
+    }
+  }
+  this->timers_[slot] = {deadline, interval, handler, true};
+  uint8_t pos = this->count_++;
+  this->heap_[pos] = slot;
+  this->position_[slot] = pos;
+  this->sift_up_(pos);
+  return slot;
+}
+
+bool TimerScheduler::cancel(int8_t slot) {
+  if (!this->is_armed(slot)) {
+    return false;
+  }
+  this->remove_at_(this->position_[slot]);
+  this->timers_[slot].enabled = false;
+  return true;
+}
+
+bool TimerScheduler::reschedule(int8_t slot, uint32_t delay) {
+  if (!this->is_armed(slot)) {
+    return false;
+  }
+  uint64_t old_deadline = this->timers_[slot].deadline;
+  this->timers_[slot].deadline = now_ms() + delay;
+  if (this->timers_[slot].deadline < old_deadline) {
+    this->sift_up_(this->position_[slot]);
+  } else {
+    this->sift_down_(this->position_[slot]);
+  }
+  return true;
+}
+
+bool TimerScheduler::is_armed(int8_t slot) const {
+  return slot >= 0 && slot < NOWTALK_MAX_TIMERS && this->position_[slot] != NOWTALK_NO_TIMER;
+}
+
+uint64_t TimerScheduler::next_deadline() const {
+  return this->count_ == 0 ? UINT64_MAX : this->timers_[this->heap_[0]].deadline;
+}
+
+uint8_t TimerScheduler::run(uint64_t now) {
+  uint8_t fired = 0;
+  // Bounded by the heap size so a zero interval repeat cannot spin forever.
+  for (uint8_t guard = 0; guard < NOWTALK_MAX_TIMERS && this->count_ > 0; guard++) {
+    int8_t slot = this->heap_[0];
+    nowtalk_timer_t &timer = this->timers_[slot];
+    if (timer.deadline > now) {
+      break;
+    }
+    if (timer.interval > 0) {
+      // Skip missed periods (e.g. after a long sleep) instead of firing a burst.
+      uint64_t missed = (now - timer.deadline) / timer.interval;
+      timer.deadline += (missed + 1) * timer.interval;
+      this->sift_down_(0);
+    } else {
+      this->remove_at_(0);
+      timer.enabled = false;
+    }
+    uint8_t index = (uint8_t) timer.handler;
+    if (index < NOWTALK_MAX_HANDLERS && this->handlers_[index]) {
+      this->handlers_[index](slot);
+    }
+    fired++;
+  }
+  return fired;
+}
+
+uint64_t TimerScheduler::program_wakeup(uint64_t now) {
+  uint64_t deadline = this->next_deadline();
+  uint64_t sleep_ms = 0;
+  if (deadline != UINT64_MAX) {
+    sleep_ms = deadline > now ? deadline - now : 1;
+#ifdef USE_ESP32
+    esp_sleep_enable_timer_wakeup(sleep_ms * 1000ULL);
+#endif
+  }
+#ifdef USE_ESP32
+  // The next boot starts counting where this sleep ends.
+  clock_offset_ms = now + sleep_ms;
+#endif
+  return sleep_ms;
+}
+
+bool TimerScheduler::less_(uint8_t a, uint8_t b) const {
+  return this->timers_[this->heap_[a]].deadline < this->timers_[this->heap_[b]].deadline;
+}
+
+void TimerScheduler::swap_(uint8_t a, uint8_t b) {
+  std::swap(this->heap_[a], this->heap_[b]);
+  this->position_[this->heap_[a]] = a;
+  this->position_[this->heap_[b]] = b;
+}
+
+void TimerScheduler::sift_up_(uint8_t pos) {
+  while (pos > 0) {
+    uint8_t parent = (pos - 1) / 2;
+    if (!this->less_(pos, parent)) {
+      break;
+    }
+    this->swap_(pos, parent);
+    pos = parent;
+  }
+}
+
+void TimerScheduler::sift_down_(uint8_t pos) {
+  while (true) {
+    uint8_t smallest = pos;
+    uint8_t left = 2 * pos + 1;
+    uint8_t right = left + 1;
+    if (left < this->count_ && this->less_(left, smallest)) {
+      smallest = left;
+    }
+    if (right < this->count_ && this->less_(right, smallest)) {
+      smallest = right;
+    }
+    if (smallest == pos) {
+      return;
+    }
+    this->swap_(pos, smallest);
+    pos = smallest;
+  }
+}
+
+void TimerScheduler::remove_at_(uint8_t pos) {
+  int8_t slot = this->heap_[pos];
+  uint8_t last = --this->count_;
+  if (pos != last) {
+    this->swap_(pos, last);
+  }
+  this->position_[slot] = NOWTALK_NO_TIMER;
+  if (pos < this->count_) {
+    this->sift_down_(pos);
+    this->sift_up_(pos);
+  }
+}
+
+}  // namespace nowtalk
+}  // namespace esphome
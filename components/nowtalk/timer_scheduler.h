@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome {
+namespace nowtalk {
+
+static const uint8_t NOWTALK_MAX_TIMERS = 16;
+static const int8_t NOWTALK_NO_TIMER = -1;
+
+/// Stable handler identifiers. These are kept in RTC memory across deep sleep, so never renumber existing entries.
+enum class TimerHandler : uint8_t {
+  NONE = 0,
+  PING = 1,
+  SLEEP = 2,
+  TIMEOUT = 3,
+  HEARTBEAT = 4,
+};
+static const uint8_t NOWTALK_MAX_HANDLERS = 8;
+
+struct nowtalk_timer_t {
+  uint64_t deadline;  // absolute time in ms on now_ms(), which survives deep sleep
+  uint32_t interval;  // repeat interval in ms, 0 for a one shot timer
+  TimerHandler handler;
+  bool enabled;
+};
+
+/// Binary min-heap of timers keyed on deadline.
+///
+/// Timers are addressed by a slot id (e.g. the component's PING and SLEEP timers). Each slot remembers its
+/// position in the heap, so arm, cancel and reschedule are all O(log n) and the earliest deadline is O(1).
+class TimerScheduler {
+ public:
+  using handler_t = std::function<void(int8_t)>;
+
+  TimerScheduler();
+
+  /// Milliseconds on a clock that keeps counting across deep sleep and is not moved by SNTP.
+  static uint64_t now_ms();
+
+  void register_handler(TimerHandler id, handler_t &&handler);
+
+  /// Arm a timer that fires `delay` ms from now. Returns the slot id or NOWTALK_NO_TIMER when full.
+  int8_t arm(TimerHandler handler, uint32_t delay, bool repeat = false);
+  /// Arm (or restore) a timer at an absolute deadline. When `slot` is free it is reused, so ids stay stable
+  /// across deep sleep.
+  int8_t arm_at(TimerHandler handler, uint64_t deadline, uint32_t interval, int8_t slot = NOWTALK_NO_TIMER);
+  bool cancel(int8_t slot);
+  bool reschedule(int8_t slot, uint32_t delay);
+
+  bool is_armed(int8_t slot) const;
+  const nowtalk_timer_t &get(int8_t slot) const { return this->timers_[slot]; }
+  size_t size() const { return this->count_; }
+
+  /// Earliest pending deadline, or UINT64_MAX when nothing is armed.
+  uint64_t next_deadline() const;
+  /// Fire every timer whose deadline has passed. Returns the number of handlers invoked.
+  uint8_t run(uint64_t now);
+  uint8_t run() { return this->run(now_ms()); }
+
+  /// Program the RTC timer to wake the chip for the earliest deadline. Returns the sleep time in ms,
+  /// or 0 when no timer is armed (the wakeup source is left disabled in that case).
+  /// The clock resumes after the wake as if the whole sleep time had passed; a wake from another source comes
+  /// early, so timers may fire early but never late.
+  uint64_t program_wakeup(uint64_t now);
+
+ protected:
+  bool less_(uint8_t a, uint8_t b) const;
+  void swap_(uint8_t a, uint8_t b);
+  void sift_up_(uint8_t pos);
+  void sift_down_(uint8_t pos);
+  void remove_at_(uint8_t pos);
+
+  std::array<nowtalk_timer_t, NOWTALK_MAX_TIMERS> timers_{};
+  std::array<uint8_t, NOWTALK_MAX_TIMERS> heap_{};      // heap position -> slot
+  std::array<int8_t, NOWTALK_MAX_TIMERS> position_{};  // slot -> heap position, NOWTALK_NO_TIMER when free
+  uint8_t count_{0};
+
+  std::array<handler_t, NOWTALK_MAX_HANDLERS> handlers_{};
+};
+
+}  // namespace nowtalk
+}  // namespace esphome
@@ -6,7 +6,7 @@
 #include "FS.h"
 #include "SPIFFS.h"
 #include <ArduinoJson.h>
-#include "TimeEvents.h"
+#include "protocol.h"
 #include "Version.h"
 extern "C" {
 #include "crypto/base64.h"
@@ -17,50 +17,6 @@ extern "C" {
 #endif
 
 
-/// Request message codes :
-
-#define NOWTALK_CLIENT_PING 0x01
-#define NOWTALK_SERVER_PONG 0x02
-#define NOWTALK_SERVER_REQUEST_DETAILS 0x03
-#define NOWTALK_CLIENT_DETAILS 0x04
-#define NOWTALK_CLIENT_NEWPEER 0x05
-
-#define NOWTALK_SERVER_ACCEPT 0x07
-
-#define NOWTALK_SERVER_NEW_NAME 0x0d
-#define NOWTALK_SERVER_NEW_IP 0x0e
-
-#define NOWTALK_CLIENT_ACK 0x10
-#define NOWTALK_CLIENT_NACK 0x11
-
-#define NOWTALK_CLIENT_START_CALL 0x30
-#define NOWTALK_SERVER_SEND_PEER 0x31
-#define NOWTALK_SERVER_PEER_GONE 0x32
-#define NOWTALK_SERVER_OVER_WEB 0x33
-
-#define NOWTALK_CLIENT_REQUEST 0x37
-#define NOWTALK_CLIENT_RECEIVE 0x38
-#define NOWTALK_CLIENT_CLOSED 0x39
-
-#define NOWTALK_STREAM_START 0x3d
-#define NOWTALK_STREAM_DATA 0x3e
-#define NOWTALK_STREAM_END 0x3f
-
-
-#define NOWTALK_CLIENT_HELPSOS 0xff
-
-
-
-#define NOWTALK_STATUS_GONE 0x00
-#define NOWTALK_STATUS_ALIVE 0x01
-#define NOWTALK_STATUS_GUEST 0x02
-
-
-#define NOWTALK_PEER_MEMBER 0x10
-#define NOWTALK_PEER_FRIEND 0x20
-#define NOWTALK_PEER_BLOCKED 0x80
-
-
 struct config_t
 {
     boolean wakeup = false;
@@ -76,8 +32,6 @@ struct config_t
     boolean TFTActive = false;
     int ledBacklight = 80; // Initial TFT backlight intensity on a scale of 0 to 255. Initial value is 80.
     int sprVolume = 40;
-    int sleepID = -1;
-    int PingID = -1;
     int timeoutID = -1;
     short heartbeat = 0;
     size_t updateSize = 0;
@@ -89,9 +43,6 @@ config_t config;//
 RTC_DATA_ATTR boolean wakeup = false;
 RTC_DATA_ATTR uint8_t currentSwitchboard[6] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 
-alarm_t alarms[dtNBR_ALARMS];
-TimeEventsClass myEvents = TimeEventsClass(alarms);
-
 typedef struct
 {
     uint8_t mac[6];
@@ -236,19 +187,6 @@ void loadConfiguration(bool clear = false)
     {
         config.registrationMode = true;
     }
-
-    for (JsonObject elem : doc["alarms"].as<JsonArray>()) {
-        int id = elem["id"];
-        uint64_t nt = elem["nextTrigger"].as<uint64_t>();
-        alarms[id].value = elem["time"];
-        alarms[id].nextTrigger = nt;
-        alarms[id].Mode.alarmType = elem["mode_alarmType"];
-        alarms[id].Mode.isEnabled = elem["mode_isEnabled"];
-        alarms[id].Mode.isOneShot = elem["mode_isOneShot"];
-        alarms[id].onTickHandler = (OnTick_t)elem["trigger"].as<uint32_t>();
-        Serial.printf("timeleft %lld\n", myEvents.timeNow() - nt);
-        myEvents.updateNextTrigger(id);
-    }
 }
 
 // Saves the configuration to a file
@@ -292,19 +230,6 @@ void saveConfiguration()
     doc["ledBacklight"] = config.ledBacklight; // Initial TFT backlight intensity on a scale of 0 to 255. Initial value is 80.
     doc["sprVolume"] = config.sprVolume;
 
-    JsonArray data = doc.createNestedArray("alarms");
-    for (uint8_t id = 0; id < dtNBR_ALARMS; id++) {
-        if (alarms[id].Mode.alarmType != dtNotAllocated) {
-            JsonObject data_0 = data.createNestedObject();
-            data_0["id"] = id;
-            data_0["time"] = alarms[id].value;
-            data_0["nextTrigger"] = alarms[id].nextTrigger;
-            data_0["mode_alarmType"] = alarms[id].Mode.alarmType;
-            data_0["mode_isEnabled"] = alarms[id].Mode.isEnabled;
-            data_0["mode_isOneShot"] = alarms[id].Mode.isOneShot;
-            data_0["trigger"] = (uint32_t)alarms[id].onTickHandler;
-        }
-    }
    // serializeJsonPretty(doc, Serial);
     if (serializeJson(doc, file) == 0)
     {
@@ -0,0 +1,81 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import microphone
+from esphome.const import (
+    CONF_BITS_PER_SAMPLE,
+    CONF_ID,
+    CONF_MICROPHONE,
+    CONF_NUM_CHANNELS,
+    CONF_SAMPLE_RATE,
+)
+
+AUTO_LOAD = ["microphone"]
+
+CODEOWNERS = ["@LumenSoftNL"]
+
+CONF_SHARED_CAPTURE_ID = "shared_capture_id"
+CONF_BUFFER_DURATION = "buffer_duration"
+CONF_PRE_ROLL = "pre_roll"
+CONF_ALWAYS_ON = "always_on"
+
+shared_capture_ns = cg.esphome_ns.namespace("shared_capture")
+SharedCapture = shared_capture_ns.class_(
+    "SharedCapture", microphone.Microphone, cg.Component
+)
+
+
+def _validate_pre_roll(config):
+    if config[CONF_PRE_ROLL] >= config[CONF_BUFFER_DURATION]:
+        raise cv.Invalid(f"{CONF_PRE_ROLL} must be shorter than {CONF_BUFFER_DURATION}")
+    return config
+
+
+CONFIG_SCHEMA = cv.All(
+    microphone.MICROPHONE_SCHEMA.extend(
+        {
+            cv.GenerateID(): cv.declare_id(SharedCapture),
+            cv.Required(CONF_MICROPHONE): microphone.microphone_source_schema(
+                min_bits_per_sample=16,
+                max_bits_per_sample=16,
+                min_channels=1,
+                max_channels=1,
+            ),
+            cv.Optional(CONF_BUFFER_DURATION, default="512ms"): cv.All(
+                cv.positive_time_period_milliseconds,
+                cv.Range(min=cv.TimePeriod(milliseconds=64), max=cv.TimePeriod(milliseconds=4096)),
+            ),
+            cv.Optional(CONF_PRE_ROLL, default="200ms"): cv.positive_time_period_milliseconds,
+            cv.Optional(CONF_ALWAYS_ON, default=True): cv.boolean,
+            # The format consumers see, validated by them like that of any other microphone.
+            cv.Optional(CONF_SAMPLE_RATE, default=16000): cv.one_of(16000, int=True),
+            cv.Optional(CONF_BITS_PER_SAMPLE, default=16): cv.one_of(16, int=True),
+            cv.Optional(CONF_NUM_CHANNELS, default=1): cv.one_of(1, int=True),
+        }
+    ).extend(cv.COMPONENT_SCHEMA),
+    _validate_pre_roll,
+)
+
+SHARED_CAPTURE_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_SHARED_CAPTURE_ID): cv.use_id(SharedCapture),
+    }
+)
+
+
+async def register_shared_capture(var, config):
+    if capture_id := config.get(CONF_SHARED_CAPTURE_ID):
+        capture = await cg.get_variable(capture_id)
+        cg.add(var.set_shared_capture(capture))
+
+
+async def to_code(config):
+    var = cg.new_Pvariable(config[CONF_ID])
+    await cg.register_component(var, config)
+    await microphone.register_microphone(var, config)
+
+    source = await microphone.microphone_source_to_code(config[CONF_MICROPHONE])
+    cg.add(var.set_source(source))
+    cg.add(var.set_buffer_duration(config[CONF_BUFFER_DURATION]))
+    cg.add(var.set_pre_roll(config[CONF_PRE_ROLL]))
+    cg.add(var.set_always_on(config[CONF_ALWAYS_ON]))
+    cg.add_define("USE_SHARED_CAPTURE")
@@ -0,0 +1,152 @@
+#include "shared_capture.h"
+
+#include "esphome/core/log.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+namespace esphome::shared_capture {
+
+static const char *const TAG = "shared_capture";
+
+void SharedCapture::setup() {
+  this->audio_stream_info_ = this->source_->get_audio_stream_info();
+  // A power of two, so the byte counters keep indexing the ring correctly when they wrap around.
+  this->size_ = 1;
+  while (this->size_ < this->audio_stream_info_.ms_to_bytes(this->buffer_duration_ms_)) {
+    this->size_ <<= 1;
+  }
+  RAMAllocator<uint8_t> allocator;
+  this->ring_ = allocator.allocate(this->size_);
+  if (this->ring_ == nullptr) {
+    ESP_LOGE(TAG, "Could not allocate capture buffer");
+    this->mark_failed();
+    return;
+  }
+  this->source_->add_data_callback([this](const std::vector<uint8_t> &data) { this->on_audio_(data); });
+  this->update_source_();
+}
+
+void SharedCapture::dump_config() {
+  ESP_LOGCONFIG(TAG, "Shared Capture:");
+  ESP_LOGCONFIG(TAG, "  Buffer: %" PRIu32 " ms (%u bytes)", this->buffer_duration_ms_, (unsigned) this->size_);
+  ESP_LOGCONFIG(TAG, "  Pre-roll: %" PRIu32 " ms", this->pre_roll_ms_);
+  ESP_LOGCONFIG(TAG, "  Always on: %s", YESNO(this->always_on_));
+  ESP_LOGCONFIG(TAG, "  Taps: %u", this->tap_count_);
+}
+
+void SharedCapture::loop() {
+  // Microphone consumers wait for the running state before they expect data.
+  if (this->state_ == microphone::STATE_STARTING && this->source_->is_running()) {
+    this->state_ = microphone::STATE_RUNNING;
+  }
+}
+
+void SharedCapture::start() {
+  if (this->is_failed()) {
+    return;
+  }
+  if (this->state_ == microphone::STATE_STOPPED) {
+    this->state_ = this->source_->is_running() ? microphone::STATE_RUNNING : microphone::STATE_STARTING;
+  }
+  this->forward_ = true;
+  this->update_source_();
+}
+
+void SharedCapture::stop() {
+  this->forward_ = false;
+  this->state_ = microphone::STATE_STOPPED;
+  this->update_source_();
+}
+
+uint8_t SharedCapture::add_tap(bool pre_roll) {
+  if (this->tap_count_ == CAPTURE_MAX_TAPS) {
+    ESP_LOGE(TAG, "More than %u taps", CAPTURE_MAX_TAPS);
+    return CAPTURE_MAX_TAPS - 1;
+  }
+  this->taps_[this->tap_count_].pre_roll = pre_roll;
+  return this->tap_count_++;
+}
+
+void SharedCapture::start_tap(uint8_t tap) {
+  if (this->ring_ == nullptr) {
+    return;
+  }
+  uint32_t written = this->written_.load(std::memory_order_acquire);
+  size_t pre_roll = 0;
+  if (this->taps_[tap].pre_roll) {
+    pre_roll = std::min<size_t>(this->audio_stream_info_.ms_to_bytes(this->pre_roll_ms_), this->size_);
+  }
+  pre_roll = std::min<size_t>(pre_roll, written);
+  // Whole frames only, a tap must not start in the middle of a sample.
+  pre_roll -= pre_roll % this->audio_stream_info_.frames_to_bytes(1);
+  this->taps_[tap].position = written - pre_roll;
+  this->taps_[tap].active = true;
+  this->update_source_();
+}
+
+void SharedCapture::stop_tap(uint8_t tap) {
+  this->taps_[tap].active = false;
+  this->update_source_();
+}
+
+size_t SharedCapture::available(uint8_t tap) {
+  capture_tap_t &reader = this->taps_[tap];
+  if (!reader.active || this->ring_ == nullptr) {
+    return 0;
+  }
+  uint32_t written = this->written_.load(std::memory_order_acquire);
+  uint32_t behind = written - reader.position;
+  if (behind > this->size_ - this->size_ / 4) {
+    // (Nearly) lapped: the writer is overwriting what this tap has not read. Skip to half a ring behind, which
+    // leaves the writer room for the next blocks.
+    reader.overruns++;
+    behind = this->size_ / 2;
+    behind -= behind % this->audio_stream_info_.frames_to_bytes(1);
+    reader.position = written - behind;
+  }
+  return behind;
+}
+
+size_t SharedCapture::read(uint8_t tap, uint8_t *data, size_t length) {
+  length = std::min(length, this->available(tap));
+  capture_tap_t &reader = this->taps_[tap];
+  size_t offset = reader.position % this->size_;
+  size_t first = std::min(length, this->size_ - offset);
+  memcpy(data, this->ring_ + offset, first);
+  memcpy(data + first, this->ring_, length - first);
+  reader.position += length;
+  return length;
+}
+
+void SharedCapture::on_audio_(const std::vector<uint8_t> &data) {
+  size_t length = std::min(data.size(), this->size_);
+  const uint8_t *src = data.data() + data.size() - length;
+  uint32_t written = this->written_.load(std::memory_order_relaxed);
+  size_t offset = written % this->size_;
+  size_t first = std::min(length, this->size_ - offset);
+  memcpy(this->ring_ + offset, src, first);
+  memcpy(this->ring_, src + first, length - first);
+  this->written_.store(written + length, std::memory_order_release);
+
+  if (this->forward_ && this->state_ == microphone::STATE_RUNNING) {
+    // The same block goes to every microphone consumer, each of them only gets a reference.
+    this->data_callbacks_.call(data);
+  }
+}
+
+void SharedCapture::update_source_() {
+  bool needed = this->always_on_ || this->forward_;
+  for (uint8_t tap = 0; tap < this->tap_count_; tap++) {
+    needed |= this->taps_[tap].active;
+  }
+  if (needed && this->source_->is_stopped()) {
+    this->source_->start();
+    this->source_starts_++;
+  } else if (!needed && this->source_->is_running()) {
+    this->source_->stop();
+  }
+}
+
+}  // namespace esphome::shared_capture
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "esphome/core/component.h"
+#include "esphome/core/helpers.h"
+
+#include "esphome/components/microphone/microphone.h"
+#include "esphome/components/microphone/microphone_source.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esphome::shared_capture {
+
+static const uint8_t CAPTURE_MAX_TAPS = 4;
+
+/// A reader of the shared ring with its own position.
+struct capture_tap_t {
+  uint32_t position{0};
+  bool active{false};
+  bool pre_roll{true};
+  uint32_t overruns{0};
+};
+
+/// One capture for every audio consumer on the badge.
+///
+/// The microphone is opened once, through a single MicrophoneSource that does the bit depth, channel and gain
+/// conversion, and keeps running while consumers come and go. Every block it delivers is written once into a
+/// pre-roll ring. Consumers then take it from there without copies of their own:
+///  - as a microphone: voice_assistant and other components that want a Microphone point at this component and get
+///    the block delivered by reference through the data callbacks;
+///  - as a tap: the intercom reads straight from the ring at its own position. A tap that asks for it gets the last
+///    `pre_roll` of audio right away when it starts, so speech that began during the switch is not lost. Live
+///    consumers start at the newest audio instead, they read at real-time pace and would never catch up.
+///
+/// Starting or stopping a consumer only flips a flag, the I2S side is not restarted, which turns a switch from wake
+/// word to intercom from a pipeline restart into a few milliseconds.
+class SharedCapture : public microphone::Microphone, public Component {
+ public:
+  void setup() override;
+  void loop() override;
+  void dump_config() override;
+  float get_setup_priority() const override { return setup_priority::HARDWARE; }
+
+  void set_source(microphone::MicrophoneSource *source) { this->source_ = source; }
+  void set_buffer_duration(uint32_t duration_ms) { this->buffer_duration_ms_ = duration_ms; }
+  void set_pre_roll(uint32_t pre_roll_ms) { this->pre_roll_ms_ = pre_roll_ms; }
+  /// Keep capturing without consumers, so the pre-roll is always filled and nothing waits for I2S to start.
+  void set_always_on(bool always_on) { this->always_on_ = always_on; }
+
+  // Microphone consumers.
+  void start() override;
+  void stop() override;
+
+  // Tap consumers.
+  /// `pre_roll`: start each read `pre_roll` behind the newest audio, instead of at the newest audio.
+  uint8_t add_tap(bool pre_roll = true);
+  /// Start reading, `pre_roll` behind the newest audio when the tap was added with it.
+  void start_tap(uint8_t tap);
+  void stop_tap(uint8_t tap);
+  bool is_tap_running(uint8_t tap) const { return this->taps_[tap].active && this->source_->is_running(); }
+  /// Bytes the tap can read. A tap the capture laps loses the oldest audio and continues half a ring behind.
+  size_t available(uint8_t tap);
+  size_t read(uint8_t tap, uint8_t *data, size_t length);
+
+  /// Times the capture itself was started, consumers switching do not count.
+  uint32_t get_source_starts() const { return this->source_starts_; }
+  uint32_t get_overruns(uint8_t tap) const { return this->taps_[tap].overruns; }
+
+ protected:
+  void on_audio_(const std::vector<uint8_t> &data);
+  void update_source_();
+
+  microphone::MicrophoneSource *source_{nullptr};
+  uint32_t buffer_duration_ms_{512};
+  uint32_t pre_roll_ms_{200};
+  bool always_on_{true};
+
+  // Written by the microphone task only; `written_` counts bytes ever written and is published after the copy.
+  uint8_t *ring_{nullptr};
+  size_t size_{0};
+  std::atomic<uint32_t> written_{0};
+
+  std::array<capture_tap_t, CAPTURE_MAX_TAPS> taps_{};
+  uint8_t tap_count_{0};
+  bool forward_{false};
+  uint32_t source_starts_{0};
+};
+
+}  // namespace esphome::shared_capture
@@ -0,0 +1,53 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.const import CONF_ID
+from esphome.components.espnow import (
+    ESPNOW_SCHEMA,
+    register_espnow_extention,
+    ESPNowReceivedPacketHandler,
+    ESPNowBroadcastedHandler,
+)
+
+AUTO_LOAD = ["espnow"]
+
+CODEOWNERS = ["@LumenSoftNL"]
+
+CONF_TX_SCHEDULER_ID = "tx_scheduler_id"
+CONF_RATE_ADAPTATION = "rate_adaptation"
+
+tx_scheduler_ns = cg.esphome_ns.namespace("tx_scheduler")
+TxScheduler = tx_scheduler_ns.class_(
+    "TxScheduler", cg.Component, ESPNowReceivedPacketHandler, ESPNowBroadcastedHandler
+)
+
+TxClass = tx_scheduler_ns.enum("TxClass", is_class=True)
+
+CONFIG_SCHEMA = (
+    cv.Schema(
+        {
+            cv.GenerateID(): cv.declare_id(TxScheduler),
+            cv.Optional(CONF_RATE_ADAPTATION, default=True): cv.boolean,
+        }
+    )
+    .extend(cv.COMPONENT_SCHEMA)
+    .extend(ESPNOW_SCHEMA)
+)
+
+TX_SCHEDULER_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(CONF_TX_SCHEDULER_ID): cv.use_id(TxScheduler),
+    }
+)
+
+
+async def register_tx_scheduler(var, config):
+    scheduler = await cg.get_variable(config[CONF_TX_SCHEDULER_ID])
+    cg.add(var.set_tx_scheduler(scheduler))
+
+
+async def to_code(config):
+    var = cg.new_Pvariable(config[CONF_ID])
+    await cg.register_component(var, config)
+    await register_espnow_extention(var, config)
+    cg.add(var.set_rate_adaptation(config[CONF_RATE_ADAPTATION]))
+    cg.add_define("USE_TX_SCHEDULER")
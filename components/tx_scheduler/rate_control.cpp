@@ -0,0 +1,107 @@
+#include "rate_control.h"
+
+#include <cstring>
+
+namespace esphome::tx_scheduler {
+
+/// Extra margin in dB before moving up a tier.
+static const int8_t RATE_HYSTERESIS = 4;
+/// Failure rate (per mille) that forces a step down.
+static const uint16_t RATE_FAIL_LIMIT = 200;
+/// Sends and time at a tier before stepping up again.
+static const uint16_t RATE_MIN_SENDS = 16;
+static const uint32_t RATE_MIN_DWELL = 1000;
+
+link_quality_t &RateSelector::get_or_add_(const uint8_t *address, uint32_t now) {
+  link_quality_t *oldest = &this->links_[0];
+  for (link_quality_t &link : this->links_) {
+    if (link.used && memcmp(link.address, address, 6) == 0) {
+      link.last_used = now;
+      return link;
+    }
+    if (!oldest->used) {
+      continue;
+    }
+    if (!link.used || now - link.last_used > now - oldest->last_used) {
+      oldest = &link;
+    }
+  }
+  // Least recently used peer makes room; new peers start at the most robust tier.
+  *oldest = link_quality_t{};
+  memcpy(oldest->address, address, 6);
+  oldest->used = true;
+  oldest->last_used = now;
+  oldest->last_change = now;
+  oldest->tier = RateTier::R1M;
+  return *oldest;
+}
+
+const link_quality_t *RateSelector::find(const uint8_t *address) const {
+  for (const link_quality_t &link : this->links_) {
+    if (link.used && memcmp(link.address, address, 6) == 0) {
+      return &link;
+    }
+  }
+  return nullptr;
+}
+
+RateTier RateSelector::get_tier(const uint8_t *address) const {
+  const link_quality_t *link = this->find(address);
+  return link == nullptr ? RateTier::R1M : link->tier;
+}
+
+void RateSelector::on_rssi(const uint8_t *address, int8_t rssi, uint32_t now) {
+  link_quality_t &link = this->get_or_add_(address, now);
+  if (!link.heard) {
+    link.rssi_x16 = rssi * 16;
+    link.heard = true;
+  } else {
+    link.rssi_x16 += (rssi * 16 - link.rssi_x16) / 8;
+  }
+}
+
+bool RateSelector::on_send(const uint8_t *address, bool success, uint32_t now) {
+  link_quality_t &link = this->get_or_add_(address, now);
+  link.fail_x1000 = link.fail_x1000 - link.fail_x1000 / 16 + (success ? 0 : 1000 / 16);
+  if (link.sends < UINT16_MAX) {
+    link.sends++;
+  }
+  return this->select_(link, now);
+}
+
+bool RateSelector::select_(link_quality_t &link, uint32_t now) {
+  uint8_t current = (uint8_t) link.tier;
+  uint8_t target = current;
+
+  if (link.fail_x1000 > RATE_FAIL_LIMIT) {
+    target = current > 0 ? current - 1 : 0;
+  } else if (link.heard) {
+    int32_t rssi = link.rssi_x16 / 16;
+    // Highest tier the RSSI supports; only the step up needs the hysteresis margin.
+    uint8_t supported = 0;
+    for (uint8_t tier = 1; tier < RATE_TIER_COUNT; tier++) {
+      int32_t needed = this->thresholds_[tier] + (tier > current ? RATE_HYSTERESIS : 0);
+      if (rssi >= needed) {
+        supported = tier;
+      }
+    }
+    if (supported < current) {
+      target = supported;
+    } else if (supported > current && link.sends >= RATE_MIN_SENDS && now - link.last_change >= RATE_MIN_DWELL) {
+      target = current + 1;
+    }
+  }
+
+  if (target == current) {
+    return false;
+  }
+  link.tier = (RateTier) target;
+  link.sends = 0;
+  link.last_change = now;
+  // Failures at the old rate say nothing about the new one.
+  link.fail_x1000 = 0;
+  this->changes_++;
+  return true;
+}
+
+}  // namespace esphome::tx_scheduler
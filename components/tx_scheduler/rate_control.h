@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace esphome::tx_scheduler {
+
+/// PHY rate tiers from most robust to fastest. The mapping to driver rates lives in the component, so the selection
+/// logic builds and runs on a host.
+enum class RateTier : uint8_t { R1M, R6M, MCS2, MCS4, MCS7 };
+static const uint8_t RATE_TIER_COUNT = 5;
+
+static const uint8_t RATE_MAX_PEERS = 16;
+
+struct link_quality_t {
+  uint8_t address[6];
+  bool used;
+  bool heard;              // at least one RSSI sample
+  int32_t rssi_x16;        // RSSI EWMA in 1/16 dBm
+  uint16_t fail_x1000;     // send failure EWMA, per mille
+  uint16_t sends;          // sends since the last rate change
+  uint32_t last_change;
+  uint32_t last_used;
+  RateTier tier;
+};
+
+/// Per-peer link tracking and rate choice.
+///
+/// The tier follows the RSSI EWMA through a threshold table with hysteresis. A failure rate over the limit steps
+/// down one tier right away; stepping up needs a minimum number of sends and time at the current tier, so a
+/// marginal link does not flap.
+class RateSelector {
+ public:
+  /// RSSI needed to use each tier, in dBm.
+  void set_thresholds(const std::array<int8_t, RATE_TIER_COUNT> &thresholds) { this->thresholds_ = thresholds; }
+
+  void on_rssi(const uint8_t *address, int8_t rssi, uint32_t now);
+  /// Record the outcome of a unicast send. Returns true when the peer's tier changed.
+  bool on_send(const uint8_t *address, bool success, uint32_t now);
+
+  const link_quality_t *find(const uint8_t *address) const;
+  RateTier get_tier(const uint8_t *address) const;
+  uint32_t get_changes() const { return this->changes_; }
+
+ protected:
+  link_quality_t &get_or_add_(const uint8_t *address, uint32_t now);
+  bool select_(link_quality_t &link, uint32_t now);
+
+  std::array<link_quality_t, RATE_MAX_PEERS> links_{};
+  std::array<int8_t, RATE_TIER_COUNT> thresholds_{-127, -85, -78, -70, -62};
+  uint32_t changes_{0};
+};
+
+}  // namespace esphome::tx_scheduler
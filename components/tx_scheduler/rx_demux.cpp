@@ -0,0 +1,47 @@
+#include "rx_demux.h"
+
+#include <cstring>
+
+namespace esphome::tx_scheduler {
+
+bool RxDemux::add(uint8_t protocol, rx_handler_t &&handler) {
+  uint8_t index = this->routes_[protocol];
+  if (index == RX_NO_ROUTE) {
+    if (this->count_ == RX_MAX_PROTOCOLS) {
+      return false;
+    }
+    index = this->count_++;
+    this->routes_[protocol] = index;
+  }
+  this->protocols_[index].handler = std::move(handler);
+  return true;
+}
+
+void RxDemux::set_filter(uint8_t protocol, const uint8_t *address) {
+  uint8_t index = this->routes_[protocol];
+  if (index == RX_NO_ROUTE) {
+    return;
+  }
+  protocol_t &entry = this->protocols_[index];
+  entry.filtered = address != nullptr;
+  if (address != nullptr) {
+    memcpy(entry.address, address, ESP_NOW_ETH_ALEN);
+  }
+}
+
+bool RxDemux::dispatch(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
+  if (size == 0 || this->routes_[data[0]] == RX_NO_ROUTE) {
+    this->stats_.foreign++;
+    return false;
+  }
+  const protocol_t &entry = this->protocols_[this->routes_[data[0]]];
+  if (entry.filtered && memcmp(info.des_addr, entry.address, ESP_NOW_ETH_ALEN) != 0) {
+    this->stats_.filtered++;
+    return true;
+  }
+  this->stats_.frames++;
+  entry.handler(info, data, size);
+  return true;
+}
+
+}  // namespace esphome::tx_scheduler
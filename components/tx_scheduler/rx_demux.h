@@ -0,0 +1,60 @@
+#pragma once
+
+#include "esphome/components/espnow/espnow_component.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+
+namespace esphome::tx_scheduler {
+
+/// First byte of every frame of our ESP-NOW protocols, the byte the receive path dispatches on.
+static const uint8_t PROTOCOL_INTERCOM = 0x49;  // 'I'
+static const uint8_t PROTOCOL_NOWTALK = 0x4e;   // 'N', NOWTALK_HEADER
+static const uint8_t PROTOCOL_CLOCK = 0x54;     // 'T'
+
+/// Protocols that can be registered at once.
+static const uint8_t RX_MAX_PROTOCOLS = 4;
+static const uint8_t RX_NO_ROUTE = 0xff;
+
+/// Takes a frame whose first byte matched its protocol, the protocol byte included.
+using rx_handler_t = std::function<void(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size)>;
+
+struct rx_stats_t {
+  uint32_t frames{0};    // handed to a protocol
+  uint32_t filtered{0};  // ours, but for another destination
+  uint32_t foreign{0};   // not ours, left to other ESP-NOW handlers
+};
+
+/// Receive side of the shared ESP-NOW path. A 256 entry table maps the protocol byte to its handler, so each frame
+/// costs one lookup and reaches exactly one protocol. A protocol can ask for frames to one destination only; the
+/// address is resolved when it is set rather than per frame.
+class RxDemux {
+ public:
+  RxDemux() { this->routes_.fill(RX_NO_ROUTE); }
+
+  /// Frames starting with `protocol` go to `handler`. A second registration for the same byte replaces the first.
+  bool add(uint8_t protocol, rx_handler_t &&handler);
+  /// Only pass frames of `protocol` whose destination is `address`, nullptr passes every frame.
+  void set_filter(uint8_t protocol, const uint8_t *address);
+
+  /// Hand the frame to its protocol. Returns false when no registered protocol claims it.
+  bool dispatch(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size);
+  bool claims(uint8_t protocol) const { return this->routes_[protocol] != RX_NO_ROUTE; }
+
+  const rx_stats_t &get_stats() const { return this->stats_; }
+
+ protected:
+  struct protocol_t {
+    rx_handler_t handler;
+    bool filtered;
+    uint8_t address[ESP_NOW_ETH_ALEN];
+  };
+
+  std::array<uint8_t, 256> routes_;
+  std::array<protocol_t, RX_MAX_PROTOCOLS> protocols_{};
+  uint8_t count_{0};
+  rx_stats_t stats_{};
+};
+
+}  // namespace esphome::tx_scheduler
@@ -0,0 +1,210 @@
+#include "tx_scheduler.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <esp_idf_version.h>
+#include <esp_now.h>
+
+#include <cinttypes>
+#include <cstring>
+
+namespace esphome::tx_scheduler {
+
+static const char *const TAG = "tx_scheduler";
+
+static const char *const TX_CLASS_NAMES[TX_CLASS_COUNT] = {"emergency", "control", "audio", "bulk"};
+
+/// A send callback that does not arrive within this time is taken as lost, so the path never stalls.
+static const uint32_t TX_CALLBACK_TIMEOUT_US = 50000;
+
+static const char *const RATE_TIER_NAMES[RATE_TIER_COUNT] = {"1M", "6M", "MCS2", "MCS4", "MCS7"};
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 4, 0)
+struct phy_rate_t {
+  wifi_phy_mode_t mode;
+  wifi_phy_rate_t rate;
+};
+static const phy_rate_t RATE_TIERS[RATE_TIER_COUNT] = {
+    {WIFI_PHY_MODE_11B, WIFI_PHY_RATE_1M_L},       {WIFI_PHY_MODE_11G, WIFI_PHY_RATE_6M},
+    {WIFI_PHY_MODE_HT20, WIFI_PHY_RATE_MCS2_LGI},  {WIFI_PHY_MODE_HT20, WIFI_PHY_RATE_MCS4_LGI},
+    {WIFI_PHY_MODE_HT20, WIFI_PHY_RATE_MCS7_SGI},
+};
+#endif
+
+static bool is_broadcast(const uint8_t *address) {
+  static const uint8_t BROADCAST[ESP_NOW_ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+  return memcmp(address, BROADCAST, ESP_NOW_ETH_ALEN) == 0;
+}
+
+bool TxScheduler::send(TxClass cls, const uint8_t *address, const uint8_t *data, size_t len,
+                       tx_callback_t &&callback) {
+  if (len > ESP_NOW_MAX_DATA_LEN) {
+    return false;
+  }
+  if (cls == TxClass::AUDIO) {
+    this->audio_seen_ = true;
+    this->last_audio_ = millis();
+  }
+  uint8_t index = (uint8_t) cls;
+  class_queue_t &queue = this->queues_[index];
+  if (queue.count == TX_QUEUE_DEPTH[index]) {
+    if (cls != TxClass::AUDIO) {
+      this->stats_[index].dropped++;
+      return false;
+    }
+    tx_frame_t &oldest = queue.frames[queue.head];
+    if (oldest.callback) {
+      oldest.callback(ESP_ERR_NO_MEM);
+    }
+    queue.head = (queue.head + 1) % TX_QUEUE_DEPTH[index];
+    queue.count--;
+    this->stats_[index].dropped++;
+  }
+
+  tx_frame_t &frame = queue.frames[(queue.head + queue.count) % TX_QUEUE_DEPTH[index]];
+  frame.has_address = address != nullptr;
+  if (frame.has_address) {
+    memcpy(frame.address, address, ESP_NOW_ETH_ALEN);
+  }
+  memcpy(frame.data, data, len);
+  frame.len = len;
+  frame.queued_us = micros();
+  frame.callback = std::move(callback);
+  queue.count++;
+
+  this->dispatch_();
+  return true;
+}
+
+void TxScheduler::dispatch_() {
+  while (!this->in_flight_) {
+    uint8_t index = 0;
+    while (index < TX_CLASS_COUNT && this->queues_[index].count == 0) {
+      index++;
+    }
+    if (index == TX_CLASS_COUNT) {
+      return;
+    }
+    class_queue_t &queue = this->queues_[index];
+    tx_frame_t &frame = queue.frames[queue.head];
+    queue.head = (queue.head + 1) % TX_QUEUE_DEPTH[index];
+    queue.count--;
+
+    uint32_t now = micros();
+    uint32_t latency = now - frame.queued_us;
+    tx_class_stats_t &stats = this->stats_[index];
+    stats.sent++;
+    stats.latency_avg_us = stats.sent == 1 ? latency : stats.latency_avg_us - stats.latency_avg_us / 8 + latency / 8;
+    stats.latency_max_us = std::max(stats.latency_max_us, latency);
+
+    this->in_flight_ = true;
+    this->in_flight_since_ = now;
+    this->in_flight_callback_ = std::move(frame.callback);
+    this->in_flight_unicast_ = frame.has_address && !is_broadcast(frame.address);
+    if (this->in_flight_unicast_) {
+      memcpy(this->in_flight_address_, frame.address, ESP_NOW_ETH_ALEN);
+    }
+    uint32_t sequence = ++this->sequence_;
+    esp_err_t err = this->parent_->send(frame.has_address ? frame.address : nullptr, frame.data, frame.len,
+                                        [this, sequence](esp_err_t err) { this->complete_(sequence, err); });
+    if (err != ESP_OK) {
+      this->finish_(err);
+    }
+  }
+}
+
+void TxScheduler::finish_(esp_err_t err) {
+  this->in_flight_ = false;
+  if (this->rate_adaptation_ && this->in_flight_unicast_ &&
+      this->rates_.on_send(this->in_flight_address_, err == ESP_OK, millis())) {
+    this->apply_rate_(this->in_flight_address_, this->rates_.get_tier(this->in_flight_address_));
+  }
+  tx_callback_t callback = std::move(this->in_flight_callback_);
+  this->in_flight_callback_ = nullptr;
+  if (callback) {
+    callback(err);
+  }
+}
+
+void TxScheduler::complete_(uint32_t sequence, esp_err_t err) {
+  // Late callbacks of frames that already timed out must not complete the frame now in flight.
+  if (!this->in_flight_ || sequence != this->sequence_) {
+    return;
+  }
+  this->finish_(err);
+  this->dispatch_();
+}
+
+void TxScheduler::on_rssi(const uint8_t *address, int8_t rssi) {
+  if (this->rate_adaptation_) {
+    this->rates_.on_rssi(address, rssi, millis());
+  }
+}
+
+void TxScheduler::setup() {
+  this->parent_->register_received_handler(this);
+  this->parent_->register_broadcasted_handler(this);
+}
+
+bool TxScheduler::on_received(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
+  if (size > 0 && this->demux_.claims(data[0])) {
+    this->on_rssi(info.src_addr, info.rx_ctrl->rssi);
+  }
+  if (size > 0 && data[0] == PROTOCOL_INTERCOM) {
+    this->audio_seen_ = true;
+    this->last_audio_ = millis();
+  }
+  return this->demux_.dispatch(info, data, size);
+}
+
+bool TxScheduler::on_broadcasted(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) {
+  return this->on_received(info, data, size);
+}
+
+void TxScheduler::apply_rate_(const uint8_t *address, RateTier tier) {
+  const link_quality_t *link = this->rates_.find(address);
+  ESP_LOGD(TAG, "Peer %02X:%02X:%02X:%02X:%02X:%02X rate %s (RSSI %" PRId32 " dBm, %u%% fail)", address[0],
+           address[1], address[2], address[3], address[4], address[5], RATE_TIER_NAMES[(uint8_t) tier],
+           link->rssi_x16 / 16, link->fail_x1000 / 10);
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 4, 0)
+  esp_now_rate_config_t config = {};
+  config.phymode = RATE_TIERS[(uint8_t) tier].mode;
+  config.rate = RATE_TIERS[(uint8_t) tier].rate;
+  esp_err_t err = esp_now_set_peer_rate_config(address, &config);
+  if (err != ESP_OK) {
+    ESP_LOGV(TAG, "Setting peer rate failed: %s", esp_err_to_name(err));
+  }
+#endif
+}
+
+void TxScheduler::loop() {
+  if (this->in_flight_ && micros() - this->in_flight_since_ > TX_CALLBACK_TIMEOUT_US) {
+    ESP_LOGW(TAG, "Send callback timed out");
+    this->finish_(ESP_ERR_TIMEOUT);
+  }
+  this->dispatch_();
+}
+
+void TxScheduler::dump_config() {
+  ESP_LOGCONFIG(TAG, "TX scheduler:");
+  ESP_LOGCONFIG(TAG, "  Rate adaptation: %s", YESNO(this->rate_adaptation_));
+#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 4, 0)
+  if (this->rate_adaptation_) {
+    ESP_LOGCONFIG(TAG, "  Per-peer rates need ESP-IDF 5.4, tracking link quality only");
+  }
+#endif
+  for (uint8_t index = 0; index < TX_CLASS_COUNT; index++) {
+    const tx_class_stats_t &stats = this->stats_[index];
+    ESP_LOGCONFIG(TAG,
+                  "  %s: depth %u, sent %" PRIu32 ", dropped %" PRIu32 ", latency avg %" PRIu32 " us, max %" PRIu32
+                  " us",
+                  TX_CLASS_NAMES[index], TX_QUEUE_DEPTH[index], stats.sent, stats.dropped, stats.latency_avg_us,
+                  stats.latency_max_us);
+  }
+  const rx_stats_t &rx = this->demux_.get_stats();
+  ESP_LOGCONFIG(TAG, "  Received: %" PRIu32 " frames, %" PRIu32 " for other destinations, %" PRIu32 " foreign",
+                rx.frames, rx.filtered, rx.foreign);
+}
+
+}  // namespace esphome::tx_scheduler
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "esphome/core/component.h"
+#include "esphome/core/helpers.h"
+
+#include "esphome/components/espnow/espnow_component.h"
+
+#include "rate_control.h"
+#include "rx_demux.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+
+namespace esphome::tx_scheduler {
+
+/// Strict priority order: a queued frame of a lower class only goes out when every higher class is empty.
+enum class TxClass : uint8_t { EMERGENCY, CONTROL, AUDIO, BULK };
+static const uint8_t TX_CLASS_COUNT = 4;
+
+/// Frames per class queue. Audio is kept short, a late voice frame is worth less than a dropped one.
+static const uint8_t TX_QUEUE_DEPTH[TX_CLASS_COUNT] = {4, 8, 4, 8};
+static const uint8_t TX_QUEUE_MAX_DEPTH = 8;
+
+using tx_callback_t = std::function<void(esp_err_t)>;
+
+struct tx_frame_t {
+  uint8_t address[ESP_NOW_ETH_ALEN];
+  bool has_address;
+  uint8_t len;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+  uint32_t queued_us;
+  tx_callback_t callback;
+};
+
+struct tx_class_stats_t {
+  uint32_t sent{0};
+  uint32_t dropped{0};
+  uint32_t latency_avg_us{0};  // EWMA of queueing latency, enqueue to hand-off
+  uint32_t latency_max_us{0};
+};
+
+/// Shared ESP-NOW send path. Keeps a single frame in flight and picks the next one by class, so an SOS or a call
+/// setup frame waits for at most one frame of airtime however much audio or bulk data is queued.
+///
+/// It is also the single ESP-NOW receive handler of the protocols that send through it, see RxDemux.
+class TxScheduler : public Component,
+                    public Parented<espnow::ESPNowComponent>,
+                    public espnow::ESPNowReceivedPacketHandler,
+                    public espnow::ESPNowBroadcastedHandler {
+ public:
+  void setup() override;
+  void loop() override;
+  void dump_config() override;
+  float get_setup_priority() const override { return setup_priority::AFTER_WIFI; }
+
+  /// Queue `len` bytes for `address` (nullptr for the broadcast or default peer). A full audio queue drops its
+  /// oldest frame, the other classes refuse the new one and return false.
+  bool send(TxClass cls, const uint8_t *address, const uint8_t *data, size_t len, tx_callback_t &&callback = nullptr);
+
+  /// Per-peer PHY rate from RSSI and send failures. Broadcasts always use the default rate.
+  void set_rate_adaptation(bool enabled) { this->rate_adaptation_ = enabled; }
+  /// Feed the RSSI of every received frame, ESPNowRecvInfo::rx_ctrl->rssi. Frames of registered protocols are fed
+  /// by the scheduler itself.
+  void on_rssi(const uint8_t *address, int8_t rssi);
+
+  /// Receive frames whose first byte is `protocol` (PROTOCOL_*).
+  bool add_protocol(uint8_t protocol, rx_handler_t &&handler) { return this->demux_.add(protocol, std::move(handler)); }
+  /// Only pass frames of `protocol` sent to `address`, nullptr passes all.
+  void set_protocol_filter(uint8_t protocol, const uint8_t *address) { this->demux_.set_filter(protocol, address); }
+  bool on_received(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) override;
+  bool on_broadcasted(const espnow::ESPNowRecvInfo &info, const uint8_t *data, uint8_t size) override;
+
+  size_t queued(TxClass cls) const { return this->queues_[(uint8_t) cls].count; }
+  /// Whether intercom audio went out or came in during the last `window` ms.
+  bool is_audio_active(uint32_t now, uint32_t window) const {
+    return this->audio_seen_ && now - this->last_audio_ < window;
+  }
+  const tx_class_stats_t &get_stats(TxClass cls) const { return this->stats_[(uint8_t) cls]; }
+
+ protected:
+  struct class_queue_t {
+    std::array<tx_frame_t, TX_QUEUE_MAX_DEPTH> frames{};
+    uint8_t head{0};
+    uint8_t count{0};
+  };
+
+  void dispatch_();
+  void finish_(esp_err_t err);
+  void complete_(uint32_t sequence, esp_err_t err);
+  void apply_rate_(const uint8_t *address, RateTier tier);
+
+  std::array<class_queue_t, TX_CLASS_COUNT> queues_{};
+  std::array<tx_class_stats_t, TX_CLASS_COUNT> stats_{};
+  bool audio_seen_{false};
+  uint32_t last_audio_{0};
+
+  bool in_flight_{false};
+  uint32_t in_flight_since_{0};
+  uint32_t sequence_{0};
+  tx_callback_t in_flight_callback_{};
+  uint8_t in_flight_address_[ESP_NOW_ETH_ALEN]{};
+  bool in_flight_unicast_{false};
+
+  bool rate_adaptation_{true};
+  RateSelector rates_;
+  RxDemux demux_;
+};
+
+}  // namespace esphome::tx_scheduler
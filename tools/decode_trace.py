@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Decode an event_trace dump from a device log into a timeline.
+
+Capture the log while the event_trace.dump action runs, e.g. `esphome logs combadge.yaml > trace.log`, then:
+
+    tools/decode_trace.py trace.log            # one line per event
+    tools/decode_trace.py --summary trace.log  # event counts and loop time per component
+"""
+
+import argparse
+import collections
+import re
+import struct
+import sys
+
+# Same table as TraceEvent in components/event_trace/event_trace.h.
+EVENTS = {
+    0x0001: ("loop", "component", "cycles"),
+    0x0002: ("mark", "arg0", "arg1"),
+    0x0101: ("intercom.mode", "new", "old"),
+    0x0102: ("intercom.rx", "bytes", "timed"),
+    0x0103: ("intercom.tx", "bytes", "timed"),
+    0x0104: ("intercom.underrun", "underruns", "buffered"),
+    0x0105: ("intercom.resync", "late", "-"),
+    0x0106: ("intercom.drop", "bytes", "buffered"),
+    0x0107: ("intercom.conceal", "lost", "samples"),
+    0x0108: ("intercom.recover", "block", "total"),
+    0x0201: ("mesh.mode", "new", "old"),
+    0x0202: ("mesh.rx", "bytes", "from"),
+    0x0203: ("mesh.counter", "received", "expected"),
+    0x0204: ("mesh.tx", "bytes", "counter"),
+    0x0205: ("mesh.forward", "bytes", "children"),
+    0x0301: ("nowtalk.rx", "code", "bytes"),
+    0x0302: ("nowtalk.tx", "code", "bytes"),
+    0x0303: ("nowtalk.batch", "requests", "cycles"),
+    0x0304: ("nowtalk.call", "direct", "us"),
+}
+
+EVENT = struct.Struct("<IHHII")
+LINE = re.compile(r"TRACE (begin|end|loop|[0-9a-fA-F]+)(.*)$")
+
+
+def parse(lines):
+    """Return (cpu frequency, loop component names, events) of the last complete dump in `lines`."""
+    freq, names, data, dumps = 240000000, {}, bytearray(), []
+    for line in lines:
+        match = LINE.search(line.strip())
+        if not match:
+            continue
+        kind, rest = match.groups()
+        if kind == "begin":
+            fields = dict(item.split("=") for item in rest.split())
+            freq, names, data = int(fields["freq"]), {}, bytearray()
+        elif kind == "loop":
+            index, name = rest.strip().split("=", 1)
+            names[int(index)] = name
+        elif kind == "end":
+            dumps.append((freq, names, bytes(data)))
+        else:
+            data += bytes.fromhex(kind)
+    if not dumps:
+        sys.exit("no complete TRACE dump found")
+    freq, names, data = dumps[-1]
+    return freq, names, [EVENT.unpack_from(data, offset) for offset in range(0, len(data) - EVENT.size + 1, EVENT.size)]
+
+
+def timeline(names, events):
+    """Events with a 64 bit time in microseconds, unwrapping the 32 bit timestamps."""
+    elapsed, prev, expected_seq = 0, None, None
+    for time_us, event_id, seq, arg0, arg1 in events:
+        if prev is not None:
+            elapsed += (time_us - prev) & 0xFFFFFFFF
+        prev = time_us
+        gap = expected_seq is not None and seq != expected_seq
+        expected_seq = (seq + 1) & 0xFFFF
+        name, label0, label1 = EVENTS.get(event_id, (f"0x{event_id:04x}", "arg0", "arg1"))
+        if event_id == 0x0001:
+            arg0 = names.get(arg0, arg0)
+        yield elapsed, name, (label0, arg0), (label1, arg1), gap
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("log", nargs="?", type=argparse.FileType("r"), default=sys.stdin)
+    parser.add_argument("--summary", action="store_true", help="counts per event and loop time per component")
+    args = parser.parse_args()
+
+    freq, names, events = parse(args.log)
+    if not args.summary:
+        for time_us, name, (label0, arg0), (label1, arg1), gap in timeline(names, events):
+            if gap:
+                print("  ... events lost ...")
+            print(f"{time_us:12.1f} us  {name:20} {label0}={arg0} {label1}={arg1}")
+        return
+
+    counts = collections.Counter()
+    loops = collections.defaultdict(list)
+    span = 0.0
+    for time_us, name, (_, arg0), (_, arg1), _ in timeline(names, events):
+        counts[name] += 1
+        span = time_us
+        if name == "loop":
+            loops[arg0].append(arg1 * 1e6 / freq)
+    print(f"{len(events)} events over {span / 1000:.1f} ms")
+    for name, count in counts.most_common():
+        print(f"  {name:20} {count:8}")
+    print("loop time per component:")
+    for component, times in sorted(loops.items(), key=lambda item: -sum(item[1])):
+        share = 100 * sum(times) / span if span else 0
+        print(
+            f"  {str(component):20} {share:5.1f}%  {len(times):6} calls  "
+            f"avg {sum(times) / len(times):7.1f} us  max {max(times):7.1f} us"
+        )
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,165 @@
+// Host test for the per-peer PHY rate choice of tx_scheduler: hysteresis, dwell time and the step down on failures.
+//
+//   g++ -std=c++17 -Icomponents tools/rate_control_test.cpp components/tx_scheduler/rate_control.cpp && ./a.out
+//
+// Prints every failed check and exits non-zero when there was one.
+
+#include "tx_scheduler/rate_control.h"
+
+#include <cstdint>
+#include <cstdio>
+
+using namespace esphome::tx_scheduler;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+static const uint8_t PEER[6] = {0x24, 0x6f, 0x28, 0x00, 0x00, 0x01};
+static const uint8_t OTHER[6] = {0x24, 0x6f, 0x28, 0x00, 0x00, 0x02};
+
+/// Enough samples for the RSSI average to settle on `rssi`.
+static void settle_rssi(RateSelector &selector, const uint8_t *address, int8_t rssi, uint32_t now) {
+  for (int i = 0; i < 64; i++) {
+    selector.on_rssi(address, rssi, now);
+  }
+}
+
+/// Successful sends, one per ms from `now`. Returns the time after the last one.
+static uint32_t send_ok(RateSelector &selector, const uint8_t *address, uint32_t count, uint32_t now) {
+  for (uint32_t i = 0; i < count; i++) {
+    selector.on_send(address, true, now++);
+  }
+  return now;
+}
+
+/// Strong signal, step up one tier per dwell until `tier` is reached. Returns the time of the last change.
+static uint32_t climb_to(RateSelector &selector, const uint8_t *address, RateTier tier) {
+  uint32_t now = 0;
+  settle_rssi(selector, address, -40, now);
+  while (selector.get_tier(address) < tier && now < 100000) {
+    now = send_ok(selector, address, 16, now + 1000);
+  }
+  return selector.find(address)->last_change;
+}
+
+static void test_new_peer() {
+  RateSelector selector;
+  CHECK(selector.get_tier(PEER) == RateTier::R1M);
+  CHECK(selector.find(PEER) == nullptr);
+  selector.on_rssi(PEER, -40, 0);
+  CHECK(selector.get_tier(PEER) == RateTier::R1M);
+  CHECK(selector.find(PEER) != nullptr);
+  CHECK(selector.find(OTHER) == nullptr);
+}
+
+static void test_hysteresis() {
+  // R6M needs -85 dBm, plus 4 dB of margin to move up to it.
+  RateSelector selector;
+  settle_rssi(selector, PEER, -83, 0);
+  send_ok(selector, PEER, 100, 2000);
+  CHECK(selector.get_tier(PEER) == RateTier::R1M);
+
+  settle_rssi(selector, PEER, -80, 3000);
+  send_ok(selector, PEER, 16, 4000);
+  CHECK(selector.get_tier(PEER) == RateTier::R6M);
+
+  // Inside the margin on the way down the tier is kept, below the threshold it is left on the next send.
+  settle_rssi(selector, PEER, -84, 5000);
+  send_ok(selector, PEER, 100, 5000);
+  CHECK(selector.get_tier(PEER) == RateTier::R6M);
+  settle_rssi(selector, PEER, -90, 6000);
+  CHECK(selector.on_send(PEER, true, 6000));
+  CHECK(selector.get_tier(PEER) == RateTier::R1M);
+}
+
+static void test_dwell() {
+  RateSelector selector;
+  settle_rssi(selector, PEER, -40, 0);
+  // Plenty of sends, but not yet a second at the tier.
+  send_ok(selector, PEER, 100, 0);
+  CHECK(selector.get_tier(PEER) == RateTier::R1M);
+  CHECK(selector.on_send(PEER, true, 1000));
+  CHECK(selector.get_tier(PEER) == RateTier::R6M);
+
+  // Long past the dwell, but the send count starts over with the change.
+  send_ok(selector, PEER, 15, 5000);
+  CHECK(selector.get_tier(PEER) == RateTier::R6M);
+  CHECK(selector.on_send(PEER, true, 5015));
+  // One tier at a time, even with a signal that supports the fastest one.
+  CHECK(selector.get_tier(PEER) == RateTier::MCS2);
+  CHECK(selector.get_changes() == 2);
+}
+
+static void test_fail_step_down() {
+  RateSelector selector;
+  uint32_t now = climb_to(selector, PEER, RateTier::MCS4) + 1;
+  CHECK(selector.get_tier(PEER) == RateTier::MCS4);
+  uint32_t changes = selector.get_changes();
+
+  // The failure average passes the limit on the fourth failure in a row and drops exactly one tier.
+  CHECK(!selector.on_send(PEER, false, now++));
+  CHECK(!selector.on_send(PEER, false, now++));
+  CHECK(!selector.on_send(PEER, false, now++));
+  CHECK(selector.get_tier(PEER) == RateTier::MCS4);
+  CHECK(selector.on_send(PEER, false, now++));
+  CHECK(selector.get_tier(PEER) == RateTier::MCS2);
+  CHECK(selector.get_changes() == changes + 1);
+  // The average starts over at the new tier, a single failure does not drop it again.
+  CHECK(selector.find(PEER)->fail_x1000 == 0);
+  CHECK(!selector.on_send(PEER, false, now++));
+  CHECK(selector.get_tier(PEER) == RateTier::MCS2);
+
+  // Climbing back needs the full dwell again, however good the signal is.
+  now = send_ok(selector, PEER, 100, now);
+  CHECK(selector.get_tier(PEER) == RateTier::MCS2);
+  send_ok(selector, PEER, 16, selector.find(PEER)->last_change + 1000);
+  CHECK(selector.get_tier(PEER) == RateTier::MCS4);
+}
+
+static void test_floor() {
+  RateSelector selector;
+  uint32_t now = 0;
+  for (int i = 0; i < 50; i++) {
+    selector.on_send(PEER, false, now++);
+  }
+  CHECK(selector.get_tier(PEER) == RateTier::R1M);
+  CHECK(selector.get_changes() == 0);
+}
+
+static void test_eviction() {
+  RateSelector selector;
+  uint8_t address[6] = {0x24, 0x6f, 0x28, 0x01, 0x00, 0x00};
+  for (uint8_t i = 0; i < RATE_MAX_PEERS; i++) {
+    address[5] = i;
+    selector.on_rssi(address, -60, i);
+  }
+  // A new peer replaces the least recently used one and starts at the most robust tier.
+  selector.on_rssi(PEER, -40, 100);
+  address[5] = 0;
+  CHECK(selector.find(address) == nullptr);
+  address[5] = 1;
+  CHECK(selector.find(address) != nullptr);
+  CHECK(selector.get_tier(PEER) == RateTier::R1M);
+}
+
+int main() {
+  test_new_peer();
+  test_hysteresis();
+  test_dwell();
+  test_fail_step_down();
+  test_floor();
+  test_eviction();
+  if (failures > 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All rate control checks passed\n");
+  return 0;
+}
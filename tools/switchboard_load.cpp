@@ -0,0 +1,102 @@
+// Drive the NowTalk switchboard engine with synthetic badge traffic on the host and report its throughput and reply
+// latency.
+//
+//   g++ -O2 -Icomponents tools/switchboard_load.cpp components/nowtalk/{switchboard,roster,bulk_transfer}.cpp
+//   ./a.out [badges] [requests/s] [seconds] [loop ms]
+//
+// Requests arrive at random times on a simulated clock and are handled in one pass per loop, like on the device.
+// The latency is the simulated time a request waits for its pass; requests/s is how many the engine handles per
+// second of host CPU time.
+
+#include "nowtalk/protocol.h"
+#include "nowtalk/switchboard.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace esphome::nowtalk;
+
+int main(int argc, char **argv) {
+  uint32_t badges = argc > 1 ? strtoul(argv[1], nullptr, 10) : 120;
+  uint32_t rate = argc > 2 ? strtoul(argv[2], nullptr, 10) : 500;
+  uint32_t seconds = argc > 3 ? strtoul(argv[3], nullptr, 10) : 10;
+  uint32_t loop_ms = argc > 4 ? strtoul(argv[4], nullptr, 10) : 16;
+  badges = std::min<uint32_t>(std::max<uint32_t>(badges, 2), NOWTALK_ROSTER_SIZE);
+  loop_ms = std::max<uint32_t>(loop_ms, 1);
+
+  std::vector<std::array<uint8_t, 6>> macs(badges);
+  for (uint32_t i = 0; i < badges; i++) {
+    macs[i] = {0x24, 0x6f, 0x28, 0x00, (uint8_t) (i >> 8), (uint8_t) i};
+  }
+
+  uint32_t frames = 0;
+  RosterServer roster;
+  roster.set_send([&frames](uint8_t code, const uint8_t *data, size_t len) {
+    frames++;
+    return true;
+  });
+  SwitchboardEngine engine;
+  engine.set_roster(&roster);
+  engine.set_send([&frames](const uint8_t *mac, uint8_t code, const uint8_t *data, size_t len) {
+    frames++;
+    return true;
+  });
+
+  // Every badge registers first, already synced so the run is not dominated by roster dumps.
+  uint8_t ping[4] = {NOWTALK_STATUS_ALIVE, 0, 0, 1};
+  for (uint32_t i = 0; i < badges; i++) {
+    engine.submit(macs[i].data(), NOWTALK_CLIENT_PING, ping, sizeof(ping), 0);
+    if (engine.queued() == SWITCHBOARD_QUEUE_SIZE) {
+      engine.process(0, 0);
+    }
+  }
+  engine.process(0, 0);
+  switchboard_stats_t warmup = engine.get_stats();
+
+  // Mostly keepalives, the rest call setup and hang ups.
+  std::mt19937 rng(1);
+  std::exponential_distribution<double> gap(rate / 1e6);
+  std::uniform_int_distribution<uint32_t> pick(0, badges - 1);
+  std::uniform_int_distribution<uint32_t> kind(0, 99);
+
+  uint64_t end_us = (uint64_t) seconds * 1000000;
+  uint64_t next_us = (uint64_t) gap(rng);
+  std::chrono::nanoseconds busy{0};
+  for (uint64_t now_us = loop_ms * 1000; now_us <= end_us; now_us += loop_ms * 1000) {
+    auto start = std::chrono::steady_clock::now();
+    for (; next_us < now_us; next_us += (uint64_t) gap(rng) + 1) {
+      uint32_t badge = pick(rng);
+      uint32_t roll = kind(rng);
+      if (roll < 70) {
+        engine.submit(macs[badge].data(), NOWTALK_CLIENT_PING, ping, sizeof(ping), next_us);
+      } else if (roll < 90) {
+        uint32_t peer = (badge + 1 + pick(rng) % (badges - 1)) % badges;
+        engine.submit(macs[badge].data(), NOWTALK_CLIENT_START_CALL, macs[peer].data(), 6, next_us);
+      } else {
+        engine.submit(macs[badge].data(), NOWTALK_CLIENT_CLOSED, nullptr, 0, next_us);
+      }
+    }
+    engine.process(now_us / 1000, now_us);
+    roster.loop(now_us / 1000);
+    busy += std::chrono::steady_clock::now() - start;
+  }
+
+  const switchboard_stats_t &stats = engine.get_stats();
+  uint32_t requests = stats.requests - warmup.requests;
+  double cpu_s = std::chrono::duration<double>(busy).count();
+  printf("%" PRIu32 " badges, %" PRIu32 " requests/s offered for %" PRIu32 " s, one pass every %" PRIu32 " ms\n",
+         badges, rate, seconds, loop_ms);
+  printf("  requests: %" PRIu32 " handled, %" PRIu32 " dropped (queue of %u)\n", requests,
+         stats.dropped - warmup.dropped, SWITCHBOARD_QUEUE_SIZE);
+  printf("  replies:  %" PRIu32 " in %" PRIu32 " passes, %" PRIu32 " calls set up, %" PRIu32 " frames sent\n",
+         stats.replies - warmup.replies, stats.batches - warmup.batches, stats.calls, frames);
+  printf("  latency:  %" PRIu32 " us avg, %" PRIu32 " us max\n", stats.latency_avg_us, stats.latency_max_us);
+  printf("  host:     %.0f requests/s (%.1f ms CPU)\n", cpu_s > 0 ? requests / cpu_s : 0.0, cpu_s * 1000);
+  return 0;
+}